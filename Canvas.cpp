@@ -1,6 +1,10 @@
 #include "AlphaBlend.h"
 #include "ApplicationGlobal.h"
 #include "Canvas.h"
+#include "PointOperation.h"
+#include "floodfill.h"
+#include "resample.h"
+#include "rotate.h"
 #include <QDateTime>
 #include <QDebug>
 #include <QElapsedTimer>
@@ -8,6 +12,7 @@
 #include <functional>
 #include <mutex>
 #include <omp.h>
+#include <optional>
 
 #if !defined(_WIN32) && !defined(__APPLE__)
 #include <x86intrin.h>
@@ -119,7 +124,7 @@ Canvas::Layer *Canvas::selection_layer()
 	return &m->selection_layer;
 }
 
-void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offset, Panel const *input_panel, QPoint const &input_offset, Layer const *mask_layer, RenderOption const &opt, QColor const &brush_color, int opacity, bool *abort)
+void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offset, Panel const *input_panel, QPoint const &input_offset, Layer const *mask_layer, RenderOption const &opt, QColor const &brush_color, int opacity, euclase::CancelToken const &abort)
 {
 	if (!opt.use_mask) {
 		mask_layer = nullptr;
@@ -208,6 +213,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 		if (dstfmt == euclase::Image::Format_U8_RGBA) {
 			euclase::OctetRGBA color(c.red(), c.green(), c.blue());
 			for (int i = 0; i < h; i++) {
+				if (abort.canceled()) break;
 				using Pixel = euclase::OctetRGBA;
 				uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(i);
 				uint8_t const *src = input_image->scanLine(sy + i);
@@ -220,6 +226,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 		} else if (dstfmt == euclase::Image::Format_F32_RGBA) {
 			euclase::Float32RGBA color((uint8_t)c.red(), (uint8_t)c.green(), (uint8_t)c.blue());
 			for (int i = 0; i < h; i++) {
+				if (abort.canceled()) break;
 				using Pixel = euclase::Float32RGBA;
 				uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(i);
 				uint8_t const *src = input_image->scanLine(sy + i);
@@ -231,6 +238,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 			}
 		} else if (dstfmt == euclase::Image::Format_U8_Grayscale) {
 			for (int y = 0; y < h; y++) {
+				if (abort.canceled()) break;
 				uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(y);
 				uint8_t const *src = input_image->scanLine(sy + y);
 				uint8_t *dst = target_panel->imagep()->scanLine(dy + y);
@@ -261,6 +269,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 		if (dstfmt == euclase::Image::Format_U8_RGBA) {
 			euclase::OctetRGBA color(c.red(), c.green(), c.blue());
 			for (int i = 0; i < h; i++) {
+				if (abort.canceled()) break;
 				using Pixel = euclase::OctetRGBA;
 				uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(i);
 				float const *src = (float const *)input_image->scanLine(sy + i);
@@ -273,6 +282,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 		} else if (dstfmt == euclase::Image::Format_F32_RGBA) {
 			euclase::Float32RGBA color((uint8_t)c.red(), (uint8_t)c.green(), (uint8_t)c.blue());
 			for (int i = 0; i < h; i++) {
+				if (abort.canceled()) break;
 				using Pixel = euclase::Float32RGBA;
 				uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(i);
 				float const *src = (float const *)input_image->scanLine(sy + i);
@@ -284,6 +294,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 			}
 		} else if (dstfmt == euclase::Image::Format_U8_Grayscale) {
 			for (int y = 0; y < h; y++) {
+				if (abort.canceled()) break;
 				uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(y);
 				float const *src = (float const *)input_image->scanLine(sy + y);
 				uint8_t *dst = target_panel->imagep()->scanLine(dy + y);
@@ -338,6 +349,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 				}
 				if (renderer) {
 					for (int i = 0; i < h; i++) {
+						if (abort.canceled()) break;
 						uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(i);
 						uint8_t const *src = inputimg->scanLine(sy + i);
 						uint8_t *dst = outputimg->scanLine(dy + i);
@@ -402,6 +414,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 				}
 			};
 			for (int i = 0; i < h; i++) {
+				if (abort.canceled()) break;
 				uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(i);
 				uint8_t const *src = input_image->scanLine(sy + i);
 				uint8_t *dst = target_panel->imagep()->scanLine(dy + i);
@@ -420,6 +433,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 			uint8_t const *mask = maskimg ? (uint8_t const *)maskimg->data() : nullptr;
 			int mask_stride = maskimg ? maskimg->width() : 0;
 			for (int y = 0; y < h; y++) {
+				if (abort.canceled()) break;
 				float const *s = src + 4 * (src_stride * (sy + y) + sx);
 				float *d = dst + 4 * (dst_stride * (dy + y) + dx);
 				switch (opt.blend_mode) {
@@ -489,6 +503,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 			uint8_t const *mask = maskimg ? (uint8_t const *)maskimg->data() : nullptr;
 			int mask_stride = maskimg ? maskimg->width() : 0;
 			for (int y = 0; y < h; y++) {
+				if (abort.canceled()) break;
 				euclase::_float16_t const *s = src + 4 * (src_stride * (sy + y) + sx);
 				float *d = dst + 4 * (dst_stride * (dy + y) + dx);
 				switch (opt.blend_mode) {
@@ -577,6 +592,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 				}
 			};
 			for (int i = 0; i < h; i++) {
+				if (abort.canceled()) break;
 				uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(i);
 				uint8_t const *src = input_image->scanLine(sy + i);
 				uint8_t *dst = target_panel->imagep()->scanLine(dy + i);
@@ -595,6 +611,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 			uint8_t const *mask = maskimg ? (uint8_t const *)maskimg->data() : nullptr;
 			int mask_stride = maskimg ? maskimg->width() : 0;
 			for (int y = 0; y < h; y++) {
+				if (abort.canceled()) break;
 				float const *s = src + 4 * (src_stride * (sy + y) + sx);
 				euclase::_float16_t *d = dst + 4 * (dst_stride * (dy + y) + dx);
 				switch (opt.blend_mode) {
@@ -642,6 +659,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 			uint8_t const *mask = maskimg ? (uint8_t const *)maskimg->data() : nullptr;
 			int mask_stride = maskimg ? maskimg->width() : 0;
 			for (int y = 0; y < h; y++) {
+				if (abort.canceled()) break;
 				euclase::_float16_t const *s = src + 4 * (src_stride * (sy + y) + sx);
 				euclase::_float16_t *d = dst + 4 * (dst_stride * (dy + y) + dx);
 				switch (opt.blend_mode) {
@@ -712,6 +730,7 @@ void Canvas::renderToSinglePanel(Panel *target_panel, QPoint const &target_offse
 
 		if (renderer) {
 			for (int i = 0; i < h; i++) {
+				if (abort.canceled()) break;
 				uint8_t const *msk = !maskimg ? tmpmask : maskimg->scanLine(i);
 				uint8_t const *src = input_image->scanLine(sy + i);
 				uint8_t *dst = target_panel->imagep()->scanLine(dy + i);
@@ -866,7 +885,7 @@ void Canvas::composePanels(Panel *target_panel, std::vector<Panel> const *altern
 	}
 }
 
-void Canvas::renderToEachPanels_internal_(Panel *target_panel, QPoint const &target_offset, Layer const &input_layer, Layer *mask_layer, QColor const &brush_color, int opacity, RenderOption const &opt, bool *abort)
+void Canvas::renderToEachPanels_internal_(Panel *target_panel, QPoint const &target_offset, Layer const &input_layer, Layer *mask_layer, QColor const &brush_color, int opacity, RenderOption const &opt, euclase::CancelToken const &abort)
 {
 	QRect r1(
 		target_offset.x() + target_panel->offset().x(),
@@ -890,10 +909,19 @@ void Canvas::renderToEachPanels_internal_(Panel *target_panel, QPoint const &tar
 			panels.push_back(&input_panel);
 		}
 	}
+	if (opt.active_panel == Canvas::AlternateLayer && input_layer.alternate_blend_mode == BlendMode::Copy) {
+		// 元のパネルが無い位置の代替パネルもそのまま描く
+		for (Panel const &alt_panel : input_layer.alternate_panels) {
+			QRect r2(input_layer.offset() + alt_panel.offset(), alt_panel.size());
+			if (r1.intersects(r2) && !findPanel(&input_layer.primary_panels, alt_panel.offset())) {
+				panels.push_back(&alt_panel);
+			}
+		}
+	}
 
 	for (size_t i = 0; i < panels.size(); i++) {
 		Panel const *input_panel = panels[i];
-		if (abort && *abort) continue;
+		if (abort.canceled()) continue;
 
 		QPoint offset = input_panel->offset();
 
@@ -934,23 +962,47 @@ void Canvas::renderToEachPanels_internal_(Panel *target_panel, QPoint const &tar
 					composePanel(&composed_panel, alt_panel, alt_mask, opt2);
 					input_panel = &composed_panel;
 				}
+			} else if (input_layer.alternate_blend_mode == BlendMode::Copy) { // 変形など
+				Panel *alt_panel = findPanel(&input_layer.alternate_panels, offset);
+				if (alt_panel) { // 選択範囲は代替パネルを作るときに反映済み
+					input_panel = alt_panel;
+				}
 			}
 		}
 next:;
 		RenderOption opt3 = opt;
 		opt3.use_mask = false; // composeの工程で選択範囲のマスクは済んでいるので次はマスクは使わない
-		renderToSinglePanel(target_panel, target_offset, input_panel, input_layer.offset(), nullptr, opt3, brush_color, opacity);
+		renderToSinglePanel(target_panel, target_offset, input_panel, input_layer.offset(), nullptr, opt3, brush_color, opacity, abort);
 	}
 }
 
-void Canvas::renderToEachPanels(Panel *target_panel, QPoint const &target_offset, std::vector<Layer *> const &input_layers, Layer *mask_layer, QColor const &brush_color, int opacity, RenderOption const &opt, bool *abort)
+/**
+ * @brief 調整レイヤーの点演算をパネルに適用する
+ * @param target_panel それまでのレイヤーを合成したパネル
+ * @param op 点演算
+ */
+void Canvas::applyAdjustment(Panel *target_panel, PointOperation const &op)
+{
+	if (target_panel->isNull() || op.isIdentity()) return;
+	euclase::Image::MemoryType memtype = target_panel->image().memtype();
+	euclase::Image image = op.apply(target_panel->image(), nullptr);
+	image.memconvert(memtype);
+	*target_panel->imagep() = image;
+}
+
+void Canvas::renderToEachPanels(Panel *target_panel, QPoint const &target_offset, std::vector<Layer *> const &input_layers, Layer *mask_layer, QColor const &brush_color, int opacity, RenderOption const &opt, euclase::CancelToken const &abort)
 {
 	for (Layer *layer : input_layers) {
+		if (layer->isAdjustmentLayer()) { // 合成中のタイルにだけ適用するので、レイヤーの内容は変更しない
+			if (abort.canceled()) return;
+			applyAdjustment(target_panel, *layer->adjustment);
+			continue;
+		}
 		renderToEachPanels_internal_(target_panel, target_offset, *layer, mask_layer, brush_color, opacity, opt, abort);
 	}
 }
 
-void Canvas::renderToLayer(Layer *target_layer, ActivePanel activepanel, Layer const &input_layer, Layer *mask_layer, RenderOption const &opt, bool *abort)
+void Canvas::renderToLayer(Layer *target_layer, ActivePanel activepanel, Layer const &input_layer, Layer *mask_layer, RenderOption const &opt, euclase::CancelToken const &abort)
 {
 	Q_ASSERT(input_layer.format_ != euclase::Image::Format_Invalid);
 	std::vector<Panel> *targetpanels = target_layer->panels(activepanel);
@@ -964,7 +1016,7 @@ void Canvas::renderToLayer(Layer *target_layer, ActivePanel activepanel, Layer c
 			QPoint s1 = s0 + QPoint(input_panel.width(), input_panel.height());
 			for (int y = (s0.y() & ~(PANEL_SIZE - 1)); y < s1.y(); y += PANEL_SIZE) {
 				for (int x = (s0.x() & ~(PANEL_SIZE - 1)); x < s1.x(); x += PANEL_SIZE) {
-					if (abort && *abort) return;
+					if (abort.canceled()) return;
 					QPoint d0 = QPoint(x, y) - target_layer->offset();
 					QPoint d1 = d0 + QPoint(PANEL_SIZE, PANEL_SIZE);
 					for (int y2 = (d0.y() & ~(PANEL_SIZE - 1)); y2 < d1.y(); y2 += PANEL_SIZE) {
@@ -1002,42 +1054,53 @@ void Canvas::clear()
 	m->layers.emplace_back(newLayer());
 }
 
-void Canvas::paintToCurrentLayer(Layer const &source, RenderOption const &opt, bool *abort)
+void Canvas::paintToCurrentLayer(Layer const &source, RenderOption const &opt, euclase::CancelToken const &abort)
 {
 	renderToLayer(current_layer(), Canvas::PrimaryLayer, source, selection_layer(), opt, abort);
 }
 
-void Canvas::paintToCurrentAlternate(Layer const &source, RenderOption const &opt, bool *abort)
+void Canvas::paintToCurrentAlternate(Layer const &source, RenderOption const &opt, euclase::CancelToken const &abort)
 {
 	renderToLayer(current_layer(), Canvas::AlternateLayer, source, opt.use_mask ? selection_layer() : nullptr, opt, abort);
 }
 
-void Canvas::addSelection(Layer const &source, RenderOption const &opt, bool *abort)
+void Canvas::addSelection(Layer const &source, RenderOption const &opt, euclase::CancelToken const &abort)
 {
 	RenderOption o = opt;
 	o.brush_color = Qt::white;
 	renderToLayer(selection_layer(), Canvas::PrimaryLayer, source, nullptr, o, abort);
 }
 
-void Canvas::subSelection(Layer const &source, RenderOption const &opt, bool *abort)
+void Canvas::subSelection(Layer const &source, RenderOption const &opt, euclase::CancelToken const &abort)
 {
 	RenderOption o = opt;
 	o.brush_color = Qt::black;
 	renderToLayer(selection_layer(), Canvas::PrimaryLayer, source, nullptr, o, abort);
 }
 
-Canvas::Panel Canvas::renderSelection(const QRect &r, bool *abort) const
+Canvas::Panel Canvas::renderSelection(const QRect &r, euclase::CancelToken const &abort) const
+{
+	return renderSelection(m->selection_layer, r, abort);
+}
+
+/**
+ * @brief 選択範囲をレンダリングする
+ * @param selection_layer 選択レイヤー。ロックの外で使うなら、ロックの中で複製したもの
+ * @param r 範囲
+ * @param abort 中断
+ */
+Canvas::Panel Canvas::renderSelection(Layer const &selection_layer, const QRect &r, euclase::CancelToken const &abort)
 {
 	Panel panel;
 	panel.imagep()->make(r.width(), r.height(), euclase::Image::Format_U8_Grayscale, /*selection_layer()->memtype_*/euclase::Image::Host, euclase::k::black);
 	panel.setOffset(r.topLeft());
 	std::vector<Layer *> layers;
-	layers.push_back(const_cast<Canvas *>(this)->selection_layer());
+	layers.push_back(const_cast<Layer *>(&selection_layer));
 	renderToEachPanels(&panel, QPoint(), layers, nullptr, QColor(), 255, {}, abort);
 	return panel;
 }
 
-Canvas::Panel Canvas::renderToPanel(InputLayerMode input_layer_mode, euclase::Image::Format format, const QRect &r, QRect const &maskrect, ActivePanel activepanel, RenderOption const &opt, bool *abort) const
+Canvas::Panel Canvas::renderToPanel(InputLayerMode input_layer_mode, euclase::Image::Format format, const QRect &r, QRect const &maskrect, ActivePanel activepanel, RenderOption const &opt, euclase::CancelToken const &abort) const
 {
 	if (r.width() < 1 || r.height() < 1) return {};
 
@@ -1072,7 +1135,7 @@ Canvas::Panel Canvas::renderToPanel(InputLayerMode input_layer_mode, euclase::Im
 	return target_panel;
 }
 
-Canvas::Panel Canvas::crop(const QRect &r, bool *abort) const
+Canvas::Panel Canvas::crop(const QRect &r, euclase::CancelToken const &abort) const
 {
 	Panel panel;
 	panel.imagep()->make(r.width(), r.height(), euclase::Image::Format_U8_RGBA);
@@ -1083,6 +1146,23 @@ Canvas::Panel Canvas::crop(const QRect &r, bool *abort) const
 	return panel;
 }
 
+/**
+ * @brief 現在のレイヤーの確定済みの内容を描画する
+ *
+ * renderToPanel(CurrentLayerOnly, ...) と異なり、代替パネルの合成方法を変更しない
+ */
+Canvas::Panel Canvas::renderCurrentLayer(euclase::Image::Format format, QRect const &r, euclase::CancelToken const &abort) const
+{
+	if (r.width() < 1 || r.height() < 1) return {};
+	Panel panel;
+	panel.imagep()->make(r.width(), r.height(), format, current_layer()->memtype_);
+	panel.setOffset(r.topLeft());
+	std::vector<Layer *> layers;
+	layers.push_back(const_cast<Canvas *>(this)->current_layer());
+	renderToEachPanels(&panel, QPoint(), layers, nullptr, QColor(), 255, {}, abort);
+	return panel;
+}
+
 void Canvas::trim(const QRect &r)
 {
 	current_layer()->setOffset(current_layer()->offset() - r.topLeft());
@@ -1156,9 +1236,30 @@ void Canvas::Layer::setAlternateOption(BlendMode blendmode)
 	alternate_blend_mode = blendmode;
 }
 
+/**
+ * @brief 代替パネルを設定する
+ *
+ * Copyで置き換えるときは、元のパネルが無い位置の代替パネルも描画される。元のパネルは変更しない
+ */
+void Canvas::Layer::setAlternatePanels(std::vector<Panel> const &panels, BlendMode blendmode)
+{
+	alternate_panels = panels;
+	alternate_blend_mode = blendmode;
+	active_panel_ = AlternateLayer;
+}
+
 void Canvas::Layer::finishAlternatePanels(bool apply, Layer *mask_layer, RenderOption const &opt)
 {
-	if (apply) {
+	if (apply && alternate_blend_mode == BlendMode::Copy) {
+		for (Panel const &panel : alternate_panels) {
+			Panel *p = findPanel(&primary_panels, panel.offset());
+			if (p) {
+				*p = panel;
+			} else {
+				addPanel(&primary_panels, panel.copy());
+			}
+		}
+	} else if (apply) {
 		for (Panel const &panel : alternate_panels) {
 			Panel *p = findPanel(&primary_panels, panel.offset());
 			if (!p) {
@@ -1297,11 +1398,596 @@ int Canvas::addNewLayer()
 	return index;
 }
 
+/**
+ * @brief 調整レイヤーを現在のレイヤーの上に追加する
+ * @param op 下のレイヤーの合成結果に適用する点演算
+ * @return 追加したレイヤーのインデックス
+ */
+int Canvas::addAdjustmentLayer(PointOperation const &op)
+{
+	int index = addNewLayer();
+	m->layers[index]->adjustment = std::make_shared<PointOperation const>(op);
+	return index;
+}
+
+void Canvas::removeLayer(int index)
+{
+	if (index < 0 || index >= (int)m->layers.size()) return;
+	m->layers.erase(m->layers.begin() + index);
+	if (m->current_layer_index >= index && m->current_layer_index > 0) {
+		m->current_layer_index--;
+	}
+}
+
 void Canvas::setCurrentLayer(int index)
 {
 	m->current_layer_index = index;
 }
 
+int Canvas::currentLayerIndex() const
+{
+	return m->current_layer_index;
+}
+
+namespace {
+
+/**
+ * @brief レイヤーの全てのパネルを、位置を付け替えながら変換する
+ * @param map 変換前のパネルのキャンバス上の矩形から、変換後の左上の位置を返す関数
+ * @param fn パネルの画像の変換
+ *
+ * レイヤーの位置も同じ規則で変換するので、パネルはPANEL_SIZEの格子に揃ったままになる
+ */
+void transformLayer(Canvas::Layer *layer, std::function<QPoint (QRect const &r)> const &map, std::function<void (euclase::Image *image)> const &fn)
+{
+	layer->finishAlternatePanels(false, nullptr, {});
+	const QPoint org = map(QRect(layer->offset(), QSize(PANEL_SIZE, PANEL_SIZE)));
+	std::vector<Canvas::Panel> &panels = layer->primary_panels;
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < (int)panels.size(); i++) {
+		Canvas::Panel &panel = panels[i];
+		const QRect r(layer->offset() + panel.offset(), panel.size());
+		fn(panel.imagep());
+		panel.setOffset(map(r) - org);
+	}
+	Canvas::Layer::sort(&panels);
+	layer->setOffset(org);
+}
+
+/**
+ * @brief レイヤーのパネルから、矩形に掛かるものを探すための索引
+ *
+ * パネルがPANEL_SIZEの格子に揃って整列していれば、矩形が掛かる格子の位置だけを findPanel で探す
+ * 揃っていなければ（setImage で作ったレイヤーなど）、全てのパネルを調べる
+ */
+class LayerPanelIndex {
+private:
+	Canvas::Layer const &layer_;
+	bool grid_ = true;
+public:
+	explicit LayerPanelIndex(Canvas::Layer const &layer)
+		: layer_(layer)
+	{
+		std::vector<Canvas::Panel> const &panels = layer.primary_panels;
+		for (size_t i = 0; i < panels.size(); i++) {
+			const QPoint pt = panels[i].offset();
+			if ((pt.x() & (PANEL_SIZE - 1)) || (pt.y() & (PANEL_SIZE - 1)) || panels[i].width() > PANEL_SIZE || panels[i].height() > PANEL_SIZE) {
+				grid_ = false;
+				break;
+			}
+			if (i > 0 && COMP(panels[i - 1].offset(), pt) >= 0) {
+				grid_ = false;
+				break;
+			}
+		}
+	}
+	Canvas::Layer const &layer() const
+	{
+		return layer_;
+	}
+	/**
+	 * @brief 矩形に掛かるパネルを集める
+	 * @param r キャンバス上の矩形
+	 */
+	void find(QRect const &r, std::vector<Canvas::Panel const *> *out) const
+	{
+		out->clear();
+		if (r.isEmpty()) return;
+		std::vector<Canvas::Panel> const &panels = layer_.primary_panels;
+		const QRect t = r.translated(-layer_.offset()); // レイヤー内の座標
+		const int x0 = t.left() & ~(PANEL_SIZE - 1);
+		const int y0 = t.top() & ~(PANEL_SIZE - 1);
+		const int cols = (t.right() - x0) / PANEL_SIZE + 1;
+		const int rows = (t.bottom() - y0) / PANEL_SIZE + 1;
+		if (grid_ && (size_t)cols * rows <= panels.size()) {
+			for (int y = 0; y < rows; y++) {
+				for (int x = 0; x < cols; x++) {
+					Canvas::Panel const *p = Canvas::findPanel(&panels, QPoint(x0 + x * PANEL_SIZE, y0 + y * PANEL_SIZE));
+					if (p) {
+						out->push_back(p);
+					}
+				}
+			}
+			return;
+		}
+		for (Canvas::Panel const &panel : panels) { // パネルの方が少なければ全部調べる方が速い
+			if (QRect(panel.offset(), panel.size()).intersects(t)) {
+				out->push_back(&panel);
+			}
+		}
+	}
+};
+
+/**
+ * @brief レイヤーの矩形の範囲を読み出す
+ * @param index レイヤーのパネルの索引
+ * @param r キャンバス上の矩形
+ * @param out 読み出した画像。パネルの無いところは透明
+ * @return 範囲にパネルが無ければfalse
+ */
+bool readLayerRect(LayerPanelIndex const &index, QRect const &r, euclase::Image *out)
+{
+	Canvas::Layer const &layer = index.layer();
+	std::vector<Canvas::Panel const *> panels;
+	index.find(r, &panels);
+	bool found = false;
+	for (Canvas::Panel const *panel : panels) {
+		const QRect pr(layer.offset() + panel->offset(), panel->size());
+		const QRect t = pr.intersected(r);
+		if (t.isEmpty()) continue;
+		if (!found) {
+			if (!out->make(r.width(), r.height(), panel->format())) return false;
+			found = true;
+		}
+		euclase::Image src = panel->image().toHost();
+		const size_t bpp = src.bytesPerPixel();
+		for (int y = t.top(); y <= t.bottom(); y++) {
+			uint8_t const *s = src.scanLine(y - pr.y()) + bpp * (t.x() - pr.x());
+			uint8_t *d = out->scanLine(y - r.y()) + bpp * (t.x() - r.x());
+			memcpy(d, s, bpp * t.width());
+		}
+	}
+	return found;
+}
+
+/**
+ * @brief 選択範囲のマスクと浮動小数点の相互変換
+ *
+ * マスクの値は線形なので、ガンマ補正をせずに変換する
+ */
+euclase::Image convertMask(euclase::Image const &image, euclase::Image::Format format)
+{
+	const int w = image.width();
+	const int h = image.height();
+	euclase::Image newimage(w, h, format);
+	for (int y = 0; y < h; y++) {
+		if (format == euclase::Image::Format_F32_Grayscale) {
+			uint8_t const *s = image.scanLine(y);
+			float *d = (float *)newimage.scanLine(y);
+			for (int x = 0; x < w; x++) {
+				d[x] = s[x] / 255.0f;
+			}
+		} else {
+			float const *s = (float const *)image.scanLine(y);
+			uint8_t *d = newimage.scanLine(y);
+			for (int x = 0; x < w; x++) {
+				d[x] = (uint8_t)std::max(0.0f, std::min(255.0f, floorf(s[x] * 255 + 0.5f)));
+			}
+		}
+	}
+	return newimage;
+}
+
+/**
+ * @brief レイヤーの大きさを変える
+ *
+ * 出力のパネルごとに、必要な入力の範囲だけを読んで拡大縮小する
+ * 入力の範囲にパネルが無ければ、出力のパネルも作らない
+ * 出力のパネルは互いに独立しているので、並列に処理する
+ */
+void resizeLayer(Canvas::Layer *layer, euclase::Resampler const &resampler)
+{
+	layer->finishAlternatePanels(false, nullptr, {});
+	if (layer->primary_panels.empty()) return;
+
+	// 出力のパネルの位置
+	std::vector<QPoint> tiles;
+	for (int y = 0; y < resampler.height(); y += PANEL_SIZE) {
+		for (int x = 0; x < resampler.width(); x += PANEL_SIZE) {
+			tiles.emplace_back(x, y);
+		}
+	}
+
+	const LayerPanelIndex index(*layer);
+	std::vector<Canvas::Panel> newpanels(tiles.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < (int)tiles.size(); i++) {
+		const int x = tiles[i].x();
+		const int y = tiles[i].y();
+		const int w = std::min(PANEL_SIZE, resampler.width() - x);
+		const int h = std::min(PANEL_SIZE, resampler.height() - y);
+		int sx, sy, sw, sh;
+		resampler.sourceRect(x, y, w, h, &sx, &sy, &sw, &sh);
+		euclase::Image source;
+		if (!readLayerRect(index, QRect(sx, sy, sw, sh), &source)) continue;
+		const euclase::Image::Format format = source.format();
+		const bool mask = format == euclase::Image::Format_U8_Grayscale;
+		if (mask) {
+			source = convertMask(source, euclase::Image::Format_F32_Grayscale);
+		}
+		euclase::Image image = resampler.render(source, sx, sy, x, y, w, h);
+		if (!image) continue;
+		if (mask) {
+			image = convertMask(image, format);
+		}
+		Canvas::Panel panel;
+		panel->make(PANEL_SIZE, PANEL_SIZE, format);
+		panel.setOffset(x, y);
+		const size_t bytes = image.bytesPerLine();
+		for (int j = 0; j < h; j++) {
+			memcpy(panel.scanLine(j), image.scanLine(j), bytes);
+		}
+		panel->memconvert(layer->memtype_);
+		newpanels[i] = panel;
+	}
+
+	// tiles は行ごとに左から並んでいるので、パネルは位置順に整列済み
+	newpanels.erase(std::remove_if(newpanels.begin(), newpanels.end(), [](Canvas::Panel const &p){ return p.isNull(); }), newpanels.end());
+	layer->primary_panels = std::move(newpanels);
+	layer->setOffset(QPoint());
+}
+
+/**
+ * @brief 選択範囲のマスクをアルファ値に掛ける
+ * @param image F32_RGBAの画像
+ * @param r image のキャンバス上の矩形
+ * @param mask_layer 選択範囲のパネルの索引。nullptrなら全選択
+ * @param area マスクを掛ける範囲。範囲外は変更しない
+ * @param invert trueなら選択されていない部分を残す
+ */
+void multiplyMask(euclase::Image *image, QRect const &r, LayerPanelIndex const *mask_layer, QRect const &area, bool invert)
+{
+	const QRect t = r.intersected(area);
+	if (t.isEmpty()) return;
+	euclase::Image mask;
+	if (mask_layer && readLayerRect(*mask_layer, t, &mask)) {
+		mask = mask.toHost();
+	}
+	for (int y = 0; y < t.height(); y++) {
+		euclase::Float32RGBA *d = (euclase::Float32RGBA *)image->scanLine(t.y() - r.y() + y) + (t.x() - r.x());
+		uint8_t const *s = mask ? mask.scanLine(y) : nullptr;
+		for (int x = 0; x < t.width(); x++) {
+			float v = 1;
+			if (mask_layer) {
+				v = s ? s[x] / 255.0f : 0; // マスクのパネルが無いところは選択されていない
+			}
+			d[x].a *= invert ? 1 - v : v;
+		}
+	}
+}
+
+} // namespace
+
+/**
+ * @brief 全てのレイヤーを反転する
+ * @param horizontal trueなら左右、falseなら上下
+ */
+void Canvas::flip(bool horizontal)
+{
+	const int w = width();
+	const int h = height();
+	auto map = [&](QRect const &r){
+		return horizontal ? QPoint(w - r.x() - r.width(), r.y()) : QPoint(r.x(), h - r.y() - r.height());
+	};
+	auto fn = [&](euclase::Image *image){
+		euclase::flipImage(image, horizontal);
+	};
+	for (LayerPtr &layer : m->layers) {
+		transformLayer(layer.get(), map, fn);
+	}
+	transformLayer(&m->selection_layer, map, fn);
+}
+
+/**
+ * @brief 全てのレイヤーを90度回転する
+ * @param clockwise trueなら時計回り
+ */
+void Canvas::rotate90(bool clockwise)
+{
+	const int w = width();
+	const int h = height();
+	auto map = [&](QRect const &r){
+		return clockwise ? QPoint(h - r.y() - r.height(), r.x()) : QPoint(r.y(), w - r.x() - r.width());
+	};
+	auto fn = [&](euclase::Image *image){
+		euclase::rotateImage90(image, clockwise);
+	};
+	for (LayerPtr &layer : m->layers) {
+		transformLayer(layer.get(), map, fn);
+	}
+	transformLayer(&m->selection_layer, map, fn);
+	setSize(QSize(h, w));
+}
+
+/**
+ * @brief キャンバスの大きさを変える
+ * @param size 新しい大きさ
+ * @param method 拡大縮小の方法
+ *
+ * レイヤーごとに処理するので、レイヤーは統合されない
+ * キャンバスの外にはみ出した部分は失われる
+ */
+void Canvas::resize(QSize const &size, euclase::EnlargeMethod method)
+{
+	if (size.width() < 1 || size.height() < 1) return;
+	if (size == this->size()) return;
+	euclase::Resampler resampler(width(), height(), size.width(), size.height(), method);
+	for (LayerPtr &layer : m->layers) {
+		resizeLayer(layer.get(), resampler);
+	}
+	resizeLayer(&m->selection_layer, resampler);
+	setSize(size);
+}
+
+/**
+ * @brief 現在のレイヤーの一部を変形した代替パネルを作る
+ * @param source_rect 変形する範囲（キャンバス上の矩形）。選択範囲があれば、さらに選択範囲で切り抜く
+ * @param transform キャンバス上の座標の変換
+ * @param interpolation 補間の方法
+ * @param clip 出力する範囲（キャンバス上の矩形）。空なら変わる範囲全体
+ * @return 内容が変わるパネル。位置はレイヤー内の座標で、BlendMode::Copy で元のパネルを置き換える
+ */
+std::vector<Canvas::Panel> Canvas::renderTransform(QRect const &source_rect, euclase::Homography const &transform, euclase::Warper::Interpolation interpolation, QRect const &clip, euclase::CancelToken const &abort) const
+{
+	Layer const *mask_layer = m->selection_layer.primary_panels.empty() ? nullptr : &m->selection_layer;
+	return renderTransform(*current_layer(), mask_layer, size(), source_rect, transform, interpolation, clip, abort);
+}
+
+/**
+ * @brief レイヤーの一部を変形した代替パネルを作る
+ * @param layer 変形するレイヤー
+ * @param mask_layer 選択範囲。nullptrなら全選択
+ * @param size キャンバスの大きさ
+ *
+ * 元の位置から切り取り、変形した画像をその上に重ねる
+ * 出力のパネルごとに、必要な入力の範囲だけを読んで変形するので、パネルごとに並列に処理できる
+ * キャンバスを参照しないので、パネルを複製したレイヤーを渡せばロックの外で実行できる
+ */
+std::vector<Canvas::Panel> Canvas::renderTransform(Layer const &layer, Layer const *mask_layer, QSize const &size, QRect const &source_rect, euclase::Homography const &transform, euclase::Warper::Interpolation interpolation, QRect const &clip, euclase::CancelToken const &abort)
+{
+	std::vector<Panel> panels;
+	if (source_rect.isEmpty() || layer.isAdjustmentLayer()) return panels;
+
+	// 変形後の四角形の外接矩形。キャンバスの外には作らない
+	QRect area(QPoint(0, 0), size);
+	{
+		const double px[4] = { (double)source_rect.left(), (double)source_rect.right() + 1, (double)source_rect.right() + 1, (double)source_rect.left() };
+		const double py[4] = { (double)source_rect.top(), (double)source_rect.top(), (double)source_rect.bottom() + 1, (double)source_rect.bottom() + 1 };
+		double x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+		bool ok = true;
+		for (int i = 0; i < 4; i++) {
+			double x, y;
+			if (!transform.map(px[i], py[i], &x, &y)) {
+				ok = false;
+				break;
+			}
+			x0 = i == 0 ? x : std::min(x0, x);
+			y0 = i == 0 ? y : std::min(y0, y);
+			x1 = i == 0 ? x : std::max(x1, x);
+			y1 = i == 0 ? y : std::max(y1, y);
+		}
+		if (ok) { // 無限遠の向こうに掛かるときはキャンバス全体
+			x0 = std::max(x0, (double)area.left());
+			y0 = std::max(y0, (double)area.top());
+			x1 = std::min(x1, (double)area.right() + 1);
+			y1 = std::min(y1, (double)area.bottom() + 1);
+			area = x0 < x1 && y0 < y1 ? QRect((int)floor(x0), (int)floor(y0), (int)ceil(x1) - (int)floor(x0), (int)ceil(y1) - (int)floor(y0)) : QRect();
+		}
+	}
+	area = area.united(source_rect); // 元の位置も切り取る
+	if (!clip.isEmpty()) {
+		area = area.intersected(clip);
+	}
+
+	// 出力のパネルの位置（レイヤー内の座標）
+	const QPoint org = layer.offset();
+	std::vector<QPoint> tiles;
+	for (int y = (area.top() - org.y()) & ~(PANEL_SIZE - 1); y < area.bottom() + 1 - org.y(); y += PANEL_SIZE) {
+		for (int x = (area.left() - org.x()) & ~(PANEL_SIZE - 1); x < area.right() + 1 - org.x(); x += PANEL_SIZE) {
+			tiles.emplace_back(x, y);
+		}
+	}
+
+	const LayerPanelIndex index(layer);
+	std::optional<LayerPanelIndex> mask_index;
+	if (mask_layer) {
+		mask_index.emplace(*mask_layer);
+	}
+	LayerPanelIndex const *mask = mask_index ? &*mask_index : nullptr;
+
+	euclase::Warper warper(transform, interpolation);
+	panels.resize(tiles.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < (int)tiles.size(); i++) {
+		if (abort.canceled()) continue;
+		const QRect r(org + tiles[i], QSize(PANEL_SIZE, PANEL_SIZE));
+
+		// 必要な入力の範囲だけを読む
+		int sx, sy, sw, sh;
+		warper.sourceRect(r.x(), r.y(), r.width(), r.height(), &sx, &sy, &sw, &sh);
+		const QRect s = QRect(sx, sy, sw, sh).intersected(source_rect);
+		euclase::Image source;
+		const bool warp = !s.isEmpty() && readLayerRect(index, s, &source);
+		if (!warp && !r.intersects(source_rect)) continue; // 変わらない
+
+		euclase::Image image;
+		if (readLayerRect(index, r, &image)) {
+			image = image.toHost().convertToFormat(euclase::Image::Format_F32_RGBA);
+		} else {
+			image.make(PANEL_SIZE, PANEL_SIZE, euclase::Image::Format_F32_RGBA);
+		}
+		multiplyMask(&image, r, mask, source_rect, true);
+
+		if (warp) {
+			source = source.toHost().convertToFormat(euclase::Image::Format_F32_RGBA);
+			multiplyMask(&source, s, mask, s, false);
+			euclase::Image warped = warper.render(source, s.x(), s.y(), r.x(), r.y(), r.width(), r.height());
+			if (warped) {
+				euclase::Float32RGBA *d = (euclase::Float32RGBA *)image.data();
+				euclase::Float32RGBA const *w = (euclase::Float32RGBA const *)warped.data();
+				for (int j = 0; j < PANEL_SIZE * PANEL_SIZE; j++) {
+					d[j] = AlphaBlend::blend(d[j], w[j]);
+				}
+			}
+		}
+
+		image = image.convertToFormat(layer.format_);
+		image.memconvert(layer.memtype_);
+		panels[i] = Panel(image, tiles[i]);
+	}
+	if (abort.canceled()) return {};
+
+	// tiles は行ごとに左から並んでいるので、パネルは位置順に整列済み
+	panels.erase(std::remove_if(panels.begin(), panels.end(), [](Panel const &p){ return p.isNull(); }), panels.end());
+	return panels;
+}
+
+/**
+ * @brief 現在のレイヤーで、指定した点から色の近い範囲を求める
+ * @param pt 起点（キャンバス上の座標）
+ * @param tolerance 色の許容差（0..1）
+ * @param contiguous falseなら、つながっていなくても色の近い画素を全て選ぶ
+ * @return 範囲のマスク（U8_Grayscale）のパネル。位置はレイヤー内の座標
+ *
+ * キャンバスを覆うレイヤーのパネルの格子の上で、パネルごとに並列に塗りつぶす
+ */
+std::vector<Canvas::Panel> Canvas::renderFloodFill(QPoint const &pt, float tolerance, bool contiguous, euclase::CancelToken const &abort) const
+{
+	return renderFloodFill(*current_layer(), size(), pt, tolerance, contiguous, abort);
+}
+
+/**
+ * @brief レイヤーで、指定した点から色の近い範囲を求める
+ * @param layer レイヤー。ロックの外で使うなら、ロックの中で複製したもの
+ * @param size キャンバスの大きさ
+ */
+std::vector<Canvas::Panel> Canvas::renderFloodFill(Layer const &layer, QSize const &size, QPoint const &pt, float tolerance, bool contiguous, euclase::CancelToken const &abort)
+{
+	std::vector<Panel> panels;
+	const QRect bounds(QPoint(0, 0), size);
+	if (!bounds.contains(pt) || layer.isAdjustmentLayer()) return panels;
+
+	// 格子の左上（レイヤー内の座標）とタイル数
+	const QPoint org = layer.offset();
+	const int x0 = (bounds.left() - org.x()) & ~(PANEL_SIZE - 1);
+	const int y0 = (bounds.top() - org.y()) & ~(PANEL_SIZE - 1);
+	const int cols = (bounds.right() + 1 - org.x() - x0 + PANEL_SIZE - 1) / PANEL_SIZE;
+	const int rows = (bounds.bottom() + 1 - org.y() - y0 + PANEL_SIZE - 1) / PANEL_SIZE;
+	std::vector<euclase::Image> tiles(cols * rows);
+	for (int i = 0; i < cols * rows; i++) {
+		Panel const *p = findPanel(&layer.primary_panels, QPoint(x0 + PANEL_SIZE * (i % cols), y0 + PANEL_SIZE * (i / cols)));
+		if (p) {
+			tiles[i] = p->image();
+		}
+	}
+
+	const QPoint o = org + QPoint(x0, y0); // 格子の左上のキャンバス上の座標
+	euclase::FloodFill fill(cols, rows, PANEL_SIZE, tiles);
+	fill.setBounds(bounds.x() - o.x(), bounds.y() - o.y(), bounds.width(), bounds.height());
+	std::vector<euclase::Image> masks = fill.run(pt.x() - o.x(), pt.y() - o.y(), tolerance, contiguous, abort);
+	for (int i = 0; i < (int)masks.size(); i++) {
+		if (masks[i]) {
+			panels.emplace_back(masks[i], QPoint(x0 + PANEL_SIZE * (i % cols), y0 + PANEL_SIZE * (i / cols)));
+		}
+	}
+	return panels;
+}
+
+/**
+ * @brief 現在のレイヤーの色の近い範囲を塗りつぶした代替パネルを作る
+ * @param color 塗りつぶす色
+ * @return 塗りつぶす範囲だけが不透明なパネル。BlendMode::Normal で元のパネルに重ねる
+ */
+std::vector<Canvas::Panel> Canvas::renderFill(QPoint const &pt, QColor const &color, float tolerance, bool contiguous, euclase::CancelToken const &abort) const
+{
+	return renderFill(*current_layer(), size(), pt, color, tolerance, contiguous, abort);
+}
+
+/**
+ * @brief レイヤーの色の近い範囲を塗りつぶした代替パネルを作る
+ * @param layer レイヤー。ロックの外で使うなら、ロックの中で複製したもの
+ * @param size キャンバスの大きさ
+ */
+std::vector<Canvas::Panel> Canvas::renderFill(Layer const &layer, QSize const &size, QPoint const &pt, QColor const &color, float tolerance, bool contiguous, euclase::CancelToken const &abort)
+{
+	std::vector<Panel> panels = renderFloodFill(layer, size, pt, tolerance, contiguous, abort);
+	const euclase::Float32RGBA c = euclase::Float32RGBA::convert(euclase::OctetRGBA(color.red(), color.green(), color.blue(), 255));
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < (int)panels.size(); i++) {
+		if (abort.canceled()) continue;
+		euclase::Image image(PANEL_SIZE, PANEL_SIZE, euclase::Image::Format_F32_RGBA);
+		for (int y = 0; y < PANEL_SIZE; y++) {
+			uint8_t const *s = panels[i].scanLine(y);
+			euclase::Float32RGBA *d = (euclase::Float32RGBA *)image.scanLine(y);
+			for (int x = 0; x < PANEL_SIZE; x++) {
+				d[x] = c;
+				d[x].a = s[x] / 255.0f;
+			}
+		}
+		image = image.convertToFormat(layer.format_);
+		image.memconvert(layer.memtype_);
+		*panels[i].imagep() = image;
+	}
+	if (abort.canceled()) return {};
+	return panels;
+}
+
+/**
+ * @brief 現在のレイヤーの色の近い範囲を選択する
+ * @param op 選択範囲の変え方
+ */
+void Canvas::selectColorRange(SelectionOperation op, QPoint const &pt, float tolerance, bool contiguous, euclase::CancelToken const &abort)
+{
+	std::vector<Panel> masks = renderFloodFill(pt, tolerance, contiguous, abort);
+	if (abort.canceled()) return;
+	changeSelection(op, current_layer()->offset(), masks, abort);
+}
+
+/**
+ * @brief マスクのパネルで選択範囲を変える
+ * @param op 選択範囲の変え方
+ * @param offset マスクのパネルの座標系の原点（キャンバス上の座標）
+ * @param masks マスク（U8_Grayscale）のパネル。renderFloodFill の結果など
+ *
+ * マスクのパネルを、そのまま選択範囲のレイヤーに描き込む
+ */
+void Canvas::changeSelection(SelectionOperation op, QPoint const &offset, std::vector<Panel> const &masks, euclase::CancelToken const &abort)
+{
+	Canvas::Layer layer;
+	layer.format_ = euclase::Image::Format_U8_Grayscale;
+	layer.memtype_ = m->selection_layer.memtype_;
+	layer.setOffset(offset);
+	layer.primary_panels = masks;
+	for (Panel &panel : layer.primary_panels) {
+		panel->memconvert(layer.memtype_);
+	}
+
+	RenderOption opt;
+
+	switch (op) {
+	case SelectionOperation::SetSelection:
+		clearSelection();
+		addSelection(layer, opt, abort);
+		break;
+	case SelectionOperation::AddSelection:
+		addSelection(layer, opt, abort);
+		break;
+	case SelectionOperation::SubSelection:
+		subSelection(layer, opt, abort);
+		break;
+	}
+}
+
 //
 euclase::Image cropImage(const euclase::Image &srcimg, int sx, int sy, int sw, int sh)
 {
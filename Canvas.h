@@ -3,14 +3,19 @@
 
 #include "Bounds.h"
 #include "euclase.h"
+#include "resample.h"
 #include <QColor>
 #include <QImage>
 #include <QMutex>
 #include <QPoint>
+#include <QVariant>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 
+class PointOperation;
+
 static const int PANEL_SIZE = 256; // must be power of two
 
 class Canvas {
@@ -147,6 +152,7 @@ public:
 		Normal,
 		Replace,
 		Eraser,
+		Copy, // 代替パネルで元のパネルをそのまま置き換える（変形など）
 	};
 
 	class Layer;
@@ -177,6 +183,14 @@ public:
 
 		BlendMode alternate_blend_mode = BlendMode::Normal;
 
+		std::shared_ptr<PointOperation const> adjustment; // 調整レイヤーなら、下のレイヤーの合成結果に適用する点演算
+		std::map<QString, QVariant> adjustment_parameters; // 調整レイヤーを編集し直すときのパラメータ
+
+		bool isAdjustmentLayer() const
+		{
+			return (bool)adjustment;
+		}
+
 		std::vector<Panel> *panels(ActivePanel active = PrimaryLayer)
 		{
 			switch (active) {
@@ -213,6 +227,8 @@ public:
 			primary_panels.clear();
 			alternate_panels.clear();
 			alternate_selection_panels.clear();
+			adjustment.reset();
+			adjustment_parameters.clear();
 		}
 
 		static void remove(std::vector<Panel> *panels, QPoint const &offset)
@@ -286,6 +302,7 @@ public:
 
 		void finishAlternatePanels(bool apply, Layer *mask_layer, const RenderOption &opt);
 		void setAlternateOption(BlendMode blendmode);
+		void setAlternatePanels(std::vector<Panel> const &panels, BlendMode blendmode);
 
 		QRect rect() const;
 		static Canvas::Panel *addPanel(std::vector<Panel> *panels, Panel &&panel);
@@ -308,24 +325,25 @@ public:
 	Layer const *current_layer() const;
 	Layer *selection_layer();
 
-	void paintToCurrentLayer(const Layer &source, const RenderOption &opt, bool *abort);
-	void paintToCurrentAlternate(const Layer &source, const RenderOption &opt, bool *abort);
+	void paintToCurrentLayer(const Layer &source, const RenderOption &opt, euclase::CancelToken const &abort);
+	void paintToCurrentAlternate(const Layer &source, const RenderOption &opt, euclase::CancelToken const &abort);
 
 	enum InputLayerMode {
 		AllLayers,
 		CurrentLayerOnly,
 	};
-	Panel renderToPanel(InputLayerMode input_layer_mode, euclase::Image::Format format, QRect const &r, QRect const &maskrect, ActivePanel activepanel, RenderOption const &opt, bool *abort) const;
+	Panel renderToPanel(InputLayerMode input_layer_mode, euclase::Image::Format format, QRect const &r, QRect const &maskrect, ActivePanel activepanel, RenderOption const &opt, euclase::CancelToken const &abort) const;
 
-	static void renderToSinglePanel(Panel *target_panel, const QPoint &target_offset, const Panel *input_panel, const QPoint &input_offset, const Layer *mask_layer, RenderOption const &opt, const QColor &brush_color, int opacity = 255, bool *abort = nullptr);
-	static void renderToLayer(Layer *target_layer, ActivePanel activepanel, const Layer &input_layer, Layer *mask_layer, const RenderOption &opt, bool *abort);
+	static void renderToSinglePanel(Panel *target_panel, const QPoint &target_offset, const Panel *input_panel, const QPoint &input_offset, const Layer *mask_layer, RenderOption const &opt, const QColor &brush_color, int opacity = 255, euclase::CancelToken const &abort = {});
+	static Panel *findPanel(const std::vector<Panel> *panels, const QPoint &offset);
+	static void renderToLayer(Layer *target_layer, ActivePanel activepanel, const Layer &input_layer, Layer *mask_layer, const RenderOption &opt, euclase::CancelToken const &abort);
 private:
-	static void renderToEachPanels_internal_(Panel *target_panel, const QPoint &target_offset, const Layer &input_layer, Layer *mask_layer, const QColor &brush_color, int opacity, RenderOption const &opt, bool *abort);
-	static void renderToEachPanels(Panel *target_panel, const QPoint &target_offset, const std::vector<Layer *> &input_layers, Layer *mask_layer, const QColor &brush_color, int opacity, const RenderOption &opt, bool *abort);
+	static void renderToEachPanels_internal_(Panel *target_panel, const QPoint &target_offset, const Layer &input_layer, Layer *mask_layer, const QColor &brush_color, int opacity, RenderOption const &opt, euclase::CancelToken const &abort);
+	static void renderToEachPanels(Panel *target_panel, const QPoint &target_offset, const std::vector<Layer *> &input_layers, Layer *mask_layer, const QColor &brush_color, int opacity, const RenderOption &opt, euclase::CancelToken const &abort);
 	static void composePanel(Panel *target_panel, const Panel *alt_panel, const Panel *alt_mask, const RenderOption &opt);
 	static void composePanels(Panel *target_panel, std::vector<Panel> const *alternate_panels, std::vector<Panel> const *alternate_selection_panels, const RenderOption &opt);
-	static Panel *findPanel(const std::vector<Panel> *panels, const QPoint &offset);
 	static void sortPanels(std::vector<Panel> *panels);
+	static void applyAdjustment(Panel *target_panel, PointOperation const &op);
 public:
 	enum class SelectionOperation {
 		SetSelection,
@@ -333,15 +351,26 @@ public:
 		SubSelection,
 	};
 	void clearSelection();
-	void addSelection(const Layer &source, const RenderOption &opt, bool *abort);
-	void subSelection(const Layer &source, const RenderOption &opt, bool *abort);
-	Panel renderSelection(const QRect &r, bool *abort) const;
-	Panel crop(const QRect &r, bool *abort) const;
+	void addSelection(const Layer &source, const RenderOption &opt, euclase::CancelToken const &abort);
+	void subSelection(const Layer &source, const RenderOption &opt, euclase::CancelToken const &abort);
+	Panel renderSelection(const QRect &r, euclase::CancelToken const &abort) const;
+	static Panel renderSelection(Layer const &selection_layer, const QRect &r, euclase::CancelToken const &abort);
+	Panel crop(const QRect &r, euclase::CancelToken const &abort) const;
+	Panel renderCurrentLayer(euclase::Image::Format format, const QRect &r, euclase::CancelToken const &abort) const;
 	void trim(const QRect &r);
 	void clear();
 	int addNewLayer();
+	int addAdjustmentLayer(PointOperation const &op);
+	void removeLayer(int index);
 	static LayerPtr newLayer();
 	void setCurrentLayer(int index);
+	int currentLayerIndex() const;
+
+	void flip(bool horizontal);
+	void rotate90(bool clockwise);
+	void resize(QSize const &size, euclase::EnlargeMethod method);
+	std::vector<Panel> renderTransform(QRect const &source_rect, euclase::Homography const &transform, euclase::Warper::Interpolation interpolation, QRect const &clip, euclase::CancelToken const &abort) const;
+	static std::vector<Panel> renderTransform(Layer const &layer, Layer const *mask_layer, QSize const &size, QRect const &source_rect, euclase::Homography const &transform, euclase::Warper::Interpolation interpolation, QRect const &clip, euclase::CancelToken const &abort);
 
 	class RectangleSelection {
 	public:
@@ -354,6 +383,12 @@ public:
 		QImage make(QRect const &rect) const override;
 	};
 	void changeSelection(SelectionOperation op, QRect const &rect, Bounds::Type bounds_type);
+	void changeSelection(SelectionOperation op, QPoint const &offset, std::vector<Panel> const &masks, euclase::CancelToken const &abort);
+	std::vector<Panel> renderFloodFill(QPoint const &pt, float tolerance, bool contiguous, euclase::CancelToken const &abort) const;
+	static std::vector<Panel> renderFloodFill(Layer const &layer, QSize const &size, QPoint const &pt, float tolerance, bool contiguous, euclase::CancelToken const &abort);
+	std::vector<Panel> renderFill(QPoint const &pt, QColor const &color, float tolerance, bool contiguous, euclase::CancelToken const &abort) const;
+	static std::vector<Panel> renderFill(Layer const &layer, QSize const &size, QPoint const &pt, QColor const &color, float tolerance, bool contiguous, euclase::CancelToken const &abort);
+	void selectColorRange(SelectionOperation op, QPoint const &pt, float tolerance, bool contiguous, euclase::CancelToken const &abort);
 };
 
 euclase::Image cropImage(euclase::Image const &srcimg, int sx, int sy, int sw, int sh);
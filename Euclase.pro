@@ -79,6 +79,7 @@ SOURCES += main.cpp\
 	NewDialog.cpp \
 	PanelizedImage.cpp \
 	Photoshop.cpp \
+	PointOperation.cpp \
 	ResizeDialog.cpp \
 	RingSlider.cpp \
 	RoundBrushGenerator.cpp \
@@ -86,14 +87,19 @@ SOURCES += main.cpp\
 	SelectionOutline.cpp \
 	SettingGeneralForm.cpp \
 	SettingsDialog.cpp \
+	TileRegion.cpp \
+	TileScheduler.cpp \
 	TransparentCheckerBrush.cpp \
 	antialias.cpp \
 	charvec.cpp \
 	euclase.cpp \
+	floodfill.cpp \
 	fp/fp.cpp \
 	joinpath.cpp \
 	median.cpp \
 	misc.cpp \
+	resample.cpp \
+	rotate.cpp \
 	xbrz/xbrz.cpp
 
 HEADERS += \
@@ -127,6 +133,7 @@ HEADERS += \
 	NewDialog.h \
 	PanelizedImage.h \
 	Photoshop.h \
+	PointOperation.h \
 	ResizeDialog.h \
 	RingSlider.h \
 	RoundBrushGenerator.h \
@@ -134,16 +141,22 @@ HEADERS += \
 	SelectionOutline.h \
 	SettingGeneralForm.h \
 	SettingsDialog.h \
+	TileFilter.h \
+	TileRegion.h \
+	TileScheduler.h \
 	TransparentCheckerBrush.h \
 	antialias.h \
 	charvec.h \
 	euclase.h \
+	floodfill.h \
 	fp/f16c.h \
 	fp/fp.h \
 	joinpath.h \
 	libEuclaseCUDA/libeuclasecuda.h \
 	median.h \
 	misc.h \
+	resample.h \
+	rotate.h \
 	uninitialized_vector.h \
 	xbrz/xbrz.h \
 	xbrz/xbrz_config.h \
@@ -6,22 +6,46 @@
 #include <QMutex>
 #include <QPainter>
 #include <QTimer>
+#include "FilterStatus.h"
 #include "MainWindow.h"
-#include <QWaitCondition>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
 #include <thread>
 #include <utility>
 
 struct FilterDialog::Private {
-	QDateTime start_filter;
-	int timer_id = 0;
-	bool busy = false;
-	bool done = false;
-	bool update = false;
-	std::thread thread;
+	struct Job {
+		TileFilter filter;
+		TaskFunction task; // 空でなければ filter の代わりにこれを実行する
+		QRect area;
+		int reduction = 1;
+		bool full = false; // 等倍で画像全体を処理するならtrue
+		unsigned int generation = 0;
+	};
+	std::thread worker; // ダイアログが開いている間、使い回すスレッド
+	std::mutex mutex;
+	std::condition_variable cond_job; // ジョブが来た
+	std::condition_variable cond_idle; // ジョブが終わった
+	std::optional<Job> job; // 次に実行するジョブ。後から来たもので上書きする
+	bool busy = false; // ジョブを実行中ならtrue
+	bool running_full = false; // 実行中のジョブが等倍で画像全体を処理しているならtrue
+	bool quit = false;
+	TileSourceCache cache; // パラメータを変えても入力は変わらないので使い回す
 	FilterFunction filter_fn;
+	AdjustmentFunction adjustment_fn; // 調整レイヤーの編集なら、フィルタを実行する代わりにこれを呼ぶ
+	TaskFunction task_fn; // パラメータの無い処理なら、開いたときに1回だけ実行する
+	bool apply_when_finished = false; // task_fn が終わったら、そのまま適用して閉じる
 	FilterContext context;
-	euclase::Image result_image;
+	std::vector<Canvas::Panel> result_panels;
+	unsigned int result_generation = 0; // result_panels を作ったジョブの世代
+	bool full = false; // result_panels が等倍で画像全体の結果ならtrue
+	bool done = false;
+	bool accepting = false; // OKが押されて、等倍の結果を待っているならtrue
+	QDateTime start_full; // プレビューの後、操作が無ければ等倍の処理を始める時刻
 	float progress = 0;
+	std::atomic_uint generation = 0; // フィルタを実行し直すたびに増える
 };
 
 FilterDialog::FilterDialog(MainWindow *parent, FilterContext &&context, AbstractFilterForm *form, const FilterFunction &fn)
@@ -29,12 +53,55 @@ FilterDialog::FilterDialog(MainWindow *parent, FilterContext &&context, Abstract
 	, ui(new Ui::FilterDialog)
 	, m(new Private)
 	, mainwindow(parent)
+{
+	m->filter_fn = fn;
+	setup(std::move(context), form);
+}
+
+/**
+ * @brief 調整レイヤーを編集するダイアログ
+ *
+ * パラメータが変わるたびに fn を呼ぶだけで、フィルタのスレッドは使わない
+ */
+FilterDialog::FilterDialog(MainWindow *parent, FilterContext &&context, AbstractFilterForm *form, const AdjustmentFunction &fn)
+	: QDialog(parent)
+	, ui(new Ui::FilterDialog)
+	, m(new Private)
+	, mainwindow(parent)
+{
+	m->adjustment_fn = fn;
+	setup(std::move(context), form);
+}
+
+/**
+ * @brief パラメータの無い処理の進捗を表示して、中断できるようにするダイアログ
+ * @param apply_when_finished trueなら、処理が終わったらOKを待たずに適用して閉じる
+ *
+ * 結果は画像の大きさが変わることもあるので、プレビューはしない
+ */
+FilterDialog::FilterDialog(MainWindow *parent, const TaskFunction &fn, bool apply_when_finished)
+	: QDialog(parent)
+	, ui(new Ui::FilterDialog)
+	, m(new Private)
+	, mainwindow(parent)
+{
+	m->task_fn = fn;
+	m->apply_when_finished = apply_when_finished;
+	setup({}, nullptr);
+}
+
+void FilterDialog::setup(FilterContext &&context, AbstractFilterForm *form)
 {
 	ui->setupUi(this);
 
-	m->filter_fn = fn;
 	m->context = context;
 
+	if (m->filter_fn || m->task_fn) {
+		m->worker = std::thread([this](){
+			run();
+		});
+	}
+
 	if (form) {
 		form->setParent(ui->stackedWidget);
 		ui->stackedWidget->addWidget(form);
@@ -43,6 +110,7 @@ FilterDialog::FilterDialog(MainWindow *parent, FilterContext &&context, Abstract
 	}
 
 	ui->checkBox_preview->setChecked(true);
+	ui->checkBox_preview->setVisible(m->filter_fn != nullptr);
 	mainwindow->setPreviewLayerEnable(ui->checkBox_preview->isChecked());
 
 	setProgress(0);
@@ -54,7 +122,16 @@ FilterDialog::FilterDialog(MainWindow *parent, FilterContext &&context, Abstract
 
 FilterDialog::~FilterDialog()
 {
-	stopFilter(true); // スレッド停止（完了まで待つ）
+	{
+		std::lock_guard lock(m->mutex);
+		m->quit = true;
+		m->job.reset();
+	}
+	m->generation++; // 実行中のフィルタを中断させる
+	m->cond_job.notify_all();
+	if (m->worker.joinable()) {
+		m->worker.join();
+	}
 	delete m;
 	delete ui;
 }
@@ -64,38 +141,135 @@ FilterContext *FilterDialog::context()
 	return &m->context;
 }
 
-void FilterDialog::stopFilter(bool join)
+void FilterDialog::updateFilter()
 {
-	*context()->progress_ptr() = 0.0f;
-	*context()->cancel_ptr() = true;
-	if (join) {
-		if (m->thread.joinable()) {
-			m->thread.join();
+	if (m->adjustment_fn) { // 合成時に適用されるので、表示を更新するだけでよい
+		m->adjustment_fn(context());
+		updateImageView();
+		return;
+	}
+	m->start_full = {};
+	startFilter(!m->task_fn);
+}
+
+/**
+ * @brief フィルタの実行を依頼する
+ * @param preview プレビューならtrue
+ *
+ * プレビューでは表示されている範囲だけを、縮小表示ならその縮小率で処理する
+ * 実行中のフィルタはタイルの区切りで中断され、まだ始まっていない依頼は新しいもので置き換えられる
+ */
+void FilterDialog::startFilter(bool preview)
+{
+	QRect area;
+	int reduction = 1;
+	if (preview) {
+		area = mainwindow->visibleCanvasRect();
+		double scale = mainwindow->viewScale();
+		while (reduction < 16 && reduction * 2 * scale <= 1.0) {
+			reduction *= 2;
 		}
+		if (reduction == 1 && area.contains(QRect(QPoint(0, 0), mainwindow->canvas()->size()))) {
+			preview = false; // 全体が等倍で見えているならプレビューと等倍の処理は同じ
+			area = {};
+		}
+	}
+	context()->setReduction(reduction);
+
+	Private::Job job;
+	if (m->task_fn) {
+		job.task = m->task_fn;
+	} else {
+		job.filter = m->filter_fn(context()); // パラメータはGUIスレッドで読み取っておく
+	}
+	job.area = area;
+	job.reduction = reduction;
+	job.full = !preview;
+	{
+		std::lock_guard lock(m->mutex);
+		job.generation = ++m->generation; // 実行中のフィルタを中断させる
+		m->job = std::move(job);
 	}
-	m->busy = false;
-	m->done = false;
-	m->update = false;
+	m->cond_job.notify_one();
 }
 
-void FilterDialog::updateFilter()
+/**
+ * @brief ワーカースレッドの処理
+ *
+ * 依頼を待って実行し、完了したらGUIスレッドに通知する
+ */
+void FilterDialog::run()
 {
-	stopFilter(false);
-	m->start_filter = QDateTime::currentDateTime().addMSecs(100);
+	while (1) {
+		Private::Job job;
+		{
+			std::unique_lock lock(m->mutex);
+			m->cond_job.wait(lock, [&](){ return m->quit || m->job; });
+			if (m->quit) break;
+			job = std::move(*m->job);
+			m->job.reset();
+			m->busy = true;
+			m->running_full = job.full;
+		}
+		*context()->progress_ptr() = 0.0f;
+		FilterStatus status(euclase::CancelToken(&m->generation, job.generation), context()->progress_ptr());
+		std::vector<Canvas::Panel> panels;
+		if (job.task) {
+			panels = job.task(&status);
+		} else {
+			panels = mainwindow->runTileFilter(job.filter, &status, job.area, job.reduction, &m->cache);
+		}
+		bool ok = !status.cancel.canceled();
+		{
+			std::lock_guard lock(m->mutex);
+			if (ok) {
+				m->result_panels = std::move(panels);
+				m->result_generation = job.generation;
+				m->full = job.full;
+				m->done = true;
+			}
+			m->busy = false;
+			m->running_full = false;
+		}
+		m->cond_idle.notify_all();
+		if (ok) {
+			QMetaObject::invokeMethod(this, [this, generation = job.generation](){
+				onFilterFinished(generation);
+			}, Qt::QueuedConnection);
+		}
+	}
 }
 
-void FilterDialog::startFilter()
+/**
+ * @brief フィルタの完了通知（GUIスレッド）
+ */
+void FilterDialog::onFilterFinished(unsigned int generation)
 {
-	m->thread = std::thread([&](){
-		auto memtype = context()->sourceImage().memtype();
-		m->result_image = m->filter_fn(context());
-		if (!*context()->cancel_ptr()) {
-			m->result_image.memconvert(memtype);
-			m->done = true;
-			m->update = true;
+	std::vector<Canvas::Panel> panels;
+	bool full = true;
+	{
+		std::lock_guard lock(m->mutex);
+		if (m->result_generation != generation || generation != m->generation) return; // もう新しい依頼がある
+		if (!m->task_fn) {
+			panels = m->result_panels;
+			full = m->full;
 		}
-		m->busy = false;
-	});
+	}
+	if (m->accepting && full) { // OKが押されていれば、等倍の結果が揃ったところで閉じる
+		emit end(true);
+		return;
+	}
+	if (m->task_fn) { // 結果は閉じるときに使う
+		if (m->apply_when_finished) {
+			done(QDialog::Accepted);
+		}
+		return;
+	}
+	mainwindow->setFilteredPanels(panels, false);
+	updateImageView();
+	if (!full) {
+		m->start_full = QDateTime::currentDateTime().addMSecs(500);
+	}
 }
 
 void FilterDialog::setProgress(float value)
@@ -117,23 +291,9 @@ void FilterDialog::timerEvent(QTimerEvent *event)
 		setProgress(value);
 	}
 
-	if (m->busy) return;
-
-	if (m->update) {
-		m->update = false;
-		mainwindow->setFilteredImage(m->result_image, false);
-		updateImageView();
-	}
-
-	if (m->start_filter.isValid()) {
-		QDateTime now = QDateTime::currentDateTime();
-		if (m->start_filter <= now) {
-			m->start_filter = {};
-			stopFilter(true);
-			m->busy = true;
-			*context()->cancel_ptr() = false;
-			startFilter();
-		}
+	if (m->start_full.isValid() && m->start_full <= QDateTime::currentDateTime()) {
+		m->start_full = {};
+		startFilter(false);
 	}
 }
 
@@ -151,9 +311,29 @@ void FilterDialog::paintEvent(QPaintEvent *event)
 	}
 }
 
-euclase::Image FilterDialog::result()
+/**
+ * @brief 等倍で画像全体に適用した結果を返す
+ *
+ * done() で等倍の結果が揃うのを待ってから閉じるので、ここで処理はしない
+ */
+std::vector<Canvas::Panel> FilterDialog::result()
+{
+	if (m->adjustment_fn) return {};
+	std::lock_guard lock(m->mutex);
+	if (m->done && m->full && m->result_generation == m->generation) {
+		return m->result_panels;
+	}
+	return {};
+}
+
+/**
+ * @brief 等倍で画像全体に適用した結果が揃っているか
+ */
+bool FilterDialog::isFullResultReady()
 {
-	return m->result_image;
+	if (m->adjustment_fn) return true;
+	std::lock_guard lock(m->mutex);
+	return m->done && m->full && m->result_generation == m->generation;
 }
 
 bool FilterDialog::isPreviewEnabled() const
@@ -161,17 +341,50 @@ bool FilterDialog::isPreviewEnabled() const
 	return ui->checkBox_preview->isChecked();
 }
 
+bool FilterDialog::isAdjustment() const
+{
+	return (bool)m->adjustment_fn;
+}
+
+bool FilterDialog::isTask() const
+{
+	return (bool)m->task_fn;
+}
+
 void FilterDialog::on_checkBox_preview_stateChanged(int arg1)
 {
 	updateImageView();
 }
 
+/**
+ * @brief ダイアログを閉じる
+ *
+ * OKのとき、まだプレビューの結果しか無ければ、等倍の処理をワーカースレッドに依頼して、
+ * 進捗を表示したまま結果を待つ。閉じるのは onFilterFinished() で結果が揃ってから
+ */
 void FilterDialog::done(int r)
 {
-	if (r == QDialog::Accepted) {
-		emit end(true);
-	} else {
+	if (r != QDialog::Accepted) {
 		emit end(false);
+		return;
+	}
+	if (isFullResultReady()) {
+		emit end(true);
+		return;
+	}
+	if (m->accepting) return;
+	m->accepting = true;
+	m->start_full = {};
+	ui->stackedWidget->setEnabled(false); // 待っている間にパラメータを変えさせない
+	ui->checkBox_preview->setEnabled(false);
+	ui->pushButton_ok->setEnabled(false);
+	bool running;
+	{
+		std::lock_guard lock(m->mutex);
+		running = m->busy && m->running_full && !m->job; // 実行中の等倍の処理の完了を待てばよい
+	}
+	if (!running) {
+		startFilter(false);
 	}
 }
 	
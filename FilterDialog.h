@@ -4,10 +4,13 @@
 #include <QDialog>
 #include <QVariant>
 #include <functional>
+#include "Canvas.h"
+#include "TileFilter.h"
 #include "euclase.h"
 
 class MainWindow;
 class AbstractFilterForm;
+struct FilterStatus;
 
 namespace Ui {
 class FilterDialog;
@@ -16,19 +19,10 @@ class FilterDialog;
 class FilterContext {
 private:
 	std::map<QString, QVariant> parameters_;
-	bool cancel_ = false;
+	euclase::CancelToken cancel_;
 	float progress_ = 0.0f;
-	euclase::Image source_image_;
+	int reduction_ = 1; // 縮小プレビューの縮小率
 public:
-	void setSourceImage(euclase::Image const &image)
-	{
-		source_image_ = image;
-
-	}
-	euclase::Image const &sourceImage() const
-	{
-		return source_image_;
-	}
 	void setParameter(QString const &name, QVariant const &val)
 	{
 		parameters_[name] = val;
@@ -41,17 +35,42 @@ public:
 		}
 		return def;
 	}
+	std::map<QString, QVariant> const &parameters() const
+	{
+		return parameters_;
+	}
 	float *progress_ptr()
 	{
 		return &progress_;
 	}
-	bool *cancel_ptr()
+	void setCancelToken(euclase::CancelToken const &cancel)
+	{
+		cancel_ = cancel;
+	}
+	euclase::CancelToken const &cancelToken() const
+	{
+		return cancel_;
+	}
+	void setReduction(int reduction)
+	{
+		reduction_ = reduction;
+	}
+	int reduction() const
+	{
+		return reduction_;
+	}
+	/**
+	 * @brief 半径などの長さのパラメータを縮小率に合わせる
+	 */
+	int scaledLength(int length) const
 	{
-		return &cancel_;
+		return (length + reduction_ / 2) / reduction_;
 	}
 };
 
-typedef std::function<euclase::Image (FilterContext *)> FilterFunction;
+typedef std::function<TileFilter (FilterContext *)> FilterFunction;
+typedef std::function<void (FilterContext *)> AdjustmentFunction; // 調整レイヤーのパラメータを更新する
+typedef std::function<std::vector<Canvas::Panel> (FilterStatus *)> TaskFunction; // パラメータの無い処理
 
 class FilterDialog : public QDialog {
 	Q_OBJECT
@@ -60,16 +79,23 @@ private:
 	struct Private;
 	Private *m;
 	MainWindow *mainwindow;
-	void startFilter();
-	void stopFilter(bool join);
+	void startFilter(bool preview);
+	void run();
+	void onFilterFinished(unsigned int generation);
 	void setProgress(float value);
 	void updateImageView();
+	void setup(FilterContext &&context, AbstractFilterForm *form);
+	bool isFullResultReady();
 public:
 	explicit FilterDialog(MainWindow *parent, FilterContext &&context, AbstractFilterForm *form, FilterFunction const &fn);
+	explicit FilterDialog(MainWindow *parent, FilterContext &&context, AbstractFilterForm *form, AdjustmentFunction const &fn);
+	explicit FilterDialog(MainWindow *parent, TaskFunction const &fn, bool apply_when_finished = false);
 	~FilterDialog();
 	void updateFilter();
-	euclase::Image result();
+	std::vector<Canvas::Panel> result();
 	bool isPreviewEnabled() const;
+	bool isAdjustment() const;
+	bool isTask() const;
 	FilterContext *context();
 private slots:
 	void on_checkBox_preview_stateChanged(int arg1);
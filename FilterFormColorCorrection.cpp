@@ -15,10 +15,20 @@ FilterFormColorCorrection::~FilterFormColorCorrection()
 
 void FilterFormColorCorrection::start()
 {
-	context()->setParameter("hue", 0);
-	context()->setParameter("saturation", 0);
-	context()->setParameter("value", 0);
-
+	// 調整レイヤーを編集し直すときは、保存してあったパラメータから始める
+	auto init = [&](QSlider *slider, QSpinBox *spinbox, char const *name){
+		const int value = context()->parameter(name).toInt();
+		context()->setParameter(name, value);
+		auto b1 = slider->blockSignals(true);
+		auto b2 = spinbox->blockSignals(true);
+		slider->setValue(value);
+		spinbox->setValue(value);
+		slider->blockSignals(b1);
+		spinbox->blockSignals(b2);
+	};
+	init(ui->horizontalSlider_hue, ui->spinBox_hue, "hue");
+	init(ui->horizontalSlider_saturation, ui->spinBox_saturation, "saturation");
+	init(ui->horizontalSlider_brightness, ui->spinBox_brightness, "brightness");
 }
 
 void FilterFormColorCorrection::on_horizontalSlider_hue_valueChanged(int hue)
@@ -1,10 +1,12 @@
 #ifndef FILTERSTATUS_H
 #define FILTERSTATUS_H
 
+#include "euclase.h"
+
 struct FilterStatus {
-	bool *cancel = nullptr;
+	euclase::CancelToken cancel;
 	float *progress = nullptr;
-	FilterStatus(bool *cancel, float *progress)
+	FilterStatus(euclase::CancelToken const &cancel, float *progress)
 		: cancel(cancel)
 		, progress(progress)
 	{
@@ -6,6 +6,8 @@
 #include "MainWindow.h"
 #include "PanelizedImage.h"
 #include "SelectionOutline.h"
+#include "TileRegion.h"
+#include "TileScheduler.h"
 #include "misc.h"
 #include "Bounds.h"
 #include <QBitmap>
@@ -19,6 +21,7 @@
 #include <QSvgRenderer>
 #include <QWheelEvent>
 #include <cmath>
+#include <atomic>
 #include <mutex>
 #include <thread>
 #include <condition_variable>
@@ -27,6 +30,10 @@
 const int MAX_SCALE = 32; // 32x
 const int MIN_SCALE = 16; // 1/16x
 
+// 表示用に合成する画像の形式
+// 表示は8ビットなので半精度で十分。書き出しやフィルタはF32のまま
+const euclase::Image::Format DISPLAY_IMAGE_FORMAT = euclase::Image::Format_F16_RGBA;
+
 
 class BoundsDrawer {
 public:
@@ -141,8 +148,9 @@ struct ImageViewWidget::Private {
 	QPointF bounds_start;
 	QPointF bounds_end;
 
-	QBrush horz_stripe_brush;
-	QBrush vert_stripe_brush;
+	QPolygonF transform_quad; // 変形の枠（キャンバス座標系）
+
+	QBrush grid_brush; // 最大拡大時のグリッド（1画素分の模様）
 
 	QCursor cursor;
 
@@ -152,21 +160,38 @@ struct ImageViewWidget::Private {
 	std::condition_variable cond;
 
 	std::thread image_rendering_thread;
-	bool render_interrupted = false;
+	std::atomic_bool render_interrupted = false;
 	bool render_invalidate = false;
-	bool render_requested = false;
-	bool render_canceled = false;
-	std::vector<QRect> render_canvas_rects; // in canvas coordinates
-	std::vector<QRect> render_canvas_adding_rects;
-	std::vector<Canvas::Panel> composed_panels_cache;
+	std::atomic_bool render_requested = false;
+	std::atomic_uint render_generation = 0; // 描画中の処理を取り消すたびに増える。描画は開始時の値と異なれば中断する
+	TileRegion render_damage{OFFSCREEN_PANEL_SIZE}; // 描画が必要なパネル（キャンバス座標系）
+	TileRegion render_damage_adding{OFFSCREEN_PANEL_SIZE}; // 描画中に追加された更新領域
+	TileScheduler scheduler; // パネル描画のスケジューラ
+
+	struct ComposedPanel {
+		QPoint offset; // キャンバス座標系でのパネル原点
+		Canvas::Panel panel; // 全レイヤーを合成したパネル
+	};
+	std::vector<ComposedPanel> composed_panels_cache; // 合成済みパネルのキャッシュ（offsetでソート）
+
+	struct CoarsePanel {
+		QPoint offset; // キャンバス座標系でのパネル原点
+		QImage image; // 縮小画像
+	};
+	std::vector<CoarsePanel> coarse_panels_cache; // 低解像度パネルのキャッシュ（offsetでソート）
+
+	unsigned int panels_cache_generation = 0; // パネルキャッシュを破棄するたびに増える
+	QRect visible_panels_rect; // 表示中のパネルの範囲（キャンバス座標系）。キャッシュから捨てないようにする
+	int prefetch_margin = 1; // 先読みする範囲（ビューポートの周囲のパネル数）
 
 	CoordinateMapper offscreen1_mapper;
 	PanelizedImage offscreen1;
 
 	std::thread selection_outline_thread;
-	SelectionOutline selection_outline;
-	bool selection_outline_requested = false;
-	QPixmap offscreen2;
+	SelectionOutline selection_outline; // キャンバス座標系
+	std::atomic_bool selection_outline_requested = false;
+	CoordinateMapper selection_outline_view_mapper;
+	QPainterPath selection_outline_view_path; // ビューポート座標系
 };
 
 ImageViewWidget::ImageViewWidget(QWidget *parent)
@@ -195,25 +220,22 @@ ImageViewWidget::~ImageViewWidget()
 
 void ImageViewWidget::initBrushes()
 {
-	{
-		QImage image(8, 8, QImage::Format_Grayscale8);
-		for (int y = 0; y < 8; y++) {
-			uint8_t *p = image.scanLine(y);
-			for (int x = 0; x < 8; x++) {
-				p[x] = y < 4 ? 0 : 255;
-			}
+	{ // グリッド：左端と上端に縞模様の線を持つ、キャンバス1画素分の模様
+		QImage image(MAX_SCALE, MAX_SCALE, QImage::Format_ARGB32_Premultiplied);
+		image.fill(Qt::transparent);
+		auto Stripe = [](int i){
+			const int a = 64; // 不透明度 25%
+			const int v = (i & 4) ? a : 0;
+			return qRgba(v, v, v, a);
+		};
+		for (int y = 0; y < MAX_SCALE; y++) {
+			((QRgb *)image.scanLine(y))[0] = Stripe(y);
 		}
-		m->horz_stripe_brush = QBrush(image);
-	}
-	{
-		QImage image(8, 8, QImage::Format_Grayscale8);
-		for (int y = 0; y < 8; y++) {
-			uint8_t *p = image.scanLine(y);
-			for (int x = 0; x < 8; x++) {
-				p[x] = x < 4 ? 0 : 255;
-			}
+		QRgb *p = (QRgb *)image.scanLine(0);
+		for (int x = 0; x < MAX_SCALE; x++) {
+			p[x] = Stripe(x);
 		}
-		m->vert_stripe_brush = QBrush(image);
+		m->grid_brush = QBrush(image);
 	}
 }
 
@@ -244,19 +266,225 @@ void ImageViewWidget::init(MainWindow *mainwindow, QScrollBar *vsb, QScrollBar *
 	m->h_scroll_bar = hsb;
 }
 
-static QImage scale_fp32_to_uint8_rgba(euclase::Image const &src, int w, int h)
+namespace {
+
+/**
+ * @brief 表示用のガンマ補正テーブル
+ *
+ * リニアな浮動小数点値を、ガンマ補正した8ビット値に変換する
+ * floatのビット表現の上位ビットで引くので、暗部でも精度が落ちない
+ */
+class DisplayGammaTable {
+private:
+	static constexpr int SHIFT = 15;
+	static constexpr uint32_t ONE = 0x3f800000; // 1.0f
+	uint8_t table_[(ONE >> SHIFT) + 1];
+public:
+	DisplayGammaTable()
+	{
+		const int n = (ONE >> SHIFT) + 1;
+		for (int i = 0; i < n; i++) {
+			uint32_t bits = (i < n - 1) ? (((uint32_t)i << SHIFT) | (1 << (SHIFT - 1))) : ONE; // 区間の中央の値
+			float v;
+			memcpy(&v, &bits, sizeof(v));
+			table_[i] = (uint8_t)std::min(std::max(floor(euclase::gamma(v) * 255 + 0.5f), 0.0f), 255.0f);
+		}
+	}
+	uint8_t operator () (float v) const
+	{
+		if (!(v > 0)) return 0;
+		if (v >= 1) return 255;
+		uint32_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		return table_[bits >> SHIFT];
+	}
+	static DisplayGammaTable const &instance()
+	{
+		static DisplayGammaTable table;
+		return table;
+	}
+};
+
+/**
+ * @brief 表示用画像を生成する
+ * @param src 合成済みのパネル画像（F32またはF16のRGBA）
+ * @param sx, sy, sw, sh 描画元の矩形（パネル座標系）
+ * @param dw, dh 描画先のサイズ
+ * @param dpos 描画先の座標（オフスクリーン座標系）。市松模様の位相に使う
+ * @param background falseなら市松模様と合成せず、アルファ付きのまま返す
+ *
+ * 切り出し、拡大縮小、市松模様との合成、8ビットへの変換を1回の走査で行う
+ * 拡大時は最近傍で、描画元の1行を8ビットにしてから描画先の画素に配る
+ * 縮小時は面積平均で、描画元の行をRGBAの4要素ずつ列ごとに足し込んでから、描画先の画素の範囲で合計する
+ */
+template <typename PIXEL>
+QImage render_display_image_(euclase::Image const &src, int sx, int sy, int sw, int sh, int dw, int dh, QPoint const &dpos, bool background)
 {
-	if (src.memtype() == euclase::Image::CUDA) {
-		euclase::Image tmp(w, h, euclase::Image::Format_U8_RGBA, euclase::Image::CUDA);
-		global->cuda->scale_fp32_to_uint8_rgba(w, h, w, tmp.data(), src.width(), src.height(), src.data());
-		return tmp.qimage();
-	} else {
-		QImage qimg = src.qimage();
-		if (qimg.isNull()) return {};
-		return qimg.scaled(w, h, Qt::IgnoreAspectRatio, Qt::FastTransformation);
+	DisplayGammaTable const &gamma = DisplayGammaTable::instance();
+
+	// 各画素に対応する描画元の範囲
+	std::vector<int> xs(dw + 1);
+	std::vector<int> ys(dh + 1);
+	for (int i = 0; i <= dw; i++) {
+		xs[i] = sx + (int)((int64_t)i * sw / dw);
+	}
+	for (int i = 0; i <= dh; i++) {
+		ys[i] = sy + (int)((int64_t)i * sh / dh);
+	}
+
+	// 1画素分の色
+	struct Texel {
+		int R = 0;
+		int G = 0;
+		int B = 0;
+		float a = 0;
+	};
+	// アルファを乗算した合計と画素数から色を求める
+	auto texel = [&](float const *sum, int n){
+		Texel t;
+		if (sum[3] > 0) {
+			t.R = gamma(sum[0] / sum[3]);
+			t.G = gamma(sum[1] / sum[3]);
+			t.B = gamma(sum[2] / sum[3]);
+		}
+		t.a = std::min(std::max(sum[3] / n, 0.0f), 1.0f);
+		return t;
+	};
+	// 透明部分を市松模様と合成して書き込む
+	auto put = [&](QRgb *d, int ix, int v, Texel const &t){
+		if (!background) { // アルファ付き（乗算済み）のまま
+			d[ix] = qRgba((int)(t.R * t.a + 0.5f), (int)(t.G * t.a + 0.5f), (int)(t.B * t.a + 0.5f), (int)(t.a * 255 + 0.5f));
+		} else if (t.a < 1) {
+			const int u = dpos.x() + ix;
+			const float bg = (((u ^ v) & 8) ? 255 : 192) * (1 - t.a);
+			d[ix] = qRgb((int)(t.R * t.a + bg + 0.5f), (int)(t.G * t.a + bg + 0.5f), (int)(t.B * t.a + bg + 0.5f));
+		} else {
+			d[ix] = qRgb(t.R, t.G, t.B);
+		}
+	};
+	// 描画元の1行をアルファを乗算したRGBAにして足し込む
+	auto accumulate = [&](int y, float *sum){
+		PIXEL const *s = (PIXEL const *)src.scanLine(y) + sx;
+		for (int x = 0; x < sw; x++) {
+			const float a = s[x].a;
+			float *p = sum + x * 4;
+			p[0] += s[x].r * a;
+			p[1] += s[x].g * a;
+			p[2] += s[x].b * a;
+			p[3] += a;
+		}
+	};
+
+	QImage dst(dw, dh, QImage::Format_ARGB32_Premultiplied);
+	std::vector<float> sum((size_t)sw * 4);
+	if (sw <= dw && sh <= dh) { // 拡大：描画先の各画素は描画元の1画素に対応する
+		std::vector<Texel> row(sw);
+		int loaded = -1;
+		for (int iy = 0; iy < dh; iy++) {
+			const int y = ys[iy];
+			if (y != loaded) { // 描画元の行が変わったときだけ変換する
+				std::fill(sum.begin(), sum.end(), 0.0f);
+				accumulate(y, sum.data());
+				for (int x = 0; x < sw; x++) {
+					row[x] = texel(&sum[x * 4], 1);
+				}
+				loaded = y;
+			}
+			const int v = dpos.y() + iy;
+			QRgb *d = (QRgb *)dst.scanLine(iy);
+			for (int ix = 0; ix < dw; ix++) {
+				put(d, ix, v, row[xs[ix] - sx]);
+			}
+		}
+	} else { // 縮小：面積平均
+		for (int iy = 0; iy < dh; iy++) {
+			const int y0 = ys[iy];
+			const int y1 = std::max(ys[iy + 1], y0 + 1);
+			std::fill(sum.begin(), sum.end(), 0.0f);
+			for (int y = y0; y < y1; y++) {
+				accumulate(y, sum.data());
+			}
+			const int v = dpos.y() + iy;
+			QRgb *d = (QRgb *)dst.scanLine(iy);
+			for (int ix = 0; ix < dw; ix++) {
+				const int x0 = xs[ix];
+				const int x1 = std::max(xs[ix + 1], x0 + 1);
+				float total[4] = {};
+				for (int x = x0; x < x1; x++) {
+					float const *p = &sum[(x - sx) * 4];
+					for (int c = 0; c < 4; c++) {
+						total[c] += p[c];
+					}
+				}
+				put(d, ix, v, texel(total, (x1 - x0) * (y1 - y0)));
+			}
+		}
+	}
+	return dst;
+}
+
+QImage render_display_image(euclase::Image const &src, int sx, int sy, int sw, int sh, int dw, int dh, QPoint const &dpos, bool background = true)
+{
+	if (dw < 1 || dh < 1 || sw < 1 || sh < 1) return {};
+	if (src.memtype() != euclase::Image::Host) {
+		return render_display_image(src.toHost(), sx, sy, sw, sh, dw, dh, dpos, background);
+	}
+	switch (src.format()) {
+	case euclase::Image::Format_F32_RGBA:
+		return render_display_image_<euclase::Float32RGBA>(src, sx, sy, sw, sh, dw, dh, dpos, background);
+	case euclase::Image::Format_F16_RGBA:
+		return render_display_image_<euclase::Float16RGBA>(src, sx, sy, sw, sh, dw, dh, dpos, background);
+	}
+	return render_display_image(src.convertToFormat(DISPLAY_IMAGE_FORMAT), sx, sy, sw, sh, dw, dh, dpos, background);
+}
+
+/**
+ * @brief キャンバス座標でソートされたパネルキャッシュを検索する
+ * @return offset以上の最初の要素
+ */
+template <typename T>
+auto find_cached_panel(std::vector<T> const &cache, QPoint const &offset)
+{
+	return std::lower_bound(cache.begin(), cache.end(), offset, [](T const &a, QPoint const &b){
+		return misc::compareQPoint(a.offset, b) < 0;
+	});
+}
+
+/**
+ * @brief パネルキャッシュに格納する
+ * @param limit 最大保持数。超えるときは最も遠いパネルを捨てる
+ * @param keep 表示中のパネルの範囲。この中のパネルは、範囲外のパネルが残っている間は捨てない
+ */
+template <typename T>
+void store_cached_panel(std::vector<T> *cache, T &&item, size_t limit, QRect const &keep)
+{
+	auto Find = [&](){
+		return std::lower_bound(cache->begin(), cache->end(), item.offset, [](T const &a, QPoint const &b){
+			return misc::compareQPoint(a.offset, b) < 0;
+		});
+	};
+	auto it = Find();
+	if (it != cache->end() && it->offset == item.offset) {
+		*it = std::move(item);
+		return;
 	}
+	if (cache->size() >= limit) {
+		const QPoint center = keep.isEmpty() ? item.offset : keep.center();
+		auto Distance = [&](QPoint const &pt){
+			int d = std::abs(pt.x() - center.x()) + std::abs(pt.y() - center.y());
+			return keep.contains(pt) ? d - (1 << 30) : d; // 表示中のパネルは最後に捨てる
+		};
+		auto farthest = std::max_element(cache->begin(), cache->end(), [&](T const &a, T const &b){
+			return Distance(a.offset) < Distance(b.offset);
+		});
+		cache->erase(farthest);
+		it = Find();
+	}
+	cache->insert(it, std::move(item));
 }
 
+} // namespace
+
 void ImageViewWidget::runSelectionRendering()
 {
 	while (1) {
@@ -269,7 +497,7 @@ void ImageViewWidget::runSelectionRendering()
 		}
 		if (req) {
 			m->selection_outline_requested = false;
-			SelectionOutline selection_outline = renderSelectionOutline(&m->selection_outline_requested);
+			SelectionOutline selection_outline = renderSelectionOutline(euclase::CancelToken(&m->selection_outline_requested));
 			emit notifySelectionOutlineReady(selection_outline);
 		}
 	}
@@ -299,11 +527,11 @@ void ImageViewWidget::stopRenderingThread()
 {
 	{
 		std::lock_guard lock(mutexForOffscreen());
-		m->composed_panels_cache.clear();
-		m->render_canvas_rects.clear();
-		m->render_canvas_adding_rects.clear();
+		clearPanelCaches();
+		m->render_damage.clear();
+		m->render_damage_adding.clear();
 		m->render_interrupted = true;
-		m->render_canceled = true;
+		m->render_generation++;
 		m->cond.notify_all();
 	}
 	if (m->image_rendering_thread.joinable()) {
@@ -341,6 +569,22 @@ void ImageViewWidget::hideRect(bool update)
 	}
 }
 
+/**
+ * @brief 変形の枠を表示する
+ * @param quad 四隅（キャンバス座標系）
+ */
+void ImageViewWidget::showTransformQuad(QPolygonF const &quad)
+{
+	m->transform_quad = quad;
+	update();
+}
+
+void ImageViewWidget::hideTransformQuad()
+{
+	m->transform_quad = {};
+	update();
+}
+
 bool ImageViewWidget::isRectVisible() const
 {
 	return m->bounds_visible;
@@ -427,15 +671,14 @@ void ImageViewWidget::clearRenderCache(bool clear_offscreen, bool lock)
 	}
 
 	m->offscreen1_mapper = currentCoordinateMapper();
-	m->composed_panels_cache.clear();
-	m->render_canvas_rects.clear();
-	m->render_canvas_adding_rects.clear();
+	m->render_damage.clear();
+	m->render_damage_adding.clear();
 	m->render_requested = true;
-	m->render_canceled = true;
+	m->render_generation++;
 
 	if (clear_offscreen) {
 		m->offscreen1.clear();
-		m->offscreen2 = {};
+		clearPanelCaches();
 	}
 
 	m->cond.notify_all();
@@ -455,7 +698,119 @@ void ImageViewWidget::requestUpdateCanvas(const QRect &canvasrect, bool lock)
 		requestUpdateCanvas(canvasrect, false);
 		return;
 	}
-	m->render_canvas_adding_rects.push_back(canvasrect);
+	m->render_damage_adding.addRect(canvasrect);
+}
+
+/**
+ * @brief ImageViewWidget::findComposedPanel
+ * @param offset キャンバス座標系でのパネル原点
+ * @return 合成済みパネル。なければnull
+ *
+ * 合成済みパネルのキャッシュを検索する
+ */
+Canvas::Panel ImageViewWidget::findComposedPanel(QPoint const &offset) const
+{
+	auto it = find_cached_panel(m->composed_panels_cache, offset);
+	if (it != m->composed_panels_cache.end() && it->offset == offset) {
+		return it->panel;
+	}
+	return {};
+}
+
+/**
+ * @brief ImageViewWidget::storeComposedPanel
+ * @param offset キャンバス座標系でのパネル原点
+ * @param panel 合成済みパネル
+ *
+ * 合成済みパネルをキャッシュに格納する
+ */
+void ImageViewWidget::storeComposedPanel(QPoint const &offset, Canvas::Panel const &panel)
+{
+	store_cached_panel(&m->composed_panels_cache, {offset, panel}, composedPanelLimit(), m->visible_panels_rect);
+}
+
+/**
+ * @brief ImageViewWidget::composedPanelLimit
+ * @return 合成済みパネルの最大保持数
+ *
+ * 表示中のパネルが全て収まるように、表示中のパネル数より小さくはしない
+ */
+size_t ImageViewWidget::composedPanelLimit() const
+{
+	const size_t visible = (size_t)(m->visible_panels_rect.width() / OFFSCREEN_PANEL_SIZE) * (m->visible_panels_rect.height() / OFFSCREEN_PANEL_SIZE);
+	return std::max((size_t)MAX_COMPOSED_PANELS, visible);
+}
+
+/**
+ * @brief ImageViewWidget::findCoarsePanel
+ * @param offset キャンバス座標系でのパネル原点
+ * @return 縮小画像。なければnull
+ *
+ * 低解像度パネルのキャッシュを検索する
+ */
+QImage ImageViewWidget::findCoarsePanel(QPoint const &offset) const
+{
+	auto it = find_cached_panel(m->coarse_panels_cache, offset);
+	if (it != m->coarse_panels_cache.end() && it->offset == offset) {
+		return it->image;
+	}
+	return {};
+}
+
+/**
+ * @brief ImageViewWidget::storeCoarsePanel
+ * @param offset キャンバス座標系でのパネル原点
+ * @param image 縮小画像
+ *
+ * 低解像度パネルをキャッシュに格納する
+ */
+void ImageViewWidget::storeCoarsePanel(QPoint const &offset, QImage const &image)
+{
+	store_cached_panel(&m->coarse_panels_cache, {offset, image}, MAX_COARSE_PANELS, m->visible_panels_rect);
+}
+
+/**
+ * @brief ImageViewWidget::invalidatePanelCaches
+ * @param canvasrect キャンバス座標系での更新領域
+ *
+ * 内容が変化した領域の合成済みパネルと低解像度パネルを破棄する
+ */
+void ImageViewWidget::invalidatePanelCaches(QRect const &canvasrect)
+{
+	auto Intersects = [&](QPoint const &offset){
+		return canvasrect.intersects(QRect(offset, QSize(OFFSCREEN_PANEL_SIZE, OFFSCREEN_PANEL_SIZE)));
+	};
+	auto &composed = m->composed_panels_cache;
+	composed.erase(std::remove_if(composed.begin(), composed.end(), [&](Private::ComposedPanel const &panel){
+		return Intersects(panel.offset);
+	}), composed.end());
+	auto &coarse = m->coarse_panels_cache;
+	coarse.erase(std::remove_if(coarse.begin(), coarse.end(), [&](Private::CoarsePanel const &panel){
+		return Intersects(panel.offset);
+	}), coarse.end());
+	m->panels_cache_generation++; // 描画中のパネルを格納させない
+}
+
+/**
+ * @brief ImageViewWidget::clearPanelCaches
+ *
+ * 合成済みパネルと低解像度パネルをすべて破棄する
+ */
+void ImageViewWidget::clearPanelCaches()
+{
+	m->composed_panels_cache.clear();
+	m->coarse_panels_cache.clear();
+	m->panels_cache_generation++;
+}
+
+/**
+ * @brief ImageViewWidget::setPrefetchMargin
+ * @param panels ビューポートの周囲に先読みするパネル数。0なら先読みしない
+ */
+void ImageViewWidget::setPrefetchMargin(int panels)
+{
+	std::lock_guard lock(mutexForOffscreen());
+	m->prefetch_margin = std::max(panels, 0);
 }
 
 /**
@@ -506,8 +861,10 @@ void ImageViewWidget::requestRendering(const QRect &canvasrect)
 	std::lock_guard lock(mutexForOffscreen());
 	m->offscreen1_mapper = currentCoordinateMapper();
 	if (canvasrect.isEmpty()) {
+		clearPanelCaches();
 		requestUpdateEntire(false);
 	} else {
+		invalidatePanelCaches(canvasrect);
 		requestUpdateCanvas(canvasrect, false);
 	}
 	m->render_requested = true;
@@ -538,7 +895,7 @@ void ImageViewWidget::internalScrollImage(double x, double y, bool differential_
 			{
 				std::lock_guard lock(mutexForOffscreen());
 				m->offscreen1_mapper = currentCoordinateMapper();
-				m->render_canceled = true;
+				m->render_generation++;
 
 				if (delta_x > 0) { // 右にスクロール、左に空白ができる
 					requestUpdateView({0, 0, delta_x, height()}, false);
@@ -569,9 +926,6 @@ void ImageViewWidget::scrollImage(double x, double y, bool differential_update)
 {
 	internalScrollImage(x, y, differential_update);
 
-	// 選択領域のアウトラインを更新
-	requestUpdateSelectionOutline();
-
 	// スクロールバーの位置を更新
 	if (m->h_scroll_bar) {
 		auto b = m->h_scroll_bar->blockSignals(true);
@@ -812,114 +1166,79 @@ void ImageViewWidget::zoomOut()
 	zoomToCenter(scale() / 2);
 }
 
-/**
- * @brief ImageViewWidget::generateSelectionOutlineImage
- * @return アウトライン画像
- *
- * 選択領域のアウトライン画像を生成する
- */
-QImage ImageViewWidget::generateSelectionOutlineImage(QImage const &selection, bool *abort)
-{
-	Q_ASSERT(selection.format() == QImage::Format_Grayscale8);
-
-	QImage image;
-	int w = selection.width();
-	int h = selection.height();
-
-	image = QImage(w, h, QImage::Format_Grayscale8);
-	image.fill(Qt::white);
-	for (int y = 1; y + 1 < h; y++) {
-		if (abort && *abort) return {};
-		uint8_t const *s0 = selection.scanLine(y - 1);
-		uint8_t const *s1 = selection.scanLine(y);
-		uint8_t const *s2 = selection.scanLine(y + 1);
-		uint8_t *d = image.scanLine(y);
-		for (int x = 1; x + 1 < w; x++) {
-			uint8_t v = ~(s0[x - 1] & s0[x] & s0[x + 1] & s1[x - 1] & s1[x + 1] & s2[x - 1] & s2[x] & s2[x + 1]) & s1[x];
-			d[x] = (v & 0x80) ? 0 : 255;
-		}
-	}
-	return image;
-}
-
 /**
  * @brief ImageViewWidget::renderSelectionOutline
  * @param abort
- * @return
+ * @return 選択範囲の輪郭
  *
- * 画像の選択範囲を描画する
+ * 選択範囲の輪郭をキャンバス座標系のパスとして抽出する
+ * 選択範囲が変化したときだけ実行し、拡大縮小やスクロールのときは表示時に座標変換する
  */
-SelectionOutline ImageViewWidget::renderSelectionOutline(bool *abort)
-{
-	SelectionOutline data;
-	int dw = canvas()->width();
-	int dh = canvas()->height();
-	if (dw > 0 && dh > 0) {
-		CoordinateMapper mapper = currentCoordinateMapper();
-		QPointF dp0(0, 0);
-		QPointF dp1(width(), height());
-		dp0 = mapper.mapToCanvasFromViewport(dp0);
-		dp1 = mapper.mapToCanvasFromViewport(dp1);
-		dp0.rx() = floor(std::max(dp0.rx(), (double)0));
-		dp0.ry() = floor(std::max(dp0.ry(), (double)0));
-		dp1.rx() = ceil(std::min(dp1.rx(), (double)dw));
-		dp1.ry() = ceil(std::min(dp1.ry(), (double)dh));
-		QPointF vp0 = mapper.mapToViewportFromCanvas(dp0);
-		QPointF vp1 = mapper.mapToViewportFromCanvas(dp1);
-		vp0.rx() = floor(vp0.rx());
-		vp0.ry() = floor(vp0.ry());
-		vp1.rx() = ceil(vp1.rx());
-		vp1.ry() = ceil(vp1.ry());
-		int vx = (int)vp0.x();
-		int vy = (int)vp0.y();
-		int vw = (int)vp1.x() - vx;
-		int vh = (int)vp1.y() - vy;
-		int dx = int(dp0.x());
-		int dy = int(dp0.y());
-		int dw = int(dp1.x()) - dx;
-		int dh = int(dp1.y()) - dy;
-		if (vw > 0 && vh > 0 && dw > 0 && dh > 0) {
-			QImage selection;
-			euclase::Image sel;
-			{
-				std::lock_guard lock(mainwindow()->mutexForCanvas());
-				sel = canvas()->renderSelection(QRect(dx, dy, dw, dh), abort).image(); // 選択領域をレンダリング
-			}
-			if (abort && *abort) return {};
-			// 選択領域をスケーリング
-			if (sel.memtype() == euclase::Image::CUDA) { // CUDAメモリの場合はスケーリングをCUDAで行う
-				euclase::Image tmp(vw, vh, euclase::Image::Format_U8_Grayscale, euclase::Image::CUDA);
-				int sw = sel.width();
-				int sh = sel.height();
-				global->cuda->scale(vw, vh, vw, tmp.data(), sw, sh, sw, sel.data(), 1);
-				selection = tmp.qimage();
-			} else { // それ以外はホストメモリで行う
-				selection = sel.qimage().scaled(vw, vh);
-			}
-			QImage outline = generateSelectionOutlineImage(selection, abort); // アウトライン画像を生成
-			if (outline.isNull()) return {};
-			data.bitmap = QBitmap::fromImage(outline);
-			data.point = QPoint(vx, vy);
-		}
+SelectionOutline ImageViewWidget::renderSelectionOutline(euclase::CancelToken const &abort)
+{
+	const int S = OFFSCREEN_PANEL_SIZE;
+
+	// 選択レイヤーをロックの中で複製しておき、レンダリングはロックの外で行う（パネルの画像は共有されるので複製は軽い）
+	Canvas::Layer layer;
+	{
+		std::lock_guard lock(mainwindow()->mutexForCanvas());
+		layer = *canvas()->selection_layer();
 	}
-	return data;
+
+	// 輪郭を含む可能性のあるパネル
+	std::vector<QPoint> tiles;
+	for (Canvas::Panel const &panel : *layer.panels()) {
+		QPoint pt = layer.offset() + panel.offset();
+		pt = QPoint(pt.x() & ~(S - 1), pt.y() & ~(S - 1));
+		// 各パネルは左上に1画素はみ出した範囲を調べるので、右と下のパネルも対象にする
+		tiles.push_back(pt);
+		tiles.push_back(pt + QPoint(S, 0));
+		tiles.push_back(pt + QPoint(0, S));
+		tiles.push_back(pt + QPoint(S, S));
+	}
+	std::sort(tiles.begin(), tiles.end(), [](QPoint const &a, QPoint const &b){
+		return misc::compareQPoint(a, b) < 0;
+	});
+	tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+
+	// パネルごとに並列に境界の線分を抽出
+	std::vector<std::vector<SelectionOutline::Segment>> segments(tiles.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < (int)tiles.size(); i++) {
+		if (abort.canceled()) continue;
+		QPoint const &pt = tiles[i];
+		euclase::Image sel = Canvas::renderSelection(layer, QRect(pt.x() - 1, pt.y() - 1, S + 1, S + 1), abort).image(); // 左上に1画素広げてレンダリング
+		sel = sel.toHost();
+		if (sel.isNull()) continue;
+		SelectionOutline::traceSegments(sel.scanLine(0), (int)sel.bytesPerLine(), sel.width(), sel.height(), pt - QPoint(1, 1), &segments[i]);
+	}
+	if (abort.canceled()) return {};
+
+	std::vector<SelectionOutline::Segment> all;
+	for (auto const &v : segments) {
+		all.insert(all.end(), v.begin(), v.end());
+	}
+	return SelectionOutline(SelectionOutline::buildPath(all));
 }
 
 /**
  * @brief ImageViewWidget::runImageRendering
  *
  * オフスクリーンへレンダリングする
+ * 先に低解像度パネルのキャッシュで空白部分を埋め、その後で本来の画質で描き直す
+ * 手が空いたら、ビューポートの周囲のパネルを先読みしてキャッシュしておく
  */
 void ImageViewWidget::runImageRendering()
 {
 	while (1) {
 		if (m->render_interrupted) return;
 		bool requested = false;
+		unsigned int generation;
 		{
 			std::unique_lock lock(mutexForOffscreen());
 			if (m->render_interrupted) return;
 			m->cond.wait(lock, [&](){ return m->render_requested || m->render_interrupted; });
-			m->render_canceled = false;
+			generation = m->render_generation; // この描画要求の世代
 			if (m->render_requested) {
 				m->render_requested = false;
 				requested = true;
@@ -937,9 +1256,8 @@ void ImageViewWidget::runImageRendering()
 					m->render_invalidate = false;
 					m->offscreen1.clear();
 				}
-				std::vector<QRect> v;
-				std::swap(v, m->render_canvas_adding_rects);
-				m->render_canvas_rects.insert(m->render_canvas_rects.end(), v.begin(), v.end());
+				m->render_damage.unite(m->render_damage_adding);
+				m->render_damage_adding.clear();
 			}
 
 			const int canvas_w = mainwindow()->canvasWidth();
@@ -963,50 +1281,36 @@ void ImageViewWidget::runImageRendering()
 				int y0 = (int)topleft.y() & ~S1;
 				int x1 = (int)bottomright.x() & ~S1;
 				int y1 = (int)bottomright.y() & ~S1;
-				for (int y = y0; y <= y1; y += OFFSCREEN_PANEL_SIZE) {
-					for (int x = x0; x <= x1; x += OFFSCREEN_PANEL_SIZE) {
-						QRect target_rect(x, y, OFFSCREEN_PANEL_SIZE, OFFSCREEN_PANEL_SIZE); // 描画する候補の矩形
-						for (auto const &requested_rect : m->render_canvas_rects) { // 描画要求された矩形と重なっているかどうか
-							if (target_rect.intersects(requested_rect)) {
-								target_rects.push_back(target_rect);
-								break;
-							}
-						}
-					}
-				}
+				m->visible_panels_rect = QRect(x0, y0, x1 - x0 + OFFSCREEN_PANEL_SIZE, y1 - y0 + OFFSCREEN_PANEL_SIZE);
+				target_rects = m->render_damage.tiles(m->visible_panels_rect); // 表示範囲内の描画が必要なパネル
 			}
 
+			// マウスカーソルからの距離
+			const QPoint cursor_pos = mapper.mapToCanvasFromViewport(mapFromGlobal(QCursor::pos())).toPoint();
+			auto DistanceFromCursor = [&](QRect const &r){
+				auto dx = r.center().x() - cursor_pos.x();
+				auto dy = r.center().y() - cursor_pos.y();
+				return sqrt(dx * dx + dy * dy);
+			};
+
 			if (1) { // マウスカーソルから近い順にソート
-				QPoint center = mapper.mapToCanvasFromViewport(mapFromGlobal(QCursor::pos())).toPoint();
 				std::sort(target_rects.begin(), target_rects.end(), [&](QRect const &a, QRect const &b){
-					auto Center = [=](QRect const &r){
-						return r.center();
-					};
-					auto Distance = [](QPoint const &a, QPoint const &b){
-						auto dx = a.x() - b.x();
-						auto dy = a.y() - b.y();
-						return sqrt(dx * dx + dy * dy);
-					};
-					QPoint ca = Center(a);
-					QPoint cb = Center(b);
-					return Distance(ca, center) < Distance(cb, center);
+					return DistanceFromCursor(a) < DistanceFromCursor(b);
 				});
 			}
 
+			// 世代が変わったら（スクロール、拡大縮小、内容の変化、終了）中断する
+			const euclase::CancelToken cancel(&m->render_generation, generation);
 			auto canceled = [&](){
-				bool f = /*m->render_requested ||*/ m->render_canceled || /*m->render_invalidate ||*/ m->render_interrupted;
-				return f;
+				return cancel.canceled();
 			};
 
-			size_t panelindex = 0;
-			std::atomic_int rectindex = 0;
-
-#pragma omp parallel for num_threads(8)
-			for (int i = 0; i < target_rects.size(); i++) {
-				if (canceled()) continue;
-
-				// パネル矩形
-				QRect const &rect = target_rects[rectindex++];
+			// パネルの描画範囲
+			struct TileGeometry {
+				int sx, sy, sw, sh; // 描画元（パネル座標系）
+				int dx, dy, dw, dh; // 描画先（ビューポート座標系）
+			};
+			auto Geometry = [&](QRect const &rect, TileGeometry *out){
 				const int x = rect.x();
 				const int y = rect.y();
 				const int w = rect.width();
@@ -1037,106 +1341,221 @@ void ImageViewWidget::runImageRendering()
 				// 描画先を再計算
 				dst_topleft = mapper.mapToViewportFromCanvas(src_topleft);
 				dst_bottomright = mapper.mapToViewportFromCanvas(src_bottomright);
-				int dx = (int)round(dst_topleft.x());
-				int dy = (int)round(dst_topleft.y());
-				int dw = (int)ceil(dst_bottomright.x()) - dx;
-				int dh = (int)ceil(dst_bottomright.y()) - dy;
-				if (dw < 1 || dh < 1) continue;
+				out->dx = (int)round(dst_topleft.x());
+				out->dy = (int)round(dst_topleft.y());
+				out->dw = (int)ceil(dst_bottomright.x()) - out->dx;
+				out->dh = (int)ceil(dst_bottomright.y()) - out->dy;
+				if (out->dw < 1 || out->dh < 1) return false;
 
 				// 描画元座標を確定
-				int sx = (int)src_topleft.x();
-				int sy = (int)src_topleft.y();
-				int sw = (int)src_bottomright.x() - sx;
-				int sh = (int)src_bottomright.y() - sy;
-				if (sw < 1 || sh < 1) continue;
+				out->sx = (int)src_topleft.x();
+				out->sy = (int)src_topleft.y();
+				out->sw = (int)src_bottomright.x() - out->sx;
+				out->sh = (int)src_bottomright.y() - out->sy;
+				if (out->sw < 1 || out->sh < 1) return false;
 
 				// パネル原点を引く
-				sx -= x;
-				sy -= y;
+				out->sx -= x;
+				out->sy -= y;
+				return true;
+			};
 
-				euclase::Image image;
-				Canvas::Panel newpanel;
-				Canvas::RenderOption opt;
-				opt.use_mask = true;
-				newpanel = m->mainwindow->renderToPanel(Canvas::AllLayers, euclase::Image::Format_F32_RGBA, rect, {}, opt, (bool *)&m->render_interrupted);
-				if (canceled()) continue;
+			// 透明部分を市松模様と合成してオフスクリーンへ描画する
+			auto PaintToOffscreen = [&](QImage *qimg, int dx, int dy, QPainter::CompositionMode mode){
+				QPoint dpos = QPoint(dx, dy) - center() + m->offscreen1_mapper.scrollOffset().toPoint();
 
-				newpanel = newpanel->toHost();
-				if (canceled()) continue;
+				// 透明部分の市松模様（qimgはアルファ乗算済み）
+				for (int iy = 0; iy < qimg->height(); iy++) {
+					QRgb *p = (QRgb *)qimg->scanLine(iy);
+					for (int ix = 0; ix < qimg->width(); ix++) {
+						const int a = qAlpha(*p);
+						if (a < 255) { // 透明部分
+							int u = dpos.x() + ix; // 市松模様の座標がずれないように、オフスクリーン系の座標の原点を足す
+							int v = dpos.y() + iy;
+							int bg = (((u ^ v) & 8) ? 255 : 192) * (255 - a) / 255; // 市松模様パターン
+							*p = qRgb(qRed(*p) + bg, qGreen(*p) + bg, qBlue(*p) + bg); // 背景に合成
+						}
+						p++;
+					}
+				}
+
+				if (canceled()) return;
 
-				newpanel.setOffset(x, y);
+				// オフスクリーンへ描画する
 				{
-					// パネルキャッシュから検索
 					std::lock_guard lock(mutexForOffscreen());
-					Canvas::Panel *panel = nullptr;
-					QPoint pos(x, y);
-					for (size_t j = panelindex; j < m->composed_panels_cache.size(); j++) {
-						if (m->composed_panels_cache[j].offset() == pos) {
-							std::swap(m->composed_panels_cache[panelindex], m->composed_panels_cache[j]);
-							panel = &m->composed_panels_cache[panelindex];
-							*panel->imagep() = newpanel.image();
-							panelindex++;
-							break;
-						}
+					if (!canceled()) {
+						m->offscreen1.paintImage(dpos, *qimg, qimg->size(), {}, mode);
 					}
-					if (!panel) { // 見つからなかったら、新規パネルを作成
-						if (panelindex <= m->composed_panels_cache.size()) { // 別スレッドがcomposed_panels_cacheをclearすることがあるので、範囲チェック
-							m->composed_panels_cache.insert(m->composed_panels_cache.begin() + panelindex, newpanel);
-							panel = &m->composed_panels_cache[panelindex];
-						}
-						panelindex++;
+				}
+			};
+
+			// 粗い描画：低解像度パネルのキャッシュから空白部分を埋める
+			{
+				bool painted = false;
+				for (QRect const &rect : target_rects) {
+					if (canceled()) break;
+
+					TileGeometry g;
+					if (!Geometry(rect, &g)) continue;
+
+					QImage coarse;
+					{
+						std::lock_guard lock(mutexForOffscreen());
+						coarse = findCoarsePanel(rect.topLeft());
 					}
+					if (coarse.isNull()) continue;
+
+					// 縮小画像から切り出して拡大
+					const int cw = coarse.width();
+					const int ch = coarse.height();
+					int cx0 = g.sx * cw / rect.width();
+					int cy0 = g.sy * ch / rect.height();
+					int cx1 = ((g.sx + g.sw) * cw + rect.width() - 1) / rect.width();
+					int cy1 = ((g.sy + g.sh) * ch + rect.height() - 1) / rect.height();
+					QImage qimg = coarse.copy(cx0, cy0, std::max(1, cx1 - cx0), std::max(1, cy1 - cy0));
+					qimg = qimg.scaled(g.dw, g.dh, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+					if (qimg.isNull()) continue;
+
+					PaintToOffscreen(&qimg, g.dx, g.dy, QPainter::CompositionMode_DestinationOver); // 既に描画済みの部分はそのまま残す
+					painted = true;
 				}
+				if (painted && !canceled()) {
+					update();
+				}
+			}
 
-				image = cropImage(newpanel.image(), sx, sy, sw, sh); // 画像を切り出す
-				if (canceled()) continue;
+			// 全レイヤーを合成したパネルを得る。キャッシュになければ描画してキャッシュに格納する
+			auto ComposeTile = [&](QRect const &rect, euclase::CancelToken const &cancel)->Canvas::Panel{
+				const QPoint pos = rect.topLeft();
+				unsigned int generation;
+				{
+					std::lock_guard lock(mutexForOffscreen());
+					Canvas::Panel cached = findComposedPanel(pos);
+					if (cached) return cached;
+					generation = m->panels_cache_generation;
+				}
 
-				// 拡大縮小
-				QImage qimg = scale_fp32_to_uint8_rgba(image, dw, dh);
-				if (qimg.isNull()) continue;
+				Canvas::Panel newpanel;
+				Canvas::RenderOption opt;
+				opt.use_mask = true;
+				newpanel = m->mainwindow->renderToPanel(Canvas::AllLayers, DISPLAY_IMAGE_FORMAT, rect, {}, opt, cancel);
+				if (cancel.canceled()) return {};
 
-				if (canceled()) continue;
+				newpanel = newpanel->toHost();
+				newpanel.setOffset(pos);
+				if (cancel.canceled()) return {};
 
-				QPoint dpos = QPoint(dx, dy) - center() + m->offscreen1_mapper.scrollOffset().toPoint();
+				// 低解像度パネルを作成
+				QImage coarse;
+				{
+					int cw = std::max(1, newpanel->width() / COARSE_PANEL_SCALE);
+					int ch = std::max(1, newpanel->height() / COARSE_PANEL_SCALE);
+					coarse = render_display_image(newpanel.image(), 0, 0, newpanel->width(), newpanel->height(), cw, ch, {}, false);
+				}
 
-				// 透明部分の市松模様
-				for (int iy = 0; iy < qimg.height(); iy++) {
-					euclase::OctetRGBA *p = (euclase::OctetRGBA *)qimg.scanLine(iy);
-					for (int ix = 0; ix < qimg.width(); ix++) {
-						if (p->a < 255) { // 透明部分
-							int u = dpos.x() + ix; // 市松模様の座標がずれないように、オフスクリーン系の座標の原点を足す
-							int v = dpos.y() + iy;
-							uint8_t a = ((u ^ v) & 8) ? 255 : 192; // 市松模様パターン
-							euclase::OctetRGBA bg(a, a, a, 255); // 市松模様の背景
-							*p = AlphaBlend::blend(bg, *p); // 背景に合成
+				{
+					std::lock_guard lock(mutexForOffscreen());
+					if (generation == m->panels_cache_generation) { // 描画中に内容が変化していたら格納しない
+						storeComposedPanel(pos, newpanel);
+						if (!coarse.isNull()) {
+							storeCoarsePanel(pos, coarse);
 						}
-						p++;
 					}
 				}
+				return newpanel;
+			};
 
-				if (canceled()) continue;
+			// 精細な描画：マウスカーソルに近いパネルから順に本来の画質で描画する
+			auto RenderTile = [&](QRect const &rect){
+				if (canceled()) return;
 
-				// オフスクリーンへ描画する
+				TileGeometry g;
+				if (!Geometry(rect, &g)) return;
+
+				Canvas::Panel newpanel = ComposeTile(rect, cancel);
+				if (!newpanel || canceled()) return;
+
+				// 切り出し、拡大縮小、市松模様の合成を一度に行う
+				QPoint dpos = QPoint(g.dx, g.dy) - center() + m->offscreen1_mapper.scrollOffset().toPoint();
+				QImage qimg = render_display_image(newpanel.image(), g.sx, g.sy, g.sw, g.sh, g.dw, g.dh, dpos);
+				if (qimg.isNull()) return;
+
+				if (canceled()) return;
+
+				// オフスクリーンへ転送する
 				{
 					std::lock_guard lock(mutexForOffscreen());
 					if (!canceled()) {
-						m->offscreen1.paintImage(dpos, qimg, qimg.size(), {});
+						m->offscreen1.putImage(dpos, qimg);
 					}
 				}
+			};
+
+			std::vector<TileScheduler::Task> tasks;
+			tasks.reserve(target_rects.size());
+			for (QRect const &rect : target_rects) {
+				tasks.emplace_back([&RenderTile, rect](){ RenderTile(rect); }, TileScheduler::Priority::Visible, DistanceFromCursor(rect));
 			}
+			m->scheduler.run(std::move(tasks), canceled);
+
 			{
 				std::lock_guard lock(mutexForOffscreen());
 
 				if (!canceled()) {
-					m->render_canvas_rects.clear(); // 描画済みのパネル矩形をクリア
+					m->render_damage.clear(); // 描画済みのパネルをクリア
 					update();
 				}
+			}
+
+			// 先読み：ビューポートの周囲と、1段階縮小したときに見える範囲のパネルを合成しておく
+			// 1段階拡大したときに見える範囲は、ビューポートの内側なので描画済み
+			// 新たな描画要求が来たら、合成中のパネルも含めて中断する
+			const euclase::CancelToken prefetch_cancel(&m->render_requested, &m->render_generation, generation);
+			auto prefetch_canceled = [&](){
+				return prefetch_cancel.canceled();
+			};
+			if (!prefetch_canceled()) {
+				std::vector<QRect> prefetch_rects;
+				size_t prefetch_limit;
+				{
+					std::lock_guard lock(mutexForOffscreen());
+					const int margin = m->prefetch_margin;
+					if (margin > 0) {
+						QRectF visible(mapper.mapToCanvasFromViewport(QPointF(0, 0)), mapper.mapToCanvasFromViewport(QPointF(width(), height())));
+						QRectF zoomout(visible.center() - QPointF(visible.width(), visible.height()), visible.size() * 2);
+						QRectF around = visible.adjusted(-margin * OFFSCREEN_PANEL_SIZE, -margin * OFFSCREEN_PANEL_SIZE, margin * OFFSCREEN_PANEL_SIZE, margin * OFFSCREEN_PANEL_SIZE);
+						QRect area = around.united(zoomout).toAlignedRect().intersected(QRect(0, 0, canvas_w, canvas_h));
+						if (!area.isEmpty()) {
+							const int S1 = OFFSCREEN_PANEL_SIZE - 1;
+							for (int y = area.top() & ~S1; y <= area.bottom(); y += OFFSCREEN_PANEL_SIZE) {
+								for (int x = area.left() & ~S1; x <= area.right(); x += OFFSCREEN_PANEL_SIZE) {
+									QRect rect(x, y, OFFSCREEN_PANEL_SIZE, OFFSCREEN_PANEL_SIZE);
+									if (!findComposedPanel(rect.topLeft())) {
+										prefetch_rects.push_back(rect);
+									}
+								}
+							}
+						}
+					}
+					const size_t visible = (size_t)(m->visible_panels_rect.width() / OFFSCREEN_PANEL_SIZE) * (m->visible_panels_rect.height() / OFFSCREEN_PANEL_SIZE);
+					prefetch_limit = composedPanelLimit() - std::min(composedPanelLimit(), visible);
+				}
+
+				// 表示中のパネルを追い出さないように、近いものからキャッシュの空きの分まで
+				std::sort(prefetch_rects.begin(), prefetch_rects.end(), [&](QRect const &a, QRect const &b){
+					return DistanceFromCursor(a) < DistanceFromCursor(b);
+				});
+				if (prefetch_rects.size() > prefetch_limit) {
+					prefetch_rects.resize(prefetch_limit);
+				}
 
-				// 多すぎるパネルを削除
-				size_t n = panelindex * 2;
-				if (m->composed_panels_cache.size() > n) {
-					m->composed_panels_cache.resize(n);
+				std::vector<TileScheduler::Task> prefetch_tasks;
+				prefetch_tasks.reserve(prefetch_rects.size());
+				for (QRect const &rect : prefetch_rects) {
+					prefetch_tasks.emplace_back([&ComposeTile, &prefetch_cancel, rect](){ ComposeTile(rect, prefetch_cancel); }, TileScheduler::Priority::Prefetch, DistanceFromCursor(rect));
 				}
+				m->scheduler.run(std::move(prefetch_tasks), prefetch_canceled);
 			}
 		}
 	}
@@ -1150,67 +1569,20 @@ void ImageViewWidget::runImageRendering()
  */
 void ImageViewWidget::paintEvent(QPaintEvent *)
 {
-	const int view_w = width();
-	const int view_h = height();
-
 	const int doc_w = canvas()->width();
 	const int doc_h = canvas()->height();
 
 	const CoordinateMapper mapper = currentCoordinateMapper();
 
-	// オーバーレイ用オフスクリーンの描画は別スレッドで実行
-	std::thread th;
-	if (doc_w > 0 && doc_h > 0) {
-		th = std::thread([&](){
-			Q_ASSERT(doc_w > 0);
-			Q_ASSERT(doc_h > 0);
-			if (m->offscreen2.width() != view_w || m->offscreen2.height() != view_h) {
-				m->offscreen2 = QPixmap(view_w, view_h);
-			}
-			m->offscreen2.fill(Qt::transparent);
-			{
-				QPainter pr2(&m->offscreen2);
-
-				// 最大拡大時のグリッド
-				if (scale() == MAX_SCALE && !m->scrolling) { // スクロール中はグリッドを描画しない
-					QPoint org = mapper.mapToViewportFromCanvas(QPointF(0, 0)).toPoint();
-					QPointF topleft = mapper.mapToCanvasFromViewport(QPointF(0, 0));
-					int topleft_x = (int)floor(topleft.x());
-					int topleft_y = (int)floor(topleft.y());
-					pr2.save();
-					pr2.setOpacity(0.25);
-					pr2.setBrushOrigin(org);
-					int x = topleft_x;
-					while (1) {
-						QPointF pt = mapper.mapToViewportFromCanvas(QPointF(x, topleft_y));
-						int z = (int)floor(pt.x());
-						if (z >= width()) break;
-						pr2.fillRect(z, 0, 1, height(), m->horz_stripe_brush);
-						x++;
-					}
-					int y = topleft_y;
-					while (1) {
-						QPointF pt = mapper.mapToViewportFromCanvas(QPointF(topleft_x, y));
-						int z = (int)floor(pt.y());
-						if (z >= height()) break;
-						pr2.fillRect(0, z, width(), 1, m->vert_stripe_brush);
-						y++;
-					}
-					pr2.restore();
-				}
-
-				// 選択領域点線
-				if (!m->selection_outline.bitmap.isNull()) {
-					QBrush brush = stripeBrush();
-					pr2.save();
-					pr2.setClipRegion(QRegion(m->selection_outline.bitmap).translated(m->selection_outline.point));
-					pr2.setOpacity(0.5);
-					pr2.fillRect(0, 0, width(), height(), brush);
-					pr2.restore();
-				}
-			}
-		});
+	// 選択領域の輪郭をビューポート座標系に変換
+	if (m->selection_outline_view_mapper.scale() != mapper.scale() || m->selection_outline_view_mapper.scrollOffset() != mapper.scrollOffset() || m->selection_outline_view_mapper.viewport_size() != mapper.viewport_size()) {
+		m->selection_outline_view_mapper = mapper;
+		m->selection_outline_view_path = {};
 	}
+	if (m->selection_outline_view_path.isEmpty() && !m->selection_outline.path.isEmpty()) {
+		m->selection_outline_view_path = mapper.transformToViewportFromCanvas().map(m->selection_outline.path);
+	}
+	QPainterPath const &selection_outline_path = m->selection_outline_view_path;
 
 	// ビューポートの描画
 	QPainter pr_view(this);
@@ -1222,6 +1594,7 @@ void ImageViewWidget::paintEvent(QPaintEvent *)
 		std::lock_guard lock(mutexForOffscreen());
 		auto osmapper = offscreenCoordinateMapper();
 		for (PanelizedImage::Panel const &panel : m->offscreen1.panels_) {
+			if (!panel.valid) continue;
 			QPoint org = panel.offset - m->offscreen1_mapper.scrollOffset().toPoint() + center();
 			QPointF topleft(org);
 			QPointF bottomright(org.x() + panel.image.width(), org.y() + panel.image.height());
@@ -1235,12 +1608,27 @@ void ImageViewWidget::paintEvent(QPaintEvent *)
 		}
 	}
 
-	if (th.joinable()) {
-		th.join();
-	}
-
 	// オーバーレイを描画
-	pr_view.drawPixmap(0, 0, m->offscreen2);
+	if (doc_w > 0 && doc_h > 0) {
+		// 最大拡大時のグリッド
+		if (scale() == MAX_SCALE && !m->scrolling) { // スクロール中はグリッドを描画しない
+			QPointF org = mapper.mapToViewportFromCanvas(QPointF(0, 0));
+			pr_view.save();
+			pr_view.setBrushOrigin(QPoint((int)floor(org.x()), (int)floor(org.y())));
+			pr_view.fillRect(rect(), m->grid_brush); // グリッドの模様を敷き詰める
+			pr_view.restore();
+		}
+
+		// 選択領域点線
+		if (!selection_outline_path.isEmpty()) {
+			pr_view.save();
+			pr_view.setOpacity(0.5);
+			pr_view.setPen(QPen(stripeBrush(), 1));
+			pr_view.setBrush(Qt::NoBrush);
+			pr_view.drawPath(selection_outline_path);
+			pr_view.restore();
+		}
+	}
 
 	{
 		QPointF pt0(0, 0);
@@ -1277,6 +1665,22 @@ void ImageViewWidget::paintEvent(QPaintEvent *)
 		BoundsDrawer drawer(&pr_view, mapper, m->bounds_start, m->bounds_end, f);
 		drawer.draw(mainwindow()->boundsType());
 	}
+
+	// 変形の枠
+	if (!m->transform_quad.isEmpty()) {
+		QPolygonF quad = mapper.transformToViewportFromCanvas().map(m->transform_quad);
+		pr_view.save();
+		pr_view.setOpacity(0.5);
+		pr_view.setRenderHint(QPainter::Antialiasing);
+		pr_view.setPen(QPen(stripeBrush(), 1));
+		pr_view.setBrush(Qt::NoBrush);
+		pr_view.drawPolygon(quad);
+		pr_view.setRenderHint(QPainter::Antialiasing, false);
+		for (QPointF const &pt : quad) { // ハンドル
+			pr_view.fillRect((int)floor(pt.x()) - 4, (int)floor(pt.y()) - 4, 9, 9, Qt::gray);
+		}
+		pr_view.restore();
+	}
 }
 
 
@@ -1300,9 +1704,11 @@ void ImageViewWidget::rescaleOffScreen()
 	QPointF new_org(centerF() - new_mapper.scrollOffset()); // 新しい座標系の原点
 
 	PanelizedImage new_offscreen;
+	new_offscreen.setViewportSize(size());
 
 	// 新しい座標系でオフスクリーンを再構築
 	for (PanelizedImage::Panel &panel : m->offscreen1.panels_) {
+		if (!panel.valid) continue;
 		const QPointF org = old_org + panel.offset; // パネルの原点座標
 
 		// 描画先矩形を計算
@@ -1350,7 +1756,7 @@ void ImageViewWidget::updateToolCursor()
 void ImageViewWidget::cancelRendering()
 {
 	std::lock_guard lock(mutexForOffscreen());
-	m->render_canceled = true;
+	m->render_generation++;
 	m->cond.notify_all();
 }
 
@@ -1372,8 +1778,11 @@ void ImageViewWidget::doHandScroll()
 
 void ImageViewWidget::resizeEvent(QResizeEvent *)
 {
+	{
+		std::lock_guard lock(mutexForOffscreen());
+		m->offscreen1.setViewportSize(size()); // リングバッファの大きさを合わせる
+	}
 	updateScrollBarRange();
-	requestUpdateSelectionOutline();
 	requestUpdateEntire(false);
 }
 
@@ -1434,6 +1843,7 @@ void ImageViewWidget::wheelEvent(QWheelEvent *e)
 void ImageViewWidget::onSelectionOutlineReady(const SelectionOutline &data)
 {
 	m->selection_outline = data;
+	m->selection_outline_view_path = {}; // 表示用のパスを作り直す
 	update();
 }
 
@@ -1453,11 +1863,13 @@ void ImageViewWidget::onTimer()
 		m->delayed_update_counter--;
 		if (m->delayed_update_counter == 0) { // 更新する
 			rescaleOffScreen(); // オフスクリーンを再構築
-			m->render_canceled = true; // 現在の再描画要求をキャンセル
-
-			requestUpdateEntire(true);
-			m->render_requested = true;
-			m->cond.notify_all();
+			{
+				std::lock_guard lock(mutexForOffscreen());
+				m->render_generation++; // 現在の再描画要求をキャンセル
+				requestUpdateEntire(false);
+				m->render_requested = true;
+				m->cond.notify_all();
+			}
 
 			update = false; // 再描画すると表示がガタつくので再描画しない。次のonTimerで再描画される
 		}
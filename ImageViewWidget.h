@@ -4,6 +4,7 @@
 #include "CoordinateMapper.h"
 #include "MainWindow.h"
 #include "SelectionOutline.h"
+#include <QPolygonF>
 #include <QScrollBar>
 #include <QTimer>
 #include <QWidget>
@@ -18,6 +19,9 @@ private:
 	Private *m;
 
 	static constexpr int OFFSCREEN_PANEL_SIZE = 256;
+	static constexpr int COARSE_PANEL_SCALE = 8; // 低解像度パネルの縮小率
+	static constexpr int MAX_COARSE_PANELS = 4096; // 低解像度パネルの最大保持数
+	static constexpr int MAX_COMPOSED_PANELS = 256; // 合成済みパネルの最大保持数
 
 	QTimer timer_;
 
@@ -43,7 +47,6 @@ private:
 	void updateCursorAnchorPos();
 	QBrush stripeBrush();
 	void initBrushes();
-	QImage generateSelectionOutlineImage(const QImage &selection, bool *abort);
 	void internalUpdateScroll();
 	void startRenderingThread();
 	void stopRenderingThread();
@@ -57,6 +60,13 @@ private:
 	void setScaleAnchorPos(const QPointF &pos);
 	QPointF getScaleAnchorPos();
 	void requestUpdateEntire(bool lock);
+	size_t composedPanelLimit() const;
+	Canvas::Panel findComposedPanel(const QPoint &offset) const;
+	void storeComposedPanel(const QPoint &offset, const Canvas::Panel &panel);
+	QImage findCoarsePanel(const QPoint &offset) const;
+	void storeCoarsePanel(const QPoint &offset, const QImage &image);
+	void invalidatePanelCaches(const QRect &canvasrect);
+	void clearPanelCaches();
 protected:
 	void resizeEvent(QResizeEvent *) override;
 	void paintEvent(QPaintEvent *) override;
@@ -75,6 +85,8 @@ public:
 
 	void showBounds(const QPointF &start, const QPointF &end);
 	void hideRect(bool update);
+	void showTransformQuad(const QPolygonF &quad);
+	void hideTransformQuad();
 
 	void refrectScrollBar();
 
@@ -87,8 +99,7 @@ public:
 
 	void requestUpdateSelectionOutline();
 
-	QBitmap updateSelection_();
-	SelectionOutline renderSelectionOutline(bool *abort);
+	SelectionOutline renderSelectionOutline(euclase::CancelToken const &abort);
 	bool isRectVisible() const;
 	void setToolCursor(const QCursor &cursor);
 	void doHandScroll();
@@ -102,6 +113,7 @@ public:
 	void requestUpdateView(const QRect &viewrect, bool lock);
 	void requestUpdateCanvas(const QRect &canvasrect, bool lock);
 	void requestRendering(const QRect &canvasrect);
+	void setPrefetchMargin(int panels);
 private slots:
 	void onSelectionOutlineReady(SelectionOutline const &data);
 	void onTimer();
@@ -9,6 +9,7 @@
 #include "FilterStatus.h"
 #include "MySettings.h"
 #include "NewDialog.h"
+#include "PointOperation.h"
 #include "ResizeDialog.h"
 #include "RoundBrushGenerator.h"
 #include "SettingsDialog.h"
@@ -32,6 +33,9 @@
 #include <omp.h>
 #include <stdint.h>
 #include <QMessageBox>
+#include <condition_variable>
+#include <optional>
+#include <thread>
 #include <variant>
 
 struct MainWindow::Private {
@@ -55,11 +59,48 @@ struct MainWindow::Private {
 
 	MainWindow::RectHandle rect_handle = MainWindow::RectHandle::None;
 
+	// 変形
+	struct Transform {
+		bool active = false;
+		QRect source_rect; // 変形する範囲
+		QPointF quad[4]; // 変形後の四隅（左上、右上、右下、左下）
+		QPointF start_quad[4]; // ドラッグ開始時の四隅
+		int handle = -1; // 0..3: 角、4: 移動、5: 回転
+		QRect dirty_rect; // 前回のプレビューで変えた範囲
+
+		// プレビューはワーカースレッドで作る
+		struct Job {
+			QRect source_rect;
+			euclase::Homography transform;
+			euclase::Warper::Interpolation interpolation = euclase::Warper::Interpolation::Nearest;
+			QRect clip; // 空なら変わる範囲全体
+			unsigned int generation = 0;
+		};
+		std::thread worker; // 変形中に使い回すスレッド
+		std::mutex mutex;
+		std::condition_variable cond_job; // ジョブが来た
+		std::condition_variable cond_idle; // ジョブが終わった
+		std::optional<Job> job; // 次に作るプレビュー。後から来たもので上書きする
+		bool busy = false; // ジョブを実行中ならtrue
+		bool quit = false;
+		std::vector<Canvas::Panel> result;
+		unsigned int result_generation = 0; // result を作ったジョブの世代
+		std::atomic_uint generation = 0; // プレビューを依頼し直すたびに増える
+	} transform;
+
+	float fill_tolerance = 32 / 255.0f; // 塗りつぶしと自動選択の色の許容差
+
 	bool preview_layer_enabled = true;
 
 	std::mutex canvas_mutex;
 	
 	std::unique_ptr<FilterDialog> filter_dialog;
+	int adjustment_layer_index = -1; // 編集中の調整レイヤー
+	bool adjustment_layer_added = false; // 編集中の調整レイヤーをこのダイアログで追加したならtrue
+	std::shared_ptr<PointOperation const> adjustment_original; // 既存の調整レイヤーを編集し直すときの元の点演算
+	std::map<QString, QVariant> adjustment_original_parameters; // 同じく元のパラメータ
+	std::function<void (std::vector<Canvas::Panel> const &panels)> task_apply; // 処理の結果を適用する
+	std::function<void ()> task_cancel; // 処理を取り消したときに呼ぶ
 
 	Document document;
 
@@ -72,6 +113,8 @@ struct MainWindow::Private {
 	tool::ScrollTool tool_scroll;
 	tool::BrushTool tool_brush;
 	tool::BoundsTool tool_bounds;
+	tool::TransformTool tool_transform;
+	tool::FillTool tool_fill;
 };
 
 
@@ -88,6 +131,8 @@ MainWindow::MainWindow(QWidget *parent)
 		addMainToolBarButton("Scroll", m->tool_scroll);
 		addMainToolBarButton("Brush", m->tool_brush);
 		addMainToolBarButton("Bounds", m->tool_bounds);
+		addMainToolBarButton("Transform", m->tool_transform);
+		addMainToolBarButton("Fill", m->tool_fill);
 	}
 	{
 		createPropertyBar();
@@ -150,6 +195,16 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow()
 {
+	{
+		std::lock_guard lock(m->transform.mutex);
+		m->transform.quit = true;
+		m->transform.job.reset();
+	}
+	m->transform.generation++; // 作成中のプレビューを中断させる
+	m->transform.cond_job.notify_all();
+	if (m->transform.worker.joinable()) {
+		m->transform.worker.join();
+	}
 	ui->widget_image_view->stopRenderingThread();
 	clearCanvas();
 	delete m;
@@ -461,25 +516,25 @@ bool MainWindow::isPreviewEnabled() const
 	return m->preview_layer_enabled;
 }
 
-Canvas::Panel MainWindow::renderToPanel(Canvas::InputLayerMode input_layer_mode, euclase::Image::Format format, QRect const &r, QRect const &maskrect, const Canvas::RenderOption &opt, bool *abort) const
+Canvas::Panel MainWindow::renderToPanel(Canvas::InputLayerMode input_layer_mode, euclase::Image::Format format, QRect const &r, QRect const &maskrect, const Canvas::RenderOption &opt, euclase::CancelToken const &abort) const
 {
 	std::lock_guard lock(mutexForCanvas());
 	auto activepanel = isPreviewEnabled() ? Canvas::AlternateLayer : Canvas::PrimaryLayer;
 	return canvas()->renderToPanel(input_layer_mode, format, r, maskrect, activepanel, opt, abort).image();
 }
 
-euclase::Image MainWindow::renderSelection(const QRect &r, bool *abort) const
+euclase::Image MainWindow::renderSelection(const QRect &r, euclase::CancelToken const &abort) const
 {
 	std::lock_guard lock(mutexForCanvas());
 	return canvas()->renderSelection(r, abort).image();
 }
 
-euclase::Image MainWindow::renderToImage(euclase::Image::Format format, QRect const &r, Canvas::RenderOption const &opt, bool *abort) const
+euclase::Image MainWindow::renderToImage(euclase::Image::Format format, QRect const &r, Canvas::RenderOption const &opt, euclase::CancelToken const &abort) const
 {
 	return renderToPanel(Canvas::CurrentLayerOnly, format, r, {}, opt, abort).image();
 }
 
-SelectionOutline MainWindow::renderSelectionOutline(bool *abort)
+SelectionOutline MainWindow::renderSelectionOutline(euclase::CancelToken const &abort)
 {
 	return ui->widget_image_view->renderSelectionOutline(abort);
 }
@@ -514,27 +569,63 @@ void MainWindow::on_spinBox_brush_softness_valueChanged(int value)
 	ui->widget_brush->setBrushSoftness(value / 100.0);
 }
 
-void MainWindow::on_action_resize_triggered()
+/**
+ * @brief 全てのレイヤーを変換して、表示をやり直す
+ */
+void MainWindow::transformCanvas(std::function<void (Canvas *canvas)> const &fn)
 {
-	euclase::Image srcimage = renderFilterTargetImage();
-	auto memtype = srcimage.memtype();
-	QSize sz = srcimage.size();
+	ui->widget_image_view->clearRenderCache(true, true);
+	{
+		std::lock_guard lock(mutexForCanvas());
+		fn(canvas());
+	}
+	resetView(true);
+	updateSelectionOutline();
+	updateImageViewEntire();
+}
 
+void MainWindow::on_action_resize_triggered()
+{
 	ResizeDialog dlg(this);
-	dlg.setImageSize(sz);
+	dlg.setImageSize(canvas()->size());
 	if (dlg.exec() == QDialog::Accepted) {
-		sz = dlg.imageSize();
-		unsigned int w = sz.width();
-		unsigned int h = sz.height();
-		w = std::max(w, 1U);
-		h = std::max(h, 1U);
+		QSize sz = dlg.imageSize();
+		sz = QSize(std::max(sz.width(), 1), std::max(sz.height(), 1));
 		euclase::EnlargeMethod method = dlg.method();
-		euclase::Image newimage = resizeImage(srcimage, w, h, method);
-		newimage.memconvert(memtype);
-		setImage(newimage, true);
+		transformCanvas([&](Canvas *canvas){
+			canvas->resize(sz, method);
+		});
 	}
 }
 
+void MainWindow::on_action_rotate_cw_triggered()
+{
+	transformCanvas([](Canvas *canvas){
+		canvas->rotate90(true);
+	});
+}
+
+void MainWindow::on_action_rotate_ccw_triggered()
+{
+	transformCanvas([](Canvas *canvas){
+		canvas->rotate90(false);
+	});
+}
+
+void MainWindow::on_action_flip_horizontal_triggered()
+{
+	transformCanvas([](Canvas *canvas){
+		canvas->flip(true);
+	});
+}
+
+void MainWindow::on_action_flip_vertical_triggered()
+{
+	transformCanvas([](Canvas *canvas){
+		canvas->flip(false);
+	});
+}
+
 void MainWindow::on_action_file_open_triggered()
 {
 	MySettings s;
@@ -549,12 +640,6 @@ void MainWindow::on_action_file_open_triggered()
 	}
 }
 
-euclase::Image MainWindow::renderFilterTargetImage()
-{
-	QSize sz = canvas()->size();
-	return renderToImage(euclase::Image::Format_F32_RGBA, QRect(0, 0, sz.width(), sz.height()), {}, nullptr);
-}
-
 Canvas::BlendMode MainWindow::blendMode() const
 {
 	Canvas::BlendMode blendmode = Canvas::BlendMode::Normal;
@@ -635,7 +720,7 @@ void MainWindow::setFilerDialogActive(bool active)
 	ui->tabWidget_brush->setEnabled(enable);
 }
 
-void MainWindow::filterStart(FilterContext &&context, AbstractFilterForm *form, std::function<euclase::Image (FilterContext *context)> const &fn)
+void MainWindow::filterStart(FilterContext &&context, AbstractFilterForm *form, std::function<TileFilter (FilterContext *context)> const &fn)
 {
 	canvas()->current_layer()->alternate_selection_panels.clear();
 	if (isRectVisible()) {
@@ -660,77 +745,126 @@ void MainWindow::filterStart(FilterContext &&context, AbstractFilterForm *form,
 
 	canvas()->current_layer()->alternate_blend_mode = Canvas::BlendMode::Replace;
 
-	euclase::Image image = renderFilterTargetImage();
-	if (!image) return;
-
-	context.setSourceImage(image);
-	
 	m->filter_dialog = std::make_unique<FilterDialog>(this, std::move(context), form, fn);
 	m->filter_dialog->connect(m->filter_dialog.get(), &FilterDialog::end, this, &MainWindow::filterClose);
 	m->filter_dialog->show();
 	setFilerDialogActive(true);
 }
 
+/**
+ * @brief 調整レイヤーのパラメータを編集するダイアログを開く
+ * @param fn パラメータから点演算を作る関数
+ * @param index 編集し直す調整レイヤー。負なら調整レイヤーを追加する
+ *
+ * 点演算は合成時に表示中のタイルにだけ適用されるので、パラメータを変えてもレイヤーの画像は再計算しない
+ */
+void MainWindow::adjustmentStart(FilterContext &&context, AbstractFilterForm *form, std::function<PointOperation (FilterContext *context)> const &fn, int index)
+{
+	{
+		std::lock_guard lock(mutexForCanvas());
+		m->adjustment_layer_added = index < 0;
+		if (index < 0) {
+			index = canvas()->addAdjustmentLayer(PointOperation());
+			m->adjustment_original.reset();
+			m->adjustment_original_parameters.clear();
+		} else { // 取り消したときに戻せるように
+			m->adjustment_original = canvas()->layer(index)->adjustment;
+			m->adjustment_original_parameters = canvas()->layer(index)->adjustment_parameters;
+		}
+	}
+	m->adjustment_layer_index = index;
+	AdjustmentFunction adjust = [this, index, fn](FilterContext *context){
+		setLayerAdjustment(index, fn(context), context->parameters());
+	};
+	m->filter_dialog = std::make_unique<FilterDialog>(this, std::move(context), form, adjust);
+	m->filter_dialog->connect(m->filter_dialog.get(), &FilterDialog::end, this, &MainWindow::filterClose);
+	m->filter_dialog->show();
+	setFilerDialogActive(true);
+}
+
+/**
+ * @brief パラメータの無い処理を、進捗を表示しながら別スレッドで実行する
+ * @param fn 処理
+ * @param apply ダイアログで適用されたときに結果を渡す関数
+ * @param apply_when_finished trueなら、処理が終わったらOKを待たずに適用する
+ * @param cancel ダイアログで取り消されたときに呼ぶ関数
+ */
+void MainWindow::taskStart(TaskFunction const &fn, std::function<void (std::vector<Canvas::Panel> const &panels)> const &apply, bool apply_when_finished, std::function<void ()> const &cancel)
+{
+	m->task_apply = apply;
+	m->task_cancel = cancel;
+	m->filter_dialog = std::make_unique<FilterDialog>(this, fn, apply_when_finished);
+	m->filter_dialog->connect(m->filter_dialog.get(), &FilterDialog::end, this, &MainWindow::filterClose);
+	m->filter_dialog->show();
+	setFilerDialogActive(true);
+}
+
+void MainWindow::setLayerAdjustment(int index, PointOperation const &op, std::map<QString, QVariant> const &parameters)
+{
+	{
+		std::lock_guard lock(mutexForCanvas());
+		canvas()->layer(index)->adjustment = std::make_shared<PointOperation const>(op);
+		canvas()->layer(index)->adjustment_parameters = parameters;
+	}
+	updateImageViewEntire();
+}
+
 void MainWindow::filterClose(bool apply)
 {
 	std::unique_ptr<FilterDialog> p;
 	p.swap(m->filter_dialog);
-	if (p) {
+	if (p && p->isAdjustment()) {
 		setFilerDialogActive(false);
-		euclase::Image result = p->result();
 		p->close();
 		p.reset();
-		if (apply && result) {
-			setFilteredImage(result, true);
-		} else {
-			resetCurrentAlternateOption({});
+		if (!apply) { // 取り消したら、追加した調整レイヤーは削除し、既存の調整レイヤーは元に戻す
+			std::lock_guard lock(mutexForCanvas());
+			if (m->adjustment_layer_added) {
+				canvas()->removeLayer(m->adjustment_layer_index);
+			} else {
+				Canvas::Layer *layer = canvas()->layer(m->adjustment_layer_index);
+				layer->adjustment = m->adjustment_original;
+				layer->adjustment_parameters = m->adjustment_original_parameters;
+			}
 		}
+		m->adjustment_layer_index = -1;
+		m->adjustment_layer_added = false;
+		m->adjustment_original.reset();
+		m->adjustment_original_parameters.clear();
 		updateImageViewEntire();
-	}
-}
-
-euclase::Image sepia(euclase::Image const &image, FilterStatus *status)
-{
-	if (image.memtype() != euclase::Image::Host) {
-		return sepia(image.toHost(), status);
-	}
-
-	auto isInterrupted = [&](){
-		return status && status->cancel && *status->cancel;
-	};
-	auto progress = [&](float v){
-		if (status && status->progress) {
-			*status->progress = v;
+	} else if (p && p->isTask()) {
+		setFilerDialogActive(false);
+		std::vector<Canvas::Panel> result;
+		if (apply) {
+			result = p->result();
 		}
-	};
-	int w = image.width();
-	int h = image.height();
-	euclase::Image newimage;
-	newimage.make(w, h, image.format());
-	if (w > 0 || h > 0) {
-		std::atomic_int rows = 0;
-#pragma omp parallel for schedule(static, 8)
-		for (int y = 0; y < h; y++) {
-			if (isInterrupted()) continue;
-			euclase::Float32RGBA const *s = (euclase::Float32RGBA const *)image.scanLine(y);
-			euclase::Float32RGBA *d = (euclase::Float32RGBA *)newimage.scanLine(y);
-			for (int x = 0; x < w; x++) {
-				double r = s[x].r;
-				double g = s[x].g;
-				double b = s[x].b;
-				double a = s[x].a;
-				r = pow(r, 0.62) * 0.80392156 + 0.07450980;
-				g = pow(g, 1.00) * 0.71372549 + 0.06666666;
-				b = pow(b, 1.16) * 0.61176470 + 0.08235294;
-				d[x].r = r;
-				d[x].g = g;
-				d[x].b = b;
-				d[x].a = a;
-			}
-			progress((float)++rows / h);
+		p->close();
+		p.reset();
+		auto task_apply = std::move(m->task_apply);
+		auto task_cancel = std::move(m->task_cancel);
+		m->task_apply = {};
+		m->task_cancel = {};
+		if (apply && !result.empty()) {
+			task_apply(result);
+		} else if (!apply && task_cancel) {
+			task_cancel();
 		}
+		updateImageViewEntire();
+	} else if (p) {
+		setFilerDialogActive(false);
+		std::vector<Canvas::Panel> result;
+		if (apply) {
+			result = p->result();
+		}
+		p->close();
+		p.reset();
+		if (apply && !result.empty()) {
+			setFilteredPanels(result, true);
+		} else {
+			resetCurrentAlternateOption({});
+		}
+		updateImageViewEntire();
 	}
-	return newimage;
 }
 
 void MainWindow::on_action_filter_sepia_triggered()
@@ -738,8 +872,10 @@ void MainWindow::on_action_filter_sepia_triggered()
 	FilterContext fc;
 	fc.setParameter("amount", 10);
 	filterStart(std::move(fc), nullptr, [](FilterContext *context){
-		FilterStatus s(context->cancel_ptr(), context->progress_ptr());
-		return sepia(context->sourceImage(), &s);
+		PointOperation op = PointOperation::sepia();
+		return TileFilter(0, [op](euclase::Image const &image, FilterStatus *status){
+			return op.apply(image, status);
+		});
 	});
 }
 
@@ -748,9 +884,10 @@ void MainWindow::on_action_filter_median_triggered()
 	FilterContext fc;
 	fc.setParameter("amount", 10);
 	filterStart(std::move(fc), new FilterFormMedian(this), [](FilterContext *context){
-		FilterStatus s(context->cancel_ptr(), context->progress_ptr());
-		int value = context->parameter("amount").toInt();
-		return filter_median(context->sourceImage(), value, &s);
+		int value = context->scaledLength(context->parameter("amount").toInt());
+		return TileFilter(value, [value](euclase::Image const &image, FilterStatus *status){
+			return filter_median(image, value, status);
+		});
 	});
 }
 
@@ -759,9 +896,10 @@ void MainWindow::on_action_filter_maximize_triggered()
 	FilterContext fc;
 	fc.setParameter("amount", 10);
 	filterStart(std::move(fc), nullptr, [](FilterContext *context){
-		FilterStatus s(context->cancel_ptr(), context->progress_ptr());
-		int value = context->parameter("amount").toInt();
-		return filter_maximize(context->sourceImage(), value, &s);
+		int value = context->scaledLength(context->parameter("amount").toInt());
+		return TileFilter(value, [value](euclase::Image const &image, FilterStatus *status){
+			return filter_maximize(image, value, status);
+		});
 	});
 }
 
@@ -770,25 +908,21 @@ void MainWindow::on_action_filter_minimize_triggered()
 	FilterContext fc;
 	fc.setParameter("amount", 10);
 	filterStart(std::move(fc), nullptr, [](FilterContext *context){
-		FilterStatus s(context->cancel_ptr(), context->progress_ptr());
-		int value = context->parameter("amount").toInt();
-		return filter_minimize(context->sourceImage(), value, &s);
+		int value = context->scaledLength(context->parameter("amount").toInt());
+		return TileFilter(value, [value](euclase::Image const &image, FilterStatus *status){
+			return filter_minimize(image, value, status);
+		});
 	});
 }
 
 void MainWindow::on_action_filter_blur_triggered()
 {
 	auto fn = [](FilterContext *context){
-		int radius = context->parameter("amount").toInt();
-		euclase::Image newimage = context->sourceImage().toHost();
-		FilterStatus s(context->cancel_ptr(), context->progress_ptr());
-		for (int pass = 0; pass < 3; pass++) {
-			auto progress = [&](float v){
-				*s.progress = (pass + v) / 3.0f;
-			};
-			newimage = filter_blur(newimage, radius, s.cancel, progress);
-		}
-		return newimage;
+		int radius = context->scaledLength(context->parameter("amount").toInt());
+		// 矩形のカーネルを3回重ねるので、近傍の半径も3倍になる
+		return TileFilter(radius * 3, [radius](euclase::Image const &image, FilterStatus *status){
+			return filter_blur(image, radius, status->cancel, [](float){}, euclase::BlurMode::Gaussian);
+		});
 	};
 
 	FilterContext fc;
@@ -801,9 +935,12 @@ void MainWindow::on_action_filter_antialias_triggered()
 	FilterContext fc;
 	fc.setParameter("amount", 10);
 	filterStart(std::move(fc), nullptr, [](FilterContext *context){
-		euclase::Image newimage = context->sourceImage();
-		filter_antialias(&newimage);
-		return newimage;
+		// 輪郭の段差を追跡する範囲は局所的ではないので、タイルに分けると継ぎ目で結果が変わる
+		return TileFilter::whole([](euclase::Image const &image, FilterStatus *status){
+			euclase::Image newimage = image.copy();
+			filter_antialias(&newimage);
+			return newimage;
+		});
 	});
 }
 
@@ -873,6 +1010,23 @@ QPointF MainWindow::mapToViewportFromCanvas(QPointF const &pt) const
 	return ui->widget_image_view->mapToViewportFromCanvas(pt);
 }
 
+/**
+ * @brief 表示されているキャンバスの範囲
+ */
+QRect MainWindow::visibleCanvasRect() const
+{
+	QWidget const *w = ui->widget_image_view;
+	QPointF a = mapToCanvasFromViewport(QPointF(0, 0));
+	QPointF b = mapToCanvasFromViewport(QPointF(w->width(), w->height()));
+	QRect r = QRectF(a, b).normalized().toAlignedRect();
+	return r.intersected(QRect(QPoint(0, 0), canvas()->size()));
+}
+
+double MainWindow::viewScale() const
+{
+	return ui->widget_image_view->scale();
+}
+
 /**
  * @brief MainWindow::updateImageViewEntire
  *
@@ -1004,28 +1158,301 @@ QPointF MainWindow::pointOnCanvas(int x, int y) const
 	return ui->widget_image_view->mapToCanvasFromViewport(pos);
 }
 
-void MainWindow::setFilteredImage(euclase::Image const &image, bool apply)
+/**
+ * @brief マスク画像の中で選択されている画素の外接矩形を求める
+ * @param mask マスク画像
+ * @return 外接矩形。選択されている画素が無ければ空
+ */
+static QRect maskBounds(euclase::Image const &mask)
+{
+	euclase::Image image = mask.toHost().convertToFormat(euclase::Image::Format_U8_Grayscale);
+	const int w = image.width();
+	const int h = image.height();
+	int x0 = w;
+	int y0 = h;
+	int x1 = -1;
+	int y1 = -1;
+	for (int y = 0; y < h; y++) {
+		uint8_t const *s = (uint8_t const *)image.scanLine(y);
+		int l = 0;
+		while (l < w && s[l] == 0) l++;
+		if (l == w) continue; // この行は選択されていない
+		int r = w - 1;
+		while (s[r] == 0) r--;
+		x0 = std::min(x0, l);
+		x1 = std::max(x1, r);
+		y0 = std::min(y0, y);
+		y1 = y;
+	}
+	if (x1 < 0) return {};
+	return QRect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+/**
+ * @brief 画像を縮小する
+ * @param image 画像（F32_RGBA）
+ * @param k 縮小率
+ * @return k×k 画素の平均を1画素とした画像。端の半端な区画は存在する画素だけで平均する
+ */
+static euclase::Image reduceImage(euclase::Image const &image, int k)
+{
+	const int w = image.width();
+	const int h = image.height();
+	const int dw = (w + k - 1) / k;
+	const int dh = (h + k - 1) / k;
+	euclase::Image newimage;
+	newimage.make(dw, dh, euclase::Image::Format_F32_RGBA);
+	for (int y = 0; y < dh; y++) {
+		euclase::Float32RGBA *d = (euclase::Float32RGBA *)newimage.scanLine(y);
+		const int y0 = y * k;
+		const int y1 = std::min(y0 + k, h);
+		for (int x = 0; x < dw; x++) {
+			const int x0 = x * k;
+			const int x1 = std::min(x0 + k, w);
+			// 色はアルファで重み付けして平均する
+			float r = 0, g = 0, b = 0, a = 0;
+			for (int i = y0; i < y1; i++) {
+				euclase::Float32RGBA const *s = (euclase::Float32RGBA const *)image.scanLine(i);
+				for (int j = x0; j < x1; j++) {
+					r += s[j].r * s[j].a;
+					g += s[j].g * s[j].a;
+					b += s[j].b * s[j].a;
+					a += s[j].a;
+				}
+			}
+			if (a > 0) {
+				d[x] = euclase::Float32RGBA(r / a, g / a, b / a, a / ((y1 - y0) * (x1 - x0)));
+			} else {
+				d[x] = euclase::Float32RGBA(0, 0, 0, 0);
+			}
+		}
+	}
+	return newimage;
+}
+
+/**
+ * @brief タイル単位でフィルタを実行する
+ * @param filter フィルタ
+ * @param status 中断の判定と進捗
+ * @param area 処理する範囲（キャンバス座標系）。空なら全体
+ * @param reduction 縮小率。1より大きければ縮小した画像にフィルタをかけて拡大する（プレビュー用）
+ * @param cache タイルの入力画像のキャッシュ。nullptrならキャッシュしない
+ * @return 現在のレイヤーの代替パネルにそのまま使えるパネル
+ *
+ * 現在のレイヤーのパネル境界に合わせたタイルごとに、周囲を halo 画素広げた範囲だけを読み込んでフィルタを並列に実行する
+ * キャッシュを使わなければ、同時に保持する作業用の画像はスレッド数分のタイルだけなので、画像全体の複製を作らない
+ * ただし filter.untiled なら、範囲全体（等倍ならキャンバス全体）を1回で読み込んで処理し、結果をタイルに切り分ける
+ * フィルタ用選択領域（alternate_selection_panels）があれば、選択されていないタイルは処理せず、代替パネルも作らない
+ */
+std::vector<Canvas::Panel> MainWindow::runTileFilter(TileFilter const &filter, FilterStatus *status, QRect const &area, int reduction, TileSourceCache *cache)
+{
+	const int S = PANEL_SIZE;
+	const int k = std::max(1, reduction);
+
+	Canvas::Layer *layer;
+	QRect canvas_rect;
+	QPoint layer_offset;
+	euclase::Image::Format format;
+	euclase::Image::MemoryType memtype;
+	std::vector<Canvas::Panel> mask_panels; // フィルタ用選択領域。空なら全選択
+	std::vector<Canvas::Panel> source_panels; // 元のパネル。タイルのうち処理しない部分を埋める
+	{
+		std::lock_guard lock(mutexForCanvas());
+		layer = canvas()->current_layer();
+		canvas_rect = QRect(QPoint(0, 0), canvas()->size());
+		layer_offset = layer->offset();
+		format = layer->format_;
+		memtype = layer->memtype_;
+		mask_panels = layer->alternate_selection_panels;
+		source_panels = layer->primary_panels;
+	}
+	if (canvas_rect.isEmpty() || !filter.fn) return {};
+
+	// キャンバスを覆うタイル（レイヤー座標系のパネル位置）
+	std::vector<QPoint> offsets;
+	{
+		QRect r = canvas_rect.translated(-layer_offset);
+		int x0 = r.left() & ~(S - 1);
+		int y0 = r.top() & ~(S - 1);
+		for (int y = y0; y <= r.bottom(); y += S) {
+			for (int x = x0; x <= r.right(); x += S) {
+				offsets.emplace_back(x, y);
+			}
+		}
+	}
+
+	auto isInterrupted = [&](){
+		return status && status->cancel.canceled();
+	};
+
+	// 選択範囲に掛かるタイルだけを、選択されている画素の外接矩形に絞って処理する
+	std::vector<QRect> targets(offsets.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < (int)offsets.size(); i++) {
+		const QRect tile_rect(layer_offset + offsets[i], QSize(S, S)); // キャンバス座標系
+		QRect r = tile_rect;
+		if (!mask_panels.empty()) {
+			Canvas::Panel const *mask = Canvas::findPanel(&mask_panels, offsets[i]);
+			if (!mask) continue; // 選択範囲外
+			r = maskBounds(mask->image()).translated(tile_rect.topLeft());
+		}
+		r = r.intersected(canvas_rect);
+		if (!area.isEmpty()) {
+			r = r.intersected(area);
+		}
+		targets[i] = r;
+	}
+	struct Tile {
+		QPoint offset; // パネル位置（レイヤー座標系）
+		QRect target; // 処理する範囲（キャンバス座標系）
+	};
+	std::vector<Tile> tiles;
+	for (size_t i = 0; i < offsets.size(); i++) {
+		if (!targets[i].isEmpty()) {
+			tiles.push_back({offsets[i], targets[i]});
+		}
+	}
+
+	// 範囲の入力画像を作る。縮小表示なら縮小する
+	auto readSource = [&](QRect const &source_rect){
+		euclase::Image input = cache ? cache->find(source_rect, k) : euclase::Image();
+		if (!input) {
+			euclase::Image src;
+			{
+				std::lock_guard lock(mutexForCanvas());
+				src = canvas()->renderCurrentLayer(euclase::Image::Format_F32_RGBA, source_rect, status ? status->cancel : euclase::CancelToken()).image();
+			}
+			if (isInterrupted()) return euclase::Image();
+
+			input = src.toHost();
+			if (k > 1) {
+				input = reduceImage(input, k);
+			}
+			if (cache) {
+				cache->insert(source_rect, k, input);
+			}
+		}
+		return input;
+	};
+
+	// フィルタを実行する
+	auto runFilter = [&](euclase::Image const &input){
+		FilterStatus s(status ? status->cancel : euclase::CancelToken(), nullptr);
+		euclase::Image dst = filter.fn(input, &s);
+		if (isInterrupted() || !dst) return euclase::Image();
+		dst = dst.toHost().convertToFormat(euclase::Image::Format_F32_RGBA);
+		Q_ASSERT(dst.width() == input.width() && dst.height() == input.height());
+		return dst;
+	};
+
+	// source_rect の範囲の出力から、タイルの処理する範囲をパネルに書き込む
+	std::vector<Canvas::Panel> panels(tiles.size());
+	std::atomic_int done = 0;
+	auto writePanel = [&](int i, euclase::Image const &dst, QRect const &source_rect){
+		const QRect tile_rect(layer_offset + tiles[i].offset, QSize(S, S)); // キャンバス座標系
+		const QRect target_rect = tiles[i].target;
+		euclase::Image image;
+		Canvas::Panel const *source = target_rect != tile_rect ? Canvas::findPanel(&source_panels, tiles[i].offset) : nullptr;
+		if (source && source->size() == QSize(S, S)) { // パネルは Replace で置き換わるので、処理しない部分は元のままにしておく
+			image = source->image().toHost();
+			image = image.format() == euclase::Image::Format_F32_RGBA ? image.copy() : image.convertToFormat(euclase::Image::Format_F32_RGBA);
+		} else {
+			image.make(S, S, euclase::Image::Format_F32_RGBA);
+		}
+		const int dx = target_rect.x() - tile_rect.x();
+		const int dy = target_rect.y() - tile_rect.y();
+		const int sx = target_rect.x() - source_rect.x();
+		const int sy = target_rect.y() - source_rect.y();
+		for (int y = 0; y < target_rect.height(); y++) {
+			euclase::Float32RGBA const *s = (euclase::Float32RGBA const *)dst.scanLine((sy + y) / k);
+			euclase::Float32RGBA *d = (euclase::Float32RGBA *)image.scanLine(dy + y) + dx;
+			if (k == 1) {
+				memcpy(d, s + sx, sizeof(euclase::Float32RGBA) * target_rect.width());
+			} else {
+				for (int x = 0; x < target_rect.width(); x++) {
+					d[x] = s[(sx + x) / k];
+				}
+			}
+		}
+		image = image.convertToFormat(format);
+		image.memconvert(memtype);
+		panels[i] = Canvas::Panel(image, tiles[i].offset);
+
+		if (status && status->progress) {
+			*status->progress = (float)++done / tiles.size();
+		}
+	};
+
+	if (filter.untiled) { // タイルに分けずに、範囲全体を1回で処理する
+		QRect source_rect;
+		for (Tile const &tile : tiles) {
+			source_rect = source_rect.united(tile.target);
+		}
+		if (area.isEmpty()) {
+			source_rect = canvas_rect; // 結果が画像全体を1回で処理したものと同じになるように
+		}
+		source_rect.setLeft(source_rect.left() - source_rect.left() % k); // 縮小の格子に揃える
+		source_rect.setTop(source_rect.top() - source_rect.top() % k);
+		euclase::Image dst;
+		if (!tiles.empty()) {
+			euclase::Image input = readSource(source_rect);
+			if (input) {
+				dst = runFilter(input);
+			}
+		}
+		if (dst) {
+#pragma omp parallel for schedule(dynamic)
+			for (int i = 0; i < (int)tiles.size(); i++) {
+				writePanel(i, dst, source_rect);
+			}
+		}
+	} else {
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < (int)tiles.size(); i++) {
+			if (isInterrupted()) continue;
+
+			const QRect target_rect = tiles[i].target;
+			const int halo = filter.halo * k; // 等倍での近傍の半径
+			QRect source_rect = target_rect.adjusted(-halo, -halo, halo, halo).intersected(canvas_rect);
+			source_rect.setLeft(source_rect.left() - source_rect.left() % k); // 縮小の格子に揃える
+			source_rect.setTop(source_rect.top() - source_rect.top() % k);
+
+			euclase::Image input = readSource(source_rect);
+			if (!input) continue;
+			euclase::Image dst = runFilter(input);
+			if (!dst) continue;
+
+			// halo を除いた部分をパネルに書き込む
+			writePanel(i, dst, source_rect);
+		}
+	}
+	if (isInterrupted()) return {};
+
+	// tiles は行ごとに左から並んでいるので、パネルは位置順に整列済み
+	panels.erase(std::remove_if(panels.begin(), panels.end(), [](Canvas::Panel const &p){ return p.isNull(); }), panels.end());
+	return panels;
+}
+
+/**
+ * @brief フィルタの結果を現在のレイヤーの代替パネルに設定する
+ * @param panels runTileFilter() の結果
+ * @param apply 確定するならtrue
+ */
+void MainWindow::setFilteredPanels(std::vector<Canvas::Panel> const &panels, bool apply)
 {
-	if (!image) return;
-	// Q_ASSERT(image);
+	if (panels.empty()) return;
 
 	std::lock_guard lock(mutexForCanvas());
-	
-	canvas()->current_layer()->alternate_panels.clear();
-	
-	Canvas::Layer layer;
-	layer.setImage(QPoint(0, 0), image);
-	
-	Canvas::RenderOption opt;
-	opt.blend_mode = Canvas::BlendMode::Normal;
-	canvas()->renderToLayer(canvas()->current_layer(), Canvas::AlternateLayer, layer, nullptr, opt, nullptr);
-	
-	canvas()->current_layer()->alternate_blend_mode = Canvas::BlendMode::Replace;
-	
+
+	Canvas::Layer *layer = canvas()->current_layer();
+	layer->alternate_panels = panels;
+	layer->alternate_blend_mode = Canvas::BlendMode::Replace;
+	layer->active_panel_ = Canvas::AlternateLayer;
+
 	if (apply) {
 		applyCurrentAlternateLayer(false);
 	}
-	
+
 	updateImageViewEntire();
 }
 
@@ -1174,6 +1601,48 @@ bool BoundsTool::on(MainWindow *mw, const MouseButtonRelease &a)
 	return true;
 }
 
+bool TransformTool::on(MainWindow *mw, const MouseButtonPress &a)
+{
+	mw->onTransformStart();
+	return true;
+}
+
+bool TransformTool::on(MainWindow *mw, const MouseMove &a)
+{
+	mw->onTransformMove(a);
+	return true;
+}
+
+bool TransformTool::on(MainWindow *mw, const MouseButtonRelease &a)
+{
+	mw->onTransformEnd(a);
+	return true;
+}
+
+bool FillTool::on(MainWindow *mw, const MouseButtonPress &a)
+{
+	QPointF pos = mw->pointOnCanvas(a.x, a.y);
+	QPoint pt((int)floor(pos.x()), (int)floor(pos.y()));
+	bool contiguous = !(QApplication::keyboardModifiers() & Qt::ControlModifier); // Ctrlを押していれば離れた同じ色も対象にする
+	if (isMagicWand()) {
+		mw->selectColorRangeAt(pt, contiguous);
+	} else {
+		mw->fillAt(pt, contiguous);
+	}
+	return true;
+}
+
+bool FillTool::on(MainWindow *mw, const MouseMove &a)
+{
+	mw->setToolCursor(Qt::CrossCursor);
+	return true;
+}
+
+bool FillTool::on(MainWindow *mw, const MouseButtonRelease &a)
+{
+	return a.left_button;
+}
+
 bool BrushTool::on(MainWindow *mw, const MouseButtonPress &a)
 {
 	QPointF pos = mw->pointOnCanvas(a.x, a.y);
@@ -1227,6 +1696,8 @@ struct ToolUtil {
 	static AbstractTool *toolptr(tool::ScrollTool &t) { return &t; }
 	static AbstractTool *toolptr(tool::BrushTool &t) { return &t; }
 	static AbstractTool *toolptr(tool::BoundsTool &t) { return &t; }
+	static AbstractTool *toolptr(tool::TransformTool &t) { return &t; }
+	static AbstractTool *toolptr(tool::FillTool &t) { return &t; }
 
 	static void setupPropertyBar(MainWindow *mw, tool::ScrollTool const &)
 	{
@@ -1244,11 +1715,23 @@ struct ToolUtil {
 		mw->addPropertyBarButton(MainWindow::tr("Ellipse"), tool::BoundsTool::Ellipse());
 	}
 
+	static void setupPropertyBar(MainWindow *mw, tool::TransformTool const &)
+	{
+	}
+
+	static void setupPropertyBar(MainWindow *mw, tool::FillTool const &)
+	{
+		mw->addPropertyBarButton(MainWindow::tr("Fill"), tool::FillTool());
+		mw->addPropertyBarButton(MainWindow::tr("Magic Wand"), tool::FillTool::MagicWand());
+	}
+
 };
 
 void ScrollTool::setupPropertyBar(MainWindow *mw) { ToolUtil::setupPropertyBar(mw, *this); }
 void BrushTool::setupPropertyBar(MainWindow *mw)  { ToolUtil::setupPropertyBar(mw, *this); }
 void BoundsTool::setupPropertyBar(MainWindow *mw) { ToolUtil::setupPropertyBar(mw, *this); }
+void TransformTool::setupPropertyBar(MainWindow *mw) { ToolUtil::setupPropertyBar(mw, *this); }
+void FillTool::setupPropertyBar(MainWindow *mw) { ToolUtil::setupPropertyBar(mw, *this); }
 
 } // namespace tool
 
@@ -1259,6 +1742,10 @@ tool::AbstractTool *MainWindow::abstractTool(tool::ToolVariant tool)
 
 void MainWindow::changeTool_internal(MainTool tool)
 {
+	if (!std::holds_alternative<tool::TransformTool>(tool.var)) {
+		commitTransform(); // 他のツールに切り替えたら変形を確定する
+	}
+
 	m->current_tool = tool.var;
 	m->current_tool2 = abstractTool(tool.var);
 
@@ -1394,6 +1881,422 @@ void MainWindow::onBoundsEnd(tool::MouseButtonRelease const &a)
 	}
 }
 
+static QPolygonF transformQuad(QPointF const *quad)
+{
+	QPolygonF polygon;
+	for (int i = 0; i < 4; i++) {
+		polygon.push_back(quad[i]);
+	}
+	return polygon;
+}
+
+/**
+ * @brief 変形の枠のどこを指しているか
+ * @param pt ビューポート座標
+ * @return 0..3: 角、4: 枠の内側（移動）、5: 枠の外側（回転）
+ */
+int MainWindow::transformHitTest(QPoint const &pt) const
+{
+	const int D = 100;
+	QPolygonF quad;
+	for (int i = 0; i < 4; i++) {
+		QPointF p = mapToViewportFromCanvas(m->transform.quad[i]);
+		double dx = pt.x() - p.x();
+		double dy = pt.y() - p.y();
+		if (dx * dx + dy * dy < D) {
+			return i;
+		}
+		quad.push_back(p);
+	}
+	return quad.containsPoint(pt, Qt::OddEvenFill) ? 4 : 5;
+}
+
+/**
+ * @brief 変形を始める
+ *
+ * 範囲指定矩形があればその範囲、なければ選択範囲、それもなければキャンバス全体を変形する
+ */
+void MainWindow::beginTransform()
+{
+	if (m->transform.active) return;
+	if (canvas()->current_layer()->isAdjustmentLayer()) return;
+
+	QRect r;
+	if (isRectVisible()) {
+		r = boundsRect();
+	} else if (!canvas()->selection_layer()->primary_panels.empty()) {
+		r = selectionRect();
+	} else {
+		r = QRect(QPoint(0, 0), canvas()->size());
+	}
+	if (r.isEmpty()) return;
+
+	hideBounds(false);
+	resetCurrentAlternateOption(Canvas::BlendMode::Copy);
+	setPreviewLayerEnable(true);
+
+	m->transform.active = true;
+	m->transform.source_rect = r;
+	m->transform.quad[0] = QPointF(r.left(), r.top());
+	m->transform.quad[1] = QPointF(r.right() + 1, r.top());
+	m->transform.quad[2] = QPointF(r.right() + 1, r.bottom() + 1);
+	m->transform.quad[3] = QPointF(r.left(), r.bottom() + 1);
+	m->transform.dirty_rect = {};
+	ui->widget_image_view->showTransformQuad(transformQuad(m->transform.quad));
+}
+
+/**
+ * @brief 変形後の四隅から、キャンバス上の座標の変換を求める
+ */
+euclase::Homography MainWindow::transformHomography() const
+{
+	QRect const &r = m->transform.source_rect;
+	double quad[8];
+	for (int i = 0; i < 4; i++) {
+		quad[i * 2 + 0] = m->transform.quad[i].x();
+		quad[i * 2 + 1] = m->transform.quad[i].y();
+	}
+	return euclase::Homography::fromRectToQuad(r.x(), r.y(), r.width(), r.height(), quad);
+}
+
+/**
+ * @brief 変形のプレビューの作成を依頼する
+ * @param interpolation ドラッグ中は最近傍、離したら双線形
+ * @param clip 作る範囲。ドラッグ中は表示されている範囲だけ。空なら変わる範囲全体
+ *
+ * 作成中のプレビューは中断され、まだ始まっていない依頼は新しいもので置き換えられる
+ */
+void MainWindow::requestTransformPreview(euclase::Warper::Interpolation interpolation, QRect const &clip)
+{
+	if (!m->transform.active) return;
+
+	Private::Transform::Job job;
+	job.source_rect = m->transform.source_rect;
+	job.transform = transformHomography();
+	job.interpolation = interpolation;
+	job.clip = clip;
+	{
+		std::lock_guard lock(m->transform.mutex);
+		job.generation = ++m->transform.generation; // 作成中のプレビューを中断させる
+		m->transform.job = job;
+	}
+	if (!m->transform.worker.joinable()) {
+		m->transform.worker = std::thread([this](){
+			runTransformPreview();
+		});
+	}
+	m->transform.cond_job.notify_one();
+}
+
+/**
+ * @brief 作成中のプレビューを中断して、終わるまで待つ
+ */
+void MainWindow::stopTransformPreview()
+{
+	std::unique_lock lock(m->transform.mutex);
+	m->transform.job.reset();
+	m->transform.generation++;
+	m->transform.cond_idle.wait(lock, [&](){ return !m->transform.busy; });
+}
+
+/**
+ * @brief プレビューを作るワーカースレッドの処理
+ *
+ * レイヤーのパネルをロックの中で複製し、変形はロックの外で行う
+ */
+void MainWindow::runTransformPreview()
+{
+	auto &t = m->transform;
+	while (1) {
+		Private::Transform::Job job;
+		{
+			std::unique_lock lock(t.mutex);
+			t.cond_job.wait(lock, [&](){ return t.quit || t.job; });
+			if (t.quit) break;
+			job = *t.job;
+			t.job.reset();
+			t.busy = true;
+		}
+		Canvas::Layer layer;
+		Canvas::Layer mask_layer;
+		bool use_mask;
+		QSize size;
+		{
+			std::lock_guard lock(mutexForCanvas());
+			layer = *canvas()->current_layer();
+			use_mask = !canvas()->selection_layer()->primary_panels.empty();
+			if (use_mask) {
+				mask_layer = *canvas()->selection_layer();
+			}
+			size = canvas()->size();
+		}
+		euclase::CancelToken cancel(&t.generation, job.generation);
+		std::vector<Canvas::Panel> panels = Canvas::renderTransform(layer, use_mask ? &mask_layer : nullptr, size, job.source_rect, job.transform, job.interpolation, job.clip, cancel);
+		bool ok = !cancel.canceled();
+		{
+			std::lock_guard lock(t.mutex);
+			if (ok) {
+				t.result = std::move(panels);
+				t.result_generation = job.generation;
+			}
+			t.busy = false;
+		}
+		t.cond_idle.notify_all();
+		if (ok) {
+			QMetaObject::invokeMethod(this, [this, generation = job.generation](){
+				onTransformPreviewFinished(generation);
+			}, Qt::QueuedConnection);
+		}
+	}
+}
+
+/**
+ * @brief プレビューの完了通知（GUIスレッド）
+ */
+void MainWindow::onTransformPreviewFinished(unsigned int generation)
+{
+	std::vector<Canvas::Panel> panels;
+	{
+		std::lock_guard lock(m->transform.mutex);
+		if (m->transform.result_generation != generation || generation != m->transform.generation) return; // もう新しい依頼がある
+		panels = std::move(m->transform.result);
+	}
+	if (!m->transform.active) return;
+	setTransformPanels(panels);
+}
+
+/**
+ * @brief 変形した結果を代替パネルに設定し、表示を更新する
+ */
+void MainWindow::setTransformPanels(std::vector<Canvas::Panel> const &panels)
+{
+	QRect rect;
+	{
+		std::lock_guard lock(mutexForCanvas());
+		Canvas::Layer *layer = canvas()->current_layer();
+		layer->setAlternatePanels(panels, Canvas::BlendMode::Copy);
+		for (Canvas::Panel const &panel : panels) {
+			rect = rect.united(QRect(layer->offset() + panel.offset(), panel.size()));
+		}
+	}
+
+	// 前回変えた範囲も元に戻す
+	QRect dirty = rect.united(m->transform.dirty_rect);
+	m->transform.dirty_rect = rect;
+	if (!dirty.isEmpty()) {
+		updateImageView(dirty);
+	}
+}
+
+/**
+ * @brief 変形を確定する
+ *
+ * 確定するときだけ双三次で全体を作り直す。大きなレイヤーでは時間がかかるので、中断できる処理として別スレッドで行う
+ * 取り消されたら変形も取り消す
+ * 選択範囲は変形前の位置のままになるので解除する
+ */
+void MainWindow::commitTransform()
+{
+	if (!m->transform.active || isFilterDialogActive()) return;
+	stopTransformPreview();
+	const QRect source_rect = m->transform.source_rect;
+	const euclase::Homography transform = transformHomography();
+	taskStart([this, source_rect, transform](FilterStatus *status){
+		Canvas::Layer layer;
+		Canvas::Layer mask_layer;
+		bool use_mask;
+		QSize size;
+		{
+			std::lock_guard lock(mutexForCanvas());
+			layer = *canvas()->current_layer();
+			use_mask = !canvas()->selection_layer()->primary_panels.empty();
+			if (use_mask) {
+				mask_layer = *canvas()->selection_layer();
+			}
+			size = canvas()->size();
+		}
+		return Canvas::renderTransform(layer, use_mask ? &mask_layer : nullptr, size, source_rect, transform, euclase::Warper::Interpolation::Bicubic, {}, status->cancel);
+	}, [this](std::vector<Canvas::Panel> const &panels){
+		if (!m->transform.active) return;
+		setTransformPanels(panels);
+		applyCurrentAlternateLayer();
+		m->transform.active = false;
+		ui->widget_image_view->hideTransformQuad();
+		if (!canvas()->selection_layer()->primary_panels.empty()) {
+			{
+				std::lock_guard lock(mutexForCanvas());
+				canvas()->clearSelection();
+			}
+			updateSelectionOutline();
+		}
+		updateImageView(m->transform.dirty_rect);
+	}, true, [this](){
+		cancelTransform();
+	});
+}
+
+/**
+ * @brief 変形を取り消す
+ */
+void MainWindow::cancelTransform()
+{
+	if (!m->transform.active) return;
+	stopTransformPreview();
+	resetCurrentAlternateOption();
+	m->transform.active = false;
+	ui->widget_image_view->hideTransformQuad();
+	if (!m->transform.dirty_rect.isEmpty()) {
+		updateImageView(m->transform.dirty_rect);
+	}
+}
+
+void MainWindow::onTransformStart()
+{
+	beginTransform();
+	if (!m->transform.active) return;
+	m->transform.handle = transformHitTest(m->start_viewport_pt);
+	for (int i = 0; i < 4; i++) {
+		m->transform.start_quad[i] = m->transform.quad[i];
+	}
+}
+
+void MainWindow::onTransformMove(tool::MouseMove const &a)
+{
+	const bool drag = !a.set_cursor_only && a.left_button;
+	if (!m->transform.active) {
+		setToolCursor(Qt::ArrowCursor);
+		return;
+	}
+	int handle = drag ? m->transform.handle : transformHitTest(QPoint(a.x, a.y));
+	if (handle < 0) {
+		setToolCursor(Qt::ArrowCursor);
+	} else if (handle < 4) {
+		setToolCursor(Qt::CrossCursor);
+	} else if (handle == 4) {
+		setToolCursor(Qt::SizeAllCursor);
+	} else {
+		setToolCursor(Qt::ArrowCursor);
+	}
+	if (!drag || handle < 0) return;
+
+	m->mouse_moved = true;
+	QPointF start = mapToCanvasFromViewport(m->start_viewport_pt);
+	QPointF pt = mapToCanvasFromViewport(QPointF(a.x, a.y));
+	QPointF const *q = m->transform.start_quad;
+	if (handle < 4) { // 角を動かすと射影変換になる
+		m->transform.quad[handle] = q[handle] + pt - start;
+	} else if (handle == 4) { // 移動
+		for (int i = 0; i < 4; i++) {
+			m->transform.quad[i] = q[i] + pt - start;
+		}
+	} else { // 中心のまわりに回転
+		QPointF c = (q[0] + q[1] + q[2] + q[3]) / 4;
+		double t = atan2(pt.y() - c.y(), pt.x() - c.x()) - atan2(start.y() - c.y(), start.x() - c.x());
+		double cs = cos(t);
+		double sn = sin(t);
+		for (int i = 0; i < 4; i++) {
+			QPointF d = q[i] - c;
+			m->transform.quad[i] = c + QPointF(d.x() * cs - d.y() * sn, d.x() * sn + d.y() * cs);
+		}
+	}
+	ui->widget_image_view->showTransformQuad(transformQuad(m->transform.quad));
+	QRect visible = visibleCanvasRect();
+	if (!visible.isEmpty()) {
+		requestTransformPreview(euclase::Warper::Interpolation::Nearest, visible); // ドラッグ中は見えている範囲だけ
+	}
+}
+
+void MainWindow::onTransformEnd(tool::MouseButtonRelease const &a)
+{
+	if (a.left_button && a.mouse_moved) {
+		requestTransformPreview(euclase::Warper::Interpolation::Bilinear, {}); // 離したら補間して全体を作り直す
+	}
+	m->transform.handle = -1;
+}
+
+/**
+ * @brief 現在のレイヤーの色の近い範囲を前景色で塗りつぶす
+ * @param pt 起点（キャンバス上の座標）
+ * @param contiguous falseなら、つながっていなくても色の近い画素を全て塗る
+ *
+ * 塗りつぶしは中断できる処理として別スレッドで行い、終わったら結果を適用する
+ * 選択範囲があれば、その中だけを塗る
+ */
+void MainWindow::fillAt(QPoint const &pt, bool contiguous)
+{
+	if (isFilterDialogActive()) return;
+
+	const QColor color = foregroundColor();
+	const float tolerance = m->fill_tolerance;
+	taskStart([this, pt, color, tolerance, contiguous](FilterStatus *status){
+		Canvas::Layer layer;
+		QSize size;
+		{
+			std::lock_guard lock(mutexForCanvas());
+			layer = *canvas()->current_layer();
+			size = canvas()->size();
+		}
+		return Canvas::renderFill(layer, size, pt, color, tolerance, contiguous, status->cancel);
+	}, [this](std::vector<Canvas::Panel> const &panels){
+		QRect rect;
+		{
+			std::lock_guard lock(mutexForCanvas());
+			Canvas::Layer *layer = canvas()->current_layer();
+			layer->finishAlternatePanels(false, nullptr, {});
+			layer->setAlternatePanels(panels, Canvas::BlendMode::Normal);
+			applyCurrentAlternateLayer(false);
+			for (Canvas::Panel const &panel : panels) {
+				rect = rect.united(QRect(layer->offset() + panel.offset(), panel.size()));
+			}
+		}
+		updateImageView(rect);
+	}, true);
+}
+
+/**
+ * @brief 現在のレイヤーの色の近い範囲を選択する
+ * @param pt 起点（キャンバス上の座標）
+ * @param contiguous falseなら、つながっていなくても色の近い画素を全て選ぶ
+ *
+ * Shiftを押していれば選択範囲に加え、Altを押していれば選択範囲から除く
+ * 範囲を求めるのは中断できる処理として別スレッドで行い、終わったら選択範囲を変える
+ */
+void MainWindow::selectColorRangeAt(QPoint const &pt, bool contiguous)
+{
+	if (isFilterDialogActive()) return;
+
+	Canvas::SelectionOperation op = Canvas::SelectionOperation::SetSelection;
+	Qt::KeyboardModifiers modifiers = QApplication::keyboardModifiers();
+	if (modifiers & Qt::ShiftModifier) {
+		op = Canvas::SelectionOperation::AddSelection;
+	} else if (modifiers & Qt::AltModifier) {
+		op = Canvas::SelectionOperation::SubSelection;
+	}
+	const float tolerance = m->fill_tolerance;
+	QPoint offset;
+	{
+		std::lock_guard lock(mutexForCanvas());
+		offset = canvas()->current_layer()->offset();
+	}
+	taskStart([this, pt, tolerance, contiguous](FilterStatus *status){
+		Canvas::Layer layer;
+		QSize size;
+		{
+			std::lock_guard lock(mutexForCanvas());
+			layer = *canvas()->current_layer();
+			size = canvas()->size();
+		}
+		return Canvas::renderFloodFill(layer, size, pt, tolerance, contiguous, status->cancel);
+	}, [this, op, offset](std::vector<Canvas::Panel> const &masks){
+		{
+			std::lock_guard lock(mutexForCanvas());
+			canvas()->changeSelection(op, offset, masks, nullptr);
+		}
+		onSelectionChanged();
+		updateImageViewEntire();
+	}, true);
+}
+
 void MainWindow::doHandScroll()
 {
 	ui->widget_image_view->doHandScroll();
@@ -1652,6 +2555,9 @@ bool MainWindow::eventFilter(QObject *watched, QEvent *event)
 				case Qt::Key_B:
 					changeTool(tool::BrushTool());
 					return true;
+				case Qt::Key_G:
+					changeTool(tool::FillTool());
+					return true;
 				case Qt::Key_H:
 					changeTool(tool::ScrollTool());
 					return true;
@@ -1692,10 +2598,21 @@ bool MainWindow::eventFilter(QObject *watched, QEvent *event)
 				case Qt::Key_T:
 					if (ctrl) {
 						test();
+					} else {
+						changeTool(tool::TransformTool());
 					}
 					return true;
 				case Qt::Key_U:
-					colorCollection();
+					if ((e->modifiers() & Qt::ShiftModifier) && ctrl) {
+						editAdjustmentLayer();
+					} else if (e->modifiers() & Qt::ShiftModifier) {
+						addColorCorrectionLayer();
+					} else {
+						colorCollection();
+					}
+					return true;
+				case Qt::Key_W:
+					changeTool(tool::FillTool::MagicWand());
 					return true;
 				case Qt::Key_X:
 					setColor(m->secondary_color, m->primary_color);
@@ -1706,7 +2623,18 @@ bool MainWindow::eventFilter(QObject *watched, QEvent *event)
 				case Qt::Key_Minus:
 					ui->widget_image_view->zoomOut();
 					return true;
+				case Qt::Key_Return:
+				case Qt::Key_Enter:
+					if (m->transform.active) {
+						commitTransform();
+						return true;
+					}
+					break;
 				case Qt::Key_Escape:
+					if (m->transform.active) {
+						cancelTransform();
+						return true;
+					}
 					on_action_clear_bounds_triggered();
 					return true;
 				}
@@ -1792,19 +2720,120 @@ void MainWindow::on_action_settings_triggered()
 	}
 }
 
-void MainWindow::filter_xBRZ(int factor)
+/**
+ * @brief xBRZで拡大したキャンバスのパネルを作る
+ * @param factor 倍率
+ * @param status 中断の判定と進捗
+ * @return 拡大後のキャンバスを覆うパネル
+ *
+ * 出力のパネル1段分に対応する入力の行ごとに、上下に数行の余白を付けてレイヤーから描画し、並列に拡大する
+ * xBRZ が参照する近傍は上下2行までなので、余白があれば画像全体を一度に拡大したときと同じ結果になる
+ */
+std::vector<Canvas::Panel> MainWindow::scaleXBRZ(int factor, FilterStatus *status)
 {
-	euclase::Image image = renderFilterTargetImage();
-	QImage srcimage = image.qimage();
-	srcimage = srcimage.convertToFormat(QImage::Format_RGBA8888);
-	int w = srcimage.width();
-	int h = srcimage.height();
-	if (w > 0 && h > 0) {
-		QImage dstimage(w * factor, h * factor, QImage::Format_RGBA8888);
+	const int S = PANEL_SIZE;
+	const int MARGIN = 4;
+
+	QSize size;
+	euclase::Image::Format format = preferredImageFormat();
+	euclase::Image::MemoryType memtype = preferredMemoryType();
+	{
+		std::lock_guard lock(mutexForCanvas());
+		size = canvas()->size();
+	}
+	const int w = size.width();
+	const int h = size.height();
+	if (w < 1 || h < 1) return {};
+	const int dw = w * factor;
+	const int dh = h * factor;
+	const int cols = (dw + S - 1) / S;
+	const int rows = (dh + S - 1) / S;
+
+	auto isInterrupted = [&](){
+		return status && status->cancel.canceled();
+	};
+
+	std::vector<std::vector<Canvas::Panel>> bands(rows);
+	std::atomic_int done = 0;
+#pragma omp parallel for schedule(dynamic)
+	for (int row = 0; row < rows; row++) {
+		if (isInterrupted()) continue;
+
+		// 出力の行 [row * S, (row + 1) * S) を含む入力の行
+		const int y0 = row * S / factor;
+		const int y1 = std::min(h, ((row + 1) * S + factor - 1) / factor);
+		const int m0 = std::min(MARGIN, y0);
+		const int m1 = std::min(MARGIN, h - y1);
+		const QRect source_rect(0, y0 - m0, w, m0 + (y1 - y0) + m1);
+
+		euclase::Image src;
+		{
+			std::lock_guard lock(mutexForCanvas());
+			src = canvas()->renderToPanel(Canvas::AllLayers, euclase::Image::Format_U8_RGBA, source_rect, {}, Canvas::PrimaryLayer, {}, status ? status->cancel : euclase::CancelToken()).image();
+		}
+		if (isInterrupted() || !src) continue;
+		src = src.toHost();
+
+		euclase::Image dst(dw, (m0 + y1 - y0) * factor, euclase::Image::Format_U8_RGBA);
 		xbrz::ScalerCfg cfg;
-		xbrz::scale(factor, (uint32_t*)srcimage.bits(), (uint32_t*)dstimage.bits(), w, h, xbrz::ColorFormat::RGBA, cfg, 0, h);
-		setImage(euclase::Image(dstimage), true);
+		xbrz::scale(factor, (uint32_t const *)src.scanLine(0), (uint32_t *)dst.scanLine(0), w, source_rect.height(), xbrz::ColorFormat::RGBA, cfg, m0, m0 + (y1 - y0));
+
+		// パネルに切り分ける
+		const int top = row * S - y0 * factor; // dst の中での出力の先頭行（余白を除く）
+		const int n = std::min(S, dh - row * S);
+		for (int col = 0; col < cols; col++) {
+			const int x = col * S;
+			const int len = std::min(S, dw - x);
+			euclase::Image image(S, S, euclase::Image::Format_U8_RGBA);
+			for (int i = 0; i < n; i++) {
+				memcpy(image.scanLine(i), dst.scanLine(m0 * factor + top + i) + x * 4, len * 4);
+			}
+			image = image.convertToFormat(format);
+			image.memconvert(memtype);
+			bands[row].emplace_back(image, QPoint(x, row * S));
+		}
+
+		if (status && status->progress) {
+			*status->progress = (float)++done / rows;
+		}
+	}
+	if (isInterrupted()) return {};
+
+	std::vector<Canvas::Panel> panels;
+	for (std::vector<Canvas::Panel> const &band : bands) {
+		panels.insert(panels.end(), band.begin(), band.end());
+	}
+	return panels;
+}
+
+/**
+ * @brief キャンバスの大きさを変えて、パネルを1枚のレイヤーとして置く
+ * @param size 新しい大きさ
+ * @param panels パネル（位置はレイヤー座標系で、行優先に並んでいること）
+ */
+void MainWindow::setLayerPanels(QSize const &size, std::vector<Canvas::Panel> const &panels)
+{
+	clearCanvas();
+	ui->widget_image_view->clearRenderCache(true, true);
+	{
+		std::lock_guard lock(mutexForCanvas());
+		canvas()->setSize(size);
+		Canvas::Layer *layer = canvas()->current_layer();
+		setupBasicLayer(layer);
+		layer->primary_panels = panels;
 	}
+	resetView(true);
+	updateImageView({});
+}
+
+void MainWindow::filter_xBRZ(int factor)
+{
+	const QSize size = canvas()->size() * factor;
+	taskStart([this, factor](FilterStatus *status){
+		return scaleXBRZ(factor, status);
+	}, [this, size](std::vector<Canvas::Panel> const &panels){
+		setLayerPanels(size, panels);
+	});
 }
 
 void MainWindow::on_action_filter_2xBRZ_triggered()
@@ -1836,83 +2865,27 @@ struct ColorCorrectionParams {
 	float brightness = 0;
 };
 
-euclase::Image filter_color_correction(euclase::Image const &image, ColorCorrectionParams const &params, FilterStatus *status)
+/**
+ * @brief 色調補正の点演算
+ *
+ * 色相と彩度は3次元のLUTに、明るさはトーンカーブにまとめる
+ */
+PointOperation color_correction_operation(ColorCorrectionParams const &params)
 {
-	euclase::Image srcimage;
-	if (image.memtype() == euclase::Image::Host) {
-		srcimage = image;
-	} else {
-		srcimage = image.toHost();
-	}
+	PointOperation op;
+	op.then(PointOperation::hue(params.hue));
+	op.then(PointOperation::saturation(params.saturation));
+	op.then(PointOperation::brightness(params.brightness));
+	return op;
+}
 
-	auto isInterrupted = [&](){
-		return status && status->cancel && *status->cancel;
-	};
-	auto progress = [&](float v){
-		if (status && status->progress) {
-			*status->progress = v;
-		}
-	};
-	int w = srcimage.width();
-	int h = srcimage.height();
-	euclase::Image newimage;
-	newimage.make(w, h, srcimage.format());
-	if (w > 0 || h > 0) {
-		float s_lo = -1;
-		float s_hi = -1;
-		if (params.saturation < 0) {
-			s_lo = 1.0f + params.saturation;
-		} else if (params.saturation > 0) {
-			s_hi = 1.0f - params.saturation;
-		}
-		float v_lo = -1;
-		float v_hi = -1;
-		if (params.brightness < 0) {
-			v_lo = 1.0f + params.brightness;
-			v_lo *= v_lo;
-		} else if (params.brightness > 0) {
-			v_hi = 1.0f - params.brightness;
-			v_hi = sqrtf(v_hi);
-		}
-		std::atomic_int rows = 0;
-#pragma omp parallel for schedule(static, 8)
-		for (int y = 0; y < h; y++) {
-			if (isInterrupted()) continue;
-			euclase::Float32RGBA const *s = (euclase::Float32RGBA const *)srcimage.scanLine(y);
-			euclase::Float32RGBA *d = (euclase::Float32RGBA *)newimage.scanLine(y);
-			for (int x = 0; x < w; x++) {
-				euclase::Float32RGB rgb(s[x].r, s[x].g, s[x].b);
-				double A = s[x].a;
-				if (params.hue != 0) {
-					auto hsv = euclase::rgb_to_hsv(rgb);
-					hsv.h = hsv.h + params.hue;
-					rgb = euclase::hsv_to_rgb(hsv);
-				}
-				if (params.saturation != 0) {
-					float gray = euclase::grayf(rgb.r, rgb.g, rgb.b);
-					float s = params.saturation + 1.0f;
-					if (s > 0) {
-						s *= s;
-					}
-					rgb.r = gray + (rgb.r - gray) * s;
-					rgb.g = gray + (rgb.g - gray) * s;
-					rgb.b = gray + (rgb.b - gray) * s;
-				}
-				if (v_lo >= 0) {
-					rgb.r *= v_lo;
-					rgb.g *= v_lo;
-					rgb.b *= v_lo;
-				} else if (v_hi >= 0) {
-					rgb.r = 1.0f - (1.0f - rgb.r) * v_hi;
-					rgb.g = 1.0f - (1.0f - rgb.g) * v_hi;
-					rgb.b = 1.0f - (1.0f - rgb.b) * v_hi;
-				}
-				d[x] = euclase::Float32RGBA(rgb.r, rgb.g, rgb.b, A);
-			}
-			progress((float)++rows / h);
-		}
-	}
-	return newimage;
+ColorCorrectionParams color_correction_params(FilterContext const *context)
+{
+	ColorCorrectionParams params;
+	params.hue = context->parameter("hue").toInt() / 360.f;
+	params.saturation = context->parameter("saturation").toInt() / 100.f;
+	params.brightness = context->parameter("brightness").toInt() / 100.f;
+	return params;
 }
 
 void MainWindow::colorCollection()
@@ -1922,15 +2895,51 @@ void MainWindow::colorCollection()
 	fc.setParameter("saturation", 0);
 	fc.setParameter("brightness", 0);
 	filterStart(std::move(fc), new FilterFormColorCorrection(this), [](FilterContext *context){
-		FilterStatus s(context->cancel_ptr(), context->progress_ptr());
-		ColorCorrectionParams params;
-		params.hue = context->parameter("hue").toInt() / 360.f;
-		params.saturation = context->parameter("saturation").toInt() / 100.f;
-		params.brightness = context->parameter("brightness").toInt() / 100.f;
-		return filter_color_correction(context->sourceImage(), params, &s);
+		PointOperation op = color_correction_operation(color_correction_params(context));
+		return TileFilter(0, [op](euclase::Image const &image, FilterStatus *status){
+			return op.apply(image, status);
+		});
 	});
 }
 
+PointOperation color_correction_adjustment(FilterContext *context)
+{
+	return color_correction_operation(color_correction_params(context));
+}
+
+/**
+ * @brief 色調補正の調整レイヤーを追加する
+ */
+void MainWindow::addColorCorrectionLayer()
+{
+	FilterContext fc;
+	fc.setParameter("hue", 0);
+	fc.setParameter("saturation", 0);
+	fc.setParameter("brightness", 0);
+	adjustmentStart(std::move(fc), new FilterFormColorCorrection(this), color_correction_adjustment);
+}
+
+/**
+ * @brief 現在の調整レイヤーを、保存してあるパラメータから編集し直す
+ */
+void MainWindow::editAdjustmentLayer()
+{
+	if (isFilterDialogActive()) return;
+	int index;
+	FilterContext fc;
+	{
+		std::lock_guard lock(mutexForCanvas());
+		Canvas::Layer const *layer = canvas()->current_layer();
+		if (!layer || !layer->isAdjustmentLayer()) return;
+		index = canvas()->currentLayerIndex();
+		for (auto const &[name, value] : layer->adjustment_parameters) {
+			fc.setParameter(name, value);
+		}
+	}
+	// 調整レイヤーは今のところ色調補正だけ
+	adjustmentStart(std::move(fc), new FilterFormColorCorrection(this), color_correction_adjustment, index);
+}
+
 void MainWindow::onUpdateDocumentInformation()
 {
 	Document const &doc = currentDocument();
@@ -5,12 +5,14 @@
 #include "Canvas.h"
 #include "Document.h"
 #include "SelectionOutline.h"
+#include "TileFilter.h"
 #include <QMainWindow>
 
 class Brush;
 
 class QToolButton;
 class FilterContext;
+class PointOperation;
 class MyToolButton;
 
 namespace Ui {
@@ -22,6 +24,9 @@ enum class Tool_ {
 	Brush,
 	EraserBrush,
 	Bounds,
+	Transform,
+	Fill,
+	MagicWand,
 };
 
 namespace tool {
@@ -87,10 +92,39 @@ public:
 	}
 };
 
+class TransformTool : public AbstractTool {
+public:
+	Tool_ id() const { return Tool_::Transform; }
+	bool on(MainWindow *mw, MouseButtonPress const &a);
+	bool on(MainWindow *mw, MouseMove const &a);
+	bool on(MainWindow *mw, MouseButtonRelease const &a);
+	void setupPropertyBar(MainWindow *mw);
+};
+
+class FillTool : public AbstractTool {
+private:
+	Tool_ kind = Tool_::Fill;
+public:
+	Tool_ id() const { return kind; }
+	bool on(MainWindow *mw, MouseButtonPress const &a);
+	bool on(MainWindow *mw, MouseMove const &a);
+	bool on(MainWindow *mw, MouseButtonRelease const &a);
+	void setupPropertyBar(MainWindow *mw);
+	bool isMagicWand() const { return kind == Tool_::MagicWand; }
+	static FillTool MagicWand()
+	{
+		FillTool ret;
+		ret.kind = Tool_::MagicWand;
+		return ret;
+	}
+};
+
 typedef std::variant<
 	ScrollTool,
 	BrushTool,
-	BoundsTool
+	BoundsTool,
+	TransformTool,
+	FillTool
 	> ToolVariant;
 
 } // namespace tool
@@ -115,6 +149,8 @@ class MainWindow : public QMainWindow {
 	friend class tool::ScrollTool;
 	friend class tool::BrushTool;
 	friend class tool::BoundsTool;
+	friend class tool::TransformTool;
+	friend class tool::FillTool;
 	friend class SetupPropertyBar;
 public:
 	enum RectHandle {
@@ -139,7 +175,8 @@ private:
 
 	void setImage(euclase::Image image, bool fitview);
 	void setImageFromBytes(QByteArray const &ba, bool fitview);
-	void setFilteredImage(const euclase::Image &image, bool apply);
+	std::vector<Canvas::Panel> runTileFilter(TileFilter const &filter, FilterStatus *status, QRect const &area = {}, int reduction = 1, TileSourceCache *cache = nullptr);
+	void setFilteredPanels(const std::vector<Canvas::Panel> &panels, bool apply);
 
 	enum class Operation {
 		PaintToCurrentLayer,
@@ -156,13 +193,14 @@ private:
 	void setColorHue(int value);
 	void setColorSaturation(int value);
 	void setColorValue(int value);
-	euclase::Image renderFilterTargetImage();
 	void onSelectionChanged();
 	euclase::Image selectedImage() const;
 	MainWindow::RectHandle rectHitTest(const QPoint &pt) const;
 	QPointF pointOnCanvas(int x, int y) const;
 	QPointF mapToCanvasFromViewport(const QPointF &pt) const;
 	QPointF mapToViewportFromCanvas(const QPointF &pt) const;
+	QRect visibleCanvasRect() const;
+	double viewScale() const;
 
 
 	void clearCanvas();
@@ -170,13 +208,21 @@ private:
 	bool isRectVisible() const;
 	QRect boundsRect() const;
 	void resetView(bool fitview);
-	void filterStart(FilterContext &&context, AbstractFilterForm *form, const std::function<euclase::Image (FilterContext *)> &fn);
+	void filterStart(FilterContext &&context, AbstractFilterForm *form, const std::function<TileFilter (FilterContext *)> &fn);
+	void adjustmentStart(FilterContext &&context, AbstractFilterForm *form, const std::function<PointOperation (FilterContext *)> &fn, int index = -1);
+	void setLayerAdjustment(int index, PointOperation const &op, std::map<QString, QVariant> const &parameters);
+	void taskStart(TaskFunction const &fn, std::function<void (std::vector<Canvas::Panel> const &panels)> const &apply, bool apply_when_finished = false, std::function<void ()> const &cancel = {});
+	std::vector<Canvas::Panel> scaleXBRZ(int factor, FilterStatus *status);
+	void setLayerPanels(QSize const &size, std::vector<Canvas::Panel> const &panels);
 	void filter_xBRZ(int factor);
+	void transformCanvas(std::function<void (Canvas *canvas)> const &fn);
 	void resetCurrentAlternateOption(Canvas::BlendMode blendmode = Canvas::BlendMode::Normal);
 	void applyCurrentAlternateLayer(bool lock = true);
 	int addNewLayer();
 	void setupBasicLayer(Canvas::Layer *layer);
 	void colorCollection();
+	void addColorCorrectionLayer();
+	void editAdjustmentLayer();
 	bool mouseMove_internal(int x, int y, bool leftbutton, bool set_cursor_only);
 	Canvas::RenderOption2 renderOption() const;
 	void setFilerDialogActive(bool active);
@@ -188,6 +234,21 @@ private:
 	void onBoundsStart();
 	void onBoundsMove(tool::MouseMove const &a);
 	void onBoundsEnd(tool::MouseButtonRelease const &a);
+	int transformHitTest(const QPoint &pt) const;
+	void beginTransform();
+	euclase::Homography transformHomography() const;
+	void requestTransformPreview(euclase::Warper::Interpolation interpolation, QRect const &clip);
+	void stopTransformPreview();
+	void runTransformPreview();
+	void onTransformPreviewFinished(unsigned int generation);
+	void setTransformPanels(std::vector<Canvas::Panel> const &panels);
+	void commitTransform();
+	void cancelTransform();
+	void onTransformStart();
+	void onTransformMove(tool::MouseMove const &a);
+	void onTransformEnd(tool::MouseButtonRelease const &a);
+	void fillAt(QPoint const &pt, bool contiguous);
+	void selectColorRangeAt(QPoint const &pt, bool contiguous);
 	void clearMainToolBar();
 	void clearPropertyBar();
 	void createMainToolBar();
@@ -206,8 +267,8 @@ public:
 	Canvas const *canvas() const;
 
 	void fitView();
-	Canvas::Panel renderToPanel(Canvas::InputLayerMode input_layer_mode, euclase::Image::Format format, QRect const &r, const QRect &maskrect, const Canvas::RenderOption &opt, bool *abort) const;
-	euclase::Image renderToImage(euclase::Image::Format format, QRect const &r, Canvas::RenderOption const &opt, bool *abort) const;
+	Canvas::Panel renderToPanel(Canvas::InputLayerMode input_layer_mode, euclase::Image::Format format, QRect const &r, const QRect &maskrect, const Canvas::RenderOption &opt, euclase::CancelToken const &abort) const;
+	euclase::Image renderToImage(euclase::Image::Format format, QRect const &r, Canvas::RenderOption const &opt, euclase::CancelToken const &abort) const;
 	QRect selectionRect() const;
 	void openFile(const QString &path);
 	int canvasWidth() const;
@@ -218,7 +279,7 @@ public:
 	void changeTool(tool::ToolVariant tool);
 	tool::ToolVariant currentTool() const;
 
-	SelectionOutline renderSelectionOutline(bool *abort);
+	SelectionOutline renderSelectionOutline(euclase::CancelToken const &abort);
 	void setColor(QColor primary_color, QColor secondary_color);
 	void updateToolCursor();
 public slots:
@@ -241,6 +302,10 @@ private slots:
 	void on_action_filter_minimize_triggered();
 	void on_action_filter_sepia_triggered();
 	void on_action_resize_triggered();
+	void on_action_rotate_cw_triggered();
+	void on_action_rotate_ccw_triggered();
+	void on_action_flip_horizontal_triggered();
+	void on_action_flip_vertical_triggered();
 	void on_action_trim_triggered();
 	void on_horizontalScrollBar_valueChanged(int value);
 	void on_verticalScrollBar_valueChanged(int value);
@@ -285,7 +350,7 @@ public:
 	euclase::Image::Format preferredImageFormat() const;
 	void updateImageView(const QRect &canvasrect); // canvasrect is in canvas coordinate
 	std::mutex &mutexForCanvas() const;
-	euclase::Image renderSelection(const QRect &r, bool *abort) const;
+	euclase::Image renderSelection(const QRect &r, euclase::CancelToken const &abort) const;
 	bool isFilterDialogActive() const;
 	Bounds::Type boundsType() const;
 	tool::AbstractTool *abstractTool(tool::ToolVariant tool);
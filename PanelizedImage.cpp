@@ -4,26 +4,54 @@
 
 
 
-PanelizedImage::Panel *PanelizedImage::findPanel_(const std::vector<Panel> *panels, const QPoint &offset)
+/**
+ * @brief PanelizedImage::setViewportSize
+ * @param size 表示領域のサイズ
+ *
+ * 表示領域を覆えるようにリングバッファの大きさを決める
+ * 大きさが変わったときは内容を破棄する
+ */
+void PanelizedImage::setViewportSize(QSize const &size)
 {
-	int lo = 0;
-	int hi = (int)panels->size(); // 上限の一つ後
-	while (lo < hi) {
-		int m = (lo + hi) / 2;
-		Panel const *p = &panels->at(m);
-		Q_ASSERT(p);
-		int i = misc::compareQPoint(p->offset, offset);
-		if (i == 0) return const_cast<Panel *>(p);
-		if (i < 0) {
-			lo = m + 1;
-		} else {
-			hi = m;
-		}
+	int cols = (size.width() + PANEL_SIZE - 1) / PANEL_SIZE + 2; // 両端に部分的にかかるパネルの分を足す
+	int rows = (size.height() + PANEL_SIZE - 1) / PANEL_SIZE + 2;
+	if (cols == ring_cols_ && rows == ring_rows_) return;
+	ring_cols_ = cols;
+	ring_rows_ = rows;
+	panels_.clear();
+	panels_.resize(cols * rows);
+}
+
+/**
+ * @brief PanelizedImage::panel_
+ * @param offset パネルの原点（PANEL_SIZEの倍数）
+ * @param create なければ作成する場合はtrue
+ * @return パネル。なければnullptr
+ *
+ * リングバッファからパネルを取得する
+ * スロットに別のパネルが入っているときは、createがtrueならそれを捨てて再利用する
+ */
+PanelizedImage::Panel *PanelizedImage::panel_(QPoint const &offset, bool create)
+{
+	auto Mod = [](int v, int n){
+		v %= n;
+		return v < 0 ? v + n : v;
+	};
+	const int tx = offset.x() / PANEL_SIZE; // offsetはPANEL_SIZEの倍数なので割り切れる
+	const int ty = offset.y() / PANEL_SIZE;
+	Panel *p = &panels_[Mod(ty, ring_rows_) * ring_cols_ + Mod(tx, ring_cols_)];
+	if (p->valid && p->offset == offset) return p;
+	if (!create) return nullptr;
+	if (p->image.isNull() || p->image.format() != format_) {
+		p->image = QImage(PANEL_SIZE, PANEL_SIZE, format_);
 	}
-	return nullptr;
+	p->image.fill(Qt::transparent);
+	p->offset = offset;
+	p->valid = true;
+	return p;
 }
 
-void PanelizedImage::paintImage(const QPoint &dstpos, const QImage &srcimg, QSize const &scale, QRect const &dstmask)
+void PanelizedImage::paintImage(const QPoint &dstpos, const QImage &srcimg, QSize const &scale, QRect const &dstmask, QPainter::CompositionMode mode)
 {
 	int panel_dx0 = dstpos.x() - offset_.x();
 	int panel_dy0 = dstpos.y() - offset_.y();
@@ -36,8 +64,6 @@ void PanelizedImage::paintImage(const QPoint &dstpos, const QImage &srcimg, QSiz
 	panel_dx1 &= ~S1;
 	panel_dy1 &= ~S1;
 
-	std::vector<Panel> newpanels;
-
 	int zx0 = dstmask.x();
 	int zy0 = dstmask.y();
 	int zx1 = dstmask.x() + dstmask.width();
@@ -85,30 +111,57 @@ void PanelizedImage::paintImage(const QPoint &dstpos, const QImage &srcimg, QSiz
 					sw = std::max(1, sx1 - sx0);
 					sh = std::max(1, sy1 - sy0);
 				}
-				Panel *dst = findPanel_(&panels_, {x, y});
-				if (!dst) { // なければ追加
-					newpanels.push_back({{x, y}, QImage(PANEL_SIZE, PANEL_SIZE, format_)});
-					dst = &newpanels.back();
-					dst->image.fill(Qt::transparent);
-				}
+				Panel *dst = panel_({x, y}, true);
 				{
 					QPainter pr(&dst->image);
+					pr.setCompositionMode(mode);
 					pr.drawImage(QRect(dx0, dy0, dw, dh), srcimg, QRect(sx0, sy0, sw, sh));
 				}
 			}
 		}
 	}
+}
+
+/**
+ * @brief PanelizedImage::putImage
+ * @param dstpos 描画先座標
+ * @param srcimg 描画する画像
+ *
+ * 画像を等倍でパネルへ転送する。合成はせずに画素をそのまま上書きする
+ */
+void PanelizedImage::putImage(QPoint const &dstpos, QImage const &srcimg)
+{
+	if (srcimg.format() != format_) { // 形式が異なるときは変換して描画
+		paintImage(dstpos, srcimg, srcimg.size(), {}, QPainter::CompositionMode_Source);
+		return;
+	}
 
-	panels_.insert(panels_.end(), newpanels.begin(), newpanels.end());
+	const int S1 = PANEL_SIZE - 1;
+	const int bpp = srcimg.depth() / 8;
+	QRect dstrect(dstpos - offset_, srcimg.size());
+	int panel_dx0 = dstrect.left() & ~S1;
+	int panel_dy0 = dstrect.top() & ~S1;
+	int panel_dx1 = dstrect.right() & ~S1;
+	int panel_dy1 = dstrect.bottom() & ~S1;
 
-	std::sort(panels_.begin(), panels_.end(), [&](Panel const &a, Panel const &b){ // offset でソート
-		return misc::compareQPoint(a.offset, b.offset) < 0;
-	});
+	for (int y = panel_dy0; y <= panel_dy1; y += PANEL_SIZE) {
+		for (int x = panel_dx0; x <= panel_dx1; x += PANEL_SIZE) {
+			QRect r = dstrect.intersected(QRect(x, y, PANEL_SIZE, PANEL_SIZE));
+			if (r.isEmpty()) continue;
+			Panel *dst = panel_({x, y}, true);
+			for (int i = 0; i < r.height(); i++) {
+				uint8_t const *s = srcimg.constScanLine(r.top() + i - dstrect.top()) + (r.left() - dstrect.left()) * bpp;
+				uint8_t *d = dst->image.scanLine(r.top() + i - y) + (r.left() - x) * bpp;
+				memcpy(d, s, r.width() * bpp);
+			}
+		}
+	}
 }
 
 void PanelizedImage::renderImage(QPainter *painter, const QPoint &dstpos, const QRect &srcrect) const
 {
 	for (Panel const &panel : panels_) {
+		if (!panel.valid) continue;
 		QRect r(0, 0, PANEL_SIZE, PANEL_SIZE);
 		int ox = offset().x() + panel.offset.x();
 		int oy = offset().y() + panel.offset.y();
@@ -2,8 +2,16 @@
 #define PANELIZEDIMAGE_H
 
 #include <QImage>
+#include <QPainter>
 #include "misc.h"
 
+/**
+ * @brief パネルに分割された画像
+ *
+ * パネルは固定サイズのスロットを環状に並べたリングバッファに格納する
+ * パネル(tx, ty)はスロット(tx mod cols, ty mod rows)に置かれるので、スクロールしても
+ * 表示中のパネルはそのまま残り、新たに見えるようになった端のパネルだけが入れ替わる
+ */
 class PanelizedImage {
 	friend class ImageViewWidget;
 private:
@@ -11,32 +19,31 @@ private:
 	public:
 		QPoint offset;
 		QImage image;
+		bool valid = false;
 		Panel() = default;
 		Panel(QPoint const &offset, QImage const &image)
 			: offset(offset)
 			, image(image)
+			, valid(true)
 		{
 		}
-		bool operator == (Panel const &t) const
-		{
-			return offset == t.offset;
-		}
-		bool operator < (Panel const &t) const
-		{
-			return misc::compareQPoint(offset, t.offset) < 0;
-		}
 	};
 	static constexpr int PANEL_SIZE = 256; // must be power of two
+	static constexpr int DEFAULT_RING_SIZE = 8;
 	QPoint offset_;
-	QImage::Format format_ = QImage::Format_RGBA8888;
-	std::vector<Panel> panels_;
-	static Panel *findPanel_(std::vector<Panel> const *panels, QPoint const &offset);
+	QImage::Format format_ = QImage::Format_ARGB32_Premultiplied;
+	int ring_cols_ = DEFAULT_RING_SIZE;
+	int ring_rows_ = DEFAULT_RING_SIZE;
+	std::vector<Panel> panels_ = std::vector<Panel>(DEFAULT_RING_SIZE * DEFAULT_RING_SIZE); // リングバッファ
+	Panel *panel_(QPoint const &offset, bool create);
 public:
 	PanelizedImage() = default;
 	PanelizedImage &operator = (PanelizedImage &&t)
 	{
 		offset_ = t.offset_;
 		format_ = t.format_;
+		ring_cols_ = t.ring_cols_;
+		ring_rows_ = t.ring_rows_;
 		panels_ = std::move(t.panels_);
 		return *this;
 	}
@@ -54,9 +61,13 @@ public:
 	}
 	void clear()
 	{
-		panels_.clear();
+		for (Panel &panel : panels_) {
+			panel.valid = false; // 画像のメモリは再利用する
+		}
 	}
-	void paintImage(QPoint const &dstpos, QImage const &srcimg, const QSize &scale, const QRect &dstmask);
+	void setViewportSize(QSize const &size);
+	void paintImage(QPoint const &dstpos, QImage const &srcimg, const QSize &scale, const QRect &dstmask, QPainter::CompositionMode mode = QPainter::CompositionMode_SourceOver);
+	void putImage(QPoint const &dstpos, QImage const &srcimg);
 	void renderImage(QPainter *painter, QPoint const &dstpos, QRect const &srcrect) const;
 };
 
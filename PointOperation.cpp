@@ -0,0 +1,359 @@
+#include "PointOperation.h"
+#include "FilterStatus.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace {
+
+template <typename PIXEL> euclase::Image apply_(PointOperation const &op, euclase::Image const &image, FilterStatus *status)
+{
+	auto isInterrupted = [&](){
+		return status && status->cancel.canceled();
+	};
+	auto progress = [&](float v){
+		if (status && status->progress) {
+			*status->progress = v;
+		}
+	};
+	const int w = image.width();
+	const int h = image.height();
+	euclase::Image newimage(w, h, image.format());
+	std::atomic_int rows = 0;
+#pragma omp parallel for schedule(static, 8)
+	for (int y = 0; y < h; y++) {
+		if (isInterrupted()) continue;
+		PIXEL const *s = (PIXEL const *)image.scanLine(y);
+		PIXEL *d = (PIXEL *)newimage.scanLine(y);
+		std::vector<euclase::Float32RGB> row(w);
+		for (int x = 0; x < w; x++) {
+			euclase::Float32RGBA p(s[x]);
+			row[x] = euclase::Float32RGB(p.r, p.g, p.b);
+		}
+		op.apply(row.data(), w);
+		for (int x = 0; x < w; x++) {
+			d[x] = PIXEL(euclase::Float32RGBA(row[x].r, row[x].g, row[x].b, euclase::Float32RGBA(s[x]).a));
+		}
+		progress((float)++rows / h);
+	}
+	if (isInterrupted()) return {};
+	return newimage;
+}
+
+} // namespace
+
+/**
+ * @brief PointOperation::lookupCurve
+ * @param curve 1次元LUT
+ * @param v 入力値
+ * @return 隣り合う2要素を線形補間した値。0〜1の外は端の傾きで延長する
+ */
+float PointOperation::lookupCurve(std::vector<float> const &curve, float v)
+{
+	float t = v * (CURVE_SIZE - 1);
+	int i = std::max(0, std::min(CURVE_SIZE - 2, (int)floorf(t)));
+	float f = t - i;
+	return curve[i] + (curve[i + 1] - curve[i]) * f;
+}
+
+/**
+ * @brief PointOperation::lookupCube
+ * @param rgb 入力値
+ * @return 3次元LUTを三線形補間した値
+ *
+ * 0〜1の外（HDRなど）は切り詰めずに、LUTに畳み込む前の変換を順に適用して求める
+ */
+euclase::Float32RGB PointOperation::lookupCube(euclase::Float32RGB const &rgb) const
+{
+	auto inside = [](float v){
+		return v >= 0.0f && v <= 1.0f;
+	};
+	if (!inside(rgb.r) || !inside(rgb.g) || !inside(rgb.b)) {
+		euclase::Float32RGB t = rgb;
+		for (auto const &fn : chain_) {
+			t = fn(t);
+		}
+		return t;
+	}
+
+	const int S = CUBE_SIZE;
+	auto index = [](float v, int *i, float *f){
+		float t = std::max(0.0f, std::min(1.0f, v)) * (S - 1);
+		*i = std::min((int)t, S - 2);
+		*f = t - *i;
+	};
+	int ir, ig, ib;
+	float fr, fg, fb;
+	index(rgb.r, &ir, &fr);
+	index(rgb.g, &ig, &fg);
+	index(rgb.b, &ib, &fb);
+	euclase::Float32RGB const *p = &cube_[(ib * S + ig) * S + ir];
+	auto lerp = [](euclase::Float32RGB const &a, euclase::Float32RGB const &b, float t){
+		return euclase::Float32RGB(a.r + (b.r - a.r) * t, a.g + (b.g - a.g) * t, a.b + (b.b - a.b) * t);
+	};
+	euclase::Float32RGB c00 = lerp(p[0], p[1], fr);
+	euclase::Float32RGB c01 = lerp(p[S], p[S + 1], fr);
+	euclase::Float32RGB c10 = lerp(p[S * S], p[S * S + 1], fr);
+	euclase::Float32RGB c11 = lerp(p[S * S + S], p[S * S + S + 1], fr);
+	return lerp(lerp(c00, c01, fg), lerp(c10, c11, fg), fb);
+}
+
+bool PointOperation::isIdentity() const
+{
+	for (int c = 0; c < 3; c++) {
+		if (!pre_[c].empty() || !post_[c].empty()) return false;
+	}
+	return cube_.empty();
+}
+
+/**
+ * @brief チャンネルごとのトーンカーブを繋ぐ
+ * @param fn チャンネル（0:R 1:G 2:B）と入力値から出力値を返す関数
+ */
+PointOperation &PointOperation::curve(std::function<float (int channel, float v)> const &fn)
+{
+	std::vector<float> *curves = cube_.empty() ? pre_ : post_;
+	for (int c = 0; c < 3; c++) {
+		std::vector<float> &t = curves[c];
+		if (t.empty()) {
+			t.resize(CURVE_SIZE);
+			for (int i = 0; i < CURVE_SIZE; i++) {
+				t[i] = (float)i / (CURVE_SIZE - 1);
+			}
+		}
+		for (int i = 0; i < CURVE_SIZE; i++) {
+			t[i] = fn(c, t[i]);
+		}
+	}
+	return *this;
+}
+
+/**
+ * @brief チャンネルをまたぐ色の変換を繋ぐ
+ * @param fn 変換
+ *
+ * 後のカーブがあれば3次元LUTに畳み込んでから、格子点ごとに変換を適用する
+ */
+PointOperation &PointOperation::transform(std::function<euclase::Float32RGB (euclase::Float32RGB const &rgb)> const &fn)
+{
+	const int S = CUBE_SIZE;
+	if (cube_.empty()) {
+		cube_.resize(S * S * S);
+		for (int b = 0; b < S; b++) {
+			for (int g = 0; g < S; g++) {
+				for (int r = 0; r < S; r++) {
+					cube_[(b * S + g) * S + r] = euclase::Float32RGB((float)r / (S - 1), (float)g / (S - 1), (float)b / (S - 1));
+				}
+			}
+		}
+	}
+	for (euclase::Float32RGB &p : cube_) {
+		if (!post_[0].empty()) {
+			p.r = lookupCurve(post_[0], p.r);
+			p.g = lookupCurve(post_[1], p.g);
+			p.b = lookupCurve(post_[2], p.b);
+		}
+		p = fn(p);
+	}
+	if (!post_[0].empty()) {
+		chain_.push_back([r = post_[0], g = post_[1], b = post_[2]](euclase::Float32RGB const &rgb){
+			return euclase::Float32RGB(lookupCurve(r, rgb.r), lookupCurve(g, rgb.g), lookupCurve(b, rgb.b));
+		});
+	}
+	chain_.push_back(fn);
+	for (int c = 0; c < 3; c++) {
+		post_[c].clear();
+	}
+	return *this;
+}
+
+/**
+ * @brief 別の点演算を繋ぐ
+ * @param op 後に適用する点演算
+ */
+PointOperation &PointOperation::then(PointOperation const &op)
+{
+	if (!op.pre_[0].empty()) {
+		curve([&](int c, float v){
+			return lookupCurve(op.pre_[c], v);
+		});
+	}
+	if (!op.cube_.empty()) {
+		transform([chain = op.chain_](euclase::Float32RGB const &rgb){ // LUTの範囲外でも使うので、参照ではなく複製を持つ
+			euclase::Float32RGB t = rgb;
+			for (auto const &fn : chain) {
+				t = fn(t);
+			}
+			return t;
+		});
+	}
+	if (!op.post_[0].empty()) {
+		curve([&](int c, float v){
+			return lookupCurve(op.post_[c], v);
+		});
+	}
+	return *this;
+}
+
+euclase::Float32RGB PointOperation::apply(euclase::Float32RGB const &rgb) const
+{
+	euclase::Float32RGB t = rgb;
+	apply(&t, 1);
+	return t;
+}
+
+/**
+ * @brief 画素の列をまとめて変換する
+ * @param rgb 画素の列。変換した値で上書きする
+ * @param n 画素の数
+ *
+ * 段（前のカーブ、3次元LUT、後のカーブ）ごとに列を走査するので、段の有無の判定は列ごとに1回で済む
+ */
+void PointOperation::apply(euclase::Float32RGB *rgb, int n) const
+{
+	auto curves = [&](std::vector<float> const *curve){
+		for (int i = 0; i < n; i++) {
+			rgb[i] = euclase::Float32RGB(lookupCurve(curve[0], rgb[i].r), lookupCurve(curve[1], rgb[i].g), lookupCurve(curve[2], rgb[i].b));
+		}
+	};
+	if (!pre_[0].empty()) {
+		curves(pre_);
+	}
+	if (!cube_.empty()) {
+		for (int i = 0; i < n; i++) {
+			rgb[i] = lookupCube(rgb[i]);
+		}
+	}
+	if (!post_[0].empty()) {
+		curves(post_);
+	}
+}
+
+/**
+ * @brief 画像に適用する
+ * @param image 画像
+ * @param status 中断と進捗
+ * @return 変換した画像。アルファはそのまま
+ */
+euclase::Image PointOperation::apply(euclase::Image const &image, FilterStatus *status) const
+{
+	if (image.memtype() != euclase::Image::Host) {
+		return apply(image.toHost(), status);
+	}
+	switch (image.format()) {
+	case euclase::Image::Format_F32_RGBA:
+		return apply_<euclase::Float32RGBA>(*this, image, status);
+	case euclase::Image::Format_F16_RGBA:
+		return apply_<euclase::Float16RGBA>(*this, image, status);
+	}
+	euclase::Image newimage = apply(image.convertToFormat(euclase::Image::Format_F32_RGBA), status);
+	return newimage ? newimage.convertToFormat(image.format()) : newimage;
+}
+
+/**
+ * @brief セピア調
+ */
+PointOperation PointOperation::sepia()
+{
+	PointOperation op;
+	op.curve([](int c, float v){
+		switch (c) {
+		case 0: return powf(v, 0.62f) * 0.80392156f + 0.07450980f;
+		case 1: return v * 0.71372549f + 0.06666666f;
+		}
+		return powf(v, 1.16f) * 0.61176470f + 0.08235294f;
+	});
+	return op;
+}
+
+/**
+ * @brief 明るさ
+ * @param amount -1〜1。負なら暗く、正なら明るくする
+ */
+PointOperation PointOperation::brightness(float amount)
+{
+	PointOperation op;
+	if (amount < 0) {
+		float t = 1.0f + amount;
+		t *= t;
+		op.curve([t](int, float v){
+			return v * t;
+		});
+	} else if (amount > 0) {
+		float t = sqrtf(1.0f - amount);
+		op.curve([t](int, float v){
+			return 1.0f - (1.0f - v) * t;
+		});
+	}
+	return op;
+}
+
+/**
+ * @brief ガンマ補正
+ * @param gamma 1より大きければ中間調を明るくする
+ */
+PointOperation PointOperation::gamma(float gamma)
+{
+	PointOperation op;
+	if (gamma > 0 && gamma != 1) {
+		op.curve([gamma](int, float v){
+			return powf(v, 1.0f / gamma);
+		});
+	}
+	return op;
+}
+
+/**
+ * @brief レベル補正
+ * @param black 黒にする入力値
+ * @param white 白にする入力値
+ * @param gamma 中間調のガンマ
+ */
+PointOperation PointOperation::levels(float black, float white, float gamma)
+{
+	PointOperation op;
+	if (white <= black) return op;
+	op.curve([=](int, float v){
+		float t = std::max(0.0f, std::min(1.0f, (v - black) / (white - black)));
+		return gamma > 0 && gamma != 1 ? powf(t, 1.0f / gamma) : t;
+	});
+	return op;
+}
+
+/**
+ * @brief 色相の回転
+ * @param amount 回転量（1で1周）
+ */
+PointOperation PointOperation::hue(float amount)
+{
+	PointOperation op;
+	if (amount != 0) {
+		op.transform([amount](euclase::Float32RGB const &rgb){
+			auto hsv = euclase::rgb_to_hsv(rgb);
+			hsv.h = hsv.h + amount;
+			return euclase::hsv_to_rgb(hsv);
+		});
+	}
+	return op;
+}
+
+/**
+ * @brief 彩度
+ * @param amount -1〜1。-1で灰色になる
+ */
+PointOperation PointOperation::saturation(float amount)
+{
+	PointOperation op;
+	if (amount != 0) {
+		float s = amount + 1.0f;
+		if (s > 0) {
+			s *= s;
+		}
+		op.transform([s](euclase::Float32RGB const &rgb){
+			float gray = euclase::grayf(rgb.r, rgb.g, rgb.b);
+			return euclase::Float32RGB(gray + (rgb.r - gray) * s, gray + (rgb.g - gray) * s, gray + (rgb.b - gray) * s);
+		});
+	}
+	return op;
+}
@@ -0,0 +1,45 @@
+#ifndef POINTOPERATION_H
+#define POINTOPERATION_H
+
+#include "euclase.h"
+#include <functional>
+#include <vector>
+
+struct FilterStatus;
+
+/**
+ * @brief 画素ごとに独立した色の変換（点演算）
+ *
+ * チャンネルごとのトーンカーブは1次元のLUTに、チャンネルをまたぐ変換（色相・彩度など）は3次元のLUTにまとめる
+ * 変換をいくつ繋いでも「前のカーブ→3次元LUT→後のカーブ」の形に畳み込まれるので、適用は画像を1回走査するだけで済む
+ */
+class PointOperation {
+public:
+	static constexpr int CURVE_SIZE = 4096; // 1次元LUTの要素数
+	static constexpr int CUBE_SIZE = 33; // 3次元LUTの1辺の格子点の数
+private:
+	std::vector<float> pre_[3]; // 3次元LUTの前に適用するカーブ。空なら恒等
+	std::vector<euclase::Float32RGB> cube_; // 空なら恒等
+	std::vector<std::function<euclase::Float32RGB (euclase::Float32RGB const &rgb)>> chain_; // 3次元LUTに畳み込んだ変換の列。LUTの範囲外の値はこれで計算する
+	std::vector<float> post_[3]; // 3次元LUTの後に適用するカーブ。空なら恒等
+	static float lookupCurve(std::vector<float> const &curve, float v);
+	euclase::Float32RGB lookupCube(euclase::Float32RGB const &rgb) const;
+public:
+	bool isIdentity() const;
+	PointOperation &curve(std::function<float (int channel, float v)> const &fn);
+	PointOperation &transform(std::function<euclase::Float32RGB (euclase::Float32RGB const &rgb)> const &fn);
+	PointOperation &then(PointOperation const &op);
+
+	euclase::Float32RGB apply(euclase::Float32RGB const &rgb) const;
+	void apply(euclase::Float32RGB *rgb, int n) const;
+	euclase::Image apply(euclase::Image const &image, FilterStatus *status) const;
+
+	static PointOperation sepia();
+	static PointOperation brightness(float amount);
+	static PointOperation gamma(float gamma);
+	static PointOperation levels(float black, float white, float gamma = 1);
+	static PointOperation hue(float amount);
+	static PointOperation saturation(float amount);
+};
+
+#endif // POINTOPERATION_H
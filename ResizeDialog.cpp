@@ -40,6 +40,7 @@ euclase::EnlargeMethod ResizeDialog::method() const
 {
 	if (ui->radioButton_bilinear->isChecked()) return euclase::EnlargeMethod::Bilinear;
 	if (ui->radioButton_bicubic->isChecked()) return euclase::EnlargeMethod::Bicubic;
+	if (ui->radioButton_lanczos3->isChecked()) return euclase::EnlargeMethod::Lanczos3;
 	return euclase::EnlargeMethod::NearestNeighbor;
 }
 
@@ -0,0 +1,117 @@
+#include "SelectionOutline.h"
+#include <unordered_map>
+
+/**
+ * @brief SelectionOutline::traceSegments
+ * @param bits 選択範囲のマスク（8ビットグレースケール）
+ * @param stride 1行のバイト数
+ * @param w 幅
+ * @param h 高さ
+ * @param org マスクの原点（キャンバス座標系）
+ * @param out 輪郭の線分
+ *
+ * マーチングスクエア法で選択範囲の境界を線分として抽出する
+ * 隣接する画素の中心4点を1つのセルとし、セルの辺上の中点を結ぶ
+ * 線分は向きを揃えてあり、あるセルの終点は隣のセルの始点になる
+ */
+void SelectionOutline::traceSegments(uint8_t const *bits, int stride, int w, int h, QPoint const &org, std::vector<Segment> *out)
+{
+	for (int cy = 0; cy + 1 < h; cy++) {
+		uint8_t const *s0 = bits + stride * cy;
+		uint8_t const *s1 = s0 + stride;
+		for (int cx = 0; cx + 1 < w; cx++) {
+			// 四隅（時計回り：左上、右上、右下、左下）
+			const bool in[4] = {
+				s0[cx] >= 128,
+				s0[cx + 1] >= 128,
+				s1[cx + 1] >= 128,
+				s1[cx] >= 128,
+			};
+			if (in[0] == in[1] && in[1] == in[2] && in[2] == in[3]) continue; // 境界なし
+
+			// 各辺の中点（上、右、下、左）
+			const int X = 2 * (org.x() + cx);
+			const int Y = 2 * (org.y() + cy);
+			const QPoint mid[4] = {
+				QPoint(X + 2, Y + 1),
+				QPoint(X + 3, Y + 2),
+				QPoint(X + 2, Y + 3),
+				QPoint(X + 1, Y + 2),
+			};
+
+			// 内側から外側へ出る辺を始点とし、反時計回りに直近の外側から内側へ入る辺を終点とする
+			for (int k = 0; k < 4; k++) {
+				if (in[k] && !in[(k + 1) & 3]) {
+					for (int j = 1; j < 4; j++) {
+						int e = (k - j) & 3;
+						if (!in[e] && in[(e + 1) & 3]) {
+							out->push_back({mid[k], mid[e]});
+							break;
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief SelectionOutline::buildPath
+ * @param segments 輪郭の線分
+ * @return キャンバス座標系のパス
+ *
+ * 線分をつないで折れ線にする。一直線に並ぶ頂点はまとめる
+ */
+QPainterPath SelectionOutline::buildPath(std::vector<Segment> const &segments)
+{
+	auto Key = [](QPoint const &pt){
+		return ((uint64_t)(uint32_t)pt.x() << 32) | (uint32_t)pt.y();
+	};
+
+	std::unordered_map<uint64_t, size_t> map; // 始点 -> 線分
+	map.reserve(segments.size());
+	for (size_t i = 0; i < segments.size(); i++) {
+		map[Key(segments[i].from)] = i;
+	}
+
+	QPainterPath path;
+	std::vector<bool> used(segments.size());
+	std::vector<QPoint> points;
+	for (size_t i = 0; i < segments.size(); i++) {
+		if (used[i]) continue;
+
+		points.clear();
+		points.push_back(segments[i].from);
+		size_t cur = i;
+		bool closed = false;
+		while (1) {
+			used[cur] = true;
+			QPoint pt = segments[cur].to;
+			size_t n = points.size();
+			if (n >= 2) { // 直前の辺と同じ向きなら頂点を置き換える
+				QPoint d0 = points[n - 1] - points[n - 2];
+				QPoint d1 = pt - points[n - 1];
+				if (d0.x() * d1.y() == d0.y() * d1.x() && QPoint::dotProduct(d0, d1) > 0) {
+					points.pop_back();
+				}
+			}
+			points.push_back(pt);
+			auto it = map.find(Key(pt));
+			if (it == map.end()) break;
+			cur = it->second;
+			if (used[cur]) {
+				closed = (cur == i);
+				break;
+			}
+		}
+
+		path.moveTo(points[0].x() / 2.0, points[0].y() / 2.0);
+		for (size_t j = 1; j < points.size(); j++) {
+			path.lineTo(points[j].x() / 2.0, points[j].y() / 2.0);
+		}
+		if (closed) {
+			path.closeSubpath();
+		}
+	}
+	return path;
+}
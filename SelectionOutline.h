@@ -1,18 +1,31 @@
 #ifndef SELECTIONOUTLINE_H
 #define SELECTIONOUTLINE_H
 
-#include <QBitmap>
+#include <QMetaType>
+#include <QPainterPath>
+#include <cstdint>
+#include <vector>
 
+/**
+ * @brief 選択範囲の輪郭
+ *
+ * 輪郭はキャンバス座標系のパスとして保持し、表示時にビューポート座標系へ変換する
+ */
 class SelectionOutline {
 public:
+	struct Segment { // 座標は2倍した値（画素の中心が奇数になる）
+		QPoint from;
+		QPoint to;
+	};
 	SelectionOutline() = default;
-	SelectionOutline(QPoint point, QBitmap const &bitmap)
-		: point(point)
-		, bitmap(bitmap)
+	explicit SelectionOutline(QPainterPath const &path)
+		: path(path)
 	{
 	}
-	QPoint point;
-	QBitmap bitmap;
+	QPainterPath path; // キャンバス座標系での輪郭
+
+	static void traceSegments(uint8_t const *bits, int stride, int w, int h, QPoint const &org, std::vector<Segment> *out);
+	static QPainterPath buildPath(std::vector<Segment> const &segments);
 };
 Q_DECLARE_METATYPE(SelectionOutline)
 
@@ -0,0 +1,82 @@
+#ifndef TILEFILTER_H
+#define TILEFILTER_H
+
+#include "euclase.h"
+#include <QRect>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+struct FilterStatus;
+
+/**
+ * @brief タイル単位で実行できるフィルタ
+ *
+ * fn はタイルの周囲を halo 画素広げた範囲の画像（F32_RGBA）を受け取り、同じ大きさの画像を返す
+ * 出力のうち周囲 halo 画素は捨てられるので、各画素の計算に必要な近傍がその範囲に収まるように halo を宣言する
+ * 近傍が局所的でないフィルタは whole() で作ると、タイルに分けずに範囲全体を1回で処理する
+ */
+struct TileFilter {
+	int halo = 0; // 参照する近傍の半径
+	bool untiled = false; // trueならタイルに分けない
+	std::function<euclase::Image (euclase::Image const &image, FilterStatus *status)> fn;
+	TileFilter() = default;
+	TileFilter(int halo, std::function<euclase::Image (euclase::Image const &image, FilterStatus *status)> fn)
+		: halo(halo)
+		, fn(fn)
+	{
+	}
+	static TileFilter whole(std::function<euclase::Image (euclase::Image const &image, FilterStatus *status)> fn)
+	{
+		TileFilter t(0, fn);
+		t.untiled = true;
+		return t;
+	}
+};
+
+/**
+ * @brief フィルタに渡すタイルの入力画像のキャッシュ
+ *
+ * パラメータを変えて実行し直すときに、キャンバスからの描画と縮小をやり直さないで済むようにする
+ * レイヤーの内容が変わったら clear() すること
+ */
+class TileSourceCache {
+private:
+	using Key = std::tuple<int, int, int, int, int>;
+	static constexpr size_t MAX_BYTES = size_t(512) << 20; // これを超えたら捨てる
+	std::mutex mutex_;
+	std::map<Key, euclase::Image> images_;
+	size_t bytes_ = 0;
+	static Key key(QRect const &rect, int reduction)
+	{
+		return {rect.x(), rect.y(), rect.width(), rect.height(), reduction};
+	}
+public:
+	euclase::Image find(QRect const &rect, int reduction)
+	{
+		std::lock_guard lock(mutex_);
+		auto it = images_.find(key(rect, reduction));
+		return it != images_.end() ? it->second : euclase::Image();
+	}
+	void insert(QRect const &rect, int reduction, euclase::Image const &image)
+	{
+		std::lock_guard lock(mutex_);
+		size_t n = image.bytesPerLine() * image.height();
+		if (bytes_ + n > MAX_BYTES) {
+			images_.clear();
+			bytes_ = 0;
+		}
+		if (images_.insert({key(rect, reduction), image}).second) {
+			bytes_ += n;
+		}
+	}
+	void clear()
+	{
+		std::lock_guard lock(mutex_);
+		images_.clear();
+		bytes_ = 0;
+	}
+};
+
+#endif // TILEFILTER_H
@@ -0,0 +1,133 @@
+#include "TileRegion.h"
+
+#include <algorithm>
+
+/**
+ * @brief TileRegion::TileRegion
+ * @param tile_size タイルの大きさ（2のべき乗）
+ */
+TileRegion::TileRegion(int tile_size)
+	: tile_size_(tile_size)
+{
+}
+
+/**
+ * @brief TileRegion::reserve
+ * @param cols 列数
+ * @param rows 行数
+ *
+ * 格子が足りなければ広げる。既存のビットは保持する
+ */
+void TileRegion::reserve(int cols, int rows)
+{
+	if (cols <= cols_ && rows <= rows_) return;
+	cols = std::max(cols, cols_);
+	rows = std::max(rows, rows_);
+	const int wpr = (cols + 63) / 64;
+	std::vector<uint64_t> bits(size_t(wpr) * rows);
+	for (int y = 0; y < rows_; y++) {
+		std::copy(bits_.begin() + size_t(words_per_row_) * y, bits_.begin() + size_t(words_per_row_) * (y + 1), bits.begin() + size_t(wpr) * y);
+	}
+	cols_ = cols;
+	rows_ = rows;
+	words_per_row_ = wpr;
+	bits_ = std::move(bits);
+}
+
+/**
+ * @brief TileRegion::clear
+ *
+ * 空にする。格子の大きさは保持する
+ */
+void TileRegion::clear()
+{
+	if (empty_) return;
+	std::fill(bits_.begin(), bits_.end(), 0);
+	empty_ = true;
+}
+
+/**
+ * @brief TileRegion::addRect
+ * @param rect キャンバス座標系の矩形
+ *
+ * 矩形に重なるタイルを追加する。負の座標は捨てる
+ */
+void TileRegion::addRect(QRect const &rect)
+{
+	QRect r = rect.intersected(QRect(0, 0, 1 << 30, 1 << 30));
+	if (r.isEmpty()) return;
+	const int c0 = r.left() / tile_size_;
+	const int r0 = r.top() / tile_size_;
+	const int c1 = r.right() / tile_size_;
+	const int r1 = r.bottom() / tile_size_;
+	reserve(c1 + 1, r1 + 1);
+	for (int y = r0; y <= r1; y++) {
+		uint64_t *row = &bits_[size_t(words_per_row_) * y];
+		for (int w = c0 / 64; w <= c1 / 64; w++) {
+			const int b0 = std::max(c0 - w * 64, 0);
+			const int b1 = std::min(c1 - w * 64, 63);
+			uint64_t mask = (b1 - b0 == 63) ? ~uint64_t(0) : (((uint64_t(1) << (b1 - b0 + 1)) - 1) << b0);
+			row[w] |= mask;
+		}
+	}
+	empty_ = false;
+}
+
+/**
+ * @brief TileRegion::unite
+ * @param other 追加する領域（タイルの大きさが同じであること）
+ */
+void TileRegion::unite(TileRegion const &other)
+{
+	if (other.empty_) return;
+	reserve(other.cols_, other.rows_);
+	for (int y = 0; y < other.rows_; y++) {
+		uint64_t const *src = &other.bits_[size_t(other.words_per_row_) * y];
+		uint64_t *dst = &bits_[size_t(words_per_row_) * y];
+		for (int w = 0; w < other.words_per_row_; w++) {
+			dst[w] |= src[w];
+		}
+	}
+	empty_ = false;
+}
+
+/**
+ * @brief TileRegion::contains
+ * @param col 列
+ * @param row 行
+ * @return タイルが含まれていればtrue
+ */
+bool TileRegion::contains(int col, int row) const
+{
+	if (col < 0 || row < 0 || col >= cols_ || row >= rows_) return false;
+	return (bits_[size_t(words_per_row_) * row + col / 64] >> (col % 64)) & 1;
+}
+
+/**
+ * @brief TileRegion::tiles
+ * @param area キャンバス座標系の範囲
+ * @return 範囲に重なる、含まれているタイルの矩形
+ */
+std::vector<QRect> TileRegion::tiles(QRect const &area) const
+{
+	std::vector<QRect> out;
+	QRect r = area.intersected(QRect(0, 0, cols_ * tile_size_, rows_ * tile_size_));
+	if (empty_ || r.isEmpty()) return out;
+	const int c0 = r.left() / tile_size_;
+	const int r0 = r.top() / tile_size_;
+	const int c1 = r.right() / tile_size_;
+	const int r1 = r.bottom() / tile_size_;
+	for (int y = r0; y <= r1; y++) {
+		uint64_t const *row = &bits_[size_t(words_per_row_) * y];
+		for (int w = c0 / 64; w <= c1 / 64; w++) {
+			uint64_t bits = row[w];
+			for (int b = 0; bits; b++, bits >>= 1) { // 空の語は読み飛ばす
+				if (!(bits & 1)) continue;
+				const int x = w * 64 + b;
+				if (x < c0 || x > c1) continue;
+				out.emplace_back(x * tile_size_, y * tile_size_, tile_size_, tile_size_);
+			}
+		}
+	}
+	return out;
+}
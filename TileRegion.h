@@ -0,0 +1,41 @@
+#ifndef TILEREGION_H
+#define TILEREGION_H
+
+#include <QRect>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief タイル単位の領域
+ *
+ * キャンバスをタイルの格子に分け、各タイルが含まれるかどうかをビットで持つ
+ * 矩形の追加は重なるタイルのビットを立てるだけなので、矩形がいくつ来ても大きくならない
+ */
+class TileRegion {
+private:
+	int tile_size_;
+	int cols_ = 0;
+	int rows_ = 0;
+	int words_per_row_ = 0;
+	std::vector<uint64_t> bits_;
+	bool empty_ = true;
+	void reserve(int cols, int rows);
+public:
+	explicit TileRegion(int tile_size);
+
+	int tileSize() const
+	{
+		return tile_size_;
+	}
+	bool isEmpty() const
+	{
+		return empty_;
+	}
+	void clear();
+	void addRect(QRect const &rect);
+	void unite(TileRegion const &other);
+	bool contains(int col, int row) const;
+	std::vector<QRect> tiles(QRect const &area) const;
+};
+
+#endif // TILEREGION_H
@@ -0,0 +1,206 @@
+#include "TileScheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+struct TileScheduler::Worker {
+	std::mutex mutex;
+	std::deque<Task> queue; // 先頭ほど優先度が高い
+	std::thread thread;
+};
+
+struct TileScheduler::Private {
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::mutex run_mutex; // run() の多重呼び出しを防ぐ
+	std::mutex mutex;
+	std::condition_variable cond; // ワーカーを起こす
+	std::condition_variable done_cond; // 全タスクの完了を通知する
+	int queued = 0; // キューに積まれているタスクの数
+	int pending = 0; // 完了していないタスクの数
+	bool quit = false;
+	std::function<bool ()> canceled;
+};
+
+/**
+ * @brief TileScheduler::TileScheduler
+ * @param threads スレッド数。0ならハードウェアのスレッド数
+ */
+TileScheduler::TileScheduler(int threads)
+	: m(new Private)
+{
+	if (threads < 1) {
+		threads = (int)std::thread::hardware_concurrency();
+		if (threads < 1) threads = 1;
+	}
+	for (int i = 0; i < threads; i++) {
+		m->workers.push_back(std::make_unique<Worker>());
+	}
+	for (int i = 0; i < threads; i++) {
+		m->workers[i]->thread = std::thread([this, i](){
+			runWorker(i);
+		});
+	}
+}
+
+TileScheduler::~TileScheduler()
+{
+	{
+		std::lock_guard lock(m->mutex);
+		m->quit = true;
+		m->cond.notify_all();
+	}
+	for (auto &worker : m->workers) {
+		if (worker->thread.joinable()) {
+			worker->thread.join();
+		}
+	}
+	delete m;
+}
+
+/**
+ * @brief TileScheduler::threadCount
+ * @return ワーカースレッドの数
+ */
+int TileScheduler::threadCount() const
+{
+	return (int)m->workers.size();
+}
+
+/**
+ * @brief TileScheduler::pop
+ * @param worker 自スレッドのワーカー
+ * @param out 取り出したタスク
+ * @return 取り出せたらtrue
+ *
+ * 自スレッドのキューから最も優先度の高いタスクを取り出す
+ */
+bool TileScheduler::pop(Worker *worker, Task *out)
+{
+	std::lock_guard lock(worker->mutex);
+	if (worker->queue.empty()) return false;
+	*out = std::move(worker->queue.front());
+	worker->queue.pop_front();
+	return true;
+}
+
+/**
+ * @brief TileScheduler::steal
+ * @param self 自スレッドの番号
+ * @param out 盗んだタスク
+ * @return 盗めたらtrue
+ *
+ * 他のスレッドのキューの中から最も優先度の高いタスクを盗む
+ */
+bool TileScheduler::steal(int self, Task *out)
+{
+	const int n = threadCount();
+	while (1) {
+		Worker *victim = nullptr;
+		bool contended = false;
+		std::vector<std::unique_lock<std::mutex>> locks;
+		for (int i = 1; i < n; i++) {
+			Worker *w = m->workers[(self + i) % n].get();
+			std::unique_lock lock(w->mutex, std::try_to_lock);
+			if (!lock.owns_lock()) { // 競合しているキューは後回し
+				contended = true;
+				continue;
+			}
+			if (w->queue.empty()) continue;
+			if (!victim || w->queue.front() < victim->queue.front()) {
+				victim = w;
+			}
+			locks.push_back(std::move(lock));
+		}
+		if (victim) {
+			*out = std::move(victim->queue.front());
+			victim->queue.pop_front();
+			return true;
+		}
+		if (!contended) return false; // すべてのキューが空
+		{
+			std::lock_guard lock(m->mutex);
+			if (m->queued <= 0) return false;
+		}
+		locks.clear();
+		std::this_thread::yield();
+	}
+}
+
+/**
+ * @brief TileScheduler::runWorker
+ * @param index スレッドの番号
+ *
+ * ワーカースレッドの処理
+ */
+void TileScheduler::runWorker(int index)
+{
+	Worker *worker = m->workers[index].get();
+	while (1) {
+		Task task;
+		if (pop(worker, &task) || steal(index, &task)) {
+			{
+				std::lock_guard lock(m->mutex);
+				m->queued--;
+			}
+			bool canceled = m->canceled && m->canceled(); // m->canceled はこのタスクが完了するまで変更されない
+			if (!canceled && task.fn) { // キャンセルされていたら実行せずに捨てる
+				task.fn();
+			}
+			{
+				std::lock_guard lock(m->mutex);
+				m->pending--;
+				if (m->pending == 0) {
+					m->done_cond.notify_all();
+				}
+			}
+			continue;
+		}
+		std::unique_lock lock(m->mutex);
+		m->cond.wait(lock, [&](){ return m->quit || m->queued > 0; });
+		if (m->quit) return;
+	}
+}
+
+/**
+ * @brief TileScheduler::run
+ * @param tasks タスク
+ * @param canceled キャンセルされたらtrueを返す関数
+ *
+ * タスクを優先度順に各スレッドへ振り分けて実行し、すべて終わるまで待つ
+ * キャンセルされた後は、未着手のタスクは実行せずに破棄する
+ */
+void TileScheduler::run(std::vector<Task> &&tasks, std::function<bool ()> const &canceled)
+{
+	if (tasks.empty()) return;
+
+	std::lock_guard run_lock(m->run_mutex);
+
+	std::stable_sort(tasks.begin(), tasks.end());
+
+	const int n = threadCount();
+	{
+		std::lock_guard lock(m->mutex);
+		m->canceled = canceled;
+		m->pending = (int)tasks.size();
+		m->queued += (int)tasks.size();
+	}
+
+	// 優先度の高いタスクが各スレッドの先頭に来るように順番に配る
+	for (int i = 0; i < n; i++) {
+		Worker *w = m->workers[i].get();
+		std::lock_guard lock(w->mutex);
+		for (size_t j = i; j < tasks.size(); j += n) {
+			w->queue.push_back(std::move(tasks[j]));
+		}
+	}
+
+	std::unique_lock lock(m->mutex);
+	m->cond.notify_all();
+	m->done_cond.wait(lock, [&](){ return m->pending == 0; });
+	m->canceled = {};
+}
@@ -0,0 +1,55 @@
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include <functional>
+#include <vector>
+
+/**
+ * @brief タイル単位の処理を並列実行するスケジューラ
+ *
+ * スレッドごとにタスクの両端キューを持ち、手が空いたスレッドは他のスレッドからタスクを盗む（ワークスティーリング）
+ * タスクは優先度の高い順に実行される
+ */
+class TileScheduler {
+public:
+	enum class Priority {
+		Visible, // 表示中の領域
+		Prefetch, // 先読み
+	};
+
+	struct Task {
+		std::function<void()> fn;
+		Priority priority = Priority::Visible;
+		double distance = 0; // 基準点（マウスカーソルなど）からの距離。小さいほど先に実行する
+		Task() = default;
+		Task(std::function<void()> fn, Priority priority, double distance)
+			: fn(fn)
+			, priority(priority)
+			, distance(distance)
+		{
+		}
+		bool operator < (Task const &t) const
+		{
+			if (priority != t.priority) return priority < t.priority;
+			return distance < t.distance;
+		}
+	};
+private:
+	struct Private;
+	Private *m;
+	struct Worker;
+	bool pop(Worker *worker, Task *out);
+	bool steal(int self, Task *out);
+	void runWorker(int index);
+public:
+	explicit TileScheduler(int threads = 0);
+	~TileScheduler();
+	TileScheduler(TileScheduler const &) = delete;
+	void operator = (TileScheduler const &) = delete;
+
+	int threadCount() const;
+
+	void run(std::vector<Task> &&tasks, std::function<bool ()> const &canceled);
+};
+
+#endif // TILESCHEDULER_H
@@ -1,24 +1,150 @@
 #include "antialias.h"
 #include "euclase.h"
 
-#include <QImage>
 #include <stdint.h>
-#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 #include <QDebug>
 
 namespace {
 
-class AntialiasRW {
-public:
-	virtual void reader(int line, uint8_t *out) = 0;
-	virtual void writer(int pos, uint8_t v) = 0;
+/**
+ * @brief 値の型ごとの計算
+ *
+ * 8ビットでは従来どおり整数で計算する
+ */
+template <typename T> struct AntialiasValue;
+
+template <> struct AntialiasValue<uint8_t> {
+	static uint8_t gray()
+	{
+		return 128;
+	}
+	static bool differs(uint8_t a, uint8_t b)
+	{
+		return a != b;
+	}
+	static uint8_t middle(uint8_t a, uint8_t b)
+	{
+		return (a + b) / 2;
+	}
+	static uint8_t blend(uint8_t a, uint8_t b, int i, int n)
+	{
+		return a + (b - a) * i / n;
+	}
+};
+
+template <> struct AntialiasValue<float> {
+	static float gray()
+	{
+		return 0.5f;
+	}
+	static bool differs(float a, float b)
+	{
+		return fabsf(a - b) >= 0.5f / 255; // 8ビットで同じ値になる差は段差とみなさない
+	}
+	static float middle(float a, float b)
+	{
+		return (a + b) / 2;
+	}
+	static float blend(float a, float b, int i, int n)
+	{
+		return a + (b - a) * i / n;
+	}
+};
+
+/**
+ * @brief 画素の型ごとのチャンネルの読み書き
+ */
+template <typename PIXEL> struct AntialiasTraits;
+
+template <> struct AntialiasTraits<euclase::OctetGray> {
+	using value_t = uint8_t;
+	static constexpr int CHANNELS = 1;
+	static constexpr bool HAS_ALPHA = false;
+	static bool opaque(euclase::OctetGray const & /*p*/)
+	{
+		return true;
+	}
+	static uint8_t get(euclase::OctetGray const &p, int /*c*/)
+	{
+		return p.v;
+	}
+	static void set(euclase::OctetGray *p, int /*c*/, uint8_t v)
+	{
+		p->v = v;
+	}
+};
+
+template <> struct AntialiasTraits<euclase::OctetRGBA> {
+	using value_t = uint8_t;
+	static constexpr int CHANNELS = 3;
+	static constexpr bool HAS_ALPHA = true;
+	static bool opaque(euclase::OctetRGBA const &p)
+	{
+		return p.a != 0;
+	}
+	static uint8_t get(euclase::OctetRGBA const &p, int c)
+	{
+		return c == 0 ? p.r : (c == 1 ? p.g : p.b);
+	}
+	static void set(euclase::OctetRGBA *p, int c, uint8_t v)
+	{
+		(c == 0 ? p->r : (c == 1 ? p->g : p->b)) = v;
+	}
+};
+
+template <> struct AntialiasTraits<euclase::Float32RGBA> {
+	using value_t = float;
+	static constexpr int CHANNELS = 3;
+	static constexpr bool HAS_ALPHA = true;
+	static bool opaque(euclase::Float32RGBA const &p)
+	{
+		return p.a > 0;
+	}
+	static float get(euclase::Float32RGBA const &p, int c)
+	{
+		return c == 0 ? p.r : (c == 1 ? p.g : p.b);
+	}
+	static void set(euclase::Float32RGBA *p, int c, float v)
+	{
+		(c == 0 ? p->r : (c == 1 ? p->g : p->b)) = v;
+	}
 };
 
-void filter3(int length, uint8_t *line0, uint8_t *line1, uint8_t *line2, AntialiasRW *rw)
+template <> struct AntialiasTraits<euclase::Float16RGBA> {
+	using value_t = float;
+	static constexpr int CHANNELS = 3;
+	static constexpr bool HAS_ALPHA = true;
+	static bool opaque(euclase::Float16RGBA const &p)
+	{
+		return (float)p.a > 0;
+	}
+	static float get(euclase::Float16RGBA const &p, int c)
+	{
+		return c == 0 ? p.r : (c == 1 ? p.g : p.b);
+	}
+	static void set(euclase::Float16RGBA *p, int c, float v)
+	{
+		(c == 0 ? p->r : (c == 1 ? p->g : p->b)) = v;
+	}
+};
+
+/**
+ * @brief 1ライン分の段差を滑らかにする
+ * @param length ラインの長さ
+ * @param line0 前のライン
+ * @param line1 処理するライン
+ * @param line2 次のライン
+ * @param out 出力先（line1 と同じ位置のライン）
+ */
+template <typename T> void filter3(int length, T const *line0, T const *line1, T const *line2, T *out)
 {
+	using V = AntialiasValue<T>;
 	for (int pos = 0; pos + 1 < length; pos++) {
-		if (line1[pos] != line1[pos + 1]) {
-			int a = (line1[pos] + line1[pos + 1]) / 2;
+		if (V::differs(line1[pos], line1[pos + 1])) {
+			T a = V::middle(line1[pos], line1[pos + 1]);
 			int n1 = 0;
 			int n2 = 0;
 			if (line1[pos] < a) {
@@ -54,16 +180,16 @@ void filter3(int length, uint8_t *line0, uint8_t *line1, uint8_t *line2, Antiali
 			}
 			n1 /= 2;
 			if (n1 > 0) {
-				int b = line1[pos - n1];
+				T b = line1[pos - n1];
 				for (int i = 0; i < n1; i++) {
-					rw->writer(pos - i, a + (b - a) * (i + 1) / (n1 + 1));
+					out[pos - i] = V::blend(a, b, i + 1, n1 + 1);
 				}
 			}
 			n2 /= 2;
 			if (n2 > 0) {
-				int b = line1[pos + 1 + n2];
+				T b = line1[pos + 1 + n2];
 				for (int i = 0; i < n2; i++) {
-					rw->writer(pos + i + 1, a + (b - a) * (i + 1) / (n2 + 1));
+					out[pos + i + 1] = V::blend(a, b, i + 1, n2 + 1);
 				}
 			}
 			pos += n2;
@@ -71,221 +197,142 @@ void filter3(int length, uint8_t *line0, uint8_t *line1, uint8_t *line2, Antiali
 	}
 }
 
-class BasicAntialias {
-protected:
-	int width;
-	int height;
-	int row;
-	uint8_t *tmp0;
-	uint8_t *tmp1;
-	uint8_t *tmp2;
-	uint8_t **scanlines;
-
-	void filter2(int length, int rows, AntialiasRW *rw)
-	{
-		uint8_t *buf0 = tmp0;
-		uint8_t *buf1 = tmp1;
-		uint8_t *buf2 = tmp2;
-		rw->reader(0, buf0);
-		rw->reader(0, buf2);
-		for (row = 0; row < rows; row++) {
-			if (row > 0) {
-				std::swap(buf0, buf1);
-			}
-			if (row + 1 < rows) {
-				std::swap(buf1, buf2);
-				rw->reader(row + 1, buf2);
-			} else {
-				buf1 = buf2;
-			}
-			filter3(length, buf0, buf1, buf2, rw);
-			filter3(length, buf2, buf1, buf0, rw);
-		}
+/**
+ * @brief 水平方向の処理
+ * @param plane 1チャンネル分の画像
+ *
+ * 各行は処理前の前後の行だけを読んで自分の行だけに書き込むので、行ごとに並列に処理できる
+ */
+template <typename T> void filter_rows(std::vector<T> *plane, int width, int height)
+{
+	std::vector<T> const src = *plane;
+	T *dst = plane->data();
+#pragma omp parallel for schedule(static, 16)
+	for (int y = 0; y < height; y++) {
+		T const *line0 = &src[(size_t)width * std::max(0, y - 1)];
+		T const *line1 = &src[(size_t)width * y];
+		T const *line2 = &src[(size_t)width * std::min(height - 1, y + 1)];
+		T *out = dst + (size_t)width * y;
+		filter3(width, line0, line1, line2, out);
+		filter3(width, line2, line1, line0, out);
 	}
-};
+}
 
-class AntialiasGray8 : public BasicAntialias {
-private:
-	class RW_H : public AntialiasRW {
-	public:
-		AntialiasGray8 *a;
-		void reader(int line, uint8_t *out)
-		{
-			memcpy(out, a->scanlines[line], a->width);
-		}
-		void writer(int pos, uint8_t v)
-		{
-			a->scanlines[a->row][pos] = v;
-		}
-		RW_H(AntialiasGray8 *a)
-			: a(a)
-		{
-		}
-	};
-	class RW_V : public AntialiasRW {
-	public:
-		AntialiasGray8 *a;
-		void reader(int line, uint8_t *out)
-		{
-			for (int y = 0; y < a->height; y++) {
-				out[y] = a->scanlines[y][line];
+template <typename T> std::vector<T> transpose(std::vector<T> const &plane, int width, int height)
+{
+	const int B = 64;
+	std::vector<T> out(plane.size());
+#pragma omp parallel for schedule(static)
+	for (int y0 = 0; y0 < height; y0 += B) {
+		const int y1 = std::min(height, y0 + B);
+		for (int x0 = 0; x0 < width; x0 += B) {
+			const int x1 = std::min(width, x0 + B);
+			for (int y = y0; y < y1; y++) {
+				for (int x = x0; x < x1; x++) {
+					out[(size_t)height * x + y] = plane[(size_t)width * y + x];
+				}
 			}
 		}
-		void writer(int pos, uint8_t v)
-		{
-			a->scanlines[pos][a->row] = v;
-		}
-		RW_V(AntialiasGray8 *a)
-			: a(a)
-		{
-		}
-	};
-public:
-	void filter(euclase::Image *image)
-	{
-		width = image->width();
-		height = image->height();
-
-		int span = width > height ? width : height;
-		tmp0 = (uint8_t *)alloca(span);
-		tmp1 = (uint8_t *)alloca(span);
-		tmp2 = (uint8_t *)alloca(span);
-
-		scanlines = (uint8_t **)alloca(sizeof(uint8_t *) * height);
-		for (int y = 0; y < height; y++) {
-			scanlines[y] = (uint8_t *)image->scanLine(y);
-		}
-
-		RW_H rwh(this);
-		RW_V rwv(this);
-
-		filter2(width, height, &rwh);
-		filter2(height, width, &rwv);
 	}
-};
+	return out;
+}
 
-class AntialiasRGB888 : public BasicAntialias {
-public:
-	int plane;
-	class RW_H : public AntialiasRW {
-	public:
-		AntialiasRGB888 *a;
-		void reader(int line, uint8_t *out)
-		{
-			uint8_t const *src = a->scanlines[line];
-			for (int i = 0; i < a->width; i++) {
-				out[i] = src[i * 4 + a->plane];
-			}
-		}
-		void writer(int pos, uint8_t v)
-		{
-			uint8_t *ptr = a->scanlines[a->row] + pos * 4;
-			ptr[a->plane] = v;
-		}
-		RW_H(AntialiasRGB888 *a)
-			: a(a)
-		{
-		}
-	};
-	class RW_V : public AntialiasRW {
-	public:
-		AntialiasRGB888 *a;
-		void reader(int line, uint8_t *out)
-		{
-			for (int y = 0; y < a->height; y++) {
-				uint8_t const *src = a->scanlines[y] + line * 4;
-				out[y] = src[a->plane];
-			}
-		}
-		void writer(int pos, uint8_t v)
-		{
-			uint8_t *ptr = a->scanlines[pos] + a->row * 4;
-			ptr[a->plane] = v;
-		}
-		RW_V(AntialiasRGB888 *a)
-			: a(a)
-		{
-		}
-	};
+/**
+ * @brief 1チャンネル分の画像を処理する
+ *
+ * 垂直方向は転置してから水平方向と同じ処理をする
+ */
+template <typename T> void filter_plane(std::vector<T> *plane, int width, int height)
+{
+	filter_rows(plane, width, height);
+	*plane = transpose(*plane, width, height);
+	filter_rows(plane, height, width);
+	*plane = transpose(*plane, height, width);
+}
 
-	void filling(euclase::Image *image)
-	{
-		int w = image->width();
-		int h = image->height();
-		for (int y = 0; y < h; y++) {
-			uint8_t *p = (uint8_t *)image->scanLine(y);
-			for (int x = 0; x < w; x++) {
-				int j;
-				for (j = x; j < w; j++) {
-					if (p[j * 4 + 3] != 0) { // alpha
-						break;
-					}
+/**
+ * @brief 透明な画素の色を両隣の不透明な画素の色で埋める
+ *
+ * 透明な部分の色が段差として扱われないようにする
+ */
+template <typename PIXEL> void fill_transparent(euclase::Image *image)
+{
+	using Traits = AntialiasTraits<PIXEL>;
+	using T = typename Traits::value_t;
+	const int w = image->width();
+	const int h = image->height();
+#pragma omp parallel for schedule(static, 16)
+	for (int y = 0; y < h; y++) {
+		PIXEL *p = (PIXEL *)image->scanLine(y);
+		for (int x = 0; x < w; x++) {
+			int j;
+			for (j = x; j < w; j++) {
+				if (Traits::opaque(p[j])) {
+					break;
 				}
-				if (j > x) {
-					int i = x;
-					x = j;
-					int m = (i + j) / 2;
-					uint8_t r = 128;
-					uint8_t g = 128;
-					uint8_t b = 128;
-					if (i > 0) {
-						r = p[(i - 1) * 4 + 0];
-						g = p[(i - 1) * 4 + 1];
-						b = p[(i - 1) * 4 + 2];
-					}
-					while (i < m) {
-						p[i * 4 + 0] = r;
-						p[i * 4 + 1] = g;
-						p[i * 4 + 2] = b;
-						i++;
+			}
+			if (j > x) {
+				int i = x;
+				x = j;
+				int m = (i + j) / 2;
+				T color[Traits::CHANNELS];
+				for (int c = 0; c < Traits::CHANNELS; c++) {
+					color[c] = i > 0 ? Traits::get(p[i - 1], c) : AntialiasValue<T>::gray();
+				}
+				while (i < m) {
+					for (int c = 0; c < Traits::CHANNELS; c++) {
+						Traits::set(&p[i], c, color[c]);
 					}
-					if (j + 1 < w) {
-						r = p[j * 4 + 0];
-						g = p[j * 4 + 1];
-						b = p[j * 4 + 2];
+					i++;
+				}
+				if (j + 1 < w) {
+					for (int c = 0; c < Traits::CHANNELS; c++) {
+						color[c] = Traits::get(p[j], c);
 					}
-					while (m < j) {
-						j--;
-						p[j * 4 + 0] = r;
-						p[j * 4 + 1] = g;
-						p[j * 4 + 2] = b;
+				}
+				while (m < j) {
+					j--;
+					for (int c = 0; c < Traits::CHANNELS; c++) {
+						Traits::set(&p[j], c, color[c]);
 					}
 				}
 			}
 		}
 	}
-public:
-	void filter(euclase::Image *image)
-	{
-		filling(image);
+}
 
-		width = image->width();
-		height = image->height();
+template <typename PIXEL> void antialias(euclase::Image *image)
+{
+	using Traits = AntialiasTraits<PIXEL>;
+	using T = typename Traits::value_t;
+	const int w = image->width();
+	const int h = image->height();
 
-		int span = width > height ? width : height;
-		tmp0 = (uint8_t *)alloca(span);
-		tmp1 = (uint8_t *)alloca(span);
-		tmp2 = (uint8_t *)alloca(span);
+	if (Traits::HAS_ALPHA) {
+		fill_transparent<PIXEL>(image);
+	}
 
-		scanlines = (uint8_t **)alloca(sizeof(uint8_t *) * height);
-		for (int y = 0; y < height; y++) {
-			scanlines[y] = (uint8_t *)image->scanLine(y);
+	std::vector<T> plane((size_t)w * h);
+	for (int c = 0; c < Traits::CHANNELS; c++) {
+#pragma omp parallel for schedule(static, 16)
+		for (int y = 0; y < h; y++) {
+			PIXEL const *p = (PIXEL const *)image->scanLine(y);
+			T *d = &plane[(size_t)w * y];
+			for (int x = 0; x < w; x++) {
+				d[x] = Traits::get(p[x], c);
+			}
+		}
+		filter_plane(&plane, w, h);
+#pragma omp parallel for schedule(static, 16)
+		for (int y = 0; y < h; y++) {
+			PIXEL *p = (PIXEL *)image->scanLine(y);
+			T const *s = &plane[(size_t)w * y];
+			for (int x = 0; x < w; x++) {
+				Traits::set(&p[x], c, s[x]);
+			}
 		}
-
-		RW_H rwh(this);
-		RW_V rwv(this);
-
-		plane = 0; // red
-		filter2(width, height, &rwh);
-		filter2(height, width, &rwv);
-		plane++; // green
-		filter2(width, height, &rwh);
-		filter2(height, width, &rwv);
-		plane++; // blue
-		filter2(width, height, &rwh);
-		filter2(height, width, &rwv);
 	}
-};
+}
 
 } // namespace
 
@@ -303,29 +350,25 @@ bool filter_antialias(euclase::Image *image)
 		return false;
 	}
 
-	if (image->format() == euclase::Image::Format_U8_Grayscale) {
+	switch (image->format()) {
+	case euclase::Image::Format_U8_Grayscale:
 		*image = image->toHost();
-		AntialiasGray8().filter(image);
+		antialias<euclase::OctetGray>(image);
 		return true;
-	}
-
-	if (image->format() == euclase::Image::Format_U8_RGBA) {
+	case euclase::Image::Format_U8_RGBA:
 		*image = image->toHost();
-		AntialiasRGB888().filter(image);
+		antialias<euclase::OctetRGBA>(image);
+		return true;
+	case euclase::Image::Format_F32_RGBA:
+		*image = image->toHost();
+		antialias<euclase::Float32RGBA>(image);
+		return true;
+	case euclase::Image::Format_F16_RGBA:
+		*image = image->toHost();
+		antialias<euclase::Float16RGBA>(image);
 		return true;
-	}
-
-	if (image->format() == euclase::Image::Format_F32_RGBA) {
-		*image = image->convertToFormat(euclase::Image::Format_U8_RGBA);
-		if (filter_antialias(image)) {
-			*image = image->convertToFormat(euclase::Image::Format_F32_RGBA);
-			return true;
-		}
-		return false;
 	}
 
 	qDebug() << "antialias: Unsupported image format.";
 	return false;
 }
-
-
@@ -11,6 +11,7 @@
 #endif
 
 #include "euclase.h"
+#include "resample.h"
 
 using namespace euclase;
 
@@ -903,17 +904,6 @@ using Float32Gray = euclase::Float32Gray;
 using Float32RGBA = euclase::Float32RGBA;
 using Float32GrayA = euclase::Float32GrayA;
 
-static double bicubic(double t)
-{
-	if (t < 0) t = -t;
-	double tt = t * t;
-	double ttt = t * t * t;
-	const double a = -0.5;
-	if (t < 1) return (a + 2) * ttt - (a + 3) * tt + 1;
-	if (t < 2) return a * ttt - 5 * a * tt + 8 * a * t - 4 * a;
-	return 0;
-}
-
 template <euclase::Image::Format FORMAT, typename PIXEL>
 euclase::Image resizeNearestNeighbor(euclase::Image const &image, int dst_w, int dst_h)
 {
@@ -935,430 +925,12 @@ euclase::Image resizeNearestNeighbor(euclase::Image const &image, int dst_w, int
 	return newimg;
 }
 
-template <euclase::Image::Format FORMAT, typename PIXEL, typename FPIXEL>
-euclase::Image resizeAveragingT(euclase::Image const &image, int dst_w, int dst_h)
-{
-	const int src_w = image.width();
-	const int src_h = image.height();
-	euclase::Image newimg(dst_w, dst_h, (euclase::Image::Format)FORMAT);
-#pragma omp parallel for
-	for (int y = 0; y < dst_h; y++) {
-		double lo_y = (double)y * src_h / dst_h;
-		double hi_y = (double)(y + 1) * src_h / dst_h;
-		PIXEL *dst = (PIXEL *)newimg.scanLine(y);
-		double mul = (double)src_w / dst_w;
-		for (int x = 0; x < dst_w; x++) {
-			double lo_x = (double)x * mul;
-			double hi_x = (double)(x + 1) * mul;
-			int lo_iy = (int)lo_y;
-			int hi_iy = (int)hi_y;
-			int lo_ix = (int)lo_x;
-			int hi_ix = (int)hi_x;
-			FPIXEL pixel;
-			double volume = 0;
-			for (int sy = lo_iy; sy <= hi_iy; sy++) {
-				double vy = 1;
-				if (sy < src_h) {
-					if (lo_iy == hi_iy) {
-						vy = hi_y - lo_y;
-					} else if (sy == lo_iy) {
-						vy = 1 - (lo_y - sy);
-					} else if (sy == hi_iy) {
-						vy = hi_y - sy;
-					}
-				}
-				PIXEL const *src = (PIXEL const *)image.scanLine(sy < src_h ? sy : (src_h - 1));
-				for (int sx = lo_ix; sx <= hi_ix; sx++) {
-					FPIXEL p = euclase::pixel_cast<FPIXEL>(src[sx < src_w ? sx : (src_w - 1)]);
-					double vx = 1;
-					if (sx < src_w) {
-						if (lo_ix == hi_ix) {
-							vx = hi_x - lo_x;
-						} else if (sx == lo_ix) {
-							vx = 1 - (lo_x - sx);
-						} else if (sx == hi_ix) {
-							vx = hi_x - sx;
-						}
-					}
-					double v = vy * vx;
-					pixel.add(p, v);
-					volume += v;
-				}
-			}
-			dst[x] = pixel.color(volume);
-		}
-	}
-	return newimg;
-}
-
-template <euclase::Image::Format FORMAT, typename PIXEL, typename FPIXEL>
-euclase::Image resizeAveragingHT(euclase::Image const &image, int dst_w)
-{
-	const int src_w = image.width();
-	const int src_h = image.height();
-	euclase::Image newimg(dst_w, src_h, (euclase::Image::Format)FORMAT);
-#pragma omp parallel for
-	for (int y = 0; y < src_h; y++) {
-		PIXEL *dst = (PIXEL *)newimg.scanLine(y);
-		for (int x = 0; x < dst_w; x++) {
-			double lo_x = (double)x * src_w / dst_w;
-			double hi_x = (double)(x + 1) * src_w / dst_w;
-			int lo_ix = (int)lo_x;
-			int hi_ix = (int)hi_x;
-			FPIXEL pixel;
-			double volume = 0;
-			PIXEL const *src = (PIXEL const *)image.scanLine(y < src_h ? y : (src_h - 1));
-			for (int sx = lo_ix; sx <= hi_ix; sx++) {
-				FPIXEL p = euclase::pixel_cast<FPIXEL>(src[sx < src_w ? sx : (src_w - 1)]);
-				double v = 1;
-				if (sx < src_w) {
-					if (lo_ix == hi_ix) {
-						v = hi_x - lo_x;
-					} else if (sx == lo_ix) {
-						v = 1 - (lo_x - sx);
-					} else if (sx == hi_ix) {
-						v = hi_x - sx;
-					}
-				}
-				pixel.add(p, v);
-				volume += v;
-			}
-			dst[x] = pixel.color(volume);
-		}
-	}
-	return newimg;
-}
-
-template <euclase::Image::Format FORMAT, typename PIXEL, typename FPIXEL>
-euclase::Image resizeAveragingVT(euclase::Image const &image, int dst_h)
-{
-	const int src_w = image.width();
-	const int src_h = image.height();
-	euclase::Image newimg(src_w, dst_h, FORMAT);
-#pragma omp parallel for
-	for (int y = 0; y < dst_h; y++) {
-		double lo_y = (double)y * src_h / dst_h;
-		double hi_y = (double)(y + 1) * src_h / dst_h;
-		PIXEL *dst = (PIXEL *)newimg.scanLine(y);
-		for (int x = 0; x < src_w; x++) {
-			int lo_iy = (int)lo_y;
-			int hi_iy = (int)hi_y;
-			FPIXEL pixel;
-			double volume = 0;
-			for (int sy = lo_iy; sy <= hi_iy; sy++) {
-				double v = 1;
-				if (sy < src_h) {
-					if (lo_iy == hi_iy) {
-						v = hi_y - lo_y;
-					} else if (sy == lo_iy) {
-						v = 1 - (lo_y - sy);
-					} else if (sy == hi_iy) {
-						v = hi_y - sy;
-					}
-				}
-				PIXEL const *src = (PIXEL const *)image.scanLine(sy < src_h ? sy : (src_h - 1));
-				FPIXEL p = euclase::pixel_cast<FPIXEL>(src[x]);
-				pixel.add(p, v);
-				volume += v;
-			}
-			dst[x] = pixel.color(volume);
-		}
-	}
-	return newimg;
-}
-
-struct bilinear_t {
-	int i0, i1;
-	double v0, v1;
-};
-
-template <euclase::Image::Format FORMAT, typename PIXEL, typename FPIXEL>
-euclase::Image resizeBilinearT(euclase::Image const &image, int dst_w, int dst_h)
-{
-	const int src_w = image.width();
-	const int src_h = image.height();
-	euclase::Image newimg(dst_w, dst_h, (euclase::Image::Format)FORMAT);
-
-	std::vector<bilinear_t> lut(dst_w);
-	bilinear_t *lut_p = &lut[0];
-	for (int x = 0; x < dst_w; x++) {
-		double tx = (double)x * src_w / dst_w - 0.5;
-		int x0, x1;
-		if (tx < 0) {
-			x0 = x1 = 0;
-			tx = 0;
-		} else {
-			x0 = x1 = (int)tx;
-			if (x0 + 1 < src_w) {
-				x1 = x0 + 1;
-				tx -= x0;
-			} else {
-				x0 = x1 = src_w - 1;
-				tx = 0;
-			}
-		}
-		lut_p[x].i0 = x0;
-		lut_p[x].i1 = x1;
-		lut_p[x].v1 = tx;
-		lut_p[x].v0 = 1 - tx;
-	}
-
-#pragma omp parallel for
-	for (int y = 0; y < dst_h; y++) {
-		double yt = (double)y * src_h / dst_h - 0.5;
-		int y0, y1;
-		if (yt < 0) {
-			y0 = y1 = 0;
-			yt = 0;
-		} else {
-			y0 = y1 = (int)yt;
-			if (y0 + 1 < src_h) {
-				y1 = y0 + 1;
-				yt -= y0;
-			} else {
-				y0 = y1 = src_h - 1;
-				yt = 0;
-			}
-		}
-		double ys = 1 - yt;
-		PIXEL *dst = (PIXEL *)newimg.scanLine(y);
-		PIXEL const *src1 = (PIXEL const *)image.scanLine(y0);
-		PIXEL const *src2 = (PIXEL const *)image.scanLine(y1);
-		for (int x = 0; x < dst_w; x++) {
-			double a11 = lut_p[x].v0 * ys;
-			double a12 = lut_p[x].v1 * ys;
-			double a21 = lut_p[x].v0 * yt;
-			double a22 = lut_p[x].v1 * yt;
-			FPIXEL pixel;
-			pixel.add(euclase::pixel_cast<FPIXEL>(src1[lut_p[x].i0]), a11);
-			pixel.add(euclase::pixel_cast<FPIXEL>(src1[lut_p[x].i1]), a12);
-			pixel.add(euclase::pixel_cast<FPIXEL>(src2[lut_p[x].i0]), a21);
-			pixel.add(euclase::pixel_cast<FPIXEL>(src2[lut_p[x].i1]), a22);
-			dst[x] = pixel.color(a11 + a12 + a21 + a22);
-		}
-	}
-	return newimg;
-}
-
-template <euclase::Image::Format FORMAT, typename PIXEL, typename FPIXEL>
-euclase::Image resizeBilinearHT(euclase::Image const &image, int dst_w)
-{
-	const int src_w = image.width();
-	const int src_h = image.height();
-	euclase::Image newimg(dst_w, src_h, (euclase::Image::Format)FORMAT);
-#pragma omp parallel for
-	for (int y = 0; y < src_h; y++) {
-		PIXEL *dst = (PIXEL *)newimg.scanLine(y);
-		PIXEL const *src = (PIXEL const *)image.scanLine(y);
-		double mul = (double)src_w / dst_w;
-		for (int x = 0; x < dst_w; x++) {
-			double xt = (double)x * mul - 0.5;
-			int x0, x1;
-			if (xt < 0) {
-				x0 = x1 = 0;
-				xt = 0;
-			} else {
-				x0 = x1 = (int)xt;
-				if (x0 + 1 < src_w) {
-					x1 = x0 + 1;
-					xt -= x0;
-				} else {
-					x0 = x1 = src_w - 1;
-					xt = 0;
-				}
-			}
-			double xs = 1 - xt;
-			FPIXEL p1(euclase::pixel_cast<FPIXEL>(src[x0]));
-			FPIXEL p2(euclase::pixel_cast<FPIXEL>(src[x1]));
-			FPIXEL p;
-			p.add(p1, xs);
-			p.add(p2, xt);
-			dst[x] = p.color(1);
-		}
-	}
-	return newimg;
-}
-
-template <euclase::Image::Format FORMAT, typename PIXEL, typename FPIXEL>
-euclase::Image resizeBilinearVT(euclase::Image const &image, int dst_h)
-{
-	const int src_w = image.width();
-	const int src_h = image.height();
-	euclase::Image newimg(src_w, dst_h, FORMAT);
-#pragma omp parallel for
-	for (int y = 0; y < dst_h; y++) {
-		double yt = (double)y * src_h / dst_h - 0.5;
-		int y0, y1;
-		if (yt < 0) {
-			y0 = y1 = 0;
-			yt = 0;
-		} else {
-			y0 = y1 = (int)yt;
-			if (y0 + 1 < src_h) {
-				y1 = y0 + 1;
-				yt -= y0;
-			} else {
-				y0 = y1 = src_h - 1;
-				yt = 0;
-			}
-		}
-		double ys = 1 - yt;
-		PIXEL *dst = (PIXEL *)newimg.scanLine(y);
-		PIXEL const *src1 = (PIXEL const *)image.scanLine(y0);
-		PIXEL const *src2 = (PIXEL const *)image.scanLine(y1);
-		for (int x = 0; x < src_w; x++) {
-			FPIXEL p1(euclase::pixel_cast<FPIXEL>(src1[x]));
-			FPIXEL p2(euclase::pixel_cast<FPIXEL>(src2[x]));
-			FPIXEL p;
-			p.add(p1, ys);
-			p.add(p2, yt);
-			dst[x] = p.color(1);
-		}
-	}
-	return newimg;
-}
-
-typedef double (*bicubic_lut_t)[4];
-
-static bicubic_lut_t makeBicubicLookupTable(int src, int dst, std::vector<double> *out)
-{
-	out->resize(dst * 4);
-	double (*lut)[4] = (double (*)[4])&(*out)[0];
-	for (int x = 0; x < dst; x++) {
-		double sx = (double)x * src / dst - 0.5;
-		int ix = (int)floor(sx);
-		double tx = sx - ix;
-		for (int x2 = -1; x2 <= 2; x2++) {
-			int x3 = ix + x2;
-			if (x3 >= 0 && x3 < src) {
-				lut[x][x2 + 1] = bicubic(x2 - tx);
-			}
-		}
-	}
-	return lut;
-}
-
-template <euclase::Image::Format FORMAT, typename PIXEL, typename FPIXEL>
-euclase::Image resizeBicubicT(euclase::Image const &image, int dst_w, int dst_h)
-{
-	const int src_w = image.width();
-	const int src_h = image.height();
-	euclase::Image newimg;
-	if (!newimg.make(dst_w, dst_h, (euclase::Image::Format)FORMAT)) {
-		return {}; // bad alloc?
-	}
-
-	std::vector<double> bicubic_lut_x;
-	std::vector<double> bicubic_lut_y;
-	bicubic_lut_t bicubic_lut_x_p = makeBicubicLookupTable(src_w, dst_w, &bicubic_lut_x);
-	bicubic_lut_t bicubic_lut_y_p = makeBicubicLookupTable(src_h, dst_h, &bicubic_lut_y);
-
-#pragma omp parallel for
-	for (int y = 0; y < dst_h; y++) {
-		PIXEL *dst = (PIXEL *)newimg.scanLine(y);
-		double sy = (double)y * src_h / dst_h - 0.5;
-		int iy = (int)floor(sy);
-		for (int x = 0; x < dst_w; x++) {
-			double sx = (double)x * src_w / dst_w - 0.5;
-			int ix = (int)floor(sx);
-			FPIXEL pixel;
-			double amount = 0;
-			for (int y2 = -1; y2 <= 2; y2++) {
-				int y3 = iy + y2;
-				if (y3 >= 0 && y3 < src_h) {
-					double vy = bicubic_lut_y_p[y][y2 + 1];
-					PIXEL const *src = (PIXEL const *)image.scanLine(y3);
-					for (int x2 = -1; x2 <= 2; x2++) {
-						int x3 = ix + x2;
-						if (x3 >= 0 && x3 < src_w) {
-							double vx = bicubic_lut_x_p[x][x2 + 1];
-							FPIXEL p(euclase::pixel_cast<FPIXEL>(src[x3]));
-							double v = vx * vy;
-							pixel.add(p, v);
-							amount += v;
-						}
-					}
-				}
-			}
-			dst[x] = pixel.color(amount);
-		}
-	}
-	return newimg;
-}
-
-template <euclase::Image::Format FORMAT, typename PIXEL, typename FPIXEL>
-euclase::Image resizeBicubicHT(euclase::Image const &image, int dst_w)
-{
-	const int src_w = image.width();
-	const int src_h = image.height();
-	euclase::Image newimg(dst_w, src_h, (euclase::Image::Format)FORMAT);
-
-	std::vector<double> bicubic_lut_x;
-	bicubic_lut_t bicubic_lut_x_p = makeBicubicLookupTable(src_w, dst_w, &bicubic_lut_x);
-
-#pragma omp parallel for
-	for (int y = 0; y < src_h; y++) {
-		PIXEL *dst = (PIXEL *)newimg.scanLine(y);
-		PIXEL const *src = (PIXEL const *)image.scanLine(y);
-		for (int x = 0; x < dst_w; x++) {
-			FPIXEL pixel;
-			double volume = 0;
-			double sx = (double)x * src_w / dst_w - 0.5;
-			int ix = (int)floor(sx);
-			for (int x2 = -1; x2 <= 2; x2++) {
-				int x3 = ix + x2;
-				if (x3 >= 0 && x3 < src_w) {
-					double v = bicubic_lut_x_p[x][x2 + 1];
-					FPIXEL p(euclase::pixel_cast<FPIXEL>(src[x3]));
-					pixel.add(p, v);
-					volume += v;
-				}
-			}
-			dst[x] = pixel.color(volume);
-		}
-	}
-	return newimg;
-}
-
-template <euclase::Image::Format FORMAT, typename PIXEL, typename FPIXEL>
-euclase::Image resizeBicubicVT(euclase::Image const &image, int dst_h)
-{
-	const int src_w = image.width();
-	const int src_h = image.height();
-	euclase::Image newimg(src_w, dst_h, FORMAT);
-
-	std::vector<double> bicubic_lut_y;
-	bicubic_lut_t bicubic_lut_y_p = makeBicubicLookupTable(src_h, dst_h, &bicubic_lut_y);
-
-#pragma omp parallel for
-	for (int x = 0; x < src_w; x++) {
-		for (int y = 0; y < dst_h; y++) {
-			PIXEL *dst = (PIXEL *)newimg.scanLine(y) + x;
-			FPIXEL pixel;
-			double volume = 0;
-			double sy = (double)y * src_h / dst_h - 0.5;
-			int iy = (int)floor(sy);
-			for (int y2 = -1; y2 <= 2; y2++) {
-				int y3 = iy + y2;
-				if (y3 >= 0 && y3 < src_h) {
-					double v = bicubic_lut_y_p[y][y2 + 1];
-					FPIXEL p(euclase::pixel_cast<FPIXEL>(((PIXEL const *)image.scanLine(y3))[x]));
-					pixel.add(p, v);
-					volume += v;
-				}
-			}
-			*dst = pixel.color(volume);
-		}
-	}
-	return newimg;
-}
-
 //
 
-template <typename PIXEL, typename FPIXEL> euclase::Image BlurFilter(euclase::Image const &image, int radius, bool *cancel, std::function<void (float)> &progress)
+template <typename PIXEL, typename FPIXEL> euclase::Image BlurFilter(euclase::Image const &image, int radius, euclase::CancelToken const &cancel, std::function<void (float)> &progress)
 {
 	auto isInterrupted = [&](){
-		return cancel && *cancel;
+		return cancel.canceled();
 	};
 
 	int w = image.width();
@@ -1446,172 +1018,170 @@ template <typename PIXEL, typename FPIXEL> euclase::Image BlurFilter(euclase::Im
 	return newimage;
 }
 
-static euclase::Image resizeColorImage(euclase::Image const &image, int dst_w, int dst_h, EnlargeMethod method, bool alphachannel)
+namespace {
+
+/**
+ * @brief 矩形のカーネルで水平方向にぼかす
+ * @param src 入力（乗算済みアルファのRGBA）
+ * @param dst 出力
+ * @param w 画素数
+ * @param radius 半径
+ *
+ * 窓の移動に合わせて和を更新するので、半径によらず1画素あたり一定の時間で済む
+ * 画像の外は数えずに、窓に入っている画素の数で割る
+ */
+void box_blur_h(float const *src, float *dst, int w, int radius)
 {
-	euclase::Image newimage;
-	int w, h;
-	w = image.width();
-	h = image.height();
-	if (w > 0 && h > 0 && dst_w > 0 && dst_h > 0) {
-		newimage = image;
-		if (w != dst_w || h != dst_h) {
-			if (dst_w < w || dst_h < h) {
-				if (method == EnlargeMethod::NearestNeighbor) {
-					newimage = resizeNearestNeighbor<euclase::Image::Format_F32_RGBA, Float32RGBA>(newimage, dst_w, dst_h);
-				} else {
-					if (dst_w < w && dst_h < h) {
-						if (alphachannel) {
-							newimage = resizeAveragingT<euclase::Image::Format_F32_RGBA, Float32RGBA, Float32RGBA>(image, dst_w, dst_h);
-						} else {
-							newimage = resizeAveragingT<euclase::Image::Format_F32_RGBA, Float32RGB, Float32RGB>(image, dst_w, dst_h);
-						}
-					} else if (dst_w < w) {
-						if (alphachannel) {
-							newimage = resizeAveragingHT<euclase::Image::Format_F32_RGBA, Float32RGBA, Float32RGBA>(image, dst_w);
-						} else {
-							newimage = resizeAveragingHT<euclase::Image::Format_F32_RGBA, Float32RGB, Float32RGB>(image, dst_w);
-						}
-					} else if (dst_h < h) {
-						if (alphachannel) {
-							newimage = resizeAveragingVT<euclase::Image::Format_F32_RGBA, Float32RGBA, Float32RGBA>(image, dst_h);
-						} else {
-							newimage = resizeAveragingVT<euclase::Image::Format_F32_RGBA, Float32RGB, Float32RGB>(image, dst_h);
-						}
-					}
-				}
+	float sum[4] = {};
+	int count = 0;
+	for (int x = 0; x < radius && x < w; x++) {
+		for (int c = 0; c < 4; c++) {
+			sum[c] += src[x * 4 + c];
+		}
+		count++;
+	}
+	for (int x = 0; x < w; x++) {
+		int x1 = x + radius;
+		if (x1 < w) {
+			for (int c = 0; c < 4; c++) {
+				sum[c] += src[x1 * 4 + c];
 			}
-			w = newimage.width();
-			h = newimage.height();
-			if (dst_w > w || dst_h > h) {
-				if (method == EnlargeMethod::Bilinear) {
-					if (dst_w > w && dst_h > h) {
-						if (alphachannel) {
-							newimage = resizeBilinearT<euclase::Image::Format_F32_RGBA, Float32RGBA, Float32RGBA>(newimage, dst_w, dst_h);
-						} else {
-							newimage = resizeBilinearT<euclase::Image::Format_F32_RGBA, Float32RGB, Float32RGB>(newimage, dst_w, dst_h);
-						}
-					} else if (dst_w > w) {
-						if (alphachannel) {
-							newimage = resizeBilinearHT<euclase::Image::Format_F32_RGBA, Float32RGBA, Float32RGBA>(newimage, dst_w);
-						} else {
-							newimage = resizeBilinearHT<euclase::Image::Format_F32_RGBA, Float32RGB, Float32RGB>(newimage, dst_w);
-						}
-					} else if (dst_h > h) {
-						if (alphachannel) {
-							newimage = resizeBilinearVT<euclase::Image::Format_F32_RGBA, Float32RGBA, Float32RGBA>(newimage, dst_h);
-						} else {
-							newimage = resizeBilinearVT<euclase::Image::Format_F32_RGBA, Float32RGB, Float32RGB>(newimage, dst_h);
-						}
-					}
-				} else if (method == EnlargeMethod::Bicubic) {
-					if (dst_w > w && dst_h > h) {
-						if (alphachannel) {
-							newimage = resizeBicubicT<euclase::Image::Format_F32_RGBA, Float32RGBA, Float32RGBA>(newimage, dst_w, dst_h);
-						} else {
-							newimage = resizeBicubicT<euclase::Image::Format_F32_RGBA, Float32RGB, Float32RGB>(newimage, dst_w, dst_h);
-						}
-					} else if (dst_w > w) {
-						if (alphachannel) {
-							newimage = resizeBicubicHT<euclase::Image::Format_F32_RGBA, Float32RGBA, Float32RGBA>(newimage, dst_w);
-						} else {
-							newimage = resizeBicubicHT<euclase::Image::Format_F32_RGBA, Float32RGB, Float32RGB>(newimage, dst_w);
-						}
-					} else if (dst_h > h) {
-						if (alphachannel) {
-							newimage = resizeBicubicVT<euclase::Image::Format_F32_RGBA, Float32RGBA, Float32RGBA>(newimage, dst_h);
-						} else {
-							newimage = resizeBicubicVT<euclase::Image::Format_F32_RGBA, Float32RGB, Float32RGB>(newimage, dst_h);
-						}
-					}
-				} else {
-					newimage = resizeNearestNeighbor<euclase::Image::Format_F32_RGBA, Float32RGBA>(newimage, dst_w, dst_h);
-				}
+			count++;
+		}
+		const float t = 1.0f / count;
+		for (int c = 0; c < 4; c++) {
+			dst[x * 4 + c] = sum[c] * t;
+		}
+		int x0 = x - radius;
+		if (x0 >= 0) {
+			for (int c = 0; c < 4; c++) {
+				sum[c] -= src[x0 * 4 + c];
 			}
+			count--;
 		}
 	}
-	return newimage;
 }
 
-static euclase::Image resizeGrayscaleImage(euclase::Image const &image, int dst_w, int dst_h, EnlargeMethod method, bool alphachannel)
+/**
+ * @brief 矩形のカーネルで垂直方向にぼかす
+ * @param src 入力（乗算済みアルファのRGBA）
+ * @param dst 出力
+ * @param w 画像の幅
+ * @param h 画像の高さ
+ * @param radius 半径
+ * @param x0 処理する列の先頭
+ * @param x1 処理する列の終端
+ *
+ * 列ごとの和を1行分の配列に持って行単位で更新するので、内側のループは連続したメモリを順に読み書きする
+ */
+void box_blur_v(float const *src, float *dst, int w, int h, int radius, int x0, int x1)
 {
-	euclase::Image newimage;
-	int w, h;
-	w = image.width();
-	h = image.height();
-	if (w > 0 && h > 0 && dst_w > 0 && dst_h > 0) {
-		if (w != dst_w || h != dst_h) {
-			newimage = image;
-			if (dst_w < w || dst_h < h) {
-				if (method == EnlargeMethod::NearestNeighbor) {
-					newimage = resizeNearestNeighbor<euclase::Image::Format_F32_Grayscale, Float32Gray>(newimage, dst_w, dst_h);
-				} else {
-					if (dst_w < w && dst_h < h) {
-						if (alphachannel) {
-							newimage = resizeAveragingT<euclase::Image::Format_F32_Grayscale, Float32GrayA, Float32GrayA>(newimage, dst_w, dst_h);
-						} else {
-							newimage = resizeAveragingT<euclase::Image::Format_F32_Grayscale, Float32Gray, Float32Gray>(newimage, dst_w, dst_h);
-						}
-					} else if (dst_w < w) {
-						if (alphachannel) {
-							newimage = resizeAveragingHT<euclase::Image::Format_F32_Grayscale, Float32GrayA, Float32GrayA>(newimage, dst_w);
-						} else {
-							newimage = resizeAveragingHT<euclase::Image::Format_F32_Grayscale, Float32Gray, Float32Gray>(newimage, dst_w);
-						}
-					} else if (dst_h < h) {
-						if (alphachannel) {
-							newimage = resizeAveragingVT<euclase::Image::Format_F32_Grayscale, Float32GrayA, Float32GrayA>(newimage, dst_h);
-						} else {
-							newimage = resizeAveragingVT<euclase::Image::Format_F32_Grayscale, Float32Gray, Float32Gray>(newimage, dst_h);
-						}
-					}
-				}
+	const int n = (x1 - x0) * 4;
+	std::vector<float> sum(n);
+	auto row = [&](float const *p, int y){
+		return p + ((size_t)y * w + x0) * 4;
+	};
+	int count = 0;
+	for (int y = 0; y < radius && y < h; y++) {
+		float const *s = row(src, y);
+		for (int i = 0; i < n; i++) {
+			sum[i] += s[i];
+		}
+		count++;
+	}
+	for (int y = 0; y < h; y++) {
+		int y1 = y + radius;
+		if (y1 < h) {
+			float const *s = row(src, y1);
+			for (int i = 0; i < n; i++) {
+				sum[i] += s[i];
 			}
-			w = newimage.width();
-			h = newimage.height();
-			if (dst_w > w || dst_h > h) {
-				if (method == EnlargeMethod::Bilinear) {
-					if (dst_w > w && dst_h > h) {
-						if (alphachannel) {
-							newimage = resizeBilinearT<euclase::Image::Format_F32_Grayscale, Float32GrayA, Float32GrayA>(newimage, dst_w, dst_h);
-						} else {
-							newimage = resizeBilinearT<euclase::Image::Format_F32_Grayscale, Float32Gray, Float32Gray>(newimage, dst_w, dst_h);
-						}
-					} else if (dst_w > w) {
-						if (alphachannel) {
-							newimage = resizeBilinearHT<euclase::Image::Format_F32_Grayscale, Float32GrayA, Float32GrayA>(newimage, dst_w);
-						} else {
-							newimage = resizeBilinearHT<euclase::Image::Format_F32_Grayscale, Float32Gray, Float32Gray>(newimage, dst_w);
-						}
-					} else if (dst_h > h) {
-						if (alphachannel) {
-							newimage = resizeBilinearVT<euclase::Image::Format_F32_Grayscale, Float32GrayA, Float32GrayA>(newimage, dst_h);
-						} else {
-							newimage = resizeBilinearVT<euclase::Image::Format_F32_Grayscale, Float32Gray, Float32Gray>(newimage, dst_h);
-						}
-					}
-				} else if (method == EnlargeMethod::Bicubic) {
-					if (dst_w > w && dst_h > h) {
-						if (alphachannel) {
-							newimage = resizeBicubicT<euclase::Image::Format_F32_Grayscale, Float32GrayA, Float32GrayA>(newimage, dst_w, dst_h);
-						} else {
-							newimage = resizeBicubicT<euclase::Image::Format_F32_Grayscale, Float32Gray, Float32Gray>(newimage, dst_w, dst_h);
-						}
-					} else if (dst_w > w) {
-						if (alphachannel) {
-							newimage = resizeBicubicHT<euclase::Image::Format_F32_Grayscale, Float32GrayA, Float32GrayA>(newimage, dst_w);
-						} else {
-							newimage = resizeBicubicHT<euclase::Image::Format_F32_Grayscale, Float32Gray, Float32Gray>(newimage, dst_w);
-						}
-					} else if (dst_h > h) {
-						if (alphachannel) {
-							newimage = resizeBicubicVT<euclase::Image::Format_F32_Grayscale, Float32GrayA, Float32GrayA>(newimage, dst_h);
-						} else {
-							newimage = resizeBicubicVT<euclase::Image::Format_F32_Grayscale, Float32Gray, Float32Gray>(newimage, dst_h);
-						}
-					}
-				} else {
-					newimage = resizeNearestNeighbor<euclase::Image::Format_F32_Grayscale, Float32Gray>(newimage, dst_w, dst_h);
-				}
+			count++;
+		}
+		const float t = 1.0f / count;
+		float *d = const_cast<float *>(row(dst, y));
+		for (int i = 0; i < n; i++) {
+			d[i] = sum[i] * t;
+		}
+		int y0 = y - radius;
+		if (y0 >= 0) {
+			float const *s = row(src, y0);
+			for (int i = 0; i < n; i++) {
+				sum[i] -= s[i];
+			}
+			count--;
+		}
+	}
+}
+
+} // namespace
+
+/**
+ * @brief 矩形のカーネルを重ねてぼかす
+ * @param image 画像（F32_RGBA または F16_RGBA）
+ * @param radius 半径
+ * @param passes 重ねる回数。3回でガウシアンに近くなる
+ *
+ * 乗算済みアルファに変換してから水平・垂直に分けてぼかすので、透明な画素の色は混ざらない
+ */
+template <typename PIXEL> euclase::Image BoxBlurFilter(euclase::Image const &image, int radius, int passes, euclase::CancelToken const &cancel, std::function<void (float)> &progress)
+{
+	auto isInterrupted = [&](){
+		return cancel.canceled();
+	};
+
+	const int w = image.width();
+	const int h = image.height();
+	euclase::Image newimage(w, h, image.format());
+	if (w < 1 || h < 1) return newimage;
+
+	std::vector<float> buf0((size_t)w * h * 4);
+	std::vector<float> buf1((size_t)w * h * 4);
+
+#pragma omp parallel for
+	for (int y = 0; y < h; y++) {
+		PIXEL const *s = (PIXEL const *)image.scanLine(y);
+		float *d = &buf0[(size_t)y * w * 4];
+		for (int x = 0; x < w; x++) {
+			euclase::Float32RGBA p(s[x]);
+			d[x * 4 + 0] = p.r * p.a;
+			d[x * 4 + 1] = p.g * p.a;
+			d[x * 4 + 2] = p.b * p.a;
+			d[x * 4 + 3] = p.a;
+		}
+	}
+
+	const int STRIP = 64; // 垂直方向の処理で1スレッドが受け持つ列の数
+	const int strips = (w + STRIP - 1) / STRIP;
+	const int steps = passes * 2;
+	for (int pass = 0; pass < passes; pass++) {
+#pragma omp parallel for
+		for (int y = 0; y < h; y++) {
+			if (isInterrupted()) continue;
+			box_blur_h(&buf0[(size_t)y * w * 4], &buf1[(size_t)y * w * 4], w, radius);
+		}
+		if (isInterrupted()) return {};
+		progress((float)(pass * 2 + 1) / steps);
+
+#pragma omp parallel for
+		for (int i = 0; i < strips; i++) {
+			if (isInterrupted()) continue;
+			box_blur_v(buf1.data(), buf0.data(), w, h, radius, i * STRIP, std::min((i + 1) * STRIP, w));
+		}
+		if (isInterrupted()) return {};
+		progress((float)(pass * 2 + 2) / steps);
+	}
+
+#pragma omp parallel for
+	for (int y = 0; y < h; y++) {
+		float const *s = &buf0[(size_t)y * w * 4];
+		PIXEL *d = (PIXEL *)newimage.scanLine(y);
+		for (int x = 0; x < w; x++) {
+			float a = s[x * 4 + 3];
+			if (a > 0) {
+				d[x] = PIXEL(euclase::Float32RGBA(s[x * 4 + 0] / a, s[x * 4 + 1] / a, s[x * 4 + 2] / a, a));
+			} else {
+				d[x] = PIXEL(euclase::Float32RGBA(0.0f, 0.0f, 0.0f, 0.0f));
 			}
 		}
 	}
@@ -1628,33 +1198,35 @@ euclase::Image euclase::resizeImage(euclase::Image const &image, int dst_w, int
 		return newimg.memconvert(memtype);
 	}
 
-	bool alphachannel = false;
-	switch (image.format()) {
-	case euclase::Image::Format_U8_RGBA:
-	case euclase::Image::Format_F32_RGBA:
-	case euclase::Image::Format_U8_GrayscaleA:
-	case euclase::Image::Format_F32_GrayscaleA:
-		alphachannel = true;
-		break;
-	}
-
 	switch (image.format()) {
 	case euclase::Image::Format_U8_Grayscale:
 		return resizeNearestNeighbor<euclase::Image::Format_U8_Grayscale, euclase::OctetGray>(image, dst_w, dst_h);
 	case euclase::Image::Format_U8_GrayscaleA:
 		return resizeNearestNeighbor<euclase::Image::Format_U8_GrayscaleA, euclase::OctetGrayA>(image, dst_w, dst_h);
-	case euclase::Image::Format_F32_RGB:
+	case euclase::Image::Format_U8_RGBA:
+	case euclase::Image::Format_F16_RGBA:
 	case euclase::Image::Format_F32_RGBA:
-		return resizeColorImage(image, dst_w, dst_h, method, alphachannel);
+	case euclase::Image::Format_F32_RGB:
 	case euclase::Image::Format_F32_Grayscale:
 	case euclase::Image::Format_F32_GrayscaleA:
-		return resizeGrayscaleImage(image, dst_w, dst_h, method, alphachannel);
+		if (image.width() < 1 || image.height() < 1 || dst_w < 1 || dst_h < 1) return {};
+		return euclase::Resampler(image.width(), image.height(), dst_w, dst_h, method).resize(image);
 	}
 	return {};
 }
 
-euclase::Image euclase::filter_blur(euclase::Image image, int radius, bool *cancel, std::function<void (float)> progress)
+euclase::Image euclase::filter_blur(euclase::Image image, int radius, CancelToken const &cancel, std::function<void (float)> progress, BlurMode mode)
 {
+	if (mode != BlurMode::Circle) {
+		const int passes = mode == BlurMode::Gaussian ? 3 : 1;
+		switch (image.format()) {
+		case Image::Format_F32_RGBA:
+			return BoxBlurFilter<Float32RGBA>(image, radius, passes, cancel, progress);
+		case Image::Format_F16_RGBA:
+			return BoxBlurFilter<Float16RGBA>(image, radius, passes, cancel, progress);
+		}
+	}
+
 	if (image.format() == Image::Format_F32_RGBA) {
 		return BlurFilter<Float32RGBA, Float32RGBA>(image, radius, cancel, progress);
 	}
@@ -1667,7 +1239,8 @@ euclase::Image euclase::filter_blur(euclase::Image image, int radius, bool *canc
 	switch (format) {
 	case euclase::Image::Format_U8_RGBA:
 	case euclase::Image::Format_U8_GrayscaleA:
-		auto img = filter_blur(image.convertToFormat(Image::Format_F32_RGBA), radius, cancel, progress);
+	case euclase::Image::Format_F16_RGBA:
+		auto img = filter_blur(image.convertToFormat(Image::Format_F32_RGBA), radius, cancel, progress, mode);
 		return img.convertToFormat(format);
 	}
 	return {};
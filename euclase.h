@@ -10,6 +10,7 @@
 #include <atomic>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <optional>
@@ -361,6 +362,46 @@ public:
 	}
 };
 
+/**
+ * @brief 処理の中断を判定するトークン
+ *
+ * 中断フラグ、または世代番号で判定する
+ * 世代番号は新しい要求のたびに増やし、開始時の世代番号と異なっていれば中断する
+ * 値のコピーなので、並列処理の各スレッドから参照してよい
+ */
+class CancelToken {
+private:
+	std::atomic_bool const *flag_ = nullptr;
+	std::atomic_uint const *generation_ = nullptr;
+	unsigned int expected_ = 0;
+public:
+	CancelToken() = default;
+	CancelToken(std::nullptr_t)
+	{
+	}
+	CancelToken(std::atomic_bool const *flag)
+		: flag_(flag)
+	{
+	}
+	CancelToken(std::atomic_uint const *generation, unsigned int expected)
+		: generation_(generation)
+		, expected_(expected)
+	{
+	}
+	CancelToken(std::atomic_bool const *flag, std::atomic_uint const *generation, unsigned int expected)
+		: flag_(flag)
+		, generation_(generation)
+		, expected_(expected)
+	{
+	}
+	bool canceled() const
+	{
+		if (flag_ && flag_->load(std::memory_order_relaxed)) return true;
+		if (generation_ && generation_->load(std::memory_order_relaxed) != expected_) return true;
+		return false;
+	}
+};
+
 template <typename T>
 static inline T clamp(T a, T min, T max)
 {
@@ -1703,9 +1744,15 @@ enum class EnlargeMethod {
 	NearestNeighbor,
 	Bilinear,
 	Bicubic,
+	Lanczos3,
 };
 euclase::Image resizeImage(euclase::Image const &image, int dst_w, int dst_h, EnlargeMethod method/* = EnlargeMethod::Bilinear*/);
-euclase::Image filter_blur(euclase::Image image, int radius, bool *cancel, std::function<void (float)> progress);
+enum class BlurMode {
+	Circle, // 円形のカーネル。半径に比例した時間がかかる
+	Box, // 矩形のカーネル。半径によらず一定の時間
+	Gaussian, // 矩形のカーネルを3回重ねてガウシアンを近似する。半径によらず一定の時間
+};
+euclase::Image filter_blur(euclase::Image image, int radius, CancelToken const &cancel, std::function<void (float)> progress, BlurMode mode = BlurMode::Circle);
 
 #ifdef USE_EUCLASE_IMAGE_READ_WRITE
 std::optional<Image> load_jpeg(char const *path);
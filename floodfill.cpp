@@ -0,0 +1,361 @@
+#include "floodfill.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+const uint16_t NONE = 0xffff; // 塗りつぶしの対象外。4近傍の連結成分は1タイルに高々半分の画素数なので足りる
+
+/**
+ * @brief 色の比較に使う値
+ *
+ * アルファを乗算した、おおよそガンマ補正した値。完全に透明な画素は色によらず同じになる
+ */
+struct Key {
+	float v[4];
+};
+
+inline Key key(euclase::Float32RGBA const &p)
+{
+	const float a = std::max(0.0f, std::min(1.0f, p.a));
+	return {{ sqrtf(std::max(0.0f, p.r)) * a, sqrtf(std::max(0.0f, p.g)) * a, sqrtf(std::max(0.0f, p.b)) * a, a }};
+}
+
+inline bool near(Key const &a, Key const &b, float tolerance)
+{
+	for (int i = 0; i < 4; i++) {
+		if (fabsf(a.v[i] - b.v[i]) > tolerance) return false;
+	}
+	return true;
+}
+
+/**
+ * @brief 1タイル分の処理の範囲と作業領域
+ */
+struct TileContext {
+	int size;
+	int x0; // 塗りつぶせる範囲（タイルの中の座標）
+	int y0;
+	int x1;
+	int y1;
+	std::vector<uint8_t> match; // 起点の色に近い画素
+	std::vector<uint16_t> labels; // 画素ごとの連結成分の番号
+	int count = 0; // 連結成分の数
+};
+
+inline euclase::Float32RGBA toFloat(euclase::Float32RGBA const &p)
+{
+	return p;
+}
+
+inline euclase::Float32RGBA toFloat(euclase::Float16RGBA const &p)
+{
+	return euclase::Float32RGBA::convert(p);
+}
+
+inline euclase::Float32RGBA toFloat(euclase::OctetRGBA const &p)
+{
+	return euclase::Float32RGBA::convert(p);
+}
+
+/**
+ * @brief 画素の型ごとに、起点の色に近い画素を求める
+ *
+ * 同じ色が続くところは比較を省く。変換前の値で比べるので、塗りつぶしの対象になりやすい平坦な部分は変換もしない
+ */
+template <typename PIXEL> void matchPixels(euclase::Image const &image, Key const &seed, float tolerance, TileContext *t)
+{
+	const int n = t->size;
+	for (int y = t->y0; y < t->y1; y++) {
+		PIXEL const *s = (PIXEL const *)image.scanLine(y);
+		uint8_t *d = &t->match[(size_t)n * y];
+		d[t->x0] = near(key(toFloat(s[t->x0])), seed, tolerance) ? 1 : 0;
+		for (int x = t->x0 + 1; x < t->x1; x++) {
+			if (memcmp(&s[x], &s[x - 1], sizeof(PIXEL)) == 0) {
+				d[x] = d[x - 1];
+			} else {
+				d[x] = near(key(toFloat(s[x])), seed, tolerance) ? 1 : 0;
+			}
+		}
+	}
+}
+
+/**
+ * @brief 起点の色に近い画素を求める
+ * @param tile タイル。空の画像は透明
+ */
+void matchTile(euclase::Image const &tile, Key const &seed, float tolerance, TileContext *t)
+{
+	const int n = t->size;
+	t->match.assign((size_t)n * n, 0);
+	if (t->x0 >= t->x1 || t->y0 >= t->y1) return;
+	if (!tile) {
+		const uint8_t v = near(key(euclase::Float32RGBA(0.0f, 0.0f, 0.0f, 0.0f)), seed, tolerance) ? 1 : 0;
+		for (int y = t->y0; y < t->y1; y++) {
+			memset(&t->match[(size_t)n * y + t->x0], v, t->x1 - t->x0);
+		}
+		return;
+	}
+	euclase::Image image = tile.toHost();
+	switch (image.format()) {
+	case euclase::Image::Format_U8_RGBA:
+		matchPixels<euclase::OctetRGBA>(image, seed, tolerance, t);
+		return;
+	case euclase::Image::Format_F16_RGBA:
+		matchPixels<euclase::Float16RGBA>(image, seed, tolerance, t);
+		return;
+	case euclase::Image::Format_F32_RGBA:
+		matchPixels<euclase::Float32RGBA>(image, seed, tolerance, t);
+		return;
+	}
+	image = image.convertToFormat(euclase::Image::Format_F32_RGBA);
+	if (image) {
+		matchPixels<euclase::Float32RGBA>(image, seed, tolerance, t);
+	}
+}
+
+/**
+ * @brief タイルの中の4近傍の連結成分に番号を付ける
+ *
+ * 走査線単位で塗りつぶす。1行ごとに左右へ広げてから、上下の行の続きをスタックに積む
+ */
+void labelTile(TileContext *t)
+{
+	const int n = t->size;
+	uint8_t const *match = t->match.data();
+	t->labels.assign((size_t)n * n, NONE);
+	uint16_t *labels = t->labels.data();
+	auto open = [&](int x, int y){
+		size_t i = (size_t)n * y + x;
+		return match[i] && labels[i] == NONE;
+	};
+	std::vector<std::pair<int, int>> stack;
+	int count = 0;
+	for (int y = 0; y < n; y++) {
+		for (int x = 0; x < n; x++) {
+			if (!open(x, y)) continue;
+			const uint16_t label = count++;
+			stack.emplace_back(x, y);
+			while (!stack.empty()) {
+				auto [sx, sy] = stack.back();
+				stack.pop_back();
+				if (!open(sx, sy)) continue;
+				int l = sx;
+				int r = sx;
+				while (l > 0 && open(l - 1, sy)) l--;
+				while (r + 1 < n && open(r + 1, sy)) r++;
+				std::fill(labels + (size_t)n * sy + l, labels + (size_t)n * sy + r + 1, label);
+				for (int ny = sy - 1; ny <= sy + 1; ny += 2) {
+					if (ny < 0 || ny >= n) continue;
+					for (int i = l; i <= r; i++) {
+						if (open(i, ny) && (i == l || !open(i - 1, ny))) { // 区間の先頭だけ積む
+							stack.emplace_back(i, ny);
+						}
+					}
+				}
+			}
+		}
+	}
+	t->count = count;
+}
+
+/**
+ * @brief タイルの境界の連結成分の番号
+ */
+struct Edges {
+	std::vector<uint16_t> top;
+	std::vector<uint16_t> bottom;
+	std::vector<uint16_t> left;
+	std::vector<uint16_t> right;
+};
+
+uint32_t find(std::vector<uint32_t> *parent, uint32_t i)
+{
+	while ((*parent)[i] != i) {
+		(*parent)[i] = (*parent)[(*parent)[i]]; // 経路を半分に縮める
+		i = (*parent)[i];
+	}
+	return i;
+}
+
+void unite(std::vector<uint32_t> *parent, uint32_t a, uint32_t b)
+{
+	a = find(parent, a);
+	b = find(parent, b);
+	if (a < b) std::swap(a, b);
+	if (a != b) {
+		(*parent)[a] = b;
+	}
+}
+
+} // namespace
+
+/**
+ * @param cols 横のタイル数
+ * @param rows 縦のタイル数
+ * @param tile_size タイルの大きさ
+ * @param tiles 行ごとに左から並べたタイル。空の画像は透明として扱う
+ */
+euclase::FloodFill::FloodFill(int cols, int rows, int tile_size, std::vector<Image> const &tiles)
+	: cols_(cols)
+	, rows_(rows)
+	, tile_size_(tile_size)
+	, tiles_(tiles)
+	, right_(cols * tile_size)
+	, bottom_(rows * tile_size)
+{
+}
+
+/**
+ * @brief 塗りつぶせる範囲を限定する
+ */
+void euclase::FloodFill::setBounds(int x, int y, int w, int h)
+{
+	left_ = std::max(0, x);
+	top_ = std::max(0, y);
+	right_ = std::min(cols_ * tile_size_, x + w);
+	bottom_ = std::min(rows_ * tile_size_, y + h);
+}
+
+/**
+ * @brief 塗りつぶす範囲を求める
+ * @param x 起点（格子の左上からの座標）
+ * @param y 起点（格子の左上からの座標）
+ * @param tolerance 色の許容差（0..1）
+ * @param contiguous falseなら、つながっていなくても色の近い画素を全て選ぶ
+ * @return タイルごとのマスク（U8_Grayscale、選ばれた画素は255）。選ばれた画素が無いタイルは空の画像
+ */
+std::vector<euclase::Image> euclase::FloodFill::run(int x, int y, float tolerance, bool contiguous, CancelToken const &abort) const
+{
+	const int n = tile_size_;
+	const int count = cols_ * rows_;
+	std::vector<Image> masks(count);
+	if (x < left_ || y < top_ || x >= right_ || y >= bottom_) return masks;
+	if ((int)tiles_.size() != count) return masks;
+
+	const int seed_tile = cols_ * (y / n) + x / n;
+	const int seed_x = x % n;
+	const int seed_y = y % n;
+
+	// 起点の色
+	Key seed = key(Float32RGBA(0.0f, 0.0f, 0.0f, 0.0f));
+	if (Image const &tile = tiles_[seed_tile]) {
+		Image image = tile.toHost().convertToFormat(Image::Format_F32_RGBA);
+		seed = key(((Float32RGBA const *)image.scanLine(seed_y))[seed_x]);
+	}
+
+	auto context = [&](int i){
+		TileContext t;
+		t.size = n;
+		const int tx = n * (i % cols_);
+		const int ty = n * (i / cols_);
+		t.x0 = std::max(0, left_ - tx);
+		t.y0 = std::max(0, top_ - ty);
+		t.x1 = std::min(n, right_ - tx);
+		t.y1 = std::min(n, bottom_ - ty);
+		return t;
+	};
+	auto makeMask = [&](TileContext const &t, std::vector<uint8_t> const &selected){
+		Image mask(n, n, Image::Format_U8_Grayscale);
+		for (int j = 0; j < n; j++) {
+			uint8_t *d = mask.scanLine(j);
+			for (int i = 0; i < n; i++) {
+				size_t k = (size_t)n * j + i;
+				d[i] = contiguous ? (t.labels[k] != NONE && selected[t.labels[k]] ? 255 : 0) : (t.match[k] ? 255 : 0);
+			}
+		}
+		return mask;
+	};
+
+	if (!contiguous) { // つながりを見ないならタイルごとに独立
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < count; i++) {
+			if (abort.canceled()) continue;
+			TileContext t = context(i);
+			matchTile(tiles_[i], seed, tolerance, &t);
+			if (std::find(t.match.begin(), t.match.end(), 1) != t.match.end()) {
+				masks[i] = makeMask(t, {});
+			}
+		}
+		if (abort.canceled()) return {};
+		return masks;
+	}
+
+	// タイルごとに連結成分を求め、境界の番号だけを残す
+	std::vector<int> counts(count);
+	std::vector<Edges> edges(count);
+	uint16_t seed_label = NONE;
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < count; i++) {
+		if (abort.canceled()) continue;
+		TileContext t = context(i);
+		matchTile(tiles_[i], seed, tolerance, &t);
+		labelTile(&t);
+		counts[i] = t.count;
+		Edges &e = edges[i];
+		e.top.assign(t.labels.begin(), t.labels.begin() + n);
+		e.bottom.assign(t.labels.end() - n, t.labels.end());
+		e.left.resize(n);
+		e.right.resize(n);
+		for (int j = 0; j < n; j++) {
+			e.left[j] = t.labels[(size_t)n * j];
+			e.right[j] = t.labels[(size_t)n * j + n - 1];
+		}
+		if (i == seed_tile) {
+			seed_label = t.labels[(size_t)n * seed_y + seed_x];
+		}
+	}
+	if (abort.canceled()) return {};
+	if (seed_label == NONE) return masks;
+
+	// 境界でつながる成分を統合する
+	std::vector<uint32_t> offsets(count + 1, 0);
+	for (int i = 0; i < count; i++) {
+		offsets[i + 1] = offsets[i] + counts[i];
+	}
+	std::vector<uint32_t> parent(offsets[count]);
+	for (uint32_t i = 0; i < parent.size(); i++) {
+		parent[i] = i;
+	}
+	for (int i = 0; i < count; i++) {
+		auto link = [&](std::vector<uint16_t> const &a, int j, std::vector<uint16_t> const &b){
+			for (int k = 0; k < n; k++) {
+				if (a[k] != NONE && b[k] != NONE && (k == 0 || a[k] != a[k - 1] || b[k] != b[k - 1])) {
+					unite(&parent, offsets[i] + a[k], offsets[j] + b[k]);
+				}
+			}
+		};
+		if (i % cols_ + 1 < cols_) {
+			link(edges[i].right, i + 1, edges[i + 1].left);
+		}
+		if (i / cols_ + 1 < rows_) {
+			link(edges[i].bottom, i + cols_, edges[i + cols_].top);
+		}
+	}
+	for (uint32_t i = 0; i < parent.size(); i++) {
+		parent[i] = find(&parent, i); // 全て根を直接指すようにしておけば、以降は並列に読める
+	}
+	edges.clear();
+	const uint32_t root = parent[offsets[seed_tile] + seed_label];
+
+	// 起点とつながる成分を含むタイルだけ、連結成分を求め直してマスクを作る
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < count; i++) {
+		if (abort.canceled()) continue;
+		std::vector<uint8_t> selected(counts[i]);
+		bool any = false;
+		for (int k = 0; k < counts[i]; k++) {
+			selected[k] = parent[offsets[i] + k] == root;
+			any = any || selected[k];
+		}
+		if (!any) continue;
+		TileContext t = context(i);
+		matchTile(tiles_[i], seed, tolerance, &t);
+		labelTile(&t);
+		masks[i] = makeMask(t, selected);
+	}
+	if (abort.canceled()) return {};
+	return masks;
+}
@@ -0,0 +1,33 @@
+#ifndef FLOODFILL_H
+#define FLOODFILL_H
+
+#include "euclase.h"
+#include <vector>
+
+namespace euclase {
+
+/**
+ * @brief タイルに分けた画像の塗りつぶし範囲を求める
+ *
+ * タイルの中の連結成分をタイルごとに並列に求めてから、タイルの境界でつながる成分を統合する
+ * 画像全体の大きさの作業領域を持たないので、大きな画像でもタイル単位のメモリで処理できる
+ */
+class FloodFill {
+private:
+	int cols_;
+	int rows_;
+	int tile_size_;
+	std::vector<Image> tiles_;
+	int left_ = 0; // 塗りつぶせる範囲（格子の左上からの座標）
+	int top_ = 0;
+	int right_ = 0;
+	int bottom_ = 0;
+public:
+	FloodFill(int cols, int rows, int tile_size, std::vector<Image> const &tiles);
+	void setBounds(int x, int y, int w, int h);
+	std::vector<Image> run(int x, int y, float tolerance, bool contiguous, CancelToken const &abort) const;
+};
+
+} // namespace euclase
+
+#endif // FLOODFILL_H
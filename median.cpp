@@ -1,456 +1,709 @@
-
-#include "median.h"
-#ifdef _WIN32
-#define _USE_MATH_DEFINES
-#endif
-#include <math.h>
-#include <vector>
-#include <string.h>
-#include <stdint.h>
-#include "euclase.h"
-#include "FilterStatus.h"
-
-namespace {
-
-using OctetRGBA = euclase::OctetRGBA;
-using OctetGrayA = euclase::OctetGrayA;
-
-//
-
-class median_t {
-private:
-	int map256_[256];
-	int map16_[16];
-public:
-	median_t()
-	{
-		clear();
-	}
-	void clear()
-	{
-		for (int i = 0; i < 256; i++) {
-			map256_[i] = 0;
-		}
-		for (int i = 0; i < 16; i++) {
-			map16_[i] = 0;
-		}
-	}
-	void insert(uint8_t n)
-	{
-		map256_[n]++;
-		map16_[n >> 4]++;
-	}
-	void remove(uint8_t n)
-	{
-		map256_[n]--;
-		map16_[n >> 4]--;
-	}
-	uint8_t get()
-	{
-		int left, right;
-		int lower, upper;
-		lower = 0;
-		upper = 0;
-		left = 0;
-		right = 15;
-		while (left < right) {
-			if (lower + map16_[left] < upper + map16_[right]) {
-				lower += map16_[left];
-				left++;
-			} else {
-				upper += map16_[right];
-				right--;
-			}
-		}
-		left *= 16;
-		right = left + 15;
-		while (left < right) {
-			if (lower + map256_[left] < upper + map256_[right]) {
-				lower += map256_[left];
-				left++;
-			} else {
-				upper += map256_[right];
-				right--;
-			}
-		}
-		return left;
-	}
-
-};
-
-struct median_filter_rgb_t {
-	median_t r;
-	median_t g;
-	median_t b;
-	void insert(OctetRGBA const &p)
-	{
-		r.insert(p.r);
-		g.insert(p.g);
-		b.insert(p.b);
-	}
-	void remove(OctetRGBA const &p)
-	{
-		r.remove(p.r);
-		g.remove(p.g);
-		b.remove(p.b);
-	}
-	OctetRGBA get(uint8_t a)
-	{
-		return OctetRGBA(r.get(), g.get(), b.get(), a);
-	}
-};
-
-struct median_filter_y_t {
-	median_t l;
-	void insert(OctetGrayA const &p)
-	{
-		l.insert(p.v);
-	}
-	void remove(OctetGrayA const &p)
-	{
-		l.remove(p.v);
-	}
-	OctetGrayA get(uint8_t a)
-	{
-		return OctetGrayA(l.get(), a);
-	}
-};
-
-class minimize_t {
-private:
-	int map256_[256];
-	int map16_[16];
-public:
-	minimize_t()
-	{
-		clear();
-	}
-	void clear()
-	{
-		for (int i = 0; i < 256; i++) {
-			map256_[i] = 0;
-		}
-		for (int i = 0; i < 16; i++) {
-			map16_[i] = 0;
-		}
-	}
-	void insert(uint8_t n)
-	{
-		map256_[n]++;
-		map16_[n >> 4]++;
-	}
-	void remove(uint8_t n)
-	{
-		map256_[n]--;
-		map16_[n >> 4]--;
-	}
-	uint8_t get()
-	{
-		int left, right;
-		for (left = 0; left < 16; left++) {
-			if (map16_[left] != 0) {
-				left *= 16;
-				right = left + 16;
-				while (left < right) {
-					if (map256_[left] != 0) {
-						return left;
-					}
-					left++;
-				}
-				break;
-			}
-		}
-		return 0;
-	}
-
-};
-
-struct minimize_filter_rgb_t {
-	minimize_t r;
-	minimize_t g;
-	minimize_t b;
-	void insert(OctetRGBA const &p)
-	{
-		r.insert(p.r);
-		g.insert(p.g);
-		b.insert(p.b);
-	}
-	void remove(OctetRGBA const &p)
-	{
-		r.remove(p.r);
-		g.remove(p.g);
-		b.remove(p.b);
-	}
-	OctetRGBA get(uint8_t a)
-	{
-		return OctetRGBA(r.get(), g.get(), b.get(), a);
-	}
-};
-
-struct minimize_filter_y_t {
-	minimize_t l;
-	void insert(OctetGrayA const &p)
-	{
-		l.insert(p.v);
-	}
-	void remove(OctetGrayA const &p)
-	{
-		l.remove(p.v);
-	}
-	OctetGrayA get(uint8_t a)
-	{
-		return OctetGrayA(l.get(), a);
-	}
-};
-
-
-class maximize_t {
-private:
-	int map256_[256];
-	int map16_[16];
-public:
-	maximize_t()
-	{
-		clear();
-	}
-	void clear()
-	{
-		for (int i = 0; i < 256; i++) {
-			map256_[i] = 0;
-		}
-		for (int i = 0; i < 16; i++) {
-			map16_[i] = 0;
-		}
-	}
-	void insert(uint8_t n)
-	{
-		map256_[n]++;
-		map16_[n >> 4]++;
-	}
-	void remove(uint8_t n)
-	{
-		map256_[n]--;
-		map16_[n >> 4]--;
-	}
-	uint8_t get()
-	{
-		int left, right;
-		right = 16;
-		while (right > 0) {
-			right--;
-			if (map16_[right] != 0) {
-				left = right * 16;
-				right = left + 16;
-				while (left < right) {
-					right--;
-					if (map256_[right] != 0) {
-						return right;
-					}
-				}
-				break;
-			}
-		}
-		return 0;
-	}
-
-};
-
-struct maximize_filter_rgb_t {
-	maximize_t r;
-	maximize_t g;
-	maximize_t b;
-	void insert(OctetRGBA const &p)
-	{
-		r.insert(p.r);
-		g.insert(p.g);
-		b.insert(p.b);
-	}
-	void remove(OctetRGBA const &p)
-	{
-		r.remove(p.r);
-		g.remove(p.g);
-		b.remove(p.b);
-	}
-	OctetRGBA get(uint8_t a)
-	{
-		return OctetRGBA(r.get(), g.get(), b.get(), a);
-	}
-};
-
-struct maximize_filter_y_t {
-	maximize_t l;
-	void insert(OctetGrayA const &p)
-	{
-		l.insert(p.v);
-	}
-	void remove(OctetGrayA const &p)
-	{
-		l.remove(p.v);
-	}
-	OctetGrayA get(uint8_t a)
-	{
-		return OctetGrayA(l.get(), a);
-	}
-};
-
-
-
-template <typename PIXEL, typename FILTER> euclase::Image Filter(euclase::Image image, int radius, FilterStatus *status)
-{
-	auto isInterrupted = [&](){
-		return status && status->cancel && *status->cancel;
-	};
-	auto progress = [&](float v){
-		if (status && status->progress) {
-			*status->progress = v;
-		}
-	};
-	int w = image.width();
-	int h = image.height();
-	euclase::Image newimage(w, h, image.format());
-	if (w > 0 && h > 0) {
-		std::vector<int> shape(radius * 2 + 1);
-		{
-			for (int y = 0; y < radius; y++) {
-				double t = asin((radius - (y + 0.5)) / radius);
-				double x = floor(cos(t) * radius + 0.5);
-				shape[y] = x;
-				shape[radius * 2 - y] = x;
-			}
-			shape[radius] = radius;
-		}
-
-		int sw = w + radius * 2;
-		int sh = h + radius * 2;
-		std::vector<PIXEL> src(sw * sh);
-		PIXEL *dst = (PIXEL *)newimage.scanLine(0);
-
-		for (int y = 0; y < h; y++) {
-			if (isInterrupted()) return {};
-			PIXEL *d = (PIXEL *)&src[(y + radius) * sw + radius];
-			PIXEL *s = (PIXEL *)image.scanLine(y);
-			memcpy(d, s, sizeof(PIXEL) * w);
-		}
-
-		std::atomic_int rows = 0;
-
-#pragma omp parallel for // schedule(static, 8)
-		for (int y = 0; y < h; y++) {
-			if (isInterrupted()) continue;
-
-			FILTER filter;
-			for (int i = 0; i < radius * 2 + 1; i++) {
-				for (int x = 0; x < shape[i]; x++) {
-					PIXEL rgb = src[(y + i) * sw + radius + x];
-					if (rgb.a > 0) {
-						filter.insert(rgb);
-					}
-				}
-			}
-			for (int x = 0; x < w; x++) {
-				if (isInterrupted()) break;
-
-				for (int i = 0; i < radius * 2 + 1; i++) {
-					PIXEL pix = src[(y + i) * sw + x + radius + shape[i]];
-					if (pix.a > 0) {
-						filter.insert(pix);
-					}
-				}
-
-				PIXEL pix = src[(radius + y) * sw + radius + x];
-				if (pix.a > 0) {
-					pix = filter.get(pix.a);
-				}
-				dst[y * w + x] = pix;
-
-				for (int i = 0; i < radius * 2 + 1; i++) {
-					PIXEL pix = src[(y + i) * sw + x + radius - shape[i]];
-					if (pix.a > 0) {
-						filter.remove(pix);
-					}
-				}
-			}
-			progress((float)++rows / h);
-		}
-	}
-	progress(1.0f);
-	return newimage;
-}
-
-} // namespace
-
-enum Operation {
-	Median,
-	Maximize,
-	Minimize,
-};
-
-euclase::Image perform_filter_(Operation op, euclase::Image const &image, int radius, FilterStatus *status)
-{
-	if (image.memtype() != euclase::Image::Host) {
-		return perform_filter_(op, image.toHost(), radius, status);
-	}
-
-	auto format = image.format();
-
-	if (format == euclase::Image::Format_F32_RGBA) {
-		euclase::Image tmpimg = image.convertToFormat(euclase::Image::Format_U8_RGBA).toHost();
-		tmpimg = perform_filter_(op, tmpimg, radius, status);
-		return tmpimg.makeFPImage();
-	}
-	if (format == euclase::Image::Format_F32_GrayscaleA) {
-		euclase::Image tmpimg = image.convertToFormat(euclase::Image::Format_U8_GrayscaleA).toHost();
-		tmpimg = perform_filter_(op, tmpimg, radius, status);
-		return tmpimg.convertToFormat(format);
-	}
-
-	if (format == euclase::Image::Format_U8_RGB) {
-		euclase::Image tmpimg = image.convertToFormat(euclase::Image::Format_U8_RGBA).toHost();
-		tmpimg = perform_filter_(op, tmpimg, radius, status);
-		return tmpimg.convertToFormat(format);
-	}
-	if (format == euclase::Image::Format_U8_Grayscale) {
-		euclase::Image tmpimg = image.convertToFormat(euclase::Image::Format_U8_GrayscaleA).toHost();
-		tmpimg = perform_filter_(op, tmpimg, radius, status);
-		return tmpimg.convertToFormat(format);
-	}
-
-	if (format == euclase::Image::Format_U8_RGBA) {
-		switch (op) {
-		case Median:
-			return Filter<OctetRGBA, median_filter_rgb_t>(image, radius, status);
-		case Maximize:
-			return Filter<OctetRGBA, maximize_filter_rgb_t>(image, radius, status);
-		case Minimize:
-			return Filter<OctetRGBA, minimize_filter_rgb_t>(image, radius, status);
-		}
-	} else if (format == euclase::Image::Format_U8_GrayscaleA) {
-		switch (op) {
-		case Median:
-			return Filter<OctetGrayA, median_filter_y_t>(image, radius, status);
-		case Maximize:
-			return Filter<OctetGrayA, maximize_filter_y_t>(image, radius, status);
-		case Minimize:
-			return Filter<OctetGrayA, minimize_filter_y_t>(image, radius, status);
-		}
-	}
-	return {};
-}
-
-euclase::Image filter_median(euclase::Image const &image, int radius, FilterStatus *status)
-{
-	return perform_filter_(Median, image, radius, status);
-}
-
-euclase::Image filter_maximize(euclase::Image const &image, int radius, FilterStatus *status)
-{
-	return perform_filter_(Maximize, image, radius, status);
-}
-
-euclase::Image filter_minimize(euclase::Image const &image, int radius, FilterStatus *status)
-{
-	return perform_filter_(Minimize, image, radius, status);
-}
-
-
-
+
+#include "median.h"
+#ifdef _WIN32
+#define _USE_MATH_DEFINES
+#endif
+#include <math.h>
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include "euclase.h"
+#include "FilterStatus.h"
+
+namespace {
+
+using OctetRGBA = euclase::OctetRGBA;
+using OctetGrayA = euclase::OctetGrayA;
+
+//
+
+/**
+ * @brief 画素の種類ごとのチャンネルの読み書き
+ *
+ * 8ビットの形式は値をそのままヒストグラムの区間にする
+ * 浮動小数点の形式は、画像に現れる値を並べた表の番号を12ビットの区間に割り当てるので、[0, 1] の外の値もそのまま扱える
+ */
+template <typename PIXEL> struct PixelTraits;
+
+template <> struct PixelTraits<OctetRGBA> {
+	static constexpr int CHANNELS = 3;
+	static constexpr int BITS = 8;
+	static constexpr bool LEVELS = false; // 値の表で量子化するならtrue
+	static bool valid(OctetRGBA const &p)
+	{
+		return p.a > 0;
+	}
+	static float get(OctetRGBA const &p, int c)
+	{
+		return c == 0 ? p.r : (c == 1 ? p.g : p.b);
+	}
+	static void set(OctetRGBA *p, int c, float v)
+	{
+		uint8_t t = (uint8_t)std::max(0.0f, std::min(255.0f, v));
+		(c == 0 ? p->r : (c == 1 ? p->g : p->b)) = t;
+	}
+};
+
+template <> struct PixelTraits<OctetGrayA> {
+	static constexpr int CHANNELS = 1;
+	static constexpr int BITS = 8;
+	static constexpr bool LEVELS = false;
+	static bool valid(OctetGrayA const &p)
+	{
+		return p.a > 0;
+	}
+	static float get(OctetGrayA const &p, int /*c*/)
+	{
+		return p.v;
+	}
+	static void set(OctetGrayA *p, int /*c*/, float v)
+	{
+		p->v = (uint8_t)std::max(0.0f, std::min(255.0f, v));
+	}
+};
+
+template <> struct PixelTraits<euclase::Float32RGBA> {
+	static constexpr int CHANNELS = 3;
+	static constexpr int BITS = 12;
+	static constexpr bool LEVELS = true;
+	static bool valid(euclase::Float32RGBA const &p)
+	{
+		return p.a > 0;
+	}
+	static float get(euclase::Float32RGBA const &p, int c)
+	{
+		return c == 0 ? p.r : (c == 1 ? p.g : p.b);
+	}
+	static void set(euclase::Float32RGBA *p, int c, float v)
+	{
+		(c == 0 ? p->r : (c == 1 ? p->g : p->b)) = v;
+	}
+};
+
+template <> struct PixelTraits<euclase::Float16RGBA> {
+	static constexpr int CHANNELS = 3;
+	static constexpr int BITS = 12;
+	static constexpr bool LEVELS = true;
+	static bool valid(euclase::Float16RGBA const &p)
+	{
+		return (float)p.a > 0;
+	}
+	static float get(euclase::Float16RGBA const &p, int c)
+	{
+		return c == 0 ? p.r : (c == 1 ? p.g : p.b);
+	}
+	static void set(euclase::Float16RGBA *p, int c, float v)
+	{
+		(c == 0 ? p->r : (c == 1 ? p->g : p->b)) = v;
+	}
+};
+
+template <> struct PixelTraits<euclase::Float32GrayA> {
+	static constexpr int CHANNELS = 1;
+	static constexpr int BITS = 12;
+	static constexpr bool LEVELS = true;
+	static bool valid(euclase::Float32GrayA const &p)
+	{
+		return p.a > 0;
+	}
+	static float get(euclase::Float32GrayA const &p, int /*c*/)
+	{
+		return p.v;
+	}
+	static void set(euclase::Float32GrayA *p, int /*c*/, float v)
+	{
+		p->v = v;
+	}
+};
+
+/**
+ * @brief 定数時間のメディアンフィルタ（Perreault–Hébert）
+ *
+ * 列ごとにヒストグラムを持ち、行を進むたびに各列へ1画素ずつ出し入れする
+ * カーネルのヒストグラムは右端の列を足して左端の列を引いて更新するので、半径によらず1画素あたり一定の時間で済む
+ * ヒストグラムは粗い段と細かい段の2段で、細かい段は中央値を含む区間だけを必要になったときに追いつかせる
+ * 区間に複数の値が入るときは、値ごとの数を中央値を含む粗い区間の分だけ持ち、細かい段と同じように列単位で追いつかせて、正確な値を選ぶ
+ * 列の画素は粗い区間ごとのリストにつないでおくので、出し入れは1画素あたり一定の時間で、追いつかせるときはその列のその区間の画素だけをたどる
+ */
+template <int BITS> class MedianPlane {
+public:
+	static constexpr int BINS = 1 << BITS;
+	static constexpr int FINE = 1 << (BITS / 2); // 細かい段の1区間の幅
+	static constexpr int COARSE = BINS / FINE; // 粗い段の区間の数
+
+	/**
+	 * @param src 量子化した値（w×h）
+	 * @param valid 有効な画素なら非0（w×h）。透明な画素は数えない
+	 * @param level 値の表の番号（w×h）。nullptrなら src の区間がそのまま値を表す
+	 * @param first 区間ごとの値の表の先頭の番号（BINS+1 個）。level と一緒に渡す
+	 * @param w 幅
+	 * @param h 高さ
+	 * @param radius 正方形のカーネルの半径
+	 * @param x0 出力する列の先頭
+	 * @param x1 出力する列の終端
+	 * @param dst 中央値。level を渡したら値の表の番号、渡さなければ区間の番号（w×h）
+	 * @param canceled 中断するならtrueを返す関数
+	 * @return 中断されたらfalse
+	 */
+	template <typename CANCELED> static bool run(uint16_t const *src, uint8_t const *valid, uint32_t const *level, uint32_t const *first, int w, int h, int radius, int x0, int x1, uint32_t *dst, CANCELED canceled)
+	{
+		const int c0 = std::max(0, x0 - radius); // ヒストグラムを持つ列の範囲
+		const int c1 = std::min(w, x1 + radius);
+		const int cw = c1 - c0;
+		std::vector<uint16_t> col_coarse((size_t)cw * COARSE);
+		std::vector<uint16_t> col_fine((size_t)cw * BINS);
+		std::vector<uint16_t> col_count(cw);
+		// 列の画素を粗い区間ごとにつなぐ双方向リスト。節点は列ごとに span 個で、行 y の画素は y % span 番目
+		const int span = radius * 2 + 1;
+		const size_t nodes = level ? (size_t)cw * span : 0;
+		std::vector<int32_t> list_head(level ? (size_t)cw * COARSE : 0, -1);
+		std::vector<int32_t> list_next(nodes);
+		std::vector<int32_t> list_prev(nodes);
+		std::vector<uint32_t> node_level(nodes); // 節点の画素の値の表の番号
+
+		auto update_column = [&](int y, int delta){
+			for (int x = c0; x < c1; x++) {
+				size_t i = (size_t)y * w + x;
+				if (!valid[i]) continue;
+				int v = src[i];
+				int c = x - c0;
+				if (level) {
+					int32_t *head = &list_head[(size_t)c * COARSE + v / FINE];
+					const int32_t node = c * span + y % span;
+					if (delta > 0) {
+						node_level[node] = level[i];
+						list_prev[node] = -1;
+						list_next[node] = *head;
+						if (*head >= 0) list_prev[*head] = node;
+						*head = node;
+					} else {
+						const int32_t prev = list_prev[node];
+						const int32_t next = list_next[node];
+						(prev >= 0 ? list_next[prev] : *head) = next;
+						if (next >= 0) list_prev[next] = prev;
+					}
+				}
+				col_coarse[(size_t)c * COARSE + v / FINE] += delta;
+				col_fine[(size_t)c * BINS + v] += delta;
+				col_count[c] += delta;
+			}
+		};
+
+		std::vector<int> coarse(COARSE);
+		std::vector<int> fine(BINS);
+		std::vector<int> fine_at(COARSE); // 細かい段の各区間がどの位置のカーネルを表しているか
+		int count = 0;
+
+		auto add_column = [&](int x, int sign){
+			if (x < c0 || x >= c1) return;
+			int c = x - c0;
+			uint16_t const *p = &col_coarse[(size_t)c * COARSE];
+			for (int k = 0; k < COARSE; k++) {
+				coarse[k] += sign * p[k];
+			}
+			count += sign * col_count[c];
+		};
+		auto add_fine = [&](int x, int k, int sign){
+			if (x < c0 || x >= c1) return;
+			uint16_t const *p = &col_fine[(size_t)(x - c0) * BINS + k * FINE];
+			int *f = &fine[k * FINE];
+			for (int b = 0; b < FINE; b++) {
+				f[b] += sign * p[b];
+			}
+		};
+
+		// 値ごとの数
+		std::vector<int> within(level ? first[BINS] : 0);
+		std::vector<int> within_at(COARSE); // 値ごとの数の各区間がどの位置のカーネルを表しているか
+		auto add_within = [&](int x, int k, int sign){
+			if (x < c0 || x >= c1) return;
+			for (int32_t node = list_head[(size_t)(x - c0) * COARSE + k]; node >= 0; node = list_next[node]) {
+				within[node_level[node]] += sign;
+			}
+		};
+
+		for (int y = 0; y < radius && y < h; y++) {
+			update_column(y, 1);
+		}
+		for (int y = 0; y < h; y++) {
+			if (canceled()) return false;
+
+			if (y + radius < h) {
+				update_column(y + radius, 1);
+			}
+
+			std::fill(coarse.begin(), coarse.end(), 0);
+			std::fill(fine_at.begin(), fine_at.end(), -(1 << 30));
+			std::fill(within_at.begin(), within_at.end(), -(1 << 30));
+			count = 0;
+			for (int x = x0 - radius; x < x0 + radius; x++) {
+				add_column(x, 1);
+			}
+			for (int x = x0; x < x1; x++) {
+				add_column(x + radius, 1);
+				uint32_t *d = dst + (size_t)y * w + x;
+				if (count > 0) {
+					const int t = (count - 1) / 2; // 中央値の順位
+					int sum = 0;
+					int k = 0;
+					while (sum + coarse[k] <= t) {
+						sum += coarse[k];
+						k++;
+					}
+					// 細かい段の区間 k を現在の位置に追いつかせる
+					if (x - fine_at[k] > radius * 2) {
+						std::fill(&fine[k * FINE], &fine[k * FINE] + FINE, 0);
+						for (int j = x - radius; j <= x + radius; j++) {
+							add_fine(j, k, 1);
+						}
+					} else {
+						for (int j = fine_at[k] + 1; j <= x; j++) {
+							add_fine(j + radius, k, 1);
+							add_fine(j - radius - 1, k, -1);
+						}
+					}
+					fine_at[k] = x;
+					int const *f = &fine[k * FINE];
+					int b = 0;
+					while (sum + f[b] <= t) {
+						sum += f[b];
+						b++;
+					}
+					const int bin = k * FINE + b;
+					if (!level) {
+						*d = bin;
+					} else if (first[bin + 1] - first[bin] == 1) {
+						*d = first[bin];
+					} else {
+						// 値ごとの数の区間 k を現在の位置に追いつかせる
+						if (x - within_at[k] > radius * 2) {
+							std::fill(&within[first[k * FINE]], &within[first[(k + 1) * FINE]], 0);
+							for (int j = x - radius; j <= x + radius; j++) {
+								add_within(j, k, 1);
+							}
+						} else {
+							for (int j = within_at[k] + 1; j <= x; j++) {
+								add_within(j + radius, k, 1);
+								add_within(j - radius - 1, k, -1);
+							}
+						}
+						within_at[k] = x;
+						uint32_t i = first[bin];
+						while (sum + within[i] <= t) {
+							sum += within[i];
+							i++;
+						}
+						*d = i;
+					}
+				} else {
+					*d = 0;
+				}
+				add_column(x - radius, -1);
+			}
+
+			if (y - radius >= 0) {
+				update_column(y - radius, -1);
+			}
+		}
+		return true;
+	}
+};
+
+/**
+ * @brief 定数時間のメディアンフィルタ
+ * @param image 画像
+ * @param radius 半径
+ * @param status 中断と進捗
+ *
+ * カーネルは円と同じ面積の正方形で近似する
+ * チャンネルごと、列の帯ごとに分けて並列に処理する
+ */
+template <typename PIXEL> euclase::Image ConstantTimeMedian(euclase::Image const &image, int radius, FilterStatus *status)
+{
+	using Traits = PixelTraits<PIXEL>;
+	using Plane = MedianPlane<Traits::BITS>;
+
+	auto isInterrupted = [&](){
+		return status && status->cancel.canceled();
+	};
+	auto progress = [&](float v){
+		if (status && status->progress) {
+			*status->progress = v;
+		}
+	};
+
+	const int w = image.width();
+	const int h = image.height();
+	euclase::Image newimage = image.copy();
+	if (w < 1 || h < 1 || radius < 1) return newimage;
+
+	const int r = std::max(1, (int)floor(radius * sqrt(M_PI) / 2 + 0.5)); // 円と同じ面積になる正方形の半径
+
+	const size_t n = (size_t)w * h;
+	std::vector<uint8_t> valid(n);
+	std::vector<uint16_t> values[Traits::CHANNELS]; // ヒストグラムの区間
+	std::vector<uint32_t> levels[Traits::CHANNELS]; // 値の表の番号
+	std::vector<float> table[Traits::CHANNELS]; // 値の表（昇順、重複なし）
+	std::vector<uint32_t> first[Traits::CHANNELS]; // 区間ごとの値の表の先頭の番号
+	std::vector<uint32_t> medians[Traits::CHANNELS];
+	for (int c = 0; c < Traits::CHANNELS; c++) {
+		values[c].resize(n);
+		medians[c].resize(n);
+	}
+	auto value = [&](PIXEL const &p, int c){
+		float v = Traits::get(p, c);
+		return std::isnan(v) ? 0.0f : v;
+	};
+#pragma omp parallel for
+	for (int y = 0; y < h; y++) {
+		PIXEL const *s = (PIXEL const *)image.scanLine(y);
+		for (int x = 0; x < w; x++) {
+			size_t i = (size_t)y * w + x;
+			valid[i] = Traits::valid(s[x]);
+			if (!Traits::LEVELS) {
+				for (int c = 0; c < Traits::CHANNELS; c++) {
+					values[c][i] = (uint16_t)value(s[x], c);
+				}
+			}
+		}
+	}
+	if (Traits::LEVELS) {
+#pragma omp parallel for
+		for (int c = 0; c < Traits::CHANNELS; c++) {
+			// 値の順に並べて、値の表と各画素の番号を作る
+			std::vector<std::pair<float, uint32_t>> sorted;
+			for (int y = 0; y < h; y++) {
+				PIXEL const *s = (PIXEL const *)image.scanLine(y);
+				for (int x = 0; x < w; x++) {
+					size_t i = (size_t)y * w + x;
+					if (valid[i]) {
+						sorted.emplace_back(value(s[x], c), (uint32_t)i);
+					}
+				}
+			}
+			std::sort(sorted.begin(), sorted.end());
+			std::vector<float> &t = table[c];
+			levels[c].resize(n);
+			for (auto const &e : sorted) {
+				if (t.empty() || t.back() != e.first) {
+					t.push_back(e.first);
+				}
+				levels[c][e.second] = (uint32_t)t.size() - 1;
+			}
+
+			// 値の表を区間に均等に割り当てる。値の種類が区間の数以下なら、1つの区間に1つの値
+			const uint64_t d = t.size();
+			const uint64_t bins = Plane::BINS;
+			first[c].resize(bins + 1);
+			for (uint64_t k = 0; k <= bins; k++) {
+				first[c][k] = (uint32_t)(d > bins ? (k * d + bins - 1) / bins : std::min(k, d));
+			}
+			for (auto const &e : sorted) {
+				uint64_t l = levels[c][e.second];
+				values[c][e.second] = (uint16_t)(d > bins ? l * bins / d : l);
+			}
+		}
+	}
+
+	const int STRIP = 256; // 1タスクが受け持つ列の数
+	const int strips = (w + STRIP - 1) / STRIP;
+	const int tasks = strips * Traits::CHANNELS;
+	std::atomic_int done = 0;
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < tasks; i++) {
+		if (isInterrupted()) continue;
+		const int c = i / strips;
+		const int x0 = (i % strips) * STRIP;
+		const int x1 = std::min(x0 + STRIP, w);
+		if (Traits::LEVELS) {
+			Plane::run(values[c].data(), valid.data(), levels[c].data(), first[c].data(), w, h, r, x0, x1, medians[c].data(), isInterrupted);
+		} else {
+			Plane::run(values[c].data(), valid.data(), nullptr, nullptr, w, h, r, x0, x1, medians[c].data(), isInterrupted);
+		}
+		progress((float)++done / tasks);
+	}
+	if (isInterrupted()) return {};
+
+#pragma omp parallel for
+	for (int y = 0; y < h; y++) {
+		PIXEL *d = (PIXEL *)newimage.scanLine(y);
+		for (int x = 0; x < w; x++) {
+			size_t i = (size_t)y * w + x;
+			if (!valid[i]) continue; // 透明な画素はそのまま
+			for (int c = 0; c < Traits::CHANNELS; c++) {
+				uint32_t m = medians[c][i];
+				Traits::set(&d[x], c, Traits::LEVELS ? table[c][m] : (float)m);
+			}
+		}
+	}
+	progress(1.0f);
+	return newimage;
+}
+
+struct Maximum {
+	static float identity()
+	{
+		return -INFINITY;
+	}
+	static float apply(float a, float b)
+	{
+		return std::max(a, b);
+	}
+};
+
+struct Minimum {
+	static float identity()
+	{
+		return INFINITY;
+	}
+	static float apply(float a, float b)
+	{
+		return std::min(a, b);
+	}
+};
+
+/**
+ * @brief 線分の構造要素で最大値（最小値）をとる（van Herk/Gil–Werman）
+ * @param plane 値（w×h）。結果で上書きする
+ * @param w 幅
+ * @param h 高さ
+ * @param a 線分の半分の長さ
+ * @param dx 線分の向き（-1, 0, 1）
+ * @param dy 線分の向き（0, 1）
+ *
+ * 線に沿って長さ 2a+1 のブロックに区切り、ブロックの先頭からの累積とブロックの末尾からの累積を作っておけば、
+ * どの窓も2つの累積の組み合わせで求まるので、線分の長さによらず1画素あたり一定の時間で済む
+ * 累積は行単位で進めるので、内側のループは行の中の連続した画素を順に処理する
+ * 画像の外は単位元（最大値なら -inf）で埋めて扱う
+ */
+template <typename OP> void line_pass(std::vector<float> *plane, int w, int h, int a, int dx, int dy)
+{
+	if (a < 1) return;
+	const int k = a * 2 + 1; // ブロックの長さ
+	const int px = a * std::abs(dx); // 余白
+	const int py = a * dy;
+	const int pw = w + px * 2;
+	const int ph = h + py * 2;
+	const float e = OP::identity();
+
+	std::vector<float> src((size_t)pw * ph, e);
+	for (int y = 0; y < h; y++) {
+		std::copy(&(*plane)[(size_t)y * w], &(*plane)[(size_t)y * w] + w, &src[(size_t)(y + py) * pw + px]);
+	}
+	std::vector<float> fwd((size_t)pw * ph); // ブロックの先頭からの累積
+	std::vector<float> bwd((size_t)pw * ph); // ブロックの末尾からの累積
+
+	if (dy == 0) { // 水平
+		for (int y = 0; y < ph; y++) {
+			float const *s = &src[(size_t)y * pw];
+			float *f = &fwd[(size_t)y * pw];
+			float *b = &bwd[(size_t)y * pw];
+			for (int x = 0; x < pw; x++) {
+				f[x] = (x % k == 0) ? s[x] : OP::apply(s[x], f[x - 1]);
+			}
+			for (int x = pw - 1; x >= 0; x--) {
+				b[x] = ((x + 1) % k == 0 || x == pw - 1) ? s[x] : OP::apply(s[x], b[x + 1]);
+			}
+		}
+	} else { // 垂直と斜め
+		const int x0 = std::max(0, dx); // 1行前の (x - dx) が範囲内になる列
+		const int x1 = std::min(pw, pw + dx);
+		for (int y = 0; y < ph; y++) {
+			float const *s = &src[(size_t)y * pw];
+			float *f = &fwd[(size_t)y * pw];
+			if (y % k == 0) {
+				std::copy(s, s + pw, f);
+				continue;
+			}
+			float const *g = &fwd[(size_t)(y - 1) * pw];
+			for (int x = 0; x < pw; x++) {
+				f[x] = s[x];
+			}
+			for (int x = x0; x < x1; x++) {
+				f[x] = OP::apply(s[x], g[x - dx]);
+			}
+		}
+		const int x2 = std::max(0, -dx); // 1行後の (x + dx) が範囲内になる列
+		const int x3 = std::min(pw, pw - dx);
+		for (int y = ph - 1; y >= 0; y--) {
+			float const *s = &src[(size_t)y * pw];
+			float *b = &bwd[(size_t)y * pw];
+			if ((y + 1) % k == 0 || y == ph - 1) {
+				std::copy(s, s + pw, b);
+				continue;
+			}
+			float const *g = &bwd[(size_t)(y + 1) * pw];
+			for (int x = 0; x < pw; x++) {
+				b[x] = s[x];
+			}
+			for (int x = x2; x < x3; x++) {
+				b[x] = OP::apply(s[x], g[x + dx]);
+			}
+		}
+	}
+
+	// 窓 [-a, a] は、始点を含むブロックの末尾側と終点を含むブロックの先頭側に分かれる
+	const int ox = a * (dy == 0 ? 1 : dx);
+	const int oy = a * dy;
+	for (int y = 0; y < h; y++) {
+		float const *b = &bwd[(size_t)(y + py - oy) * pw + px - ox];
+		float const *f = &fwd[(size_t)(y + py + oy) * pw + px + ox];
+		float *d = &(*plane)[(size_t)y * w];
+		for (int x = 0; x < w; x++) {
+			d[x] = OP::apply(b[x], f[x]);
+		}
+	}
+}
+
+/**
+ * @brief 最大値フィルタ・最小値フィルタ
+ * @param image 画像
+ * @param radius 半径
+ * @param status 中断と進捗
+ *
+ * 円形のカーネルを、水平・垂直・2方向の斜めの線分を重ねた正八角形で近似する
+ * どの線分も van Herk/Gil–Werman の方法で処理するので、半径によらず1画素あたり一定の時間で済む
+ */
+template <typename PIXEL, typename OP> euclase::Image MorphologyFilter(euclase::Image const &image, int radius, FilterStatus *status)
+{
+	using Traits = PixelTraits<PIXEL>;
+
+	auto isInterrupted = [&](){
+		return status && status->cancel.canceled();
+	};
+	auto progress = [&](float v){
+		if (status && status->progress) {
+			*status->progress = v;
+		}
+	};
+
+	const int w = image.width();
+	const int h = image.height();
+	euclase::Image newimage = image.copy();
+	if (w < 1 || h < 1 || radius < 1) return newimage;
+
+	// 正八角形の辺：水平・垂直の線分の半分の長さ a と斜めの線分の半分の長さ b
+	int b = (int)floor(radius * (1 - M_SQRT1_2) + 0.5);
+	int a = radius - b * 2;
+	if (a < 1) { // 斜めだけでは市松模様の隙間ができる
+		b = (radius - 1) / 2;
+		a = radius - b * 2;
+	}
+
+	const size_t n = (size_t)w * h;
+	std::vector<uint8_t> valid(n);
+	std::vector<float> planes[Traits::CHANNELS];
+	for (int c = 0; c < Traits::CHANNELS; c++) {
+		planes[c].resize(n);
+	}
+	for (int y = 0; y < h; y++) {
+		PIXEL const *s = (PIXEL const *)image.scanLine(y);
+		for (int x = 0; x < w; x++) {
+			size_t i = (size_t)y * w + x;
+			valid[i] = Traits::valid(s[x]);
+			for (int c = 0; c < Traits::CHANNELS; c++) {
+				planes[c][i] = valid[i] ? Traits::get(s[x], c) : OP::identity(); // 透明な画素は数えない
+			}
+		}
+	}
+
+	std::atomic_int done = 0;
+#pragma omp parallel for
+	for (int c = 0; c < Traits::CHANNELS; c++) {
+		if (isInterrupted()) continue;
+		line_pass<OP>(&planes[c], w, h, a, 1, 0);
+		line_pass<OP>(&planes[c], w, h, a, 0, 1);
+		line_pass<OP>(&planes[c], w, h, b, 1, 1);
+		line_pass<OP>(&planes[c], w, h, b, -1, 1);
+		progress((float)++done / Traits::CHANNELS);
+	}
+	if (isInterrupted()) return {};
+
+	for (int y = 0; y < h; y++) {
+		PIXEL *d = (PIXEL *)newimage.scanLine(y);
+		for (int x = 0; x < w; x++) {
+			size_t i = (size_t)y * w + x;
+			if (!valid[i]) continue; // 透明な画素はそのまま
+			for (int c = 0; c < Traits::CHANNELS; c++) {
+				Traits::set(&d[x], c, planes[c][i]);
+			}
+		}
+	}
+	progress(1.0f);
+	return newimage;
+}
+
+} // namespace
+
+enum Operation {
+	Median,
+	Maximize,
+	Minimize,
+};
+
+template <typename PIXEL> euclase::Image perform_filter_t(Operation op, euclase::Image const &image, int radius, FilterStatus *status)
+{
+	switch (op) {
+	case Median:
+		return ConstantTimeMedian<PIXEL>(image, radius, status);
+	case Maximize:
+		return MorphologyFilter<PIXEL, Maximum>(image, radius, status);
+	case Minimize:
+		return MorphologyFilter<PIXEL, Minimum>(image, radius, status);
+	}
+	return {};
+}
+
+euclase::Image perform_filter_(Operation op, euclase::Image const &image, int radius, FilterStatus *status)
+{
+	if (image.memtype() != euclase::Image::Host) {
+		return perform_filter_(op, image.toHost(), radius, status);
+	}
+
+	auto format = image.format();
+
+	switch (format) {
+	case euclase::Image::Format_U8_RGBA:
+		return perform_filter_t<OctetRGBA>(op, image, radius, status);
+	case euclase::Image::Format_U8_GrayscaleA:
+		return perform_filter_t<OctetGrayA>(op, image, radius, status);
+	case euclase::Image::Format_F32_RGBA:
+		return perform_filter_t<euclase::Float32RGBA>(op, image, radius, status);
+	case euclase::Image::Format_F16_RGBA:
+		return perform_filter_t<euclase::Float16RGBA>(op, image, radius, status);
+	case euclase::Image::Format_F32_GrayscaleA:
+		return perform_filter_t<euclase::Float32GrayA>(op, image, radius, status);
+	}
+
+	if (format == euclase::Image::Format_U8_RGB) {
+		euclase::Image tmpimg = image.convertToFormat(euclase::Image::Format_U8_RGBA).toHost();
+		tmpimg = perform_filter_(op, tmpimg, radius, status);
+		return tmpimg.convertToFormat(format);
+	}
+	if (format == euclase::Image::Format_U8_Grayscale) {
+		euclase::Image tmpimg = image.convertToFormat(euclase::Image::Format_U8_GrayscaleA).toHost();
+		tmpimg = perform_filter_(op, tmpimg, radius, status);
+		return tmpimg.convertToFormat(format);
+	}
+	return {};
+}
+
+euclase::Image filter_median(euclase::Image const &image, int radius, FilterStatus *status)
+{
+	return perform_filter_(Median, image, radius, status);
+}
+
+euclase::Image filter_maximize(euclase::Image const &image, int radius, FilterStatus *status)
+{
+	return perform_filter_(Maximize, image, radius, status);
+}
+
+euclase::Image filter_minimize(euclase::Image const &image, int radius, FilterStatus *status)
+{
+	return perform_filter_(Minimize, image, radius, status);
+}
+
+
+
@@ -0,0 +1,839 @@
+#ifdef _WIN32
+#define _USE_MATH_DEFINES
+#endif
+#include "resample.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RESAMPLE_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace euclase;
+
+namespace {
+
+/**
+ * @brief 8ビットの値と線形な値の変換表
+ */
+struct OctetTable {
+	float linear[256]; // 8ビットの値を線形な値にする
+	float threshold[255]; // 線形な値が threshold[i] 以上なら i + 1 以上になる
+	OctetTable()
+	{
+		for (int i = 0; i < 256; i++) {
+			linear[i] = degamma(i / 255.0f);
+		}
+		for (int i = 0; i < 255; i++) {
+			threshold[i] = degamma((i + 0.5f) / 255.0f); // OctetRGBA::convert と同じく、ガンマ補正後の値で丸める
+		}
+	}
+	uint8_t octet(float v) const
+	{
+		return (uint8_t)(std::upper_bound(threshold, threshold + 255, v) - threshold);
+	}
+};
+
+OctetTable const &octetTable()
+{
+	static const OctetTable table;
+	return table;
+}
+
+uint8_t alpha8(float a)
+{
+	return (uint8_t)std::max(0.0f, std::min(255.0f, floorf(a * 255 + 0.5f)));
+}
+
+/**
+ * @brief 画素の型ごとの読み書き
+ *
+ * load は乗算済みアルファのRGBAにして、store はそれを元に戻す
+ */
+template <typename PIXEL> struct ResampleTraits;
+
+template <> struct ResampleTraits<OctetRGBA> {
+	static void load(OctetRGBA const &p, float *f)
+	{
+		OctetTable const &t = octetTable();
+		float a = p.a / 255.0f;
+		f[0] = t.linear[p.r] * a;
+		f[1] = t.linear[p.g] * a;
+		f[2] = t.linear[p.b] * a;
+		f[3] = a;
+	}
+	static void store(float const *f, OctetRGBA *p)
+	{
+		OctetTable const &t = octetTable();
+		if (f[3] > 0) {
+			p->r = t.octet(f[0] / f[3]);
+			p->g = t.octet(f[1] / f[3]);
+			p->b = t.octet(f[2] / f[3]);
+		} else {
+			p->r = p->g = p->b = 0;
+		}
+		p->a = alpha8(f[3]);
+	}
+};
+
+template <typename PIXEL> struct ResampleTraitsFloatRGBA {
+	static void load(PIXEL const &p, float *f)
+	{
+		float a = p.a;
+		f[0] = p.r * a;
+		f[1] = p.g * a;
+		f[2] = p.b * a;
+		f[3] = a;
+	}
+	static void store(float const *f, PIXEL *p)
+	{
+		if (f[3] > 0) {
+			p->r = std::max(0.0f, f[0] / f[3]);
+			p->g = std::max(0.0f, f[1] / f[3]);
+			p->b = std::max(0.0f, f[2] / f[3]);
+		} else {
+			p->r = p->g = p->b = 0.0f;
+		}
+		p->a = std::max(0.0f, std::min(1.0f, f[3]));
+	}
+};
+
+template <> struct ResampleTraits<Float32RGBA> : public ResampleTraitsFloatRGBA<Float32RGBA> {
+};
+
+template <> struct ResampleTraits<Float16RGBA> : public ResampleTraitsFloatRGBA<Float16RGBA> {
+};
+
+template <> struct ResampleTraits<Float32RGB> {
+	static void load(Float32RGB const &p, float *f)
+	{
+		f[0] = p.r;
+		f[1] = p.g;
+		f[2] = p.b;
+		f[3] = 1;
+	}
+	static void store(float const *f, Float32RGB *p)
+	{
+		p->r = std::max(0.0f, f[0]);
+		p->g = std::max(0.0f, f[1]);
+		p->b = std::max(0.0f, f[2]);
+	}
+};
+
+template <> struct ResampleTraits<Float32Gray> {
+	static void load(Float32Gray const &p, float *f)
+	{
+		f[0] = f[1] = f[2] = p.v;
+		f[3] = 1;
+	}
+	static void store(float const *f, Float32Gray *p)
+	{
+		p->v = std::max(0.0f, f[0]);
+	}
+};
+
+template <> struct ResampleTraits<Float32GrayA> {
+	static void load(Float32GrayA const &p, float *f)
+	{
+		f[0] = f[1] = f[2] = p.v * p.a;
+		f[3] = p.a;
+	}
+	static void store(float const *f, Float32GrayA *p)
+	{
+		p->v = f[3] > 0 ? std::max(0.0f, f[0] / f[3]) : 0.0f;
+		p->a = std::max(0.0f, std::min(1.0f, f[3]));
+	}
+};
+
+float sinc(float x)
+{
+	if (x == 0) return 1;
+	x *= (float)M_PI;
+	return sinf(x) / x;
+}
+
+float kernelWeight(Resampler::Kernel kernel, float t)
+{
+	t = fabsf(t);
+	switch (kernel) {
+	case Resampler::Kernel::Triangle:
+		return t < 1 ? 1 - t : 0;
+	case Resampler::Kernel::Cubic:
+		{
+			const float a = -0.5f;
+			if (t < 1) return ((a + 2) * t - (a + 3)) * t * t + 1;
+			if (t < 2) return ((a * t - 5 * a) * t + 8 * a) * t - 4 * a;
+			return 0;
+		}
+	case Resampler::Kernel::Lanczos3:
+		return t < 3 ? sinc(t) * sinc(t / 3) : 0;
+	}
+	return 0;
+}
+
+float kernelRadius(Resampler::Kernel kernel)
+{
+	switch (kernel) {
+	case Resampler::Kernel::Triangle:
+		return 1;
+	case Resampler::Kernel::Cubic:
+		return 2;
+	case Resampler::Kernel::Lanczos3:
+		return 3;
+	}
+	return 0.5f;
+}
+
+#ifdef RESAMPLE_X86
+bool hasAVX2()
+{
+	static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	return avx2;
+}
+
+/**
+ * @brief 水平方向の処理（AVX2）
+ *
+ * 隣り合う2画素を1つのレジスタに読んで、2つの重みを同時に掛ける
+ */
+__attribute__((target("avx2,fma")))
+void horizontalAVX2(float const *line, int line_x0, Resampler::Axis const &ax, int dx, int dw, float *out)
+{
+	const int taps = ax.taps;
+	for (int x = 0; x < dw; x++) {
+		float const *s = line + (ax.first[dx + x] - line_x0) * 4;
+		float const *w = &ax.weights[(size_t)(dx + x) * taps];
+		__m256 acc = _mm256_setzero_ps();
+		int t = 0;
+		for (; t + 2 <= taps; t += 2) {
+			__m256 wt = _mm256_set_m128(_mm_set1_ps(w[t + 1]), _mm_set1_ps(w[t]));
+			acc = _mm256_fmadd_ps(wt, _mm256_loadu_ps(s + t * 4), acc);
+		}
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+		if (t < taps) {
+			sum = _mm_fmadd_ps(_mm_set1_ps(w[t]), _mm_loadu_ps(s + t * 4), sum);
+		}
+		_mm_storeu_ps(out + x * 4, sum);
+	}
+}
+
+/**
+ * @brief 垂直方向の処理（AVX2）
+ */
+__attribute__((target("avx2,fma")))
+void verticalAVX2(float const *const *rows, float const *w, int taps, int n, float *out)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 acc = _mm256_setzero_ps();
+		for (int t = 0; t < taps; t++) {
+			acc = _mm256_fmadd_ps(_mm256_set1_ps(w[t]), _mm256_loadu_ps(rows[t] + i), acc);
+		}
+		_mm256_storeu_ps(out + i, acc);
+	}
+	for (; i < n; i++) {
+		float v = 0;
+		for (int t = 0; t < taps; t++) {
+			v += w[t] * rows[t][i];
+		}
+		out[i] = v;
+	}
+}
+#endif
+
+/**
+ * @brief 水平方向の処理
+ * @param line 入力の1行（乗算済みアルファのRGBA）
+ * @param line_x0 line の先頭の入力の座標
+ * @param ax 水平方向の重みの表
+ * @param dx 出力の先頭の座標
+ * @param dw 出力の幅
+ * @param out 出力
+ */
+void horizontal(float const *line, int line_x0, Resampler::Axis const &ax, int dx, int dw, float *out)
+{
+#ifdef RESAMPLE_X86
+	if (hasAVX2()) {
+		horizontalAVX2(line, line_x0, ax, dx, dw, out);
+		return;
+	}
+#endif
+	const int taps = ax.taps;
+	for (int x = 0; x < dw; x++) {
+		float const *s = line + (ax.first[dx + x] - line_x0) * 4;
+		float const *w = &ax.weights[(size_t)(dx + x) * taps];
+#ifdef __SSE__
+		__m128 acc = _mm_setzero_ps();
+		for (int t = 0; t < taps; t++) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[t]), _mm_loadu_ps(s + t * 4)));
+		}
+		_mm_storeu_ps(out + x * 4, acc);
+#else
+		float acc[4] = {};
+		for (int t = 0; t < taps; t++) {
+			for (int c = 0; c < 4; c++) {
+				acc[c] += w[t] * s[t * 4 + c];
+			}
+		}
+		memcpy(out + x * 4, acc, sizeof(acc));
+#endif
+	}
+}
+
+/**
+ * @brief 垂直方向の処理
+ * @param rows 参照する taps 行分の水平方向の処理結果
+ * @param w 重み
+ * @param n 1行の要素数
+ * @param out 出力
+ */
+void vertical(float const *const *rows, float const *w, int taps, int n, float *out)
+{
+#ifdef RESAMPLE_X86
+	if (hasAVX2()) {
+		verticalAVX2(rows, w, taps, n, out);
+		return;
+	}
+#endif
+	for (int i = 0; i < n; i++) {
+		float v = 0;
+		for (int t = 0; t < taps; t++) {
+			v += w[t] * rows[t][i];
+		}
+		out[i] = v;
+	}
+}
+
+template <typename PIXEL> Image render_(Resampler::Axis const &ax, Resampler::Axis const &ay, Image const &source, int sx, int sy, int dx, int dy, int dw, int dh)
+{
+	using Traits = ResampleTraits<PIXEL>;
+	int x0, x1, y0, y1;
+	ax.range(dx, dx + dw, &x0, &x1);
+	ay.range(dy, dy + dh, &y0, &y1);
+	const int rows = y1 - y0;
+	const size_t stride = (size_t)dw * 4;
+
+	// 参照する入力の行を、水平方向に処理しておく
+	std::vector<float> hbuf(stride * rows);
+#pragma omp parallel
+	{
+		std::vector<float> line((size_t)(x1 - x0) * 4);
+#pragma omp for schedule(static)
+		for (int r = 0; r < rows; r++) {
+			PIXEL const *s = (PIXEL const *)source.scanLine(y0 + r - sy) + (x0 - sx);
+			for (int x = 0; x < x1 - x0; x++) {
+				Traits::load(s[x], &line[x * 4]);
+			}
+			horizontal(line.data(), x0, ax, dx, dw, &hbuf[stride * r]);
+		}
+	}
+
+	Image newimage(dw, dh, source.format());
+#pragma omp parallel
+	{
+		std::vector<float> acc(stride);
+		std::vector<float const *> ptrs(ay.taps);
+#pragma omp for schedule(static)
+		for (int y = 0; y < dh; y++) {
+			const int first = ay.first[dy + y] - y0;
+			for (int t = 0; t < ay.taps; t++) {
+				ptrs[t] = &hbuf[stride * (first + t)];
+			}
+			vertical(ptrs.data(), &ay.weights[(size_t)(dy + y) * ay.taps], ay.taps, (int)stride, acc.data());
+			PIXEL *d = (PIXEL *)newimage.scanLine(y);
+			for (int x = 0; x < dw; x++) {
+				Traits::store(&acc[x * 4], &d[x]);
+			}
+		}
+	}
+	return newimage;
+}
+
+/**
+ * @brief 4チャンネル分の積和
+ */
+struct Vec4 {
+#ifdef __SSE__
+	__m128 v = _mm_setzero_ps();
+	void madd(float w, float const *p)
+	{
+		v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(w), _mm_loadu_ps(p)));
+	}
+	void madd(float w, Vec4 const &p)
+	{
+		v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(w), p.v));
+	}
+	void store(float *p) const
+	{
+		_mm_storeu_ps(p, v);
+	}
+#else
+	float v[4] = {};
+	void madd(float w, float const *p)
+	{
+		for (int c = 0; c < 4; c++) {
+			v[c] += w * p[c];
+		}
+	}
+	void madd(float w, Vec4 const &p)
+	{
+		madd(w, p.v);
+	}
+	void store(float *p) const
+	{
+		memcpy(p, v, sizeof(v));
+	}
+#endif
+};
+
+template <typename PIXEL> Image warp_(Homography const &inv, Warper::Interpolation interpolation, Image const &source, int sx, int sy, int dx, int dy, int dw, int dh)
+{
+	using Traits = ResampleTraits<PIXEL>;
+	const int P = 2; // 周囲に付ける透明な画素の幅
+	const int sw = source.width();
+	const int sh = source.height();
+	const int bw = sw + P * 2;
+	const int bh = sh + P * 2;
+
+	// 入力を乗算済みアルファの線形な値にしておく
+	std::vector<float> buf((size_t)bw * bh * 4, 0.0f);
+#pragma omp parallel for schedule(static)
+	for (int y = 0; y < sh; y++) {
+		PIXEL const *s = (PIXEL const *)source.scanLine(y);
+		float *d = &buf[((size_t)bw * (y + P) + P) * 4];
+		for (int x = 0; x < sw; x++) {
+			Traits::load(s[x], d + x * 4);
+		}
+	}
+	auto pixel = [&](int x, int y){ // 入力の範囲の座標。周囲 P 画素まで読める
+		return &buf[((size_t)bw * (y + P) + (x + P)) * 4];
+	};
+
+	Image newimage(dw, dh, source.format());
+	double const *m = inv.m;
+#pragma omp parallel for schedule(static)
+	for (int y = 0; y < dh; y++) {
+		PIXEL *d = (PIXEL *)newimage.scanLine(y);
+		const double Y = dy + y + 0.5;
+		for (int x = 0; x < dw; x++) {
+			const double X = dx + x + 0.5;
+			float out[4] = {};
+			const double w = m[6] * X + m[7] * Y + m[8];
+			if (w > 0) {
+				const double u = (m[0] * X + m[1] * Y + m[2]) / w - sx - 0.5; // 画素の中心を整数とする入力の座標
+				const double v = (m[3] * X + m[4] * Y + m[5]) / w - sy - 0.5;
+				if (u > -P && v > -P && u < sw + P && v < sh + P) {
+					if (interpolation == Warper::Interpolation::Nearest) {
+						const int ix = (int)floor(u + 0.5);
+						const int iy = (int)floor(v + 0.5);
+						if (ix >= 0 && iy >= 0 && ix < sw && iy < sh) {
+							memcpy(out, pixel(ix, iy), sizeof(out));
+						}
+					} else {
+						const int ix = (int)floor(u);
+						const int iy = (int)floor(v);
+						const float fx = (float)(u - ix);
+						const float fy = (float)(v - iy);
+						if (ix >= -1 && iy >= -1 && ix < sw && iy < sh) {
+							Vec4 acc;
+							if (interpolation == Warper::Interpolation::Bilinear) {
+								acc.madd((1 - fx) * (1 - fy), pixel(ix, iy));
+								acc.madd(fx * (1 - fy), pixel(ix + 1, iy));
+								acc.madd((1 - fx) * fy, pixel(ix, iy + 1));
+								acc.madd(fx * fy, pixel(ix + 1, iy + 1));
+							} else {
+								float wx[4];
+								float wy[4];
+								for (int i = 0; i < 4; i++) {
+									wx[i] = kernelWeight(Resampler::Kernel::Cubic, fx + 1 - i);
+									wy[i] = kernelWeight(Resampler::Kernel::Cubic, fy + 1 - i);
+								}
+								for (int j = 0; j < 4; j++) {
+									Vec4 row;
+									float const *s = pixel(ix - 1, iy - 1 + j);
+									for (int i = 0; i < 4; i++) {
+										row.madd(wx[i], s + i * 4);
+									}
+									acc.madd(wy[j], row);
+								}
+							}
+							acc.store(out);
+						}
+					}
+				}
+			}
+			Traits::store(out, &d[x]);
+		}
+	}
+	return newimage;
+}
+
+} // namespace
+
+/**
+ * @brief 重みの表を作る
+ * @param src 入力の長さ
+ * @param dst 出力の長さ
+ * @param kernel フィルタ
+ *
+ * 縮小するときは、フィルタを縮小率に合わせて広げる
+ * 画像の外を参照する重みは捨てて、残りの重みの和が1になるようにする
+ */
+void Resampler::Axis::make(int src, int dst, Kernel kernel)
+{
+	this->src = src;
+	this->dst = dst;
+	const double scale = (double)src / dst;
+	const double stretch = std::max(1.0, scale);
+	double support; // 入力の画素単位の半径
+	switch (kernel) {
+	case Kernel::Nearest:
+		support = 0;
+		taps = 1;
+		break;
+	case Kernel::Box:
+		support = scale / 2;
+		taps = (int)ceil(scale) + 1;
+		break;
+	default:
+		support = kernelRadius(kernel) * stretch;
+		taps = (int)ceil(support * 2) + 1;
+		break;
+	}
+	taps = std::max(1, std::min(taps, src));
+
+	first.assign(dst, 0);
+	weights.assign((size_t)dst * taps, 0.0f);
+	std::vector<float> w;
+	for (int d = 0; d < dst; d++) {
+		const double center = (d + 0.5) * scale; // 出力の画素の中心（入力の画素の端を0とする座標）
+		int i0, i1;
+		w.clear();
+		if (kernel == Kernel::Nearest) {
+			i0 = std::min((int)center, src - 1);
+			i1 = i0 + 1;
+			w.push_back(1);
+		} else if (kernel == Kernel::Box) {
+			const double lo = center - support;
+			const double hi = center + support;
+			i0 = std::max(0, (int)floor(lo));
+			i1 = std::min(src, (int)ceil(hi));
+			for (int i = i0; i < i1; i++) {
+				w.push_back((float)std::max(0.0, std::min<double>(hi, i + 1) - std::max<double>(lo, i)));
+			}
+		} else {
+			const double c = center - 0.5; // 入力の画素の中心を整数とする座標
+			i0 = std::max(0, (int)ceil(c - support));
+			i1 = std::min(src, (int)floor(c + support) + 1);
+			for (int i = i0; i < i1; i++) {
+				w.push_back(kernelWeight(kernel, (float)((i - c) / stretch)));
+			}
+		}
+		// 重みの無い両端を除く
+		while (i1 - i0 > 1 && w.front() == 0) {
+			w.erase(w.begin());
+			i0++;
+		}
+		while (i1 - i0 > 1 && w.back() == 0) {
+			w.pop_back();
+			i1--;
+		}
+		if (i1 <= i0) { // 範囲に画素が無ければ最も近い画素を使う
+			i0 = std::max(0, std::min((int)center, src - 1));
+			i1 = i0 + 1;
+			w.assign(1, 1.0f);
+		}
+		float sum = 0;
+		for (float v : w) {
+			sum += v;
+		}
+		if (sum == 0) {
+			w.assign(w.size(), 1.0f / w.size());
+		} else {
+			for (float &v : w) {
+				v /= sum;
+			}
+		}
+		const int f = std::max(0, std::min(i0, src - taps));
+		first[d] = f;
+		for (int i = i0; i < i1 && i - f < taps; i++) {
+			weights[(size_t)d * taps + (i - f)] = w[i - i0];
+		}
+	}
+}
+
+/**
+ * @brief 出力の範囲が参照する入力の範囲
+ * @param d0 出力の先頭
+ * @param d1 出力の末尾の次
+ * @param s0 入力の先頭
+ * @param s1 入力の末尾の次
+ */
+void Resampler::Axis::range(int d0, int d1, int *s0, int *s1) const
+{
+	*s0 = src;
+	*s1 = 0;
+	for (int d = d0; d < d1; d++) {
+		*s0 = std::min(*s0, first[d]);
+		*s1 = std::max(*s1, first[d] + taps);
+	}
+}
+
+/**
+ * @brief 拡大縮小の方法から軸ごとのフィルタを決める
+ *
+ * 双線形と双三次は、縮小するときは面積平均にする
+ */
+Resampler::Kernel Resampler::kernel(EnlargeMethod method, int src, int dst)
+{
+	switch (method) {
+	case EnlargeMethod::NearestNeighbor:
+		return Kernel::Nearest;
+	case EnlargeMethod::Lanczos3:
+		return Kernel::Lanczos3;
+	case EnlargeMethod::Bilinear:
+		return dst < src ? Kernel::Box : Kernel::Triangle;
+	case EnlargeMethod::Bicubic:
+		return dst < src ? Kernel::Box : Kernel::Cubic;
+	}
+	return Kernel::Nearest;
+}
+
+Resampler::Resampler(int src_w, int src_h, int dst_w, int dst_h, EnlargeMethod method)
+{
+	x_.make(src_w, dst_w, kernel(method, src_w, dst_w));
+	y_.make(src_h, dst_h, kernel(method, src_h, dst_h));
+}
+
+/**
+ * @brief 出力の矩形を作るのに必要な入力の矩形
+ */
+void Resampler::sourceRect(int dx, int dy, int dw, int dh, int *sx, int *sy, int *sw, int *sh) const
+{
+	int x0, x1, y0, y1;
+	x_.range(dx, dx + dw, &x0, &x1);
+	y_.range(dy, dy + dh, &y0, &y1);
+	*sx = x0;
+	*sy = y0;
+	*sw = x1 - x0;
+	*sh = y1 - y0;
+}
+
+/**
+ * @brief 出力の矩形を作る
+ * @param source 入力の一部（sourceRect() の範囲を含むこと）
+ * @param sx source の左上の入力の座標
+ * @param sy source の左上の入力の座標
+ * @return 大きさが dw x dh の、source と同じ形式の画像
+ */
+Image Resampler::render(Image const &source, int sx, int sy, int dx, int dy, int dw, int dh) const
+{
+	if (dw < 1 || dh < 1) return {};
+	if (source.memtype() != Image::Host) {
+		Image newimage = render(source.toHost(), sx, sy, dx, dy, dw, dh);
+		return newimage.memconvert(source.memtype());
+	}
+	switch (source.format()) {
+	case Image::Format_U8_RGBA:
+		return render_<OctetRGBA>(x_, y_, source, sx, sy, dx, dy, dw, dh);
+	case Image::Format_F16_RGBA:
+		return render_<Float16RGBA>(x_, y_, source, sx, sy, dx, dy, dw, dh);
+	case Image::Format_F32_RGBA:
+		return render_<Float32RGBA>(x_, y_, source, sx, sy, dx, dy, dw, dh);
+	case Image::Format_F32_RGB:
+		return render_<Float32RGB>(x_, y_, source, sx, sy, dx, dy, dw, dh);
+	case Image::Format_F32_Grayscale:
+		return render_<Float32Gray>(x_, y_, source, sx, sy, dx, dy, dw, dh);
+	case Image::Format_F32_GrayscaleA:
+		return render_<Float32GrayA>(x_, y_, source, sx, sy, dx, dy, dw, dh);
+	}
+	return {};
+}
+
+/**
+ * @brief 画像全体の大きさを変える
+ *
+ * 出力を帯に分けて作るので、作業用のメモリは帯の分だけで済む
+ */
+Image Resampler::resize(Image const &image) const
+{
+	const int BAND = 256;
+	const int w = width();
+	const int h = height();
+	Image newimage;
+	if (!newimage.make(w, h, image.format())) {
+		return {}; // bad alloc?
+	}
+	Image source = image.toHost();
+	const size_t bytes = newimage.bytesPerLine();
+	for (int y = 0; y < h; y += BAND) {
+		const int n = std::min(BAND, h - y);
+		Image band = render(source, 0, 0, 0, y, w, n);
+		if (!band) return {};
+		for (int i = 0; i < n; i++) {
+			memcpy(newimage.scanLine(y + i), band.scanLine(i), bytes);
+		}
+	}
+	return newimage.memconvert(image.memtype());
+}
+
+/**
+ * @brief 点を写す
+ * @return 無限遠の向こうに写るならfalse
+ */
+bool Homography::map(double x, double y, double *ox, double *oy) const
+{
+	const double w = m[6] * x + m[7] * y + m[8];
+	if (w <= 0) return false;
+	*ox = (m[0] * x + m[1] * y + m[2]) / w;
+	*oy = (m[3] * x + m[4] * y + m[5]) / w;
+	return true;
+}
+
+/**
+ * @brief 逆変換
+ *
+ * 正則でなければ全ての要素が0の行列を返す（どの点も写らない）
+ */
+Homography Homography::inverted() const
+{
+	Homography r;
+	r.m[0] = m[4] * m[8] - m[5] * m[7];
+	r.m[1] = m[2] * m[7] - m[1] * m[8];
+	r.m[2] = m[1] * m[5] - m[2] * m[4];
+	r.m[3] = m[5] * m[6] - m[3] * m[8];
+	r.m[4] = m[0] * m[8] - m[2] * m[6];
+	r.m[5] = m[2] * m[3] - m[0] * m[5];
+	r.m[6] = m[3] * m[7] - m[4] * m[6];
+	r.m[7] = m[1] * m[6] - m[0] * m[7];
+	r.m[8] = m[0] * m[4] - m[1] * m[3];
+	const double det = m[0] * r.m[0] + m[1] * r.m[3] + m[2] * r.m[6];
+	for (double &v : r.m) {
+		v = det == 0 ? 0 : v / det;
+	}
+	return r;
+}
+
+/**
+ * @brief 矩形を四角形に写す変換
+ * @param quad 左上、右上、右下、左下の順の4点（x, y の組）
+ */
+Homography Homography::fromRectToQuad(double x, double y, double w, double h, double const quad[8])
+{
+	const double x0 = quad[0], y0 = quad[1];
+	const double x1 = quad[2], y1 = quad[3];
+	const double x2 = quad[4], y2 = quad[5];
+	const double x3 = quad[6], y3 = quad[7];
+
+	// 単位正方形から四角形へ
+	double s[9];
+	const double ex = x0 - x1 + x2 - x3;
+	const double ey = y0 - y1 + y2 - y3;
+	if (ex == 0 && ey == 0) { // 平行四辺形ならアフィン変換
+		s[6] = 0;
+		s[7] = 0;
+	} else {
+		const double dx1 = x1 - x2;
+		const double dx2 = x3 - x2;
+		const double dy1 = y1 - y2;
+		const double dy2 = y3 - y2;
+		const double det = dx1 * dy2 - dx2 * dy1;
+		if (det == 0) {
+			Homography r;
+			std::fill(r.m, r.m + 9, 0.0);
+			return r;
+		}
+		s[6] = (ex * dy2 - dx2 * ey) / det;
+		s[7] = (dx1 * ey - ex * dy1) / det;
+	}
+	s[0] = x1 - x0 + s[6] * x1;
+	s[1] = x3 - x0 + s[7] * x3;
+	s[2] = x0;
+	s[3] = y1 - y0 + s[6] * y1;
+	s[4] = y3 - y0 + s[7] * y3;
+	s[5] = y0;
+	s[8] = 1;
+
+	// 矩形を単位正方形にしてから写す
+	Homography r;
+	for (int i = 0; i < 3; i++) {
+		r.m[i * 3 + 0] = s[i * 3 + 0] / w;
+		r.m[i * 3 + 1] = s[i * 3 + 1] / h;
+		r.m[i * 3 + 2] = s[i * 3 + 2] - s[i * 3 + 0] * x / w - s[i * 3 + 1] * y / h;
+	}
+	return r;
+}
+
+/**
+ * @param transform 入力の座標から出力の座標への変換
+ * @param interpolation 補間の方法
+ */
+Warper::Warper(Homography const &transform, Interpolation interpolation)
+	: inverse_(transform.inverted())
+	, interpolation_(interpolation)
+{
+}
+
+/**
+ * @brief 出力の矩形を作るのに必要な入力の矩形
+ *
+ * 出力の矩形が無限遠の向こうに掛かるときは、範囲を限定できないので非常に大きな矩形を返す
+ */
+void Warper::sourceRect(int dx, int dy, int dw, int dh, int *sx, int *sy, int *sw, int *sh) const
+{
+	double x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+	const double px[4] = { (double)dx, (double)(dx + dw), (double)(dx + dw), (double)dx };
+	const double py[4] = { (double)dy, (double)dy, (double)(dy + dh), (double)(dy + dh) };
+	for (int i = 0; i < 4; i++) {
+		double u, v;
+		if (!inverse_.map(px[i], py[i], &u, &v) || fabs(u) > 1e8 || fabs(v) > 1e8) {
+			*sx = *sy = -(1 << 29);
+			*sw = *sh = 1 << 30;
+			return;
+		}
+		if (i == 0) {
+			x0 = x1 = u;
+			y0 = y1 = v;
+		} else {
+			x0 = std::min(x0, u);
+			y0 = std::min(y0, v);
+			x1 = std::max(x1, u);
+			y1 = std::max(y1, v);
+		}
+	}
+	const int margin = interpolation_ == Interpolation::Bicubic ? 2 : 1; // 補間に使う近傍
+	*sx = (int)floor(x0) - margin;
+	*sy = (int)floor(y0) - margin;
+	*sw = (int)ceil(x1) + margin - *sx;
+	*sh = (int)ceil(y1) + margin - *sy;
+}
+
+/**
+ * @brief 出力の矩形を作る
+ * @param source 入力の一部。範囲外は透明として扱う
+ * @param sx source の左上の入力の座標
+ * @param sy source の左上の入力の座標
+ * @return 大きさが dw x dh の、source と同じ形式の画像
+ */
+Image Warper::render(Image const &source, int sx, int sy, int dx, int dy, int dw, int dh) const
+{
+	if (dw < 1 || dh < 1 || !source) return {};
+	if (source.memtype() != Image::Host) {
+		Image newimage = render(source.toHost(), sx, sy, dx, dy, dw, dh);
+		return newimage.memconvert(source.memtype());
+	}
+	switch (source.format()) {
+	case Image::Format_U8_RGBA:
+		return warp_<OctetRGBA>(inverse_, interpolation_, source, sx, sy, dx, dy, dw, dh);
+	case Image::Format_F16_RGBA:
+		return warp_<Float16RGBA>(inverse_, interpolation_, source, sx, sy, dx, dy, dw, dh);
+	case Image::Format_F32_RGBA:
+		return warp_<Float32RGBA>(inverse_, interpolation_, source, sx, sy, dx, dy, dw, dh);
+	case Image::Format_F32_GrayscaleA:
+		return warp_<Float32GrayA>(inverse_, interpolation_, source, sx, sy, dx, dy, dw, dh);
+	}
+	return {};
+}
@@ -0,0 +1,94 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "euclase.h"
+#include <vector>
+
+namespace euclase {
+
+/**
+ * @brief 分離可能なフィルタによる画像の拡大縮小
+ *
+ * 出力の各画素が参照する入力の範囲と重みを、軸ごとに最初に表にしておき、水平方向と垂直方向に分けて処理する
+ * 出力は矩形単位で作れるので、タイルごとに必要な入力だけを読んで処理できる
+ * U8_RGBA, F16_RGBA, F32_RGBA などをそのまま扱う。計算はアルファを乗算済みの線形な値で行う
+ */
+class Resampler {
+public:
+	enum class Kernel {
+		Nearest,
+		Box, // 面積平均
+		Triangle, // 双線形
+		Cubic, // 双三次
+		Lanczos3,
+	};
+	/**
+	 * @brief 1軸分の重みの表
+	 */
+	struct Axis {
+		int src = 0;
+		int dst = 0;
+		int taps = 0; // 出力1画素あたりの重みの数
+		std::vector<int> first; // 出力の座標ごとの、参照する入力の先頭の座標
+		std::vector<float> weights; // 出力の座標ごとに taps 個
+		void make(int src, int dst, Kernel kernel);
+		void range(int d0, int d1, int *s0, int *s1) const;
+	};
+private:
+	Axis x_;
+	Axis y_;
+public:
+	Resampler(int src_w, int src_h, int dst_w, int dst_h, EnlargeMethod method);
+	static Kernel kernel(EnlargeMethod method, int src, int dst);
+
+	int width() const
+	{
+		return x_.dst;
+	}
+	int height() const
+	{
+		return y_.dst;
+	}
+
+	void sourceRect(int dx, int dy, int dw, int dh, int *sx, int *sy, int *sw, int *sh) const;
+	Image render(Image const &source, int sx, int sy, int dx, int dy, int dw, int dh) const;
+	Image resize(Image const &image) const;
+};
+
+/**
+ * @brief 射影変換
+ *
+ * 3x3の行列で (x, y) を ((m0 x + m1 y + m2) / w, (m3 x + m4 y + m5) / w)、w = m6 x + m7 y + m8 に写す
+ */
+struct Homography {
+	double m[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+	bool map(double x, double y, double *ox, double *oy) const;
+	Homography inverted() const;
+	static Homography fromRectToQuad(double x, double y, double w, double h, double const quad[8]);
+};
+
+/**
+ * @brief 逆写像による画像の変形
+ *
+ * 出力の各画素の中心を入力の座標に戻して補間する。出力は矩形単位で作れるので、タイルごとに必要な入力だけを読んで処理できる
+ * 入力の範囲外は透明として扱う
+ */
+class Warper {
+public:
+	enum class Interpolation {
+		Nearest,
+		Bilinear,
+		Bicubic,
+	};
+private:
+	Homography inverse_; // 出力の座標から入力の座標へ
+	Interpolation interpolation_;
+public:
+	Warper(Homography const &transform, Interpolation interpolation);
+	void sourceRect(int dx, int dy, int dw, int dh, int *sx, int *sy, int *sw, int *sh) const;
+	Image render(Image const &source, int sx, int sy, int dx, int dy, int dw, int dh) const;
+};
+
+} // namespace euclase
+
+#endif // RESAMPLE_H
@@ -0,0 +1,245 @@
+#include "rotate.h"
+#include "euclase.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define ROTATE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+/**
+ * @brief バイト数だけが意味を持つ画素
+ */
+template <int N> struct Bytes {
+	uint8_t v[N];
+};
+
+/**
+ * @brief 1行の左右を入れ替える
+ */
+template <typename P> void mirror(P *p, int n)
+{
+	std::reverse(p, p + n);
+}
+
+#ifdef ROTATE_SSE2
+template <> void mirror(uint32_t *p, int n)
+{
+	int i = 0;
+	int j = n;
+	while (j - i >= 8) { // 両端から4画素ずつ入れ替える
+		__m128i a = _mm_loadu_si128((__m128i const *)(p + i));
+		__m128i b = _mm_loadu_si128((__m128i const *)(p + j - 4));
+		_mm_storeu_si128((__m128i *)(p + i), _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 1, 2, 3)));
+		_mm_storeu_si128((__m128i *)(p + j - 4), _mm_shuffle_epi32(a, _MM_SHUFFLE(0, 1, 2, 3)));
+		i += 4;
+		j -= 4;
+	}
+	std::reverse(p + i, p + j);
+}
+
+template <> void mirror(uint64_t *p, int n)
+{
+	int i = 0;
+	int j = n;
+	while (j - i >= 4) { // 両端から2画素ずつ入れ替える
+		__m128i a = _mm_loadu_si128((__m128i const *)(p + i));
+		__m128i b = _mm_loadu_si128((__m128i const *)(p + j - 2));
+		_mm_storeu_si128((__m128i *)(p + i), _mm_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2)));
+		_mm_storeu_si128((__m128i *)(p + j - 2), _mm_shuffle_epi32(a, _MM_SHUFFLE(1, 0, 3, 2)));
+		i += 2;
+		j -= 2;
+	}
+	std::reverse(p + i, p + j);
+}
+#endif
+
+template <typename P> void flip_(euclase::Image *image, bool horizontal)
+{
+	const int w = image->width();
+	const int h = image->height();
+	if (horizontal) {
+		for (int y = 0; y < h; y++) {
+			mirror((P *)image->scanLine(y), w);
+		}
+	} else {
+		const size_t bytes = image->bytesPerLine();
+		std::vector<uint8_t> tmp(bytes);
+		for (int y = 0; y < h / 2; y++) {
+			uint8_t *a = image->scanLine(y);
+			uint8_t *b = image->scanLine(h - 1 - y);
+			memcpy(tmp.data(), a, bytes);
+			memcpy(a, b, bytes);
+			memcpy(b, tmp.data(), bytes);
+		}
+	}
+}
+
+/**
+ * @brief 正方形の画像をその場で転置する
+ *
+ * ブロックごとに対角の反対側のブロックと入れ替える
+ */
+template <typename P> void transpose_square(P *p, int n)
+{
+	const int B = 16;
+	for (int by = 0; by < n; by += B) {
+		for (int bx = by; bx < n; bx += B) {
+			const int ey = std::min(n, by + B);
+			const int ex = std::min(n, bx + B);
+			for (int y = by; y < ey; y++) {
+				for (int x = (bx == by ? y + 1 : bx); x < ex; x++) {
+					std::swap(p[(size_t)n * y + x], p[(size_t)n * x + y]);
+				}
+			}
+		}
+	}
+}
+
+#ifdef ROTATE_SSE2
+/**
+ * @brief 4x4画素の転置
+ */
+inline void transpose4x4(__m128 *r0, __m128 *r1, __m128 *r2, __m128 *r3)
+{
+	_MM_TRANSPOSE4_PS(*r0, *r1, *r2, *r3);
+}
+
+template <> void transpose_square(uint32_t *p, int n)
+{
+	const int m = n & ~3;
+	auto row = [&](int y, int x){
+		return (float *)(p + (size_t)n * y + x);
+	};
+	for (int by = 0; by < m; by += 4) {
+		for (int bx = by; bx < m; bx += 4) {
+			__m128 a0 = _mm_loadu_ps(row(by + 0, bx));
+			__m128 a1 = _mm_loadu_ps(row(by + 1, bx));
+			__m128 a2 = _mm_loadu_ps(row(by + 2, bx));
+			__m128 a3 = _mm_loadu_ps(row(by + 3, bx));
+			transpose4x4(&a0, &a1, &a2, &a3);
+			if (bx == by) {
+				_mm_storeu_ps(row(by + 0, bx), a0);
+				_mm_storeu_ps(row(by + 1, bx), a1);
+				_mm_storeu_ps(row(by + 2, bx), a2);
+				_mm_storeu_ps(row(by + 3, bx), a3);
+				continue;
+			}
+			__m128 b0 = _mm_loadu_ps(row(bx + 0, by));
+			__m128 b1 = _mm_loadu_ps(row(bx + 1, by));
+			__m128 b2 = _mm_loadu_ps(row(bx + 2, by));
+			__m128 b3 = _mm_loadu_ps(row(bx + 3, by));
+			transpose4x4(&b0, &b1, &b2, &b3);
+			_mm_storeu_ps(row(bx + 0, by), a0);
+			_mm_storeu_ps(row(bx + 1, by), a1);
+			_mm_storeu_ps(row(bx + 2, by), a2);
+			_mm_storeu_ps(row(bx + 3, by), a3);
+			_mm_storeu_ps(row(by + 0, bx), b0);
+			_mm_storeu_ps(row(by + 1, bx), b1);
+			_mm_storeu_ps(row(by + 2, bx), b2);
+			_mm_storeu_ps(row(by + 3, bx), b3);
+		}
+	}
+	// 4で割り切れない端の行と列
+	for (int y = 0; y < n; y++) {
+		for (int x = std::max(m, y + 1); x < n; x++) {
+			std::swap(p[(size_t)n * y + x], p[(size_t)n * x + y]);
+		}
+	}
+}
+#endif
+
+/**
+ * @brief 転置した画像を作る
+ */
+template <typename P> euclase::Image transpose(euclase::Image const &image)
+{
+	const int B = 16;
+	const int w = image.width();
+	const int h = image.height();
+	euclase::Image newimage(h, w, image.format());
+	for (int by = 0; by < h; by += B) {
+		for (int bx = 0; bx < w; bx += B) {
+			for (int y = by; y < std::min(h, by + B); y++) {
+				P const *s = (P const *)image.scanLine(y);
+				for (int x = bx; x < std::min(w, bx + B); x++) {
+					((P *)newimage.scanLine(x))[y] = s[x];
+				}
+			}
+		}
+	}
+	return newimage;
+}
+
+/**
+ * @brief 90度回転
+ *
+ * 転置してから、時計回りなら左右を、反時計回りなら上下を反転する
+ * 正方形ならその場で処理する
+ */
+template <typename P> void rotate90_(euclase::Image *image, bool clockwise)
+{
+	if (image->width() == image->height()) {
+		transpose_square((P *)image->scanLine(0), image->width());
+	} else {
+		*image = transpose<P>(*image);
+	}
+	flip_<P>(image, clockwise);
+}
+
+template <typename F> void dispatch(euclase::Image const &image, F fn)
+{
+	switch (image.bytesPerPixel()) {
+	case 1: fn(uint8_t()); return;
+	case 2: fn(uint16_t()); return;
+	case 3: fn(Bytes<3>()); return;
+	case 4: fn(uint32_t()); return;
+	case 6: fn(Bytes<6>()); return;
+	case 8: fn(uint64_t()); return;
+	case 12: fn(Bytes<12>()); return;
+	case 16: fn(Bytes<16>()); return;
+	}
+}
+
+} // namespace
+
+/**
+ * @brief 画像を反転する
+ * @param image 画像
+ * @param horizontal trueなら左右、falseなら上下
+ */
+void euclase::flipImage(Image *image, bool horizontal)
+{
+	if (!image || !*image) return;
+	auto memtype = image->memtype();
+	if (memtype != Image::Host) {
+		*image = image->toHost();
+	}
+	dispatch(*image, [&](auto p){
+		flip_<decltype(p)>(image, horizontal);
+	});
+	image->memconvert(memtype);
+}
+
+/**
+ * @brief 画像を90度回転する
+ * @param image 画像
+ * @param clockwise trueなら時計回り
+ */
+void euclase::rotateImage90(Image *image, bool clockwise)
+{
+	if (!image || !*image) return;
+	auto memtype = image->memtype();
+	if (memtype != Image::Host) {
+		*image = image->toHost();
+	}
+	dispatch(*image, [&](auto p){
+		rotate90_<decltype(p)>(image, clockwise);
+	});
+	image->memconvert(memtype);
+}
@@ -0,0 +1,12 @@
+#ifndef ROTATE_H
+#define ROTATE_H
+
+namespace euclase {
+class Image;
+
+void flipImage(Image *image, bool horizontal);
+void rotateImage90(Image *image, bool clockwise);
+
+} // namespace euclase
+
+#endif // ROTATE_H